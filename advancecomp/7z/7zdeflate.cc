@@ -5,7 +5,7 @@
 
 #include "zlib.h"
 
-bool compress_deflate_7z(const unsigned char* in_data, unsigned in_size, unsigned char* out_data, unsigned& out_size, unsigned num_passes, unsigned num_fast_bytes) throw ()
+bool compress_deflate_7z(const unsigned char* in_data, unsigned in_size, unsigned char* out_data, unsigned& out_size, unsigned num_passes, unsigned num_fast_bytes, const unsigned* limit, int (*stop)(void*), void* stop_arg) throw ()
 {
 	try {
 		NDeflate::NEncoder::CCoder cc;
@@ -17,7 +17,7 @@ bool compress_deflate_7z(const unsigned char* in_data, unsigned in_size, unsigne
 			return false;
 
 		ISequentialInStream in(reinterpret_cast<const char*>(in_data), in_size);
-		ISequentialOutStream out(reinterpret_cast<char*>(out_data), out_size);
+		ISequentialOutStream out(reinterpret_cast<char*>(out_data), out_size, limit, stop, stop_arg);
 
 		UINT64 in_size_l = in_size;
 
@@ -57,7 +57,7 @@ bool decompress_deflate_7z(const unsigned char* in_data, unsigned in_size, unsig
 	}
 }
 
-bool compress_rfc1950_7z(const unsigned char* in_data, unsigned in_size, unsigned char* out_data, unsigned& out_size, unsigned num_passes, unsigned num_fast_bytes) throw ()
+bool compress_rfc1950_7z(const unsigned char* in_data, unsigned in_size, unsigned char* out_data, unsigned& out_size, unsigned num_passes, unsigned num_fast_bytes, const unsigned* limit, int (*stop)(void*), void* stop_arg) throw ()
 {
 	if (out_size < 6)
 		return false;
@@ -74,7 +74,7 @@ bool compress_rfc1950_7z(const unsigned char* in_data, unsigned in_size, unsigne
 	out_data += 2;
 
 	unsigned size = out_size - 6;
-	if (!compress_deflate_7z(in_data, in_size, out_data, size, num_passes, num_fast_bytes)) {
+	if (!compress_deflate_7z(in_data, in_size, out_data, size, num_passes, num_fast_bytes, limit, stop, stop_arg)) {
 		return false;
 	}
 	out_data += size;
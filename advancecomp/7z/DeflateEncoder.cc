@@ -686,6 +686,9 @@ HRESULT CCoder::CodeReal(ISequentialInStream *anInStream, ISequentialOutStream *
         m_CurrentBlockUncompressedSize += aLen;
         
       }
+      // The passes of a block take long, the result is dropped if stopped
+      if (anOutStream->stop_get())
+        throw E_FAIL;
       aCurrentPassIndex++;
       bool aWriteMode = (aCurrentPassIndex == m_NumPasses);
       WriteBlockData(aWriteMode, aNoMoreBytes);
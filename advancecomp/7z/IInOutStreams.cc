@@ -12,6 +12,12 @@ HRESULT ISequentialInStream::Read(void *aData, INT aSize, INT* aProcessedSize) {
 }
 
 HRESULT ISequentialOutStream::Write(const void *aData, INT aSize, INT* aProcessedSize) {
+	// Past the limit the result is useless, the encoder is stopped
+	if ((limit && (unsigned)(total + aSize) > __atomic_load_n(limit, __ATOMIC_RELAXED)) || stop_get()) {
+		overflow = true;
+		*aProcessedSize = 0;
+		return E_FAIL;
+	}
 	if (aSize > size) {
 		overflow = true;
 		aSize = size;
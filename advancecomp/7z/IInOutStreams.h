@@ -19,11 +19,15 @@ class ISequentialOutStream
 	INT size;
 	bool overflow;
 	INT total;
+	const unsigned* limit; // size that another thread may lower meanwhile, 0 if none
+	int (*stop)(void*); // tells when the encoder has to give up, 0 if never
+	void* stop_arg;
 public:
-	ISequentialOutStream(char* Adata, unsigned Asize) : data(Adata), size(Asize), overflow(false), total(0) { }
+	ISequentialOutStream(char* Adata, unsigned Asize, const unsigned* Alimit = 0, int (*Astop)(void*) = 0, void* Astop_arg = 0) : data(Adata), size(Asize), overflow(false), total(0), limit(Alimit), stop(Astop), stop_arg(Astop_arg) { }
 
 	bool overflow_get() const { return overflow; }
 	INT size_get() const { return total; }
+	bool stop_get() const { return stop && stop(stop_arg); }
 
 	HRESULT Write(const void *aData, INT aSize, INT *aProcessedSize);
 };
@@ -22,6 +22,7 @@
 
 #include "compress.h"
 #include "data.h"
+#include "zcache.h"
 
 bool decompress_deflate_zlib(const unsigned char* in_data, unsigned in_size, unsigned char* out_data, unsigned out_size)
 {
@@ -82,15 +83,7 @@ bool decompress_deflate_zlib(const unsigned char* in_data, unsigned in_size, uns
 
 bool compress_deflate_zlib(const unsigned char* in_data, unsigned in_size, unsigned char* out_data, unsigned& out_size, int compression_level, int strategy, int mem_level)
 {
-	z_stream stream;
-
-	stream.next_in = const_cast<unsigned char*>(in_data);
-	stream.avail_in = in_size;
-	stream.next_out = out_data;
-	stream.avail_out = out_size;
-	stream.zalloc = Z_NULL;
-	stream.zfree = Z_NULL;
-	stream.opaque = Z_NULL;
+	z_stream* stream;
 
 	int compression_window;
 	unsigned required_window = in_size;
@@ -108,18 +101,24 @@ bool compress_deflate_zlib(const unsigned char* in_data, unsigned in_size, unsig
 		compression_window = MAX_WBITS;
 
 	/* windowBits is passed < 0 to suppress the zlib header */
-	if (deflateInit2(&stream, compression_level, Z_DEFLATED, -compression_window, mem_level, strategy) != Z_OK) {
+	stream = zcache_deflate_get(compression_level, -compression_window, mem_level, strategy);
+	if (!stream) {
 		return false;
 	}
 
-	if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
-		deflateEnd(&stream);
+	stream->next_in = const_cast<unsigned char*>(in_data);
+	stream->avail_in = in_size;
+	stream->next_out = out_data;
+	stream->avail_out = out_size;
+
+	if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+		zcache_deflate_put(stream);
 		return false;
 	}
 
-	out_size = stream.total_out;
+	out_size = stream->total_out;
 
-	deflateEnd(&stream);
+	zcache_deflate_put(stream);
 
 	return true;
 }
@@ -139,15 +138,7 @@ bool decompress_rfc1950_zlib(const unsigned char* in_data, unsigned in_size, uns
 
 bool compress_rfc1950_zlib(const unsigned char* in_data, unsigned in_size, unsigned char* out_data, unsigned& out_size, int compression_level, int strategy, int mem_level)
 {
-	z_stream stream;
-
-	stream.next_in = const_cast<unsigned char*>(in_data);
-	stream.avail_in = in_size;
-	stream.next_out = out_data;
-	stream.avail_out = out_size;
-	stream.zalloc = Z_NULL;
-	stream.zfree = Z_NULL;
-	stream.opaque = Z_NULL;
+	z_stream* stream;
 
 	int compression_window;
 	unsigned required_window = in_size;
@@ -164,18 +155,24 @@ bool compress_rfc1950_zlib(const unsigned char* in_data, unsigned in_size, unsig
 	if (compression_window > MAX_WBITS)
 		compression_window = MAX_WBITS;
 
-	if (deflateInit2(&stream, compression_level, Z_DEFLATED, compression_window, mem_level, strategy) != Z_OK) {
+	stream = zcache_deflate_get(compression_level, compression_window, mem_level, strategy);
+	if (!stream) {
 		return false;
 	}
 
-	if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
-		deflateEnd(&stream);
+	stream->next_in = const_cast<unsigned char*>(in_data);
+	stream->avail_in = in_size;
+	stream->next_out = out_data;
+	stream->avail_out = out_size;
+
+	if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+		zcache_deflate_put(stream);
 		return false;
 	}
 
-	out_size = stream.total_out;
+	out_size = stream->total_out;
 
-	deflateEnd(&stream);
+	zcache_deflate_put(stream);
 
 	return true;
 }
@@ -184,11 +181,13 @@ bool compress_deflate_libdeflate(const unsigned char* in_data, unsigned in_size,
 {
 	struct libdeflate_compressor* compressor;
 
-	compressor = libdeflate_alloc_compressor(compression_level);
+	compressor = zcache_libdeflate_get(compression_level);
+	if (!compressor)
+		return false;
 
 	out_size = libdeflate_deflate_compress(compressor, in_data, in_size, out_data, out_size);
 
-	libdeflate_free_compressor(compressor);
+	zcache_libdeflate_put(compressor);
 
 	if (!out_size)
 		return false;
@@ -200,11 +199,13 @@ bool compress_rfc1950_libdeflate(const unsigned char* in_data, unsigned in_size,
 {
 	struct libdeflate_compressor* compressor;
 
-	compressor = libdeflate_alloc_compressor(compression_level);
+	compressor = zcache_libdeflate_get(compression_level);
+	if (!compressor)
+		return false;
 
 	out_size = libdeflate_zlib_compress(compressor, in_data, in_size, out_data, out_size);
 
-	libdeflate_free_compressor(compressor);
+	zcache_libdeflate_put(compressor);
 
 	if (!out_size)
 		return false;
@@ -232,27 +233,146 @@ bool decompress_bzip2(const unsigned char* in_data, unsigned in_size, unsigned c
 }
 #endif
 
-bool compress_zlib(shrink_t level, unsigned char* out_data, unsigned& out_size, const unsigned char* in_data, unsigned in_size)
+/**
+ * Backends raced by shrink_insane. They run over the same input at the
+ * same time, and bound holds the smallest deflate data found so far.
+ */
+struct compress_race {
+	bool zlib;
+	shrink_t level;
+	const unsigned char* in_data;
+	unsigned in_size;
+	unsigned bound;
+	unsigned char* data[2];
+	unsigned size[2];
+	bool ok[2];
+};
+
+static void compress_race_lower(compress_race* race, unsigned size)
 {
-	if (level.level == shrink_insane) {
+	unsigned bound = __atomic_load_n(&race->bound, __ATOMIC_RELAXED);
+	while (size < bound && !__atomic_compare_exchange_n(&race->bound, &bound, size, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void compress_race_run(void* arg, size_t i)
+{
+	compress_race* race = static_cast<compress_race*>(arg);
+	unsigned header = race->zlib ? 6 : 0;
+
+	race->data[i] = 0;
+	race->ok[i] = false;
+
+	if (i == 0) {
 		ZopfliOptions opt_zopfli;
 		unsigned char* data;
 		size_t size;
 
 		ZopfliInitOptions(&opt_zopfli);
-		opt_zopfli.numiterations = level.iter > 5 ? level.iter : 5;
+		opt_zopfli.numiterations = race->level.iter > 5 ? race->level.iter : 5;
+		opt_zopfli.parallel_for = race->level.parallel_for;
+		opt_zopfli.stop = race->level.stop;
+		opt_zopfli.stop_arg = race->level.stop_arg;
 
 		size = 0;
 		data = 0;
 
-		ZopfliCompress(&opt_zopfli, ZOPFLI_FORMAT_ZLIB, in_data, in_size, &data, &size);
+		ZopfliCompress(&opt_zopfli, race->zlib ? ZOPFLI_FORMAT_ZLIB : ZOPFLI_FORMAT_DEFLATE, race->in_data, race->in_size, &data, &size);
+
+		race->data[i] = data;
+		race->size[i] = static_cast<unsigned>(size);
+		race->ok[i] = size > header;
+	} else {
+		unsigned sz_passes = race->level.iter > 15 ? race->level.iter : 15;
+		if (sz_passes > 255)
+			sz_passes = 255;
+
+		// 7z gives up as soon as its output passes the bound, which
+		// counts the deflate data alone
+		unsigned size = __atomic_load_n(&race->bound, __ATOMIC_RELAXED) + header;
+		unsigned char* data = (unsigned char*)malloc(size);
+
+		// not data_alloc(), its throw can't leave a pool task
+		if (!data)
+			race->ok[i] = false;
+		else if (race->zlib)
+			race->ok[i] = compress_rfc1950_7z(race->in_data, race->in_size, data, size, sz_passes, 255, &race->bound, race->level.stop, race->level.stop_arg);
+		else
+			race->ok[i] = compress_deflate_7z(race->in_data, race->in_size, data, size, sz_passes, 255, &race->bound, race->level.stop, race->level.stop_arg);
+
+		race->data[i] = data;
+		race->size[i] = size;
+	}
 
-		if (size < out_size) {
-			memcpy(out_data, data, size);
-			out_size = static_cast<unsigned>(size);
+	if (race->ok[i])
+		compress_race_lower(race, race->size[i] - header);
+}
+
+/**
+ * Compresses with zopfli and 7z at the same time through level.parallel_for,
+ * or one after the other without it, after libdeflate gave the first bound.
+ * The smallest result is kept, zopfli first on ties, so the output doesn't
+ * depend on which backend finishes first. Once level.stop fires zopfli
+ * outputs the iterations it had time for, and an unfinished 7z is dropped.
+ */
+static void compress_insane(bool zlib, shrink_t level, unsigned char* out_data, unsigned& out_size, const unsigned char* in_data, unsigned in_size)
+{
+	unsigned header = zlib ? 6 : 0;
+	compress_race race;
+	unsigned char* data;
+	unsigned size;
+	bool ok;
+
+	// assume that zopfli is better, but libdeflate is a fast try to cover
+	// some corner cases and bounds the slow ones
+	size = out_size;
+	data = data_alloc(size);
+
+	if (zlib)
+		ok = compress_rfc1950_libdeflate(in_data, in_size, data, size, 12);
+	else
+		ok = compress_deflate_libdeflate(in_data, in_size, data, size, 12);
+	if (ok) {
+		memcpy(out_data, data, size);
+		out_size = size;
+	}
+
+	data_free(data);
+
+	if (out_size <= header)
+		return;
+
+	// past the deadline the libdeflate result is kept as it is
+	if (level.stop && level.stop(level.stop_arg))
+		return;
+
+	race.zlib = zlib;
+	race.level = level;
+	race.in_data = in_data;
+	race.in_size = in_size;
+	race.bound = out_size - header;
+
+	if (level.parallel_for) {
+		level.parallel_for(compress_race_run, &race, 2);
+	} else {
+		compress_race_run(&race, 0);
+		compress_race_run(&race, 1);
+	}
+
+	for(unsigned i=0;i<2;++i) {
+		if (race.ok[i] && race.size[i] < out_size) {
+			memcpy(out_data, race.data[i], race.size[i]);
+			out_size = race.size[i];
 		}
+		free(race.data[i]);
+	}
+}
 
-		free(data);
+bool compress_zlib(shrink_t level, unsigned char* out_data, unsigned& out_size, const unsigned char* in_data, unsigned in_size)
+{
+	if (level.level == shrink_insane) {
+		compress_insane(true, level, out_data, out_size, in_data, in_size);
+		return true;
 	}
 
 	if (level.level == shrink_extra) {
@@ -285,7 +405,7 @@ bool compress_zlib(shrink_t level, unsigned char* out_data, unsigned& out_size,
 		return true;
 	}
 
-	if (level.level == shrink_normal || level.level == shrink_extra || level.level == shrink_insane) {
+	if (level.level == shrink_normal || level.level == shrink_extra) {
 		int compression_level;
 		unsigned char* data;
 		unsigned size;
@@ -298,10 +418,6 @@ bool compress_zlib(shrink_t level, unsigned char* out_data, unsigned& out_size,
 			// assume that 7z is better, but does a fast try to cover some corner cases
 			compression_level = 12;
 			break;
-		case shrink_insane :
-			// assume that zopfli is better, but does a fast try to cover some corner cases
-			compression_level = 12;
-			break;
 		default:
 			assert(0);
 		}
@@ -350,28 +466,12 @@ bool compress_zlib(shrink_t level, unsigned char* out_data, unsigned& out_size,
 bool compress_deflate(shrink_t level, unsigned char* out_data, unsigned& out_size, const unsigned char* in_data, unsigned in_size)
 {
 	if (level.level == shrink_insane) {
-		ZopfliOptions opt_zopfli;
-		unsigned char* data;
-		size_t size;
-		
-		ZopfliInitOptions(&opt_zopfli);
-		opt_zopfli.numiterations = level.iter > 5 ? level.iter : 5;
-
-		size = 0;
-		data = 0;
-
-		ZopfliCompress(&opt_zopfli, ZOPFLI_FORMAT_DEFLATE, in_data, in_size, &data, &size);
-
-		if (size < out_size) {
-			memcpy(out_data, data, size);
-			out_size = static_cast<unsigned>(size);
-		}
-
-		free(data);
+		compress_insane(false, level, out_data, out_size, in_data, in_size);
+		return true;
 	}
 
 	// note that in some case, 7z is better than zopfli
-	if (level.level == shrink_normal || level.level == shrink_extra || level.level == shrink_insane) {
+	if (level.level == shrink_normal || level.level == shrink_extra) {
 		int compression_level;
 		unsigned char* data;
 		unsigned size;
@@ -383,10 +483,6 @@ bool compress_deflate(shrink_t level, unsigned char* out_data, unsigned& out_siz
 		case shrink_extra :
 			compression_level = 12;
 			break;
-		case shrink_insane :
-			// assume that zopfli is better, but does a fast try to cover some corner cases
-			compression_level = 12;
-			break;
 		default:
 			assert(0);
 		}
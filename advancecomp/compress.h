@@ -65,6 +65,9 @@ enum shrink_level_t {
 struct shrink_t {
 	enum shrink_level_t level;
 	unsigned iter;
+	ZopfliParallelFor* parallel_for; /**< Threads for zopfli, 0 to run it on the caller. */
+	ZopfliStop* stop; /**< Ends zopfli and 7z early with the best result so far, 0 to run them in full. */
+	void* stop_arg;
 };
 
 bool compress_zlib(shrink_t level, unsigned char* out_data, unsigned& out_size, const unsigned char* in_data, unsigned in_size);
@@ -47,25 +47,30 @@
  */
 #define ERROR_DESC_MAX 2048
 
+/*
+ * The error state is per thread, as several images can be processed
+ * at the same time.
+ */
+
 /**
  * Last error description.
  */
-static char error_desc_buffer[ERROR_DESC_MAX];
+static __thread char error_desc_buffer[ERROR_DESC_MAX];
 
 /**
  * Flag set if an unsupported feature is found.
  */
-static adv_bool error_unsupported_flag;
+static __thread adv_bool error_unsupported_flag;
 
 /**
  * Flag for cat mode.
  */
-static adv_bool error_cat_flag;
+static __thread adv_bool error_cat_flag;
 
 /**
  * Prefix for cat mode.
  */
-static char error_cat_prefix_buffer[ERROR_DESC_MAX];
+static __thread char error_cat_prefix_buffer[ERROR_DESC_MAX];
 
 /**
  * Set the error cat mode.
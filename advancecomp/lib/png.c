@@ -34,6 +34,12 @@
 #include "endianrw.h"
 #include "error.h"
 
+#include "libdeflate/libdeflate.h"
+#include "filter.h"
+#include "zcache.h"
+
+#include <limits.h>
+
 /**************************************************************************************/
 /* PNG */
 
@@ -263,91 +269,80 @@ void adv_png_expand_1(unsigned width, unsigned height, unsigned char* ptr)
 }
 
 /**
- * Unfilter a 8 bit image.
- * \param width With of the image.
+ * Decompress the zlib stream of the IDAT chunks.
+ * libdeflate does it in one go. zlib stays for the streams it accepts and
+ * libdeflate doesn't, like the ones followed by garbage.
+ * \param out_ptr Destination.
+ * \param out_size Size of the destination.
+ * \param res_size Where to put the decompressed size.
+ * \param in_ptr Compressed stream.
+ * \param in_size Size of the compressed stream.
+ */
+static adv_error adv_png_inflate(unsigned char* out_ptr, unsigned out_size, unsigned long* res_size, unsigned char* in_ptr, unsigned in_size)
+{
+	struct libdeflate_decompressor* d;
+	size_t size;
+	z_stream z;
+	int r;
+
+	d = zcache_inflate_get();
+	if (d) {
+		r = libdeflate_zlib_decompress(d, in_ptr, in_size, out_ptr, out_size, &size);
+		zcache_inflate_put(d);
+		if (r == LIBDEFLATE_SUCCESS) {
+			*res_size = size;
+			return 0;
+		}
+	}
+
+	z.zalloc = 0;
+	z.zfree = 0;
+	z.next_out = out_ptr;
+	z.avail_out = out_size;
+	z.next_in = in_ptr;
+	z.avail_in = in_size;
+
+	r = inflateInit(&z);
+	if (r == Z_OK)
+		r = inflate(&z, Z_FINISH);
+
+	*res_size = z.total_out;
+
+	inflateEnd(&z);
+
+	return r == Z_STREAM_END ? 0 : -1;
+}
+
+/**
+ * Unfilter the rows of an image in place.
+ * \param width Row size in bytes.
  * \param height Height of the image.
  * \param p Data pointer. It must point at the first filter type byte.
  * \param line Scanline size of row.
+ * \param bpp Bytes per pixel, rounded up to 1.
  */
-void adv_png_unfilter_8(unsigned width, unsigned height, unsigned char* p, unsigned line)
+static void adv_png_unfilter(unsigned width, unsigned height, unsigned char* p, unsigned line, unsigned bpp)
 {
-	unsigned i, j;
+	unsigned i;
 
 	for(i=0;i<height;++i) {
-		unsigned char f = *p++;
-
-		if (f == 0) { /* none */
-			p += width;
-		} else if (f == 1) { /* sub */
-			++p;
-			for(j=1;j<width;++j) {
-				p[0] += p[-1];
-				++p;
-			}
-		} else if (f == 2) { /* up */
-			if (i) {
-				unsigned char* u = p - line;
-				for(j=0;j<width;++j) {
-					*p += *u;
-					++p;
-					++u;
-				}
-			} else {
-				p += width;
-			}
-		} else if (f == 3) { /* average */
-			if (i) {
-				unsigned char* u = p - line;
-				p[0] += u[0] / 2;
-				++p;
-				++u;
-				for(j=1;j<width;++j) {
-					unsigned a = (unsigned)u[0] + (unsigned)p[-1];
-					p[0] += a >> 1;
-					++p;
-					++u;
-				}
-			} else {
-				++p;
-				for(j=1;j<width;++j) {
-					p[0] += p[-1] / 2;
-					++p;
-				}
-			}
-		} else if (f == 4) { /* paeth */
-			unsigned char* u = p - line;
-			for(j=0;j<width;++j) {
-				unsigned a, b, c;
-				int v;
-				int da, db, dc;
-				a = j<1 ? 0 : p[-1];
-				b = i<1 ? 0 : u[0];
-				c = (j<1 || i<1) ? 0 : u[-1];
-				v = a + b - c;
-				da = v - a;
-				if (da < 0)
-					da = -da;
-				db = v - b;
-				if (db < 0)
-					db = -db;
-				dc = v - c;
-				if (dc < 0)
-					dc = -dc;
-				if (da <= db && da <= dc)
-					p[0] += a;
-				else if (db <= dc)
-					p[0] += b;
-				else
-					p[0] += c;
-				++p;
-				++u;
-			}
-		}
-
-		p += line - width - 1;
+		unfilter_row(p[0], p + 1, i ? p + 1 - line : 0, width, bpp);
+		p += line;
 	}
 }
 
+/**
+ * Unfilter a 8 bit image.
+ * \param width With of the image.
+ * \param height Height of the image.
+ * \param p Data pointer. It must point at the first filter type byte.
+ * \param line Scanline size of row.
+ */
+void adv_png_unfilter_8(unsigned width, unsigned height, unsigned char* p, unsigned line)
+{
+	adv_png_unfilter(width, height, p, line, 1);
+}
+
 /**
  * Unfilter a 24 bit image.
  * \param width With of the image.
@@ -357,83 +352,7 @@ void adv_png_unfilter_8(unsigned width, unsigned height, unsigned char* p, unsig
  */
 void adv_png_unfilter_24(unsigned width, unsigned height, unsigned char* p, unsigned line)
 {
-	unsigned i, j;
-
-	for(i=0;i<height;++i) {
-		unsigned char f = *p++;
-
-		if (f == 0) { /* none */
-			p += width;
-		} else if (f == 1) { /* sub */
-			p += 3;
-			for(j=3;j<width;++j) {
-				p[0] += p[-3];
-				++p;
-			}
-		} else if (f == 2) { /* up */
-			if (i) {
-				unsigned char* u = p - line;
-				for(j=0;j<width;++j) {
-					*p += *u;
-					++p;
-					++u;
-				}
-			} else {
-				p += width;
-			}
-		} else if (f == 3) { /* average */
-			if (i) {
-				unsigned char* u = p - line;
-				p[0] += u[0] / 2;
-				p[1] += u[1] / 2;
-				p[2] += u[2] / 2;
-				p += 3;
-				u += 3;
-				for(j=3;j<width;++j) {
-					unsigned a = (unsigned)u[0] + (unsigned)p[-3];
-					p[0] += a >> 1;
-					++p;
-					++u;
-				}
-			} else {
-				p += 3;
-				for(j=3;j<width;++j) {
-					p[0] += p[-3] / 2;
-					++p;
-				}
-			}
-		} else if (f == 4) { /* paeth */
-			unsigned char* u = p - line;
-			for(j=0;j<width;++j) {
-				unsigned a, b, c;
-				int v;
-				int da, db, dc;
-				a = j<3 ? 0 : p[-3];
-				b = i<1 ? 0 : u[0];
-				c = (j<3 || i<1) ? 0 : u[-3];
-				v = a + b - c;
-				da = v - a;
-				if (da < 0)
-					da = -da;
-				db = v - b;
-				if (db < 0)
-					db = -db;
-				dc = v - c;
-				if (dc < 0)
-					dc = -dc;
-				if (da <= db && da <= dc)
-					p[0] += a;
-				else if (db <= dc)
-					p[0] += b;
-				else
-					p[0] += c;
-				++p;
-				++u;
-			}
-		}
-
-		p += line - width - 1;
-	}
+	adv_png_unfilter(width, height, p, line, 3);
 }
 
 /**
@@ -445,84 +364,7 @@ void adv_png_unfilter_24(unsigned width, unsigned height, unsigned char* p, unsi
  */
 void adv_png_unfilter_32(unsigned width, unsigned height, unsigned char* p, unsigned line)
 {
-	unsigned i, j;
-
-	for(i=0;i<height;++i) {
-		unsigned char f = *p++;
-
-		if (f == 0) { /* none */
-			p += width;
-		} else if (f == 1) { /* sub */
-			p += 4;
-			for(j=4;j<width;++j) {
-				p[0] += p[-4];
-				++p;
-			}
-		} else if (f == 2) { /* up */
-			if (i) {
-				unsigned char* u = p - line;
-				for(j=0;j<width;++j) {
-					*p += *u;
-					++p;
-					++u;
-				}
-			} else {
-				p += width;
-			}
-		} else if (f == 3) { /* average */
-			if (i) {
-				unsigned char* u = p - line;
-				p[0] += u[0] / 2;
-				p[1] += u[1] / 2;
-				p[2] += u[2] / 2;
-				p[3] += u[3] / 2;
-				p += 4;
-				u += 4;
-				for(j=4;j<width;++j) {
-					unsigned a = (unsigned)u[0] + (unsigned)p[-4];
-					p[0] += a >> 1;
-					++p;
-					++u;
-				}
-			} else {
-				p += 4;
-				for(j=4;j<width;++j) {
-					p[0] += p[-4] / 2;
-					++p;
-				}
-			}
-		} else if (f == 4) { /* paeth */
-			unsigned char* u = p - line;
-			for(j=0;j<width;++j) {
-				unsigned a, b, c;
-				int v;
-				int da, db, dc;
-				a = j<4 ? 0 : p[-4];
-				b = i<1 ? 0 : u[0];
-				c = (j<4 || i<1) ? 0 : u[-4];
-				v = a + b - c;
-				da = v - a;
-				if (da < 0)
-					da = -da;
-				db = v - b;
-				if (db < 0)
-					db = -db;
-				dc = v - c;
-				if (dc < 0)
-					dc = -dc;
-				if (da <= db && da <= dc)
-					p[0] += a;
-				else if (db <= dc)
-					p[0] += b;
-				else
-					p[0] += c;
-				++p;
-				++u;
-			}
-		}
-
-		p += line - width - 1;
-	}
+	adv_png_unfilter(width, height, p, line, 4);
 }
 
 /**
@@ -571,42 +413,169 @@ adv_error adv_png_read_iend(adv_fz* f, const unsigned char* data, unsigned data_
 	return 0;
 }
 
+/**
+ * Geometry of an Adam7 pass.
+ * \param pass Pass number, from 0 to 6.
+ * \param width Width of the image.
+ * \param height Height of the image.
+ * \param x Where to put the column of the first pixel of the pass.
+ * \param y Where to put the row of the first pixel of the pass.
+ * \param dx Where to put the column step of the pass.
+ * \param dy Where to put the row step of the pass.
+ * \param pass_width Where to put the width of the pass. It may be 0.
+ * \param pass_height Where to put the height of the pass. It may be 0.
+ */
+void adv_png_adam7_pass(unsigned pass, unsigned width, unsigned height, unsigned* x, unsigned* y, unsigned* dx, unsigned* dy, unsigned* pass_width, unsigned* pass_height)
+{
+	static const unsigned char adam7[7][4] = {
+		{ 0, 0, 8, 8 },
+		{ 4, 0, 8, 8 },
+		{ 0, 4, 4, 8 },
+		{ 2, 0, 4, 4 },
+		{ 0, 2, 2, 4 },
+		{ 1, 0, 2, 2 },
+		{ 0, 1, 1, 2 }
+	};
+
+	*x = adam7[pass][0];
+	*y = adam7[pass][1];
+	*dx = adam7[pass][2];
+	*dy = adam7[pass][3];
+	*pass_width = width > *x ? (width - *x + *dx - 1) / *dx : 0;
+	*pass_height = height > *y ? (height - *y + *dy - 1) / *dy : 0;
+}
+
+/**
+ * Size of the rows of an image, or of an Adam7 pass, added to a size.
+ * \param size Size to add to.
+ * \param width Width of the rows.
+ * \param height Number of rows.
+ * \param bits Bits per pixel.
+ * \return 0 on success, -1 if the size doesn't fit in an unsigned.
+ */
+static adv_error adv_png_rows_size(unsigned* size, unsigned width, unsigned height, unsigned bits)
+{
+	unsigned line;
+
+	if (width > (UINT_MAX - 7) / bits) {
+		error_set("Image too big");
+		return -1;
+	}
+
+	line = (width * bits + 7) / 8 + 1;
+	if (height > (UINT_MAX - *size) / line) {
+		error_set("Image too big");
+		return -1;
+	}
+
+	*size += height * line;
+	return 0;
+}
+
+/**
+ * Size of the decompressed data of an image.
+ * \param size Where to put the size.
+ * \param width Width of the image.
+ * \param height Height of the image.
+ * \param bits Bits per pixel.
+ * \param interlace Interlace method, 0 or 1 for Adam7.
+ * \return 0 on success, -1 if the size doesn't fit in an unsigned.
+ */
+static adv_error adv_png_raw_size(unsigned* size, unsigned width, unsigned height, unsigned bits, unsigned interlace)
+{
+	unsigned pass, x, y, dx, dy, pass_width, pass_height;
+
+	*size = 0;
+	if (!interlace)
+		return adv_png_rows_size(size, width, height, bits);
+
+	for(pass=0;pass<7;++pass) {
+		adv_png_adam7_pass(pass, width, height, &x, &y, &dx, &dy, &pass_width, &pass_height);
+		if (pass_width && pass_height)
+			if (adv_png_rows_size(size, pass_width, pass_height, bits) != 0)
+				return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Unfilter the Adam7 passes of an image and move their pixels in place.
+ * The samples of less than 8 bits get a byte each.
+ * \param width Width of the image.
+ * \param height Height of the image.
+ * \param depth Bits per sample.
+ * \param channel Samples per pixel.
+ * \param pixel Bytes per pixel of the destination.
+ * \param dst_ptr Destination. It must point at the first filter type byte.
+ * \param dst_scanline Scanline size of the destination.
+ * \param src_ptr Decompressed passes.
+ */
+static void adv_png_deinterlace(unsigned width, unsigned height, unsigned depth, unsigned channel, unsigned pixel, unsigned char* dst_ptr, unsigned dst_scanline, unsigned char* src_ptr)
+{
+	unsigned bpp = (channel * depth + 7) / 8;
+	unsigned pass, i, j;
+
+	for(pass=0;pass<7;++pass) {
+		unsigned x, y, dx, dy, pass_width, pass_height;
+		unsigned line;
+
+		adv_png_adam7_pass(pass, width, height, &x, &y, &dx, &dy, &pass_width, &pass_height);
+		if (!pass_width || !pass_height)
+			continue;
+
+		line = (pass_width * channel * depth + 7) / 8 + 1;
+		adv_png_unfilter(line - 1, pass_height, src_ptr, line, bpp);
+
+		for(i=0;i<pass_height;++i) {
+			const unsigned char* p0 = src_ptr + i * line + 1;
+			unsigned char* p1 = dst_ptr + 1 + (y + i * dy) * dst_scanline + x * pixel;
+			for(j=0;j<pass_width;++j) {
+				if (depth >= 8) {
+					memcpy(p1, p0 + j * pixel, pixel);
+				} else {
+					unsigned bit = j * depth;
+					*p1 = (p0[bit / 8] >> (8 - depth - bit % 8)) & ((1 << depth) - 1);
+				}
+				p1 += dx * pixel;
+			}
+		}
+
+		src_ptr += pass_height * line;
+	}
+}
+
 /**
  * Read from the PNG_CN_IHDR chunk to the PNG_CN_IEND chunk.
- * \param pix_width Where to put the image width.
- * \param pix_height Where to put the image height.
- * \param pix_pixel Where to put the image bytes per pixel.
- * \param dat_ptr Where to put the allocated data pointer.
- * \param dat_size Where to put the allocated data size.
- * \param pix_ptr Where to put pointer at the start of the image data.
- * \param pix_scanline Where to put the length of a scanline in bytes.
- * \param pal_ptr Where to put the allocated palette data pointer. Set to 0 if the image is RGB.
- * \param pal_size Where to put the palette size in bytes. Set to 0 if the image is RGB.
- * \param rns_ptr Where to put the allocated transparency data pointer. Set to 0 if the image hasn't transparency.
- * \param rns_size Where to put the transparency size in number of bytes. Set to 0 if the image hasn't transparency.
- * \param f File to read.
- * \param data Pointer at the IHDR chunk. This chunk is not deallocated.
- * \param data_size Size of the IHDR chuck.
+ * \param any_format Accept all the color types, bit depths and interlace methods.
+ * Otherwise only paletted, 8 bits RGB and 8 bits RGBA not interlaced images.
  */
-adv_error adv_png_read_ihdr(
+static adv_error adv_png_read_ihdr_format(
 	unsigned* pix_width, unsigned* pix_height, unsigned* pix_pixel,
+	unsigned* pix_type, unsigned* pix_depth, unsigned* pix_interlace,
 	unsigned char** dat_ptr, unsigned* dat_size,
 	unsigned char** pix_ptr, unsigned* pix_scanline,
 	unsigned char** pal_ptr, unsigned* pal_size,
 	unsigned char** rns_ptr, unsigned* rns_size,
+	adv_bool any_format,
 	adv_fz* f, const unsigned char* data, unsigned data_size)
 {
 	unsigned char* ptr;
 	unsigned ptr_size;
 	unsigned type;
 	unsigned long res_size;
+	unsigned char* z_ptr;
+	unsigned z_size;
 	unsigned pixel;
+	unsigned channel;
 	unsigned width;
 	unsigned width_align;
 	unsigned height;
 	unsigned depth;
+	unsigned color;
+	unsigned interlace;
 	int r;
-	z_stream z;
+	adv_bool valid;
 	adv_bool has_palette;
 
 	*dat_ptr = 0;
@@ -625,35 +594,65 @@ adv_error adv_png_read_ihdr(
 	*pix_height = height = be_uint32_read(data + 4);
 
 	depth = data[8];
-	if (data[9] == 3 && depth == 8) {
-		pixel = 1;
-		width_align = width;
-		has_palette = 1;
-	} else if (data[9] == 3 && depth == 4) {
-		pixel = 1;
+	color = data[9];
+	interlace = data[12];
+	switch (color) {
+	case 0 :
+		channel = 1;
+		valid = depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16;
+		break;
+	case 3 :
+		channel = 1;
+		valid = depth == 1 || depth == 2 || depth == 4 || depth == 8;
+		break;
+	case 2 :
+	case 4 :
+	case 6 :
+		channel = color == 2 ? 3 : color == 4 ? 2 : 4;
+		valid = depth == 8 || depth == 16;
+		break;
+	default :
+		channel = 0;
+		valid = 0;
+		break;
+	}
+	if (!any_format && color != 3 && (depth != 8 || (color != 2 && color != 6)))
+		valid = 0;
+	if (!valid) {
+		error_unsupported_set("Unsupported bit depth/color type, %d/%d", depth, color);
+		goto err;
+	}
+
+	/* samples of less than 8 bits are expanded to a byte, the 16 bits ones stay big endian */
+	pixel = depth == 16 ? 2 * channel : channel;
+	has_palette = color == 3;
+
+	/* PNG limits the dimensions to 2^31 - 1, the rounding below can't wrap */
+	if (width == 0 || height == 0 || width > 0x7FFFFFFF || height > 0x7FFFFFFF) {
+		error_set("Invalid image size %ux%u", width, height);
+		goto err;
+	}
+
+	/* the rows of less than 8 bits are expanded in place, from a whole number of bytes */
+	if (depth == 4)
 		width_align = (width + 1) & ~1;
-		has_palette = 1;
-	} else if (data[9] == 3 && depth == 2) {
-		pixel = 1;
+	else if (depth == 2)
 		width_align = (width + 3) & ~3;
-		has_palette = 1;
-	} else if (data[9] == 3 && depth == 1) {
-		pixel = 1;
+	else if (depth == 1)
 		width_align = (width + 7) & ~7;
-		has_palette = 1;
-	} else if (data[9] == 2 && depth == 8) {
-		pixel = 3;
-		width_align = width;
-		has_palette = 0;
-	} else if (data[9] == 6 && depth == 8) {
-		pixel = 4;
+	else
 		width_align = width;
-		has_palette = 0;
-	} else {
-		error_unsupported_set("Unsupported bit depth/color type, %d/%d", (unsigned)data[8], (unsigned)data[9]);
+
+	/* the whole image is held in a buffer of unsigned size */
+	if (width_align > (UINT_MAX - 1) / pixel || height > UINT_MAX / (width_align * pixel + 1)) {
+		error_set("Image too big, %ux%u", width, height);
 		goto err;
 	}
+
 	*pix_pixel = pixel;
+	*pix_type = color;
+	*pix_depth = depth;
+	*pix_interlace = interlace;
 
 	if (data[10] != 0) { /* compression */
 		error_unsupported_set("Unsupported compression, %d instead of 0", (unsigned)data[10]);
@@ -663,8 +662,8 @@ adv_error adv_png_read_ihdr(
 		error_unsupported_set("Unsupported filter, %d instead of 0", (unsigned)data[11]);
 		goto err;
 	}
-	if (data[12] != 0) { /* interlace */
-		error_unsupported_set("Unsupported interlace %d", (unsigned)data[12]);
+	if (interlace > 1 || (interlace != 0 && !any_format)) {
+		error_unsupported_set("Unsupported interlace %d", interlace);
 		goto err;
 	}
 
@@ -714,91 +713,132 @@ adv_error adv_png_read_ihdr(
 		goto err_ptr;
 	}
 
+	/* a suggested palette of a RGB image isn't needed for its pixels */
+	if (any_format && (color == 2 || color == 6) && *pal_ptr) {
+		free(*pal_ptr);
+		*pal_ptr = 0;
+		*pal_size = 0;
+	}
+
 	if (!has_palette && *pal_ptr) {
 		error_set("Unexpected PLTE chunk");
 		goto err_ptr;
 	}
 
+	/* the images with an alpha channel can't have a tRNS chunk, it's ignored */
+	if (any_format && (color == 4 || color == 6) && *rns_ptr) {
+		free(*rns_ptr);
+		*rns_ptr = 0;
+		*rns_size = 0;
+	}
+
 	*dat_size = height * (width_align * pixel + 1);
 	*dat_ptr = malloc(*dat_size);
+	if (!*dat_ptr) {
+		error_set("Low memory");
+		goto err_ptr;
+	}
 	*pix_scanline = width_align * pixel + 1;
 	*pix_ptr = *dat_ptr + 1;
 
-	z.zalloc = 0;
-	z.zfree = 0;
-	z.next_out = *dat_ptr;
-	z.avail_out = *dat_size;
-	z.next_in = 0;
-	z.avail_in = 0;
-
-	r = inflateInit(&z);
-
-	while (r == Z_OK && type == ADV_PNG_CN_IDAT) {
-		z.next_in = ptr;
-		z.avail_in = ptr_size;
-
-		r = inflate(&z, Z_NO_FLUSH);
-
-		free(ptr);
-
+	/* collect the IDAT chunks to decompress them in one call */
+	z_ptr = ptr;
+	z_size = ptr_size;
+	while (1) {
 		if (adv_png_read_chunk(f, &ptr, &ptr_size, &type) != 0) {
-			inflateEnd(&z);
+			free(z_ptr);
 			goto err;
 		}
+		if (type != ADV_PNG_CN_IDAT)
+			break;
+		if (ptr_size) {
+			unsigned char* new_ptr = realloc(z_ptr, z_size + ptr_size);
+			if (!new_ptr) {
+				error_set("Low memory");
+				free(z_ptr);
+				goto err_ptr;
+			}
+			z_ptr = new_ptr;
+			memcpy(z_ptr + z_size, ptr, ptr_size);
+			z_size += ptr_size;
+		}
+		free(ptr);
 	}
 
-	res_size = z.total_out;
-
-	inflateEnd(&z);
+	if (interlace) {
+		unsigned raw_size;
+		unsigned char* raw_ptr;
 
-	if (r != Z_STREAM_END) {
-		error_set("Invalid compressed data");
-		goto err_ptr;
-	}
-
-	if (depth == 8) {
-		if (res_size != *dat_size) {
-			error_set("Invalid decompressed size");
+		if (adv_png_raw_size(&raw_size, width, height, channel * depth, interlace) != 0) {
+			free(z_ptr);
 			goto err_ptr;
 		}
 
-		if (pixel == 1)
-			adv_png_unfilter_8(width * pixel, height, *dat_ptr, width_align * pixel + 1);
-		else if (pixel == 3)
-			adv_png_unfilter_24(width * pixel, height, *dat_ptr, width_align * pixel + 1);
-		else if (pixel == 4)
-			adv_png_unfilter_32(width * pixel, height, *dat_ptr, width_align * pixel + 1);
-		else {
-			error_set("Unsupported format");
-			goto err_ptr;
-		}
-	} else if (depth == 4) {
-		if (res_size != height * (width_align / 2 + 1)) {
-			error_set("Invalid decompressed size");
+		raw_ptr = malloc(raw_size);
+		if (!raw_ptr) {
+			error_set("Low memory");
+			free(z_ptr);
 			goto err_ptr;
 		}
 
-		adv_png_unfilter_8(width_align / 2, height, *dat_ptr, width_align / 2 + 1);
+		r = adv_png_inflate(raw_ptr, raw_size, &res_size, z_ptr, z_size);
+
+		free(z_ptr);
 
-		adv_png_expand_4(width_align, height, *dat_ptr);
-	} else if (depth == 2) {
-		if (res_size != height * (width_align / 4 + 1)) {
-			error_set("Invalid decompressed size");
+		if (r != 0 || res_size != raw_size) {
+			error_set(r != 0 ? "Invalid compressed data" : "Invalid decompressed size");
+			free(raw_ptr);
 			goto err_ptr;
 		}
 
-		adv_png_unfilter_8(width_align / 4, height, *dat_ptr, width_align / 4 + 1);
+		adv_png_deinterlace(width, height, depth, channel, pixel, *dat_ptr, *pix_scanline, raw_ptr);
+
+		free(raw_ptr);
+	} else {
+		r = adv_png_inflate(*dat_ptr, *dat_size, &res_size, z_ptr, z_size);
+
+		free(z_ptr);
 
-		adv_png_expand_2(width_align, height, *dat_ptr);
-	} else if (depth == 1) {
-		if (res_size != height * (width_align / 8 + 1)) {
-			error_set("Invalid decompressed size");
+		if (r != 0) {
+			error_set("Invalid compressed data");
 			goto err_ptr;
 		}
 
-		adv_png_unfilter_8(width_align / 8, height, *dat_ptr, width_align / 8 + 1);
+		if (depth >= 8) {
+			if (res_size != *dat_size) {
+				error_set("Invalid decompressed size");
+				goto err_ptr;
+			}
+
+			adv_png_unfilter(width * pixel, height, *dat_ptr, width_align * pixel + 1, pixel);
+		} else if (depth == 4) {
+			if (res_size != height * (width_align / 2 + 1)) {
+				error_set("Invalid decompressed size");
+				goto err_ptr;
+			}
+
+			adv_png_unfilter_8(width_align / 2, height, *dat_ptr, width_align / 2 + 1);
 
-		adv_png_expand_1(width_align, height, *dat_ptr);
+			adv_png_expand_4(width_align, height, *dat_ptr);
+		} else if (depth == 2) {
+			if (res_size != height * (width_align / 4 + 1)) {
+				error_set("Invalid decompressed size");
+				goto err_ptr;
+			}
+
+			adv_png_unfilter_8(width_align / 4, height, *dat_ptr, width_align / 4 + 1);
+
+			adv_png_expand_2(width_align, height, *dat_ptr);
+		} else if (depth == 1) {
+			if (res_size != height * (width_align / 8 + 1)) {
+				error_set("Invalid decompressed size");
+				goto err_ptr;
+			}
+
+			adv_png_unfilter_8(width_align / 8, height, *dat_ptr, width_align / 8 + 1);
+
+			adv_png_expand_1(width_align, height, *dat_ptr);
+		}
 	}
 
 	if (adv_png_read_iend(f, ptr, ptr_size, type)!=0) {
@@ -818,9 +858,8 @@ err:
 }
 
 /**
- * Load a PNG image.
- * The image is stored in memory as present in the PNG format. It imply that the row scanline
- * is generally greater than the row size.
+ * Read from the PNG_CN_IHDR chunk to the PNG_CN_IEND chunk.
+ * Only paletted, 8 bits RGB and 8 bits RGBA not interlaced images are accepted.
  * \param pix_width Where to put the image width.
  * \param pix_height Where to put the image height.
  * \param pix_pixel Where to put the image bytes per pixel.
@@ -833,13 +872,57 @@ err:
  * \param rns_ptr Where to put the allocated transparency data pointer. Set to 0 if the image hasn't transparency.
  * \param rns_size Where to put the transparency size in number of bytes. Set to 0 if the image hasn't transparency.
  * \param f File to read.
+ * \param data Pointer at the IHDR chunk. This chunk is not deallocated.
+ * \param data_size Size of the IHDR chuck.
  */
-adv_error adv_png_read_rns(
+adv_error adv_png_read_ihdr(
+	unsigned* pix_width, unsigned* pix_height, unsigned* pix_pixel,
+	unsigned char** dat_ptr, unsigned* dat_size,
+	unsigned char** pix_ptr, unsigned* pix_scanline,
+	unsigned char** pal_ptr, unsigned* pal_size,
+	unsigned char** rns_ptr, unsigned* rns_size,
+	adv_fz* f, const unsigned char* data, unsigned data_size)
+{
+	unsigned pix_type;
+	unsigned pix_depth;
+	unsigned pix_interlace;
+
+	return adv_png_read_ihdr_format(pix_width, pix_height, pix_pixel, &pix_type, &pix_depth, &pix_interlace, dat_ptr, dat_size, pix_ptr, pix_scanline, pal_ptr, pal_size, rns_ptr, rns_size, 0, f, data, data_size);
+}
+
+/**
+ * Read from the PNG_CN_IHDR chunk to the PNG_CN_IEND chunk.
+ * Like png_read_ihdr() but for all the PNG formats. The samples of less than 8 bits
+ * get a byte each, with their value unchanged. The 16 bits samples stay big endian.
+ * An interlaced image is returned with its rows in order.
+ * \param pix_type Where to put the PNG color type.
+ * \param pix_depth Where to put the PNG bit depth.
+ * \param pix_interlace Where to put the PNG interlace method.
+ */
+adv_error adv_png_read_ihdr_type(
+	unsigned* pix_width, unsigned* pix_height, unsigned* pix_pixel,
+	unsigned* pix_type, unsigned* pix_depth, unsigned* pix_interlace,
+	unsigned char** dat_ptr, unsigned* dat_size,
+	unsigned char** pix_ptr, unsigned* pix_scanline,
+	unsigned char** pal_ptr, unsigned* pal_size,
+	unsigned char** rns_ptr, unsigned* rns_size,
+	adv_fz* f, const unsigned char* data, unsigned data_size)
+{
+	return adv_png_read_ihdr_format(pix_width, pix_height, pix_pixel, pix_type, pix_depth, pix_interlace, dat_ptr, dat_size, pix_ptr, pix_scanline, pal_ptr, pal_size, rns_ptr, rns_size, 1, f, data, data_size);
+}
+
+/**
+ * Load a PNG image.
+ * \param any_format Accept all the PNG formats, as png_read_ihdr_type().
+ */
+static adv_error adv_png_read_format(
 	unsigned* pix_width, unsigned* pix_height, unsigned* pix_pixel,
+	unsigned* pix_type, unsigned* pix_depth, unsigned* pix_interlace,
 	unsigned char** dat_ptr, unsigned* dat_size,
 	unsigned char** pix_ptr, unsigned* pix_scanline,
 	unsigned char** pal_ptr, unsigned* pal_size,
 	unsigned char** rns_ptr, unsigned* rns_size,
+	adv_bool any_format,
 	adv_fz* f)
 {
 	unsigned char* data;
@@ -857,7 +940,7 @@ adv_error adv_png_read_rns(
 
 		switch (type) {
 			case ADV_PNG_CN_IHDR :
-				if (adv_png_read_ihdr(pix_width, pix_height, pix_pixel, dat_ptr, dat_size, pix_ptr, pix_scanline, pal_ptr, pal_size, rns_ptr, rns_size, f, data, size) != 0)
+				if (adv_png_read_ihdr_format(pix_width, pix_height, pix_pixel, pix_type, pix_depth, pix_interlace, dat_ptr, dat_size, pix_ptr, pix_scanline, pal_ptr, pal_size, rns_ptr, rns_size, any_format, f, data, size) != 0)
 					goto err_data;
 				free(data);
 				return 0;
@@ -886,6 +969,57 @@ err:
 	return -1;
 }
 
+/**
+ * Load a PNG image.
+ * The image is stored in memory as present in the PNG format. It imply that the row scanline
+ * is generally greater than the row size.
+ * \param pix_width Where to put the image width.
+ * \param pix_height Where to put the image height.
+ * \param pix_pixel Where to put the image bytes per pixel.
+ * \param dat_ptr Where to put the allocated data pointer.
+ * \param dat_size Where to put the allocated data size.
+ * \param pix_ptr Where to put pointer at the start of the image data.
+ * \param pix_scanline Where to put the length of a scanline in bytes.
+ * \param pal_ptr Where to put the allocated palette data pointer. Set to 0 if the image is RGB.
+ * \param pal_size Where to put the palette size in bytes. Set to 0 if the image is RGB.
+ * \param rns_ptr Where to put the allocated transparency data pointer. Set to 0 if the image hasn't transparency.
+ * \param rns_size Where to put the transparency size in number of bytes. Set to 0 if the image hasn't transparency.
+ * \param f File to read.
+ */
+adv_error adv_png_read_rns(
+	unsigned* pix_width, unsigned* pix_height, unsigned* pix_pixel,
+	unsigned char** dat_ptr, unsigned* dat_size,
+	unsigned char** pix_ptr, unsigned* pix_scanline,
+	unsigned char** pal_ptr, unsigned* pal_size,
+	unsigned char** rns_ptr, unsigned* rns_size,
+	adv_fz* f)
+{
+	unsigned pix_type;
+	unsigned pix_depth;
+	unsigned pix_interlace;
+
+	return adv_png_read_format(pix_width, pix_height, pix_pixel, &pix_type, &pix_depth, &pix_interlace, dat_ptr, dat_size, pix_ptr, pix_scanline, pal_ptr, pal_size, rns_ptr, rns_size, 0, f);
+}
+
+/**
+ * Load a PNG image of any format.
+ * Like png_read_rns() but for all the PNG formats, as png_read_ihdr_type().
+ * \param pix_type Where to put the PNG color type.
+ * \param pix_depth Where to put the PNG bit depth.
+ * \param pix_interlace Where to put the PNG interlace method.
+ */
+adv_error adv_png_read_rns_type(
+	unsigned* pix_width, unsigned* pix_height, unsigned* pix_pixel,
+	unsigned* pix_type, unsigned* pix_depth, unsigned* pix_interlace,
+	unsigned char** dat_ptr, unsigned* dat_size,
+	unsigned char** pix_ptr, unsigned* pix_scanline,
+	unsigned char** pal_ptr, unsigned* pal_size,
+	unsigned char** rns_ptr, unsigned* rns_size,
+	adv_fz* f)
+{
+	return adv_png_read_format(pix_width, pix_height, pix_pixel, pix_type, pix_depth, pix_interlace, dat_ptr, dat_size, pix_ptr, pix_scanline, pal_ptr, pal_size, rns_ptr, rns_size, 1, f);
+}
+
 /**
  * Load a PNG image.
  * Like png_read_rns() but without transparency.
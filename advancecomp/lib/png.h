@@ -69,6 +69,16 @@ adv_error adv_png_read_ihdr(
 	adv_fz* f, const unsigned char* data, unsigned data_size
 );
 
+adv_error adv_png_read_ihdr_type(
+	unsigned* pix_width, unsigned* pix_height, unsigned* pix_pixel,
+	unsigned* pix_type, unsigned* pix_depth, unsigned* pix_interlace,
+	unsigned char** dat_ptr, unsigned* dat_size,
+	unsigned char** pix_ptr, unsigned* pix_scanline,
+	unsigned char** pal_ptr, unsigned* pal_size,
+	unsigned char** rns_ptr, unsigned* rns_size,
+	adv_fz* f, const unsigned char* data, unsigned data_size
+);
+
 adv_error adv_png_write_ihdr(
 	unsigned pix_width, unsigned pix_height,
 	unsigned pix_depth, unsigned pix_type,
@@ -97,6 +107,7 @@ void adv_png_expand_1(unsigned width, unsigned height, unsigned char* ptr);
 void adv_png_unfilter_8(unsigned width, unsigned height, unsigned char* ptr, unsigned line);
 void adv_png_unfilter_24(unsigned width, unsigned height, unsigned char* ptr, unsigned line);
 void adv_png_unfilter_32(unsigned width, unsigned height, unsigned char* ptr, unsigned line);
+void adv_png_adam7_pass(unsigned pass, unsigned width, unsigned height, unsigned* x, unsigned* y, unsigned* dx, unsigned* dy, unsigned* pass_width, unsigned* pass_height);
 
 /** \addtogroup VideoFile */
 /*@{*/
@@ -118,6 +129,16 @@ adv_error adv_png_read_rns(
 	adv_fz* f
 );
 
+adv_error adv_png_read_rns_type(
+	unsigned* pix_width, unsigned* pix_height, unsigned* pix_pixel,
+	unsigned* pix_type, unsigned* pix_depth, unsigned* pix_interlace,
+	unsigned char** dat_ptr, unsigned* dat_size,
+	unsigned char** pix_ptr, unsigned* pix_scanline,
+	unsigned char** pal_ptr, unsigned* pal_size,
+	unsigned char** rns_ptr, unsigned* rns_size,
+	adv_fz* f
+);
+
 adv_error adv_png_write(
 	unsigned pix_width, unsigned pix_height, unsigned pix_pixel,
 	const unsigned char* pix_ptr, int pix_pixel_pitch, int pix_scanline_pitch,
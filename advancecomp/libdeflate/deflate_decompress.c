@@ -46,6 +46,9 @@
  *   instructions and use it automatically at runtime when supported.
  */
 
+/* Built as it comes, the signedness of its comparisons is checked upstream */
+#pragma GCC diagnostic ignored "-Wsign-compare"
+
 #include <stdlib.h>
 #include <string.h>
 
@@ -24,12 +24,196 @@
 #include "lib/mng.h"
 
 #include "pngex.h"
+#include "filter.h"
+#include "zcache.h"
 
 #include <iostream>
 #include <iomanip>
 
+#include <math.h>
+
 using namespace std;
 
+/**
+ * Size of the already filtered data used as dictionary by the brute force filter.
+ */
+#define PNG_FILTER_BRUTE_WINDOW 8192
+
+/**
+ * Compression level used by the brute force filter on each row.
+ */
+#define PNG_FILTER_BRUTE_LEVEL 1
+
+/**
+ * Compression level used to compare the filter candidates.
+ */
+#define PNG_FILTER_PROBE_LEVEL 6
+
+/**
+ * Filters tried by png_filter_best(), in order of preference in case of ties.
+ */
+static const png_filter_t png_filter_candidates[] = {
+	png_filter_none,
+	png_filter_sub,
+	png_filter_up,
+	png_filter_average,
+	png_filter_paeth,
+	png_filter_minsum,
+	png_filter_entropy,
+	png_filter_brute
+};
+
+/**
+ * Shannon entropy of the filtered bytes, in bits.
+ */
+static double png_filter_score_entropy(const unsigned char* p, unsigned size)
+{
+	unsigned count[256];
+	double sum;
+	unsigned j;
+
+	memset(count, 0, sizeof(count));
+	for(j=0;j<size;++j)
+		++count[p[j]];
+
+	sum = size * log((double)size);
+	for(j=0;j<256;++j)
+		if (count[j])
+			sum -= count[j] * log((double)count[j]);
+
+	return sum / log(2.0);
+}
+
+/**
+ * Filter the image rows.
+ * \param filter Filtering strategy.
+ * \param fil_ptr Destination. It must have space for dy * (dx * img_pixel + 1) bytes.
+ */
+void png_filter(png_filter_t filter, unsigned char* fil_ptr, const unsigned char* img_ptr, unsigned img_scanline, unsigned img_pixel, unsigned x, unsigned y, unsigned dx, unsigned dy)
+{
+	unsigned size = dx * img_pixel;
+	unsigned fil_scanline = size + 1;
+	unsigned char* zero;
+	unsigned char* try_ptr;
+	struct libdeflate_compressor* compressor;
+	unsigned char* z_ptr;
+	unsigned z_size;
+	unsigned i;
+
+	zero = data_alloc(size + 1);
+	memset(zero, 0, size + 1);
+
+	if (filter <= png_filter_paeth) {
+		for(i=0;i<dy;++i) {
+			const unsigned char* row = &img_ptr[x * img_pixel + (i+y) * img_scanline];
+			const unsigned char* prev = i ? row - img_scanline : zero;
+			filter_row(filter - png_filter_none, fil_ptr + i * fil_scanline, row, prev, size, img_pixel);
+		}
+
+		data_free(zero);
+		return;
+	}
+
+	try_ptr = data_alloc(fil_scanline);
+
+	compressor = 0;
+	z_ptr = 0;
+	z_size = 0;
+	if (filter == png_filter_brute) {
+		compressor = zcache_libdeflate_get(PNG_FILTER_BRUTE_LEVEL);
+		if (!compressor) {
+			data_free(try_ptr);
+			data_free(zero);
+			throw std::bad_alloc();
+		}
+		z_size = libdeflate_deflate_compress_bound(compressor, PNG_FILTER_BRUTE_WINDOW + fil_scanline);
+		z_ptr = (unsigned char*)malloc(z_size);
+		if (!z_ptr) {
+			zcache_libdeflate_put(compressor);
+			data_free(try_ptr);
+			data_free(zero);
+			throw std::bad_alloc();
+		}
+	}
+
+	for(i=0;i<dy;++i) {
+		const unsigned char* row = &img_ptr[x * img_pixel + (i+y) * img_scanline];
+		const unsigned char* prev = i ? row - img_scanline : zero;
+		unsigned char* dst = fil_ptr + i * fil_scanline;
+		unsigned best_type = 0;
+		double best_score = 0;
+		unsigned type;
+
+		for(type=0;type<5;++type) {
+			double score;
+
+			if (filter == png_filter_brute) {
+				// filter in place, after the already filtered rows used as dictionary
+				unsigned window = i * fil_scanline;
+				if (window > PNG_FILTER_BRUTE_WINDOW)
+					window = PNG_FILTER_BRUTE_WINDOW;
+				filter_row(type, dst, row, prev, size, img_pixel);
+				score = libdeflate_deflate_compress(compressor, dst - window, window + fil_scanline, z_ptr, z_size);
+			} else {
+				filter_row(type, try_ptr, row, prev, size, img_pixel);
+				if (filter == png_filter_minsum)
+					score = filter_row_sum(try_ptr + 1, size);
+				else
+					score = png_filter_score_entropy(try_ptr + 1, size);
+			}
+
+			if (type == 0 || score < best_score) {
+				best_type = type;
+				best_score = score;
+			}
+		}
+
+		filter_row(best_type, dst, row, prev, size, img_pixel);
+	}
+
+	if (compressor) {
+		free(z_ptr);
+		zcache_libdeflate_put(compressor);
+	}
+	data_free(try_ptr);
+	data_free(zero);
+}
+
+/**
+ * Filter the image rows with the strategy that compresses better.
+ * Each candidate is compressed with a fast libdeflate pass, and only the best
+ * one is left in fil_ptr for the final and expensive compression.
+ */
+void png_filter_best(unsigned char* fil_ptr, const unsigned char* img_ptr, unsigned img_scanline, unsigned img_pixel, unsigned x, unsigned y, unsigned dx, unsigned dy)
+{
+	unsigned fil_size = dy * (dx * img_pixel + 1);
+	data_ptr try_ptr;
+	data_ptr z_ptr;
+	unsigned best_size;
+	unsigned i;
+
+	try_ptr = data_alloc(fil_size);
+	z_ptr = data_alloc(oversize_zlib(fil_size));
+
+	best_size = 0;
+	for(i=0;i<sizeof(png_filter_candidates)/sizeof(png_filter_candidates[0]);++i) {
+		unsigned z_size = oversize_zlib(fil_size);
+
+		png_filter(png_filter_candidates[i], try_ptr, img_ptr, img_scanline, img_pixel, x, y, dx, dy);
+
+		if (!compress_rfc1950_libdeflate(try_ptr, fil_size, z_ptr, z_size, PNG_FILTER_PROBE_LEVEL))
+			continue;
+
+		if (best_size == 0 || z_size < best_size) {
+			best_size = z_size;
+			memcpy(fil_ptr, try_ptr, fil_size);
+		}
+	}
+
+	if (best_size == 0)
+		png_filter(png_filter_none, fil_ptr, img_ptr, img_scanline, img_pixel, x, y, dx, dy);
+}
+
 void png_compress(shrink_t level, data_ptr& out_ptr, unsigned& out_size, const unsigned char* img_ptr, unsigned img_scanline, unsigned img_pixel, unsigned x, unsigned y, unsigned dx, unsigned dy)
 {
 	data_ptr fil_ptr;
@@ -37,8 +221,6 @@ void png_compress(shrink_t level, data_ptr& out_ptr, unsigned& out_size, const u
 	unsigned fil_scanline;
 	data_ptr z_ptr;
 	unsigned z_size;
-	unsigned i;
-	unsigned char* p0;
 
 	fil_scanline = dx * img_pixel + 1;
 	fil_size = dy * fil_scanline;
@@ -47,16 +229,11 @@ void png_compress(shrink_t level, data_ptr& out_ptr, unsigned& out_size, const u
 	fil_ptr = data_alloc(fil_size);
 	z_ptr = data_alloc(z_size);
 
-	p0 = fil_ptr;
-
-	for(i=0;i<dy;++i) {
-		const unsigned char* p1 = &img_ptr[x * img_pixel + (i+y) * img_scanline];
-		*p0++ = 0;
-		memcpy(p0, p1, dx * img_pixel);
-		p0 += dx * img_pixel;
-	}
-
-	assert(p0 == fil_ptr + fil_size);
+	// with the store level there is nothing to gain from filtering
+	if (level.level == shrink_none)
+		png_filter(png_filter_none, fil_ptr, img_ptr, img_scanline, img_pixel, x, y, dx, dy);
+	else
+		png_filter_best(fil_ptr, img_ptr, img_scanline, img_pixel, x, y, dx, dy);
 
 	if (!compress_zlib(level, z_ptr, z_size, fil_ptr, fil_size)) {
 		throw error() << "Failed compression";
@@ -86,13 +263,12 @@ void png_compress_delta(shrink_t level, data_ptr& out_ptr, unsigned& out_size, c
 	p0 = fil_ptr;
 
 	for(i=0;i<dy;++i) {
-		unsigned j;
 		const unsigned char* p1 = &img_ptr[x * img_pixel + (i+y) * img_scanline];
 		const unsigned char* p2 = &prev_ptr[x * img_pixel + (i+y) * prev_scanline];
 
 		*p0++ = 0;
-		for(j=0;j<dx*img_pixel;++j)
-			*p0++ = *p1++ - *p2++;
+		filter_row_diff(p0, p1, p2, dx * img_pixel);
+		p0 += dx * img_pixel;
 	}
 
 	assert(p0 == fil_ptr + fil_size);
@@ -310,11 +486,134 @@ void png_print_chunk(unsigned type, unsigned char* data, unsigned size)
 	cout << endl;
 }
 
-void png_write(adv_fz* f, unsigned pix_width, unsigned pix_height, unsigned pix_pixel, unsigned char* pix_ptr, unsigned pix_scanline, unsigned char* pal_ptr, unsigned pal_size, unsigned char* rns_ptr, unsigned rns_size, shrink_t level)
+unsigned png_palette_depth(unsigned pix_width, unsigned pix_height, const unsigned char* pix_ptr, unsigned pix_scanline, unsigned pal_count)
+{
+	unsigned max = pal_count > 0 ? pal_count - 1 : 0;
+	unsigned i, j;
+
+	// an index out of the palette must still be kept as it is
+	for(i=0;i<pix_height && max < 16;++i) {
+		const unsigned char* p = pix_ptr + i * pix_scanline;
+		for(j=0;j<pix_width;++j)
+			if (p[j] > max)
+				max = p[j];
+	}
+
+	if (max < 2)
+		return 1;
+	if (max < 4)
+		return 2;
+	if (max < 16)
+		return 4;
+	return 8;
+}
+
+unsigned char* png_pack(unsigned pix_width, unsigned pix_height, const unsigned char* pix_ptr, unsigned pix_scanline, unsigned depth, unsigned* dst_scanline)
+{
+	unsigned char* dst_ptr;
+	unsigned per_byte = 8 / depth;
+	unsigned i, j;
+
+	*dst_scanline = (pix_width * depth + 7) / 8;
+	dst_ptr = data_alloc(*dst_scanline * pix_height);
+
+	for(i=0;i<pix_height;++i) {
+		const unsigned char* p0 = pix_ptr + i * pix_scanline;
+		unsigned char* p1 = dst_ptr + i * *dst_scanline;
+		for(j=0;j<*dst_scanline;++j) {
+			unsigned k, v = 0;
+			// the leftmost pixel in the high bits, the padding bits at 0
+			for(k=0;k<per_byte;++k) {
+				unsigned x = j * per_byte + k;
+				v = (v << depth) | (x < pix_width ? p0[x] : 0);
+			}
+			p1[j] = v;
+		}
+	}
+
+	return dst_ptr;
+}
+
+/**
+ * Filter and compress the Adam7 passes of an image in a single stream.
+ * Each pass is filtered on its own, as the PNG format requires.
+ */
+static void png_compress_interlace(shrink_t level, data_ptr& out_ptr, unsigned& out_size, const unsigned char* img_ptr, unsigned img_scanline, unsigned img_pixel, unsigned depth, unsigned dx, unsigned dy)
+{
+	data_ptr fil_ptr;
+	unsigned fil_size;
+	unsigned fil_pos;
+	data_ptr z_ptr;
+	unsigned z_size;
+	unsigned pass, i, j;
+
+	fil_size = 0;
+	for(pass=0;pass<7;++pass) {
+		unsigned x, y, sx, sy, pass_width, pass_height;
+		adv_png_adam7_pass(pass, dx, dy, &x, &y, &sx, &sy, &pass_width, &pass_height);
+		if (pass_width && pass_height)
+			fil_size += pass_height * ((depth < 8 ? (pass_width * depth + 7) / 8 : pass_width * img_pixel) + 1);
+	}
+
+	z_size = oversize_zlib(fil_size);
+	fil_ptr = data_alloc(fil_size);
+	z_ptr = data_alloc(z_size);
+
+	fil_pos = 0;
+	for(pass=0;pass<7;++pass) {
+		unsigned x, y, sx, sy, pass_width, pass_height;
+		data_ptr pass_ptr;
+		data_ptr pack_ptr;
+		unsigned pack_scanline;
+
+		adv_png_adam7_pass(pass, dx, dy, &x, &y, &sx, &sy, &pass_width, &pass_height);
+		if (!pass_width || !pass_height)
+			continue;
+
+		pass_ptr = data_alloc(pass_height * pass_width * img_pixel);
+		for(i=0;i<pass_height;++i) {
+			const unsigned char* p0 = img_ptr + (y + i * sy) * img_scanline + x * img_pixel;
+			unsigned char* p1 = pass_ptr + i * pass_width * img_pixel;
+			for(j=0;j<pass_width;++j) {
+				memcpy(p1, p0, img_pixel);
+				p0 += sx * img_pixel;
+				p1 += img_pixel;
+			}
+		}
+
+		if (depth < 8) {
+			pack_ptr = png_pack(pass_width, pass_height, pass_ptr, pass_width, depth, &pack_scanline);
+			if (level.level == shrink_none)
+				png_filter(png_filter_none, fil_ptr + fil_pos, pack_ptr, pack_scanline, 1, 0, 0, pack_scanline, pass_height);
+			else
+				png_filter_best(fil_ptr + fil_pos, pack_ptr, pack_scanline, 1, 0, 0, pack_scanline, pass_height);
+			fil_pos += pass_height * (pack_scanline + 1);
+		} else {
+			if (level.level == shrink_none)
+				png_filter(png_filter_none, fil_ptr + fil_pos, pass_ptr, pass_width * img_pixel, img_pixel, 0, 0, pass_width, pass_height);
+			else
+				png_filter_best(fil_ptr + fil_pos, pass_ptr, pass_width * img_pixel, img_pixel, 0, 0, pass_width, pass_height);
+			fil_pos += pass_height * (pass_width * img_pixel + 1);
+		}
+	}
+
+	assert(fil_pos == fil_size);
+
+	if (!compress_zlib(level, z_ptr, z_size, fil_ptr, fil_size)) {
+		throw error() << "Failed compression";
+	}
+
+	out_ptr = z_ptr;
+	out_size = z_size;
+}
+
+void png_write_type(adv_fz* f, unsigned pix_width, unsigned pix_height, unsigned pix_type, unsigned depth, unsigned pix_pixel, unsigned char* pix_ptr, unsigned pix_scanline, unsigned char* pal_ptr, unsigned pal_size, unsigned char* rns_ptr, unsigned rns_size, unsigned interlace, shrink_t level)
 {
 	unsigned char ihdr[13];
 	data_ptr z_ptr;
 	unsigned z_size;
+	data_ptr pack_ptr;
+	unsigned pack_scanline;
 
 	if (adv_png_write_signature(f, 0) != 0) {
 		throw_png_error();
@@ -322,19 +621,11 @@ void png_write(adv_fz* f, unsigned pix_width, unsigned pix_height, unsigned pix_
 
 	be_uint32_write(ihdr + 0, pix_width);
 	be_uint32_write(ihdr + 4, pix_height);
-	ihdr[8] = 8; /* bit depth */
-	if (pix_pixel == 1)
-		ihdr[9] = 3; /* color type */
-	else if (pix_pixel == 3)
-		ihdr[9] = 2; /* color type */
-	else if (pix_pixel == 4)
-		ihdr[9] = 6; /* color type */
-	else
-		throw error() << "Invalid format";
-
+	ihdr[8] = depth; /* bit depth */
+	ihdr[9] = pix_type; /* color type */
 	ihdr[10] = 0; /* compression */
 	ihdr[11] = 0; /* filter */
-	ihdr[12] = 0; /* interlace */
+	ihdr[12] = interlace; /* interlace */
 
 	if (adv_png_write_chunk(f, ADV_PNG_CN_IHDR, ihdr, sizeof(ihdr), 0) != 0) {
 		throw_png_error();
@@ -352,7 +643,15 @@ void png_write(adv_fz* f, unsigned pix_width, unsigned pix_height, unsigned pix_
 		}
 	}
 
-	png_compress(level, z_ptr, z_size, pix_ptr, pix_scanline, pix_pixel, 0, 0, pix_width, pix_height);
+	if (interlace) {
+		png_compress_interlace(level, z_ptr, z_size, pix_ptr, pix_scanline, pix_pixel, depth, pix_width, pix_height);
+	} else if (depth < 8) {
+		// the samples are packed before filtering
+		pack_ptr = png_pack(pix_width, pix_height, pix_ptr, pix_scanline, depth, &pack_scanline);
+		png_compress(level, z_ptr, z_size, pack_ptr, pack_scanline, 1, 0, 0, pack_scanline, pix_height);
+	} else {
+		png_compress(level, z_ptr, z_size, pix_ptr, pix_scanline, pix_pixel, 0, 0, pix_width, pix_height);
+	}
 
 	if (adv_png_write_chunk(f, ADV_PNG_CN_IDAT, z_ptr, z_size, 0) != 0) {
 		throw_png_error();
@@ -363,6 +662,33 @@ void png_write(adv_fz* f, unsigned pix_width, unsigned pix_height, unsigned pix_
 	}
 }
 
+void png_write_depth(adv_fz* f, unsigned pix_width, unsigned pix_height, unsigned pix_pixel, unsigned depth, unsigned char* pix_ptr, unsigned pix_scanline, unsigned char* pal_ptr, unsigned pal_size, unsigned char* rns_ptr, unsigned rns_size, shrink_t level)
+{
+	unsigned pix_type;
+
+	if (pix_pixel == 1)
+		pix_type = 3;
+	else if (pix_pixel == 3)
+		pix_type = 2;
+	else if (pix_pixel == 4)
+		pix_type = 6;
+	else
+		throw error() << "Invalid format";
+
+	png_write_type(f, pix_width, pix_height, pix_type, depth, pix_pixel, pix_ptr, pix_scanline, pal_ptr, pal_size, rns_ptr, rns_size, 0, level);
+}
+
+void png_write(adv_fz* f, unsigned pix_width, unsigned pix_height, unsigned pix_pixel, unsigned char* pix_ptr, unsigned pix_scanline, unsigned char* pal_ptr, unsigned pal_size, unsigned char* rns_ptr, unsigned rns_size, shrink_t level)
+{
+	unsigned depth = 8;
+
+	// few colors are packed in less than a byte
+	if (pix_pixel == 1 && pal_size)
+		depth = png_palette_depth(pix_width, pix_height, pix_ptr, pix_scanline, pal_size / 3);
+
+	png_write_depth(f, pix_width, pix_height, pix_pixel, depth, pix_ptr, pix_scanline, pal_ptr, pal_size, rns_ptr, rns_size, level);
+}
+
 void png_convert_4(
 	unsigned pix_width, unsigned pix_height, unsigned pix_pixel, unsigned char* pix_ptr, unsigned pix_scanline,
 	unsigned char* pal_ptr, unsigned pal_size,
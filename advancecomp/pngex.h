@@ -39,6 +39,31 @@ inline void throw_png_error()
 
 void png_print_chunk(unsigned type, unsigned char* data, unsigned size);
 
+/**
+ * Filtering strategy of the image rows.
+ */
+enum png_filter_t {
+	png_filter_none, /**< Filter None on all the rows. */
+	png_filter_sub, /**< Filter Sub on all the rows. */
+	png_filter_up, /**< Filter Up on all the rows. */
+	png_filter_average, /**< Filter Average on all the rows. */
+	png_filter_paeth, /**< Filter Paeth on all the rows. */
+	png_filter_minsum, /**< For each row, the filter with the minimum sum of absolute differences. */
+	png_filter_entropy, /**< For each row, the filter with the minimum entropy. */
+	png_filter_brute /**< For each row, the filter that compresses better after the previous rows. */
+};
+
+void png_filter(
+	png_filter_t filter, unsigned char* fil_ptr,
+	const unsigned char* img_ptr, unsigned img_scanline, unsigned img_pixel,
+	unsigned x, unsigned y, unsigned dx, unsigned dy
+);
+void png_filter_best(
+	unsigned char* fil_ptr,
+	const unsigned char* img_ptr, unsigned img_scanline, unsigned img_pixel,
+	unsigned x, unsigned y, unsigned dx, unsigned dy
+);
+
 void png_compress(
 	shrink_t level,
 	data_ptr& out_ptr, unsigned& out_size,
@@ -57,6 +82,29 @@ void png_compress_palette_delta(
 	const unsigned char* pal_ptr, unsigned pal_size,
 	const unsigned char* prev_ptr, unsigned prev_size
 );
+/**
+ * Smallest bit depth, 1, 2, 4 or 8, that holds the indexes of a paletted image.
+ * \param pal_count Number of entries of the palette.
+ */
+unsigned png_palette_depth(
+	unsigned pix_width, unsigned pix_height,
+	const unsigned char* pix_ptr, unsigned pix_scanline,
+	unsigned pal_count
+);
+/**
+ * Pack the one byte indexes of a paletted image at a lower bit depth.
+ * \param dst_scanline Where the scanline of the packed rows is stored.
+ * \return The packed rows, to free with data_free().
+ */
+unsigned char* png_pack(
+	unsigned pix_width, unsigned pix_height,
+	const unsigned char* pix_ptr, unsigned pix_scanline,
+	unsigned depth, unsigned* dst_scanline
+);
+/**
+ * Write a PNG image.
+ * A paletted image is written at the smallest bit depth that holds its indexes.
+ */
 void png_write(
 	adv_fz* f,
 	unsigned pix_width, unsigned pix_height, unsigned pix_pixel,
@@ -65,6 +113,33 @@ void png_write(
 	unsigned char* rns_ptr, unsigned rns_size,
 	shrink_t level
 );
+/**
+ * Write a PNG image at the given bit depth.
+ * \param depth 8, or for a paletted image with one byte per pixel, the bit depth its indexes are packed at.
+ */
+void png_write_depth(
+	adv_fz* f,
+	unsigned pix_width, unsigned pix_height, unsigned pix_pixel, unsigned depth,
+	unsigned char* pix_ptr, unsigned pix_scanline,
+	unsigned char* pal_ptr, unsigned pal_size,
+	unsigned char* rns_ptr, unsigned rns_size,
+	shrink_t level
+);
+/**
+ * Write a PNG image of any color type.
+ * \param pix_type PNG color type.
+ * \param depth PNG bit depth. Below 8 the one byte samples are packed, at 16 they are already two bytes big endian.
+ * \param interlace 1 to write the image in the Adam7 passes.
+ */
+void png_write_type(
+	adv_fz* f,
+	unsigned pix_width, unsigned pix_height, unsigned pix_type, unsigned depth, unsigned pix_pixel,
+	unsigned char* pix_ptr, unsigned pix_scanline,
+	unsigned char* pal_ptr, unsigned pal_size,
+	unsigned char* rns_ptr, unsigned rns_size,
+	unsigned interlace,
+	shrink_t level
+);
 void png_convert_4(
 	unsigned pix_width, unsigned pix_height, unsigned pix_pixel, unsigned char* pix_ptr, unsigned pix_scanline,
 	unsigned char* pal_ptr, unsigned pal_size,
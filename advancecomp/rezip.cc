@@ -500,6 +500,9 @@ void process(int argc, char* argv[])
 
 	level.level = shrink_normal;
 	level.iter = 0;
+	level.parallel_for = 0;
+	level.stop = 0;
+	level.stop_arg = 0;
 
 	if (argc <= 1) {
 		usage();
@@ -236,6 +236,9 @@ void ZopfliBlockSplitLZ77(const ZopfliOptions* options,
     if (maxblocks > 0 && numblocks >= maxblocks) {
       break;
     }
+    if (options->stop && options->stop(options->stop_arg)) {
+      break;  /* Out of time, the blocks found so far are kept. */
+    }
 
     c.lz77 = lz77;
     c.start = lstart;
@@ -284,13 +287,17 @@ void ZopfliBlockSplit(const ZopfliOptions* options,
   ZopfliHash hash;
   ZopfliHash* h = &hash;
 
+  *npoints = 0;
+  *splitpoints = 0;
+
+  if (options->stop && options->stop(options->stop_arg)) {
+    return;  /* Out of time, a single block. */
+  }
+
   ZopfliInitLZ77Store(in, &store);
   ZopfliInitBlockState(options, instart, inend, 0, &s);
   ZopfliAllocHash(ZOPFLI_WINDOW_SIZE, h);
 
-  *npoints = 0;
-  *splitpoints = 0;
-
   /* Unintuitively, Using a simple LZ77 method here instead of ZopfliLZ77Optimal
   results in better blocks. */
   ZopfliLZ77Greedy(&s, in, instart, inend, &store, h);
@@ -756,8 +756,10 @@ static void AddLZ77BlockAutoType(const ZopfliOptions* options, int final,
 
   /* Whether to perform the expensive calculation of creating an optimal block
   with fixed huffman tree to check if smaller. Only do this for small blocks or
-  blocks which already are pretty good with fixed huffman tree. */
-  int expensivefixed = (lz77->size < 1000) || fixedcost <= dyncost * 1.1;
+  blocks which already are pretty good with fixed huffman tree. Not once out
+  of time. */
+  int expensivefixed = ((lz77->size < 1000) || fixedcost <= dyncost * 1.1) &&
+      !(options->stop && options->stop(options->stop_arg));
 
   ZopfliLZ77Store fixedstore;
   if (lstart == lend) {
@@ -800,47 +802,53 @@ static void AddLZ77BlockAutoType(const ZopfliOptions* options, int final,
 }
 
 /*
-Deflate a part, to allow ZopfliDeflate() to use multiple master blocks if
-needed.
-It is possible to call this function multiple times in a row, shifting
-instart and inend to next bytes of the data. If instart is larger than 0, then
-previous bytes are used as the initial dictionary for LZ77.
-This function will usually output multiple deflate blocks. If final is 1, then
-the final bit will be set on the last block.
+The LZ77 data of a part and the points where it is split in blocks, which is
+all that is needed to output the part.
 */
-void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
-                       const unsigned char* in, size_t instart, size_t inend,
-                       unsigned char* bp, unsigned char** out,
-                       size_t* outsize) {
+typedef struct ZopfliPartPlan {
+  ZopfliLZ77Store lz77;
+  size_t* splitpoints;
+  size_t npoints;
+} ZopfliPartPlan;
+
+/* Optimizes the blocks between the uncompressed split points of a part. */
+typedef struct ZopfliBlockJobs {
+  const ZopfliOptions* options;
+  const unsigned char* in;
+  size_t instart;
+  size_t inend;
+  const size_t* splitpoints_uncompressed;
+  size_t npoints;
+  ZopfliLZ77Store* stores;
+} ZopfliBlockJobs;
+
+static void OptimizeBlock(void* arg, size_t i) {
+  ZopfliBlockJobs* jobs = (ZopfliBlockJobs*)arg;
+  size_t start = i == 0 ? jobs->instart : jobs->splitpoints_uncompressed[i - 1];
+  size_t end = i == jobs->npoints ? jobs->inend
+                                  : jobs->splitpoints_uncompressed[i];
+  ZopfliBlockState s;
+  ZopfliInitBlockState(jobs->options, start, end, 1, &s);
+  ZopfliLZ77Optimal(&s, jobs->in, start, end, jobs->options->numiterations,
+                    &jobs->stores[i]);
+  ZopfliCleanBlockState(&s);
+}
+
+/*
+Finds the block split points and the optimal LZ77 data of a part for btype 2.
+The blocks only read the input, so they are optimized through
+options->parallel_for when it is set. Their costs and data are still merged
+in order, so the result is the same as the serial one.
+*/
+static void PlanPart(const ZopfliOptions* options, const unsigned char* in,
+                     size_t instart, size_t inend, ZopfliPartPlan* plan) {
   size_t i;
   /* byte coordinates rather than lz77 index */
   size_t* splitpoints_uncompressed = 0;
   size_t npoints = 0;
   size_t* splitpoints = 0;
   double totalcost = 0;
-  ZopfliLZ77Store lz77;
-
-  /* If btype=2 is specified, it tries all block types. If a lesser btype is
-  given, then however it forces that one. Neither of the lesser types needs
-  block splitting as they have no dynamic huffman trees. */
-  if (btype == 0) {
-    AddNonCompressedBlock(options, final, in, instart, inend, bp, out, outsize);
-    return;
-  } else if (btype == 1) {
-    ZopfliLZ77Store store;
-    ZopfliBlockState s;
-    ZopfliInitLZ77Store(in, &store);
-    ZopfliInitBlockState(options, instart, inend, 1, &s);
-
-    ZopfliLZ77OptimalFixed(&s, in, instart, inend, &store);
-    AddLZ77Block(options, btype, final, &store, 0, store.size, 0,
-                 bp, out, outsize);
-
-    ZopfliCleanBlockState(&s);
-    ZopfliCleanLZ77Store(&store);
-    return;
-  }
-
+  ZopfliBlockJobs jobs;
 
   if (options->blocksplitting) {
     ZopfliBlockSplit(options, in, instart, inend,
@@ -849,24 +857,37 @@ void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
     splitpoints = (size_t*)malloc(sizeof(*splitpoints) * npoints);
   }
 
-  ZopfliInitLZ77Store(in, &lz77);
+  jobs.options = options;
+  jobs.in = in;
+  jobs.instart = instart;
+  jobs.inend = inend;
+  jobs.splitpoints_uncompressed = splitpoints_uncompressed;
+  jobs.npoints = npoints;
+  jobs.stores = (ZopfliLZ77Store*)malloc(sizeof(*jobs.stores) * (npoints + 1));
+  for (i = 0; i <= npoints; i++) {
+    ZopfliInitLZ77Store(in, &jobs.stores[i]);
+  }
+
+  if (options->parallel_for && npoints > 0) {
+    options->parallel_for(OptimizeBlock, &jobs, npoints + 1);
+  } else {
+    for (i = 0; i <= npoints; i++) {
+      OptimizeBlock(&jobs, i);
+    }
+  }
+
+  ZopfliInitLZ77Store(in, &plan->lz77);
 
   for (i = 0; i <= npoints; i++) {
-    size_t start = i == 0 ? instart : splitpoints_uncompressed[i - 1];
-    size_t end = i == npoints ? inend : splitpoints_uncompressed[i];
-    ZopfliBlockState s;
-    ZopfliLZ77Store store;
-    ZopfliInitLZ77Store(in, &store);
-    ZopfliInitBlockState(options, start, end, 1, &s);
-    ZopfliLZ77Optimal(&s, in, start, end, options->numiterations, &store);
-    totalcost += ZopfliCalculateBlockSizeAutoType(&store, 0, store.size);
+    ZopfliLZ77Store* store = &jobs.stores[i];
+    totalcost += ZopfliCalculateBlockSizeAutoType(store, 0, store->size);
 
-    ZopfliAppendLZ77Store(&store, &lz77);
-    if (i < npoints) splitpoints[i] = lz77.size;
+    ZopfliAppendLZ77Store(store, &plan->lz77);
+    if (i < npoints) splitpoints[i] = plan->lz77.size;
 
-    ZopfliCleanBlockState(&s);
-    ZopfliCleanLZ77Store(&store);
+    ZopfliCleanLZ77Store(store);
   }
+  free(jobs.stores);
 
   /* Second block splitting attempt */
   if (options->blocksplitting && npoints > 1) {
@@ -874,13 +895,13 @@ void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
     size_t npoints2 = 0;
     double totalcost2 = 0;
 
-    ZopfliBlockSplitLZ77(options, &lz77,
+    ZopfliBlockSplitLZ77(options, &plan->lz77,
                          options->blocksplittingmax, &splitpoints2, &npoints2);
 
     for (i = 0; i <= npoints2; i++) {
       size_t start = i == 0 ? 0 : splitpoints2[i - 1];
-      size_t end = i == npoints2 ? lz77.size : splitpoints2[i];
-      totalcost2 += ZopfliCalculateBlockSizeAutoType(&lz77, start, end);
+      size_t end = i == npoints2 ? plan->lz77.size : splitpoints2[i];
+      totalcost2 += ZopfliCalculateBlockSizeAutoType(&plan->lz77, start, end);
     }
 
     if (totalcost2 < totalcost) {
@@ -892,19 +913,87 @@ void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
     }
   }
 
-  for (i = 0; i <= npoints; i++) {
-    size_t start = i == 0 ? 0 : splitpoints[i - 1];
-    size_t end = i == npoints ? lz77.size : splitpoints[i];
-    AddLZ77BlockAutoType(options, i == npoints && final,
-                         &lz77, start, end, 0,
+  free(splitpoints_uncompressed);
+  plan->splitpoints = splitpoints;
+  plan->npoints = npoints;
+}
+
+/* Outputs the blocks of a planned part and frees the plan. */
+static void AddPlannedPart(const ZopfliOptions* options, int final,
+                           ZopfliPartPlan* plan,
+                           unsigned char* bp, unsigned char** out,
+                           size_t* outsize) {
+  size_t i;
+  for (i = 0; i <= plan->npoints; i++) {
+    size_t start = i == 0 ? 0 : plan->splitpoints[i - 1];
+    size_t end = i == plan->npoints ? plan->lz77.size : plan->splitpoints[i];
+    AddLZ77BlockAutoType(options, i == plan->npoints && final,
+                         &plan->lz77, start, end, 0,
                          bp, out, outsize);
   }
 
-  ZopfliCleanLZ77Store(&lz77);
-  free(splitpoints);
-  free(splitpoints_uncompressed);
+  ZopfliCleanLZ77Store(&plan->lz77);
+  free(plan->splitpoints);
 }
 
+/*
+Deflate a part, to allow ZopfliDeflate() to use multiple master blocks if
+needed.
+It is possible to call this function multiple times in a row, shifting
+instart and inend to next bytes of the data. If instart is larger than 0, then
+previous bytes are used as the initial dictionary for LZ77.
+This function will usually output multiple deflate blocks. If final is 1, then
+the final bit will be set on the last block.
+*/
+void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
+                       const unsigned char* in, size_t instart, size_t inend,
+                       unsigned char* bp, unsigned char** out,
+                       size_t* outsize) {
+  ZopfliPartPlan plan;
+
+  /* If btype=2 is specified, it tries all block types. If a lesser btype is
+  given, then however it forces that one. Neither of the lesser types needs
+  block splitting as they have no dynamic huffman trees. */
+  if (btype == 0) {
+    AddNonCompressedBlock(options, final, in, instart, inend, bp, out, outsize);
+    return;
+  } else if (btype == 1) {
+    ZopfliLZ77Store store;
+    ZopfliBlockState s;
+    ZopfliInitLZ77Store(in, &store);
+    ZopfliInitBlockState(options, instart, inend, 1, &s);
+
+    ZopfliLZ77OptimalFixed(&s, in, instart, inend, &store);
+    AddLZ77Block(options, btype, final, &store, 0, store.size, 0,
+                 bp, out, outsize);
+
+    ZopfliCleanBlockState(&s);
+    ZopfliCleanLZ77Store(&store);
+    return;
+  }
+
+  PlanPart(options, in, instart, inend, &plan);
+  AddPlannedPart(options, final, &plan, bp, out, outsize);
+}
+
+#if ZOPFLI_MASTER_BLOCK_SIZE != 0
+/* Plans the master blocks of the input, each independently of the others. */
+typedef struct ZopfliMasterJobs {
+  const ZopfliOptions* options;
+  const unsigned char* in;
+  size_t insize;
+  ZopfliPartPlan* plans;
+} ZopfliMasterJobs;
+
+static void PlanMasterBlock(void* arg, size_t i) {
+  ZopfliMasterJobs* jobs = (ZopfliMasterJobs*)arg;
+  size_t start = i * ZOPFLI_MASTER_BLOCK_SIZE;
+  size_t end = start + ZOPFLI_MASTER_BLOCK_SIZE;
+  if (end > jobs->insize) end = jobs->insize;
+  PlanPart(jobs->options, jobs->in, start, end, &jobs->plans[i]);
+}
+#endif
+
 void ZopfliDeflate(const ZopfliOptions* options, int btype, int final,
                    const unsigned char* in, size_t insize,
                    unsigned char* bp, unsigned char** out, size_t* outsize) {
@@ -913,14 +1002,32 @@ void ZopfliDeflate(const ZopfliOptions* options, int btype, int final,
   ZopfliDeflatePart(options, btype, final, in, 0, insize, bp, out, outsize);
 #else
   size_t i = 0;
-  do {
-    int masterfinal = (i + ZOPFLI_MASTER_BLOCK_SIZE >= insize);
-    int final2 = final && masterfinal;
-    size_t size = masterfinal ? insize - i : ZOPFLI_MASTER_BLOCK_SIZE;
-    ZopfliDeflatePart(options, btype, final2,
-                      in, i, i + size, bp, out, outsize);
-    i += size;
-  } while (i < insize);
+  size_t nmaster = (insize + ZOPFLI_MASTER_BLOCK_SIZE - 1)
+      / ZOPFLI_MASTER_BLOCK_SIZE;
+  if (options->parallel_for && btype == 2 && nmaster > 1) {
+    /* A master block only reads the bytes before it as dictionary, so all
+    of them are planned at once and output in order afterwards. */
+    ZopfliMasterJobs jobs;
+    jobs.options = options;
+    jobs.in = in;
+    jobs.insize = insize;
+    jobs.plans = (ZopfliPartPlan*)malloc(sizeof(*jobs.plans) * nmaster);
+    options->parallel_for(PlanMasterBlock, &jobs, nmaster);
+    for (i = 0; i < nmaster; i++) {
+      AddPlannedPart(options, final && i == nmaster - 1, &jobs.plans[i],
+                     bp, out, outsize);
+    }
+    free(jobs.plans);
+  } else {
+    do {
+      int masterfinal = (i + ZOPFLI_MASTER_BLOCK_SIZE >= insize);
+      int final2 = final && masterfinal;
+      size_t size = masterfinal ? insize - i : ZOPFLI_MASTER_BLOCK_SIZE;
+      ZopfliDeflatePart(options, btype, final2,
+                        in, i, i + size, bp, out, outsize);
+      i += size;
+    } while (i < insize);
+  }
 #endif
   if (options->verbose) {
     fprintf(stderr,
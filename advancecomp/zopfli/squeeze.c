@@ -469,6 +469,18 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
   if (!costs) exit(-1); /* Allocation failed. */
   if (!length_array) exit(-1); /* Allocation failed. */
 
+  if (s->options->stop && s->options->stop(s->options->stop_arg)) {
+    /* Out of time before the block started: literals are the quickest valid
+    LZ77 data, even the greedy run takes long on a big block. */
+    size_t j;
+    for (j = instart; j < inend; j++) {
+      ZopfliStoreLitLenDist(in[j], 0, j, store);
+    }
+    free(length_array);
+    free(costs);
+    return;
+  }
+
   InitRanState(&ran_state);
   InitStats(&stats);
   ZopfliInitLZ77Store(in, &currentstore);
@@ -484,6 +496,13 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
   /* Repeat statistics with each time the cost model from the previous stat
   run. */
   for (i = 0; i < numiterations; i++) {
+    if (s->options->stop && s->options->stop(s->options->stop_arg)) {
+      /* Out of time: the greedy run stands if no iteration has ended. */
+      if (bestcost == ZOPFLI_LARGE_FLOAT) {
+        ZopfliCopyLZ77Store(&currentstore, store);
+      }
+      break;
+    }
     ZopfliCleanLZ77Store(&currentstore);
     ZopfliInitLZ77Store(in, &currentstore);
     LZ77OptimalRun(s, in, instart, inend, &path, &pathsize,
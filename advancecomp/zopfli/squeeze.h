@@ -36,7 +36,7 @@ solution.
 /*
 Calculates lit/len and dist pairs for given data.
 If instart is larger than 0, it uses values before instart as starting
-dictionary.
+dictionary. Fewer than numiterations run if s->options->stop fires.
 */
 void ZopfliLZ77Optimal(ZopfliBlockState *s,
                        const unsigned char* in, size_t instart, size_t inend,
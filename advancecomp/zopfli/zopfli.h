@@ -27,6 +27,19 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 extern "C" {
 #endif
 
+/*
+Runs run(arg, i) for every i in [0, n), possibly at the same time on several
+threads, and returns when all the calls are done.
+*/
+typedef void ZopfliParallelFor(void (*run)(void* arg, size_t i), void* arg,
+                               size_t n);
+
+/*
+Returns nonzero once the compression has to end early. It may be called from
+several threads at the same time.
+*/
+typedef int ZopfliStop(void* arg);
+
 /*
 Options used throughout the program.
 */
@@ -61,6 +74,23 @@ typedef struct ZopfliOptions {
   extreme results that hurt compression on some files). Default value: 15.
   */
   int blocksplittingmax;
+
+  /*
+  If set, the independent parts of the work, the blocks between the split
+  points and the master blocks, are optimized through it. The output is the
+  same as without it. Default: 0, everything runs on the calling thread.
+  */
+  ZopfliParallelFor* parallel_for;
+
+  /*
+  If set, polled before each iteration of the LZ77 optimization and of the
+  block splitting. Once it returns nonzero the blocks keep the best LZ77 data
+  found so far, which is the greedy one if no iteration has run, and plain
+  literals for the blocks not started. The output is still valid. Default: 0,
+  all the iterations run.
+  */
+  ZopfliStop* stop;
+  void* stop_arg;
 } ZopfliOptions;
 
 /* Initializes options with default values. */
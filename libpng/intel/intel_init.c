@@ -17,6 +17,37 @@
 #ifdef PNG_READ_SUPPORTED
 #if PNG_INTEL_SSE_IMPLEMENTATION > 0
 
+#ifdef PYOPTIPNG_FILTER_KERNELS
+#include "filter.h"
+
+/* The kernels of pyoptipng, picked at run time between SSE2 and AVX2. They
+ * handle the pixel sizes the functions below leave to the generic code.
+ */
+static void
+png_read_filter_row_sub_pyoptipng(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   unfilter_row(PNG_FILTER_VALUE_SUB, row, prev, row_info->rowbytes,
+       (row_info->pixel_depth + 7) >> 3);
+}
+
+static void
+png_read_filter_row_avg_pyoptipng(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   unfilter_row(PNG_FILTER_VALUE_AVG, row, prev, row_info->rowbytes,
+       (row_info->pixel_depth + 7) >> 3);
+}
+
+static void
+png_read_filter_row_paeth_pyoptipng(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   unfilter_row(PNG_FILTER_VALUE_PAETH, row, prev, row_info->rowbytes,
+       (row_info->pixel_depth + 7) >> 3);
+}
+#endif
+
 void
 png_init_filter_functions_sse2(png_structp pp, unsigned int bpp)
 {
@@ -43,6 +74,20 @@ png_init_filter_functions_sse2(png_structp pp, unsigned int bpp)
       pp->read_filter[PNG_FILTER_VALUE_PAETH-1] =
           png_read_filter_row_paeth4_sse2;
    }
+#ifdef PYOPTIPNG_FILTER_KERNELS
+   else
+   {
+      pp->read_filter[PNG_FILTER_VALUE_SUB-1] =
+         png_read_filter_row_sub_pyoptipng;
+      if (bpp == 6 || bpp == 8)
+      {
+         pp->read_filter[PNG_FILTER_VALUE_AVG-1] =
+            png_read_filter_row_avg_pyoptipng;
+         pp->read_filter[PNG_FILTER_VALUE_PAETH-1] =
+            png_read_filter_row_paeth_pyoptipng;
+      }
+   }
+#endif
 
    /* No need optimize PNG_FILTER_VALUE_UP.  The compiler should
     * autovectorize.
@@ -13,6 +13,10 @@
 
 #include "pngpriv.h"
 
+#ifdef PYOPTIPNG_FILTER_KERNELS
+#include "filter.h"
+#endif
+
 #ifdef PNG_WRITE_SUPPORTED
 
 #ifdef PNG_WRITE_INT_FUNCTIONS_SUPPORTED
@@ -2247,6 +2251,56 @@ png_write_filtered_row(png_structrp png_ptr, png_bytep filtered_row,
    png_size_t row_bytes);
 
 #ifdef PNG_WRITE_FILTER_SUPPORTED
+#ifdef PYOPTIPNG_FILTER_KERNELS
+/* The filters go through the vectorized kernels of pyoptipng. They always
+ * do the whole row instead of stopping once the sum goes over lmins, which
+ * can only make the sum of a losing filter larger.
+ */
+static png_size_t /* PRIVATE */
+png_setup_sub_row(png_structrp png_ptr, const png_uint_32 bpp,
+    const png_size_t row_bytes, const png_size_t lmins)
+{
+   PNG_UNUSED(lmins)
+
+   filter_row(PNG_FILTER_VALUE_SUB, png_ptr->try_row, png_ptr->row_buf + 1,
+       png_ptr->row_buf + 1, row_bytes, bpp);
+   return filter_row_sum(png_ptr->try_row + 1, row_bytes);
+}
+
+static png_size_t /* PRIVATE */
+png_setup_up_row(png_structrp png_ptr, const png_size_t row_bytes,
+    const png_size_t lmins)
+{
+   PNG_UNUSED(lmins)
+
+   filter_row(PNG_FILTER_VALUE_UP, png_ptr->try_row, png_ptr->row_buf + 1,
+       png_ptr->prev_row + 1, row_bytes, 1);
+   return filter_row_sum(png_ptr->try_row + 1, row_bytes);
+}
+
+static png_size_t /* PRIVATE */
+png_setup_avg_row(png_structrp png_ptr, const png_uint_32 bpp,
+      const png_size_t row_bytes, const png_size_t lmins)
+{
+   PNG_UNUSED(lmins)
+
+   filter_row(PNG_FILTER_VALUE_AVG, png_ptr->try_row, png_ptr->row_buf + 1,
+       png_ptr->prev_row + 1, row_bytes, bpp);
+   return filter_row_sum(png_ptr->try_row + 1, row_bytes);
+}
+
+static png_size_t /* PRIVATE */
+png_setup_paeth_row(png_structrp png_ptr, const png_uint_32 bpp,
+    const png_size_t row_bytes, const png_size_t lmins)
+{
+   PNG_UNUSED(lmins)
+
+   filter_row(PNG_FILTER_VALUE_PAETH, png_ptr->try_row, png_ptr->row_buf + 1,
+       png_ptr->prev_row + 1, row_bytes, bpp);
+   return filter_row_sum(png_ptr->try_row + 1, row_bytes);
+}
+
+#else
 static png_size_t /* PRIVATE */
 png_setup_sub_row(png_structrp png_ptr, const png_uint_32 bpp,
     const png_size_t row_bytes, const png_size_t lmins)
@@ -2389,6 +2443,7 @@ png_setup_paeth_row(png_structrp png_ptr, const png_uint_32 bpp,
 
    return (sum);
 }
+#endif /* PYOPTIPNG_FILTER_KERNELS */
 #endif /* WRITE_FILTER */
 
 void /* PRIVATE */
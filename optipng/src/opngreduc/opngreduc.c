@@ -19,6 +19,7 @@
  */
 
 #include "opngreduc.h"
+#include "palette.h"
 
 #include <string.h>
 
@@ -306,6 +307,44 @@ opng_get_alpha_row(png_row_infop row_info_ptr, png_color_16p trans_color,
       *alpha_row = *sample_ptr;
 }
 
+/*
+ * Retrieve the (red, green, blue, alpha) tuples from the given image row.
+ * The alpha_row buffer receives the alpha samples on the way.
+ */
+static void /* PRIVATE */
+opng_get_rgba_row(png_row_infop row_info_ptr, png_color_16p trans_color,
+   png_bytep row, png_bytep alpha_row, png_bytep rgba_row)
+{
+   png_bytep sample_ptr;
+   png_uint_32 width;
+   int channels;
+   png_uint_32 i;
+
+   width = row_info_ptr->width;
+   channels = row_info_ptr->channels;
+
+   opng_get_alpha_row(row_info_ptr, trans_color, row, alpha_row);
+   sample_ptr = row;
+   if (row_info_ptr->color_type & PNG_COLOR_MASK_COLOR)
+   {
+      for (i = 0; i < width; ++i, sample_ptr += channels, rgba_row += 4)
+      {
+         rgba_row[0] = sample_ptr[0];
+         rgba_row[1] = sample_ptr[1];
+         rgba_row[2] = sample_ptr[2];
+         rgba_row[3] = alpha_row[i];
+      }
+   }
+   else  /* grayscale */
+   {
+      for (i = 0; i < width; ++i, sample_ptr += channels, rgba_row += 4)
+      {
+         rgba_row[0] = rgba_row[1] = rgba_row[2] = sample_ptr[0];
+         rgba_row[3] = alpha_row[i];
+      }
+   }
+}
+
 /*
  * Analyze the redundancy of bits inside the image.
  * The parameter reductions indicates the intended reductions.
@@ -778,16 +817,17 @@ opng_reduce_to_palette(png_structp png_ptr, png_infop info_ptr,
    png_uint_32 result;
    png_row_info row_info;
    png_bytepp row_ptr;
-   png_bytep sample_ptr, alpha_row;
+   png_bytep alpha_row, rgba_row;
    png_uint_32 height, width;
    int color_type, interlace_type, compression_type, filter_type;
    int src_bit_depth, dest_bit_depth, channels;
    png_color palette[256];
    png_byte trans_alpha[256];
+   png_byte remap[256];
    png_color_16p trans_color;
-   int num_palette, num_trans, index;
-   unsigned int gray, red, green, blue, alpha;
-   unsigned int prev_gray, prev_red, prev_green, prev_blue, prev_alpha;
+   color_set colors;
+   int num_palette, num_trans, index, k;
+   unsigned int red, green, blue, alpha;
 #ifdef PNG_bKGD_SUPPORTED
    png_color_16p background;
 #endif
@@ -804,6 +844,7 @@ opng_reduce_to_palette(png_structp png_ptr, png_infop info_ptr,
    row_ptr = png_get_rows(png_ptr, info_ptr);
    channels = png_get_channels(png_ptr, info_ptr);
    alpha_row = (png_bytep)png_malloc(png_ptr, width);
+   rgba_row = (png_bytep)png_malloc(png_ptr, width * 4);
 
    row_info.width = width;
    row_info.rowbytes = 0;  /* not used */
@@ -812,65 +853,36 @@ opng_reduce_to_palette(png_structp png_ptr, png_infop info_ptr,
    row_info.channels = (png_byte)channels;
    row_info.pixel_depth = 0;  /* not used */
 
-   /* Analyze the possibility of this reduction. */
+   /* Analyze the possibility of this reduction.
+    * The distinct (red, green, blue, alpha) tuples are counted in a hash set,
+    * which gives up as soon as there are more than 256 of them.
+    */
    num_palette = num_trans = 0;
    trans_color = NULL;
    png_get_tRNS(png_ptr, info_ptr, NULL, NULL, &trans_color);
-   prev_gray = prev_red = prev_green = prev_blue = prev_alpha = 256;
+   color_set_init(&colors);
    for (i = 0; i < height; ++i, ++row_ptr)
    {
-      sample_ptr = *row_ptr;
-      opng_get_alpha_row(&row_info, trans_color, *row_ptr, alpha_row);
-      if (color_type & PNG_COLOR_MASK_COLOR)
+      opng_get_rgba_row(&row_info, trans_color, *row_ptr,
+         alpha_row, rgba_row);
+      if (!color_set_add_row(&colors, rgba_row, width, 4, NULL))
       {
-         for (j = 0; j < width; ++j, sample_ptr += channels)
-         {
-            red = sample_ptr[0];
-            green = sample_ptr[1];
-            blue = sample_ptr[2];
-            alpha = alpha_row[j];
-            /* Check the cache first. */
-            if (red != prev_red || green != prev_green || blue != prev_blue ||
-                alpha != prev_alpha)
-            {
-               prev_red = red;
-               prev_green = green;
-               prev_blue = blue;
-               prev_alpha = alpha;
-               if (opng_insert_palette_entry(palette, &num_palette,
-                   trans_alpha, &num_trans, 256,
-                   red, green, blue, alpha, &index) < 0)  /* overflow */
-               {
-                  OPNG_ASSERT(num_palette < 0);
-                  i = height;  /* forced exit from outer loop */
-                  break;
-               }
-            }
-         }
-      }
-      else  /* grayscale */
-      {
-         for (j = 0; j < width; ++j, sample_ptr += channels)
-         {
-            gray = sample_ptr[0];
-            alpha = alpha_row[j];
-            /* Check the cache first. */
-            if (gray != prev_gray || alpha != prev_alpha)
-            {
-               prev_gray = gray;
-               prev_alpha = alpha;
-               if (opng_insert_palette_entry(palette, &num_palette,
-                   trans_alpha, &num_trans, 256,
-                   gray, gray, gray, alpha, &index) < 0)  /* overflow */
-               {
-                  OPNG_ASSERT(num_palette < 0);
-                  i = height;  /* forced exit from outer loop */
-                  break;
-               }
-            }
-         }
+         num_palette = num_trans = -1;  /* overflow */
+         break;
       }
    }
+
+   /* Sort the tuples into the palette, in (alpha, red, green, blue) order. */
+   for (k = 0; num_palette >= 0 && k < colors.count; ++k)
+   {
+      red = colors.colors[k] & 0xff;
+      green = (colors.colors[k] >> 8) & 0xff;
+      blue = (colors.colors[k] >> 16) & 0xff;
+      alpha = colors.colors[k] >> 24;
+      opng_insert_palette_entry(palette, &num_palette,
+         trans_alpha, &num_trans, 256,
+         red, green, blue, alpha, &index);
+   }
 #ifdef PNG_bKGD_SUPPORTED
    if ((num_palette >= 0) && png_get_bKGD(png_ptr, info_ptr, &background))
    {
@@ -921,63 +933,35 @@ opng_reduce_to_palette(png_structp png_ptr, png_infop info_ptr,
 
    if (num_palette < 0)  /* can't reduce */
    {
+      png_free(png_ptr, rgba_row);
       png_free(png_ptr, alpha_row);
       return OPNG_REDUCE_NONE;
    }
 
+   /* Map the tuples, numbered in order of appearance, to the palette. */
+   for (k = 0; k < colors.count; ++k)
+   {
+      red = colors.colors[k] & 0xff;
+      green = (colors.colors[k] >> 8) & 0xff;
+      blue = (colors.colors[k] >> 16) & 0xff;
+      alpha = colors.colors[k] >> 24;
+      if (opng_insert_palette_entry(palette, &num_palette,
+          trans_alpha, &num_trans, 256,
+          red, green, blue, alpha, &index) != 0)
+         index = -1;  /* this should not happen */
+      OPNG_ASSERT(index >= 0);
+      remap[k] = (png_byte)index;
+   }
+
    /* Reduce. */
    row_ptr = png_get_rows(png_ptr, info_ptr);
-   index = -1;
-   prev_red = prev_green = prev_blue = prev_alpha = (unsigned int)(-1);
    for (i = 0; i < height; ++i, ++row_ptr)
    {
-      sample_ptr = *row_ptr;
-      opng_get_alpha_row(&row_info, trans_color, *row_ptr, alpha_row);
-      if (color_type & PNG_COLOR_MASK_COLOR)
-      {
-         for (j = 0; j < width; ++j, sample_ptr += channels)
-         {
-            red = sample_ptr[0];
-            green = sample_ptr[1];
-            blue = sample_ptr[2];
-            alpha = alpha_row[j];
-            /* Check the cache first. */
-            if (red != prev_red || green != prev_green || blue != prev_blue ||
-                alpha != prev_alpha)
-            {
-               prev_red = red;
-               prev_green = green;
-               prev_blue = blue;
-               prev_alpha = alpha;
-               if (opng_insert_palette_entry(palette, &num_palette,
-                   trans_alpha, &num_trans, 256,
-                   red, green, blue, alpha, &index) != 0)
-                  index = -1;  /* this should not happen */
-            }
-            OPNG_ASSERT(index >= 0);
-            (*row_ptr)[j] = (png_byte)index;
-         }
-      }
-      else  /* grayscale */
-      {
-         for (j = 0; j < width; ++j, sample_ptr += channels)
-         {
-            gray = sample_ptr[0];
-            alpha = alpha_row[j];
-            /* Check the cache first. */
-            if (gray != prev_gray || alpha != prev_alpha)
-            {
-               prev_gray = gray;
-               prev_alpha = alpha;
-               if (opng_insert_palette_entry(palette, &num_palette,
-                   trans_alpha, &num_trans, 256,
-                   gray, gray, gray, alpha, &index) != 0)
-                  index = -1;  /* this should not happen */
-            }
-            OPNG_ASSERT(index >= 0);
-            (*row_ptr)[j] = (png_byte)index;
-         }
-      }
+      opng_get_rgba_row(&row_info, trans_color, *row_ptr,
+         alpha_row, rgba_row);
+      color_set_add_row(&colors, rgba_row, width, 4, *row_ptr);
+      for (j = 0; j < width; ++j)
+         (*row_ptr)[j] = remap[(*row_ptr)[j]];
    }
 
    /* Update the image information. */
@@ -988,6 +972,7 @@ opng_reduce_to_palette(png_structp png_ptr, png_infop info_ptr,
       png_set_tRNS(png_ptr, info_ptr, trans_alpha, num_trans, NULL);
    /* bKGD (if present) is automatically updated. */
 
+   png_free(png_ptr, rgba_row);
    png_free(png_ptr, alpha_row);
 
    result = OPNG_REDUCE_RGB_TO_PALETTE;
@@ -32,7 +32,7 @@
  */
 #include "cexcept.h"
 define_exception_type(const char *);
-struct exception_context the_exception_context[1];
+#define the_exception_context (ctx->exception_context)
 
 
 /*
@@ -106,17 +106,16 @@ static const png_byte sig_fdAT[4] = { 0x66, 0x64, 0x41, 0x54 };
 
 /*
  * The optimization engine
- * (Since the engine is not thread-safe, there isn't much to put in here...)
  */
-static struct opng_engine_struct
+struct opng_engine_struct
 {
     int started;
-} engine;
+};
 
 /*
  * The optimization process
  */
-static struct opng_process_struct
+struct opng_process_struct
 {
     unsigned int status;
     int num_iterations;
@@ -128,7 +127,7 @@ static struct opng_process_struct
     png_uint_32 reductions;
     opng_bitset_t compr_level_set, mem_level_set, strategy_set, filter_set;
     int best_compr_level, best_mem_level, best_strategy, best_filter;
-} process;
+};
 
 /*
  * The optimization process limits
@@ -139,18 +138,18 @@ static const char *idat_size_max_string = "2GB";
 /*
  * The optimization process summary
  */
-static struct opng_summary_struct
+struct opng_summary_struct
 {
     unsigned int file_count;
     unsigned int err_count;
     unsigned int fix_count;
     unsigned int snip_count;
-} summary;
+};
 
 /*
  * The optimized image
  */
-static struct opng_image_struct
+struct opng_image_struct
 {
     png_uint_32 width;             /* IHDR */
     png_uint_32 height;
@@ -173,44 +172,72 @@ static struct opng_image_struct
     png_color_16 trans_color;
     png_unknown_chunkp unknowns;   /* everything else */
     int num_unknowns;
-} image;
-
-/*
- * The user options
- */
-static struct opng_options options;
-
+};
 
 /*
- * The user interface
+ * The engine context
+ * Everything an optimization touches lives here, so that independent
+ * contexts can run concurrently.
  */
-static void (*usr_printf)(const char *fmt, ...);
-static void (*usr_print_cntrl)(int cntrl_code);
-static void (*usr_progress)(unsigned long num, unsigned long denom);
-static void (*usr_panic)(const char *msg);
+struct opng_context
+{
+    struct exception_context exception_context[1];
+    struct opng_engine_struct engine;
+    struct opng_process_struct process;
+    struct opng_summary_struct summary;
+    struct opng_image_struct image;     /* the optimized image */
+    struct opng_options options;        /* the user options */
+
+    /* The user interface */
+    void (*usr_printf)(const char *fmt, ...);
+    void (*usr_print_cntrl)(int cntrl_code);
+    void (*usr_progress)(unsigned long num, unsigned long denom);
+    void (*usr_panic)(const char *msg);
+
+    /* The libpng structures */
+    png_structp read_ptr;
+    png_infop read_info_ptr;
+    png_structp write_ptr;
+    png_infop write_info_ptr;
+
+    /* The output handler state */
+    int allow_crt_chunk;
+    int crt_chunk_is_idat;
+    osys_foffset_t crt_idat_offset;
+    osys_fsize_t crt_idat_size;
+    png_uint_32 crt_idat_crc;
+
+    /* The parallel trials */
+    opng_parallel_for_fn *parallel_for;
+    osys_fsize_t *shared_max_idat_size;  /* set inside a trial only */
+    opng_stop_fn *stop;
+    void *stop_arg;
+    int *shared_completed;  /* set inside a trial only */
+};
 
 
 /*
- * More global variables, for quick access and bonus style points
+ * Internal debugging tool
  */
-static png_structp read_ptr;
-static png_infop read_info_ptr;
-static png_structp write_ptr;
-static png_infop write_info_ptr;
+#define OPNG_ENSURE(cond, msg) \
+    { if (!(cond)) ctx->usr_panic(msg); }  /* strong check, no #ifdef's */
 
 
 /*
- * Internal debugging tool
+ * Parallel trials need atomic access to the shared IDAT size limit
  */
-#define OPNG_ENSURE(cond, msg) \
-    { if (!(cond)) usr_panic(msg); }  /* strong check, no #ifdef's */
+#if defined(__GNUC__)
+#define OPNG_PARALLEL_TRIALS
+#define OPNG_ATOMIC_LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+#endif
 
 
 /*
  * Size ratio display
  */
 static void
-opng_print_fsize_ratio(osys_fsize_t num, osys_fsize_t denom)
+opng_print_fsize_ratio(struct opng_context *ctx,
+                       osys_fsize_t num, osys_fsize_t denom)
 {
 #if OSYS_FSIZE_MAX <= ULONG_MAX
 #define RATIO_TYPE struct opng_ulratio
@@ -227,7 +254,7 @@ opng_print_fsize_ratio(osys_fsize_t num, osys_fsize_t denom)
     ratio.num = num;
     ratio.denom = denom;
     result = RATIO_CONVERTOR(buffer, sizeof(buffer), &ratio);
-    usr_printf("%s%s", buffer, (result > 0) ? "" : "...");
+    ctx->usr_printf("%s%s", buffer, (result > 0) ? "" : "...");
 
 #undef RATIO_TYPE
 #undef RATIO_CONVERTOR
@@ -237,7 +264,8 @@ opng_print_fsize_ratio(osys_fsize_t num, osys_fsize_t denom)
  * Size change display
  */
 static void
-opng_print_fsize_difference(osys_fsize_t init_size, osys_fsize_t final_size,
+opng_print_fsize_difference(struct opng_context *ctx,
+                            osys_fsize_t init_size, osys_fsize_t final_size,
                             int show_ratio)
 {
     osys_fsize_t difference;
@@ -256,26 +284,27 @@ opng_print_fsize_difference(osys_fsize_t init_size, osys_fsize_t final_size,
 
     if (difference == 0)
     {
-        usr_printf("no change");
+        ctx->usr_printf("no change");
         return;
     }
     if (difference == 1)
-        usr_printf("1 byte");
+        ctx->usr_printf("1 byte");
     else
-        usr_printf("%" OSYS_FSIZE_PRIu " bytes", difference);
+        ctx->usr_printf("%" OSYS_FSIZE_PRIu " bytes", difference);
     if (show_ratio && init_size > 0)
     {
-        usr_printf(" = ");
-        opng_print_fsize_ratio(difference, init_size);
+        ctx->usr_printf(" = ");
+        opng_print_fsize_ratio(ctx, difference, init_size);
     }
-    usr_printf(sign == 0 ? " increase" : " decrease");
+    ctx->usr_printf(sign == 0 ? " increase" : " decrease");
 }
 
 /*
  * Image info display
  */
 static void
-opng_print_image_info(int show_dim, int show_depth, int show_type,
+opng_print_image_info(struct opng_context *ctx,
+                      int show_dim, int show_depth, int show_type,
                       int show_interlaced)
 {
     static const int type_channels[8] = {1, 0, 3, 1, 2, 0, 4, 0};
@@ -285,54 +314,54 @@ opng_print_image_info(int show_dim, int show_depth, int show_type,
     if (show_dim)
     {
         printed = 1;
-        usr_printf("%lux%lu pixels",
-                   (unsigned long)image.width, (unsigned long)image.height);
+        ctx->usr_printf("%lux%lu pixels",
+                   (unsigned long)ctx->image.width, (unsigned long)ctx->image.height);
     }
     if (show_depth)
     {
         if (printed)
-            usr_printf(", ");
+            ctx->usr_printf(", ");
         printed = 1;
-        channels = type_channels[image.color_type & 7];
+        channels = type_channels[ctx->image.color_type & 7];
         if (channels != 1)
-            usr_printf("%dx%d bits/pixel", channels, image.bit_depth);
-        else if (image.bit_depth != 1)
-            usr_printf("%d bits/pixel", image.bit_depth);
+            ctx->usr_printf("%dx%d bits/pixel", channels, ctx->image.bit_depth);
+        else if (ctx->image.bit_depth != 1)
+            ctx->usr_printf("%d bits/pixel", ctx->image.bit_depth);
         else
-            usr_printf("1 bit/pixel");
+            ctx->usr_printf("1 bit/pixel");
     }
     if (show_type)
     {
         if (printed)
-            usr_printf(", ");
+            ctx->usr_printf(", ");
         printed = 1;
-        if (image.color_type & PNG_COLOR_MASK_PALETTE)
+        if (ctx->image.color_type & PNG_COLOR_MASK_PALETTE)
         {
-            if (image.num_palette == 1)
-                usr_printf("1 color");
+            if (ctx->image.num_palette == 1)
+                ctx->usr_printf("1 color");
             else
-                usr_printf("%d colors", image.num_palette);
-            if (image.num_trans > 0)
-                usr_printf(" (%d transparent)", image.num_trans);
-            usr_printf(" in palette");
+                ctx->usr_printf("%d colors", ctx->image.num_palette);
+            if (ctx->image.num_trans > 0)
+                ctx->usr_printf(" (%d transparent)", ctx->image.num_trans);
+            ctx->usr_printf(" in palette");
         }
         else
         {
-            usr_printf((image.color_type & PNG_COLOR_MASK_COLOR) ?
+            ctx->usr_printf((ctx->image.color_type & PNG_COLOR_MASK_COLOR) ?
                        "RGB" : "grayscale");
-            if (image.color_type & PNG_COLOR_MASK_ALPHA)
-                usr_printf("+alpha");
-            else if (image.trans_color_ptr != NULL)
-                usr_printf("+transparency");
+            if (ctx->image.color_type & PNG_COLOR_MASK_ALPHA)
+                ctx->usr_printf("+alpha");
+            else if (ctx->image.trans_color_ptr != NULL)
+                ctx->usr_printf("+transparency");
         }
     }
     if (show_interlaced)
     {
-        if (image.interlace_type != PNG_INTERLACE_NONE)
+        if (ctx->image.interlace_type != PNG_INTERLACE_NONE)
         {
             if (printed)
-                usr_printf(", ");
-            usr_printf("interlaced");
+                ctx->usr_printf(", ");
+            ctx->usr_printf("interlaced");
         }
     }
 }
@@ -341,20 +370,20 @@ opng_print_image_info(int show_dim, int show_depth, int show_type,
  * Warning display
  */
 static void
-opng_print_warning(const char *msg)
+opng_print_warning(struct opng_context *ctx, const char *msg)
 {
-    usr_print_cntrl('\v');  /* VT: new paragraph */
-    usr_printf("Warning: %s\n", msg);
+    ctx->usr_print_cntrl('\v');  /* VT: new paragraph */
+    ctx->usr_printf("Warning: %s\n", msg);
 }
 
 /*
  * Error display
  */
 static void
-opng_print_error(const char *msg)
+opng_print_error(struct opng_context *ctx, const char *msg)
 {
-    usr_print_cntrl('\v');  /* VT: new paragraph */
-    usr_printf("Error: %s\n", msg);
+    ctx->usr_print_cntrl('\v');  /* VT: new paragraph */
+    ctx->usr_printf("Error: %s\n", msg);
 }
 
 /*
@@ -363,11 +392,13 @@ opng_print_error(const char *msg)
 static void
 opng_warning(png_structp png_ptr, png_const_charp msg)
 {
+    struct opng_context *ctx =
+        (struct opng_context *)png_get_error_ptr(png_ptr);
     /* Error in input or output file; processing may continue. */
     /* Recovery requires (re)compression of IDAT. */
-    if (png_ptr == read_ptr)
-        process.status |= (INPUT_HAS_ERRORS | OUTPUT_NEEDS_NEW_IDAT);
-    opng_print_warning(msg);
+    if (png_ptr == ctx->read_ptr)
+        ctx->process.status |= (INPUT_HAS_ERRORS | OUTPUT_NEEDS_NEW_IDAT);
+    opng_print_warning(ctx, msg);
 }
 
 /*
@@ -376,10 +407,12 @@ opng_warning(png_structp png_ptr, png_const_charp msg)
 static void
 opng_error(png_structp png_ptr, png_const_charp msg)
 {
+    struct opng_context *ctx =
+        (struct opng_context *)png_get_error_ptr(png_ptr);
     /* Error in input or output file; processing must stop. */
     /* Recovery requires (re)compression of IDAT. */
-    if (png_ptr == read_ptr)
-        process.status |= (INPUT_HAS_ERRORS | OUTPUT_NEEDS_NEW_IDAT);
+    if (png_ptr == ctx->read_ptr)
+        ctx->process.status |= (INPUT_HAS_ERRORS | OUTPUT_NEEDS_NEW_IDAT);
     Throw msg;
 }
 
@@ -400,7 +433,7 @@ opng_free(void *ptr)
  * IDAT size checker
  */
 static void
-opng_check_idat_size(osys_fsize_t size)
+opng_check_idat_size(struct opng_context *ctx, osys_fsize_t size)
 {
     if (size > idat_size_max)
         Throw "IDAT sizes larger than the maximum chunk size "
@@ -458,19 +491,19 @@ opng_is_apng_chunk(png_bytep chunk_type)
  * Chunk filter
  */
 static int
-opng_allow_chunk(png_bytep chunk_type)
+opng_allow_chunk(struct opng_context *ctx, png_bytep chunk_type)
 {
     /* Always allow critical chunks and tRNS. */
     if (opng_is_image_chunk(chunk_type))
         return 1;
     /* Block all the other chunks if requested. */
-    if (options.strip_all)
+    if (ctx->options.strip_all)
         return 0;
     /* Always block the digital signature chunks. */
     if (memcmp(chunk_type, sig_dSIG, 4) == 0)
         return 0;
     /* Block the APNG chunks when snipping. */
-    if (options.snip && opng_is_apng_chunk(chunk_type))
+    if (ctx->options.snip && opng_is_apng_chunk(chunk_type))
         return 0;
     /* Allow all the other chunks. */
     return 1;
@@ -480,16 +513,17 @@ opng_allow_chunk(png_bytep chunk_type)
  * Chunk handler
  */
 static void
-opng_handle_chunk(png_structp png_ptr, png_bytep chunk_type)
+opng_handle_chunk(struct opng_context *ctx,
+                  png_structp png_ptr, png_bytep chunk_type)
 {
     int keep;
 
     if (opng_is_image_chunk(chunk_type))
         return;
 
-    if (options.strip_all)
+    if (ctx->options.strip_all)
     {
-        process.status |= INPUT_HAS_STRIPPED_DATA | INPUT_HAS_JUNK;
+        ctx->process.status |= INPUT_HAS_STRIPPED_DATA | INPUT_HAS_JUNK;
         opng_set_keep_unknown_chunk(png_ptr,
                                     PNG_HANDLE_CHUNK_NEVER, chunk_type);
         return;
@@ -504,15 +538,15 @@ opng_handle_chunk(png_structp png_ptr, png_bytep chunk_type)
     /* Everything else is handled as unknown by libpng. */
     keep = PNG_HANDLE_CHUNK_ALWAYS;
     if (memcmp(chunk_type, sig_dSIG, 4) == 0)  /* digital signature? */
-        process.status |= INPUT_HAS_DIGITAL_SIGNATURE;
+        ctx->process.status |= INPUT_HAS_DIGITAL_SIGNATURE;
     else if (opng_is_apng_chunk(chunk_type))  /* APNG? */
     {
-        process.status |= INPUT_HAS_APNG;
+        ctx->process.status |= INPUT_HAS_APNG;
         if (memcmp(chunk_type, sig_fdAT, 4) == 0)
-            process.status |= INPUT_HAS_MULTIPLE_IMAGES;
-        if (options.snip)
+            ctx->process.status |= INPUT_HAS_MULTIPLE_IMAGES;
+        if (ctx->options.snip)
         {
-            process.status |= INPUT_HAS_JUNK;
+            ctx->process.status |= INPUT_HAS_JUNK;
             keep = PNG_HANDLE_CHUNK_NEVER;
         }
     }
@@ -523,7 +557,7 @@ opng_handle_chunk(png_structp png_ptr, png_bytep chunk_type)
  * Initialization for input handler
  */
 static void
-opng_init_read_data(void)
+opng_init_read_data(struct opng_context *ctx)
 {
     /* The relevant process data members are set to zero,
      * and nothing else needs to be done at this moment.
@@ -534,11 +568,11 @@ opng_init_read_data(void)
  * Initialization for output handler
  */
 static void
-opng_init_write_data(void)
+opng_init_write_data(struct opng_context *ctx)
 {
-    process.out_file_size = 0;
-    process.out_plte_trns_size = 0;
-    process.out_idat_size = 0;
+    ctx->process.out_file_size = 0;
+    ctx->process.out_plte_trns_size = 0;
+    ctx->process.out_idat_size = 0;
 }
 
 /*
@@ -547,6 +581,8 @@ opng_init_write_data(void)
 static void
 opng_read_data(png_structp png_ptr, png_bytep data, size_t length)
 {
+    struct opng_context *ctx =
+        (struct opng_context *)png_get_error_ptr(png_ptr);
     FILE *stream = (FILE *)png_get_io_ptr(png_ptr);
     int io_state = pngx_get_io_state(png_ptr);
     int io_state_loc = io_state & PNGX_IO_MASK_LOC;
@@ -557,21 +593,21 @@ opng_read_data(png_structp png_ptr, png_bytep data, size_t length)
         png_error(png_ptr,
             "Can't read the input file or unexpected end of file");
 
-    if (process.in_file_size == 0)  /* first piece of PNG data */
+    if (ctx->process.in_file_size == 0)  /* first piece of PNG data */
     {
         OPNG_ENSURE(length == 8, "PNG I/O must start with the first 8 bytes");
-        process.in_datastream_offset = osys_ftello(stream) - 8;
-        process.status |= INPUT_HAS_PNG_DATASTREAM;
+        ctx->process.in_datastream_offset = osys_ftello(stream) - 8;
+        ctx->process.status |= INPUT_HAS_PNG_DATASTREAM;
         if (io_state_loc == PNGX_IO_SIGNATURE)
-            process.status |= INPUT_HAS_PNG_SIGNATURE;
-        if (process.in_datastream_offset == 0)
-            process.status |= INPUT_IS_PNG_FILE;
-        else if (process.in_datastream_offset < 0)
+            ctx->process.status |= INPUT_HAS_PNG_SIGNATURE;
+        if (ctx->process.in_datastream_offset == 0)
+            ctx->process.status |= INPUT_IS_PNG_FILE;
+        else if (ctx->process.in_datastream_offset < 0)
             png_error(png_ptr,
                 "Can't get the file-position indicator in input file");
-        process.in_file_size = (osys_fsize_t)process.in_datastream_offset;
+        ctx->process.in_file_size = (osys_fsize_t)ctx->process.in_datastream_offset;
     }
-    process.in_file_size += length;
+    ctx->process.in_file_size += length;
 
     /* Handle the OptiPNG-specific events. */
     OPNG_ENSURE((io_state & PNGX_IO_READING) && (io_state_loc != 0),
@@ -587,39 +623,39 @@ opng_read_data(png_structp png_ptr, png_bytep data, size_t length)
 
         if (memcmp(chunk_sig, sig_IDAT, 4) == 0)
         {
-            OPNG_ENSURE(png_ptr == read_ptr, "Incorrect I/O handler setup");
-            if (png_get_rows(read_ptr, read_info_ptr) == NULL)  /* 1st IDAT */
+            OPNG_ENSURE(png_ptr == ctx->read_ptr, "Incorrect I/O handler setup");
+            if (png_get_rows(ctx->read_ptr, ctx->read_info_ptr) == NULL)  /* 1st IDAT */
             {
-                OPNG_ENSURE(process.in_idat_size == 0,
+                OPNG_ENSURE(ctx->process.in_idat_size == 0,
                             "Found IDAT with no rows");
                 /* Allocate the rows here, bypassing libpng.
                  * This allows to initialize the contents and perform recovery
                  * in case of a premature EOF.
                  */
-                if (png_get_image_height(read_ptr, read_info_ptr) == 0)
+                if (png_get_image_height(ctx->read_ptr, ctx->read_info_ptr) == 0)
                     return;  /* premature IDAT; an error will occur later */
-                OPNG_ENSURE(pngx_malloc_rows(read_ptr,
-                                             read_info_ptr, 0) != NULL,
+                OPNG_ENSURE(pngx_malloc_rows(ctx->read_ptr,
+                                             ctx->read_info_ptr, 0) != NULL,
                             "Failed allocation of image rows; "
                             "unsafe libpng allocator");
-                png_data_freer(read_ptr, read_info_ptr,
+                png_data_freer(ctx->read_ptr, ctx->read_info_ptr,
                                PNG_USER_WILL_FREE_DATA, PNG_FREE_ROWS);
             }
             else
             {
                 /* There is split IDAT overhead. Join IDATs. */
-                process.status |= INPUT_HAS_JUNK;
+                ctx->process.status |= INPUT_HAS_JUNK;
             }
-            process.in_idat_size += png_get_uint_32(data);
+            ctx->process.in_idat_size += png_get_uint_32(data);
         }
         else if (memcmp(chunk_sig, sig_PLTE, 4) == 0 ||
                  memcmp(chunk_sig, sig_tRNS, 4) == 0)
         {
             /* Add the chunk overhead (header + CRC) to the data size. */
-            process.in_plte_trns_size += png_get_uint_32(data) + 12;
+            ctx->process.in_plte_trns_size += png_get_uint_32(data) + 12;
         }
         else
-            opng_handle_chunk(png_ptr, chunk_sig);
+            opng_handle_chunk(ctx, png_ptr, chunk_sig);
     }
     else if (io_state_loc == PNGX_IO_CHUNK_CRC)
     {
@@ -627,17 +663,48 @@ opng_read_data(png_structp png_ptr, png_bytep data, size_t length)
     }
 }
 
+/*
+ * IDAT size limit of the current trial
+ */
+static osys_fsize_t
+opng_get_max_idat_size(struct opng_context *ctx)
+{
+#ifdef OPNG_PARALLEL_TRIALS
+    if (ctx->shared_max_idat_size != NULL)
+        return OPNG_ATOMIC_LOAD(ctx->shared_max_idat_size);
+#endif
+    return ctx->process.max_idat_size;
+}
+
+/*
+ * Whether the current trial is to be abandoned for the time limit,
+ * which happens only once another trial has completed, or at once
+ * with OPNG_STOP_ALL
+ */
+static int
+opng_trial_stopped(struct opng_context *ctx)
+{
+#ifdef OPNG_PARALLEL_TRIALS
+    int stop;
+
+    if (ctx->stop != NULL && ctx->shared_completed != NULL)
+    {
+        stop = ctx->stop(ctx->stop_arg);
+        return stop == OPNG_STOP_ALL ||
+               (stop && OPNG_ATOMIC_LOAD(ctx->shared_completed) > 0);
+    }
+#endif
+    return 0;
+}
+
 /*
  * Output handler
  */
 static void
 opng_write_data(png_structp png_ptr, png_bytep data, size_t length)
 {
-    static int allow_crt_chunk;
-    static int crt_chunk_is_idat;
-    static osys_foffset_t crt_idat_offset;
-    static osys_fsize_t crt_idat_size; 
-    static png_uint_32 crt_idat_crc;
+    struct opng_context *ctx =
+        (struct opng_context *)png_get_error_ptr(png_ptr);
     FILE *stream = (FILE *)png_get_io_ptr(png_ptr);
     int io_state = pngx_get_io_state(png_ptr);
     int io_state_loc = io_state & PNGX_IO_MASK_LOC;
@@ -652,26 +719,27 @@ opng_write_data(png_structp png_ptr, png_bytep data, size_t length)
     {
         OPNG_ENSURE(length == 8, "Writing chunk header, expecting 8 bytes");
         chunk_sig = data + 4;
-        allow_crt_chunk = opng_allow_chunk(chunk_sig);
+        ctx->allow_crt_chunk = opng_allow_chunk(ctx, chunk_sig);
         if (memcmp(chunk_sig, sig_IDAT, 4) == 0)
         {
-            crt_chunk_is_idat = 1;
-            process.out_idat_size += png_get_uint_32(data);
+            ctx->crt_chunk_is_idat = 1;
+            ctx->process.out_idat_size += png_get_uint_32(data);
             /* Abandon the trial if IDAT is bigger than the maximum allowed. */
             if (stream == NULL)
             {
-                if (process.out_idat_size > process.max_idat_size)
+                if (ctx->process.out_idat_size > opng_get_max_idat_size(ctx) ||
+                    opng_trial_stopped(ctx))
                     Throw NULL;  /* early interruption, not an error */
             }
         }
         else  /* not IDAT */
         {
-            crt_chunk_is_idat = 0;
+            ctx->crt_chunk_is_idat = 0;
             if (memcmp(chunk_sig, sig_PLTE, 4) == 0 ||
                 memcmp(chunk_sig, sig_tRNS, 4) == 0)
             {
                 /* Add the chunk overhead (header + CRC) to the data size. */
-                process.out_plte_trns_size += png_get_uint_32(data) + 12;
+                ctx->process.out_plte_trns_size += png_get_uint_32(data) + 12;
             }
         }
     }
@@ -685,7 +753,7 @@ opng_write_data(png_structp png_ptr, png_bytep data, size_t length)
         return;
 
     /* Continue only if the current chunk type is allowed. */
-    if (io_state_loc != PNGX_IO_SIGNATURE && !allow_crt_chunk)
+    if (io_state_loc != PNGX_IO_SIGNATURE && !ctx->allow_crt_chunk)
         return;
 
     /* Here comes an elaborate way of writing the data, in which all IDATs
@@ -696,28 +764,28 @@ opng_write_data(png_structp png_ptr, png_bytep data, size_t length)
     {
         case PNGX_IO_CHUNK_HDR:
         {
-            if (crt_chunk_is_idat)
+            if (ctx->crt_chunk_is_idat)
             {
-                if (crt_idat_offset == 0)
+                if (ctx->crt_idat_offset == 0)
                 {
                     /* This is the header of the first IDAT. */
-                    crt_idat_offset = osys_ftello(stream);
+                    ctx->crt_idat_offset = osys_ftello(stream);
                     /* Try guessing the size of the final (joined) IDAT. */
-                    if (process.best_idat_size > 0)
+                    if (ctx->process.best_idat_size > 0)
                     {
                         /* The guess is expected to be right. */
-                        crt_idat_size = process.best_idat_size;
+                        ctx->crt_idat_size = ctx->process.best_idat_size;
                     }
                     else
                     {
                         /* The guess could be wrong.
                          * The size of the final IDAT will be revised.
                          */
-                        crt_idat_size = length;
+                        ctx->crt_idat_size = length;
                     }
-                    png_save_uint_32(data, (png_uint_32)crt_idat_size);
+                    png_save_uint_32(data, (png_uint_32)ctx->crt_idat_size);
                     /* Start computing the CRC of the final IDAT. */
-                    crt_idat_crc = crc32(0, sig_IDAT, 4);
+                    ctx->crt_idat_crc = crc32(0, sig_IDAT, 4);
                 }
                 else
                 {
@@ -727,45 +795,45 @@ opng_write_data(png_structp png_ptr, png_bytep data, size_t length)
             }
             else
             {
-                if (crt_idat_offset != 0)
+                if (ctx->crt_idat_offset != 0)
                 {
                     /* This is the header of the first chunk after IDAT.
                      * Finalize IDAT before resuming the normal operation.
                      */
-                    png_save_uint_32(buf, crt_idat_crc);
+                    png_save_uint_32(buf, ctx->crt_idat_crc);
                     if (fwrite(buf, 1, 4, stream) != 4)
                         io_state = 0;  /* error */
-                    process.out_file_size += 4;
-                    if (process.out_idat_size != crt_idat_size)
+                    ctx->process.out_file_size += 4;
+                    if (ctx->process.out_idat_size != ctx->crt_idat_size)
                     {
                         /* The IDAT size has not been guessed correctly.
                          * It must be updated in a non-streamable way.
                          */
-                        OPNG_ENSURE(process.best_idat_size == 0,
+                        OPNG_ENSURE(ctx->process.best_idat_size == 0,
                                     "Wrong guess of the output IDAT size");
-                        opng_check_idat_size(process.out_idat_size);
+                        opng_check_idat_size(ctx, ctx->process.out_idat_size);
                         png_save_uint_32(buf,
-                                         (png_uint_32)process.out_idat_size);
-                        if (osys_fwrite_at(stream, crt_idat_offset, SEEK_SET,
+                                         (png_uint_32)ctx->process.out_idat_size);
+                        if (osys_fwrite_at(stream, ctx->crt_idat_offset, SEEK_SET,
                                            buf, 4) != 4)
                             io_state = 0;  /* error */
                     }
                     if (io_state == 0)
                         png_error(png_ptr, "Can't finalize IDAT");
-                    crt_idat_offset = 0;
+                    ctx->crt_idat_offset = 0;
                 }
             }
             break;
         }
         case PNGX_IO_CHUNK_DATA:
         {
-            if (crt_chunk_is_idat)
-                crt_idat_crc = crc32(crt_idat_crc, data, length);
+            if (ctx->crt_chunk_is_idat)
+                ctx->crt_idat_crc = crc32(ctx->crt_idat_crc, data, length);
             break;
         }
         case PNGX_IO_CHUNK_CRC:
         {
-            if (crt_chunk_is_idat)
+            if (ctx->crt_chunk_is_idat)
                 return;  /* defer writing until the first non-IDAT occurs */
             break;
         }
@@ -774,106 +842,108 @@ opng_write_data(png_structp png_ptr, png_bytep data, size_t length)
     /* Write the data. */
     if (fwrite(data, 1, length, stream) != length)
         png_error(png_ptr, "Can't write the output file");
-    process.out_file_size += length;
+    ctx->process.out_file_size += length;
 }
 
 /*
  * Image info initialization
  */
 static void
-opng_clear_image_info(void)
+opng_clear_image_info(struct opng_context *ctx)
 {
-    memset(&image, 0, sizeof(image));
+    memset(&ctx->image, 0, sizeof(ctx->image));
 }
 
 /*
  * Image info transfer
  */
 static void
-opng_load_image_info(png_structp png_ptr, png_infop info_ptr, int load_meta)
+opng_load_image_info(struct opng_context *ctx,
+                     png_structp png_ptr, png_infop info_ptr, int load_meta)
 {
-    memset(&image, 0, sizeof(image));
+    memset(&ctx->image, 0, sizeof(ctx->image));
 
     png_get_IHDR(png_ptr, info_ptr,
-        &image.width, &image.height, &image.bit_depth, &image.color_type,
-        &image.interlace_type, &image.compression_type, &image.filter_type);
-    image.row_pointers = png_get_rows(png_ptr, info_ptr);
-    png_get_PLTE(png_ptr, info_ptr, &image.palette, &image.num_palette);
+        &ctx->image.width, &ctx->image.height, &ctx->image.bit_depth, &ctx->image.color_type,
+        &ctx->image.interlace_type, &ctx->image.compression_type, &ctx->image.filter_type);
+    ctx->image.row_pointers = png_get_rows(png_ptr, info_ptr);
+    png_get_PLTE(png_ptr, info_ptr, &ctx->image.palette, &ctx->image.num_palette);
     /* Transparency is not considered metadata, although tRNS is ancillary.
      * See the comment in opng_is_image_chunk() above.
      */
     if (png_get_tRNS(png_ptr, info_ptr,
-        &image.trans_alpha, &image.num_trans, &image.trans_color_ptr))
+        &ctx->image.trans_alpha, &ctx->image.num_trans, &ctx->image.trans_color_ptr))
     {
         /* Double copying (pointer + value) is necessary here
          * due to an inconsistency in the libpng design.
          */
-        if (image.trans_color_ptr != NULL)
+        if (ctx->image.trans_color_ptr != NULL)
         {
-            image.trans_color = *image.trans_color_ptr;
-            image.trans_color_ptr = &image.trans_color;
+            ctx->image.trans_color = *ctx->image.trans_color_ptr;
+            ctx->image.trans_color_ptr = &ctx->image.trans_color;
         }
     }
 
     if (!load_meta)
         return;
 
-    if (png_get_bKGD(png_ptr, info_ptr, &image.background_ptr))
+    if (png_get_bKGD(png_ptr, info_ptr, &ctx->image.background_ptr))
     {
         /* Same problem as in tRNS. */
-        image.background = *image.background_ptr;
-        image.background_ptr = &image.background;
+        ctx->image.background = *ctx->image.background_ptr;
+        ctx->image.background_ptr = &ctx->image.background;
     }
-    png_get_hIST(png_ptr, info_ptr, &image.hist);
-    if (png_get_sBIT(png_ptr, info_ptr, &image.sig_bit_ptr))
+    png_get_hIST(png_ptr, info_ptr, &ctx->image.hist);
+    if (png_get_sBIT(png_ptr, info_ptr, &ctx->image.sig_bit_ptr))
     {
         /* Same problem as in tRNS. */
-        image.sig_bit = *image.sig_bit_ptr;
-        image.sig_bit_ptr = &image.sig_bit;
+        ctx->image.sig_bit = *ctx->image.sig_bit_ptr;
+        ctx->image.sig_bit_ptr = &ctx->image.sig_bit;
     }
-    image.num_unknowns =
-        png_get_unknown_chunks(png_ptr, info_ptr, &image.unknowns);
+    ctx->image.num_unknowns =
+        png_get_unknown_chunks(png_ptr, info_ptr, &ctx->image.unknowns);
 }
 
 /*
  * Image info transfer
  */
 static void
-opng_store_image_info(png_structp png_ptr, png_infop info_ptr, int store_meta)
+opng_store_image_info(struct opng_context *ctx,
+                      png_structp png_ptr, png_infop info_ptr, int store_meta)
 {
-    OPNG_ENSURE(image.row_pointers != NULL, "No info in image");
+    OPNG_ENSURE(ctx->image.row_pointers != NULL, "No info in image");
 
     png_set_IHDR(png_ptr, info_ptr,
-        image.width, image.height, image.bit_depth, image.color_type,
-        image.interlace_type, image.compression_type, image.filter_type);
-    png_set_rows(write_ptr, write_info_ptr, image.row_pointers);
-    if (image.palette != NULL)
-        png_set_PLTE(png_ptr, info_ptr, image.palette, image.num_palette);
+        ctx->image.width, ctx->image.height, ctx->image.bit_depth, ctx->image.color_type,
+        ctx->image.interlace_type, ctx->image.compression_type, ctx->image.filter_type);
+    png_set_rows(ctx->write_ptr, ctx->write_info_ptr, ctx->image.row_pointers);
+    if (ctx->image.palette != NULL)
+        png_set_PLTE(png_ptr, info_ptr, ctx->image.palette, ctx->image.num_palette);
     /* Transparency is not considered metadata, although tRNS is ancillary.
      * See the comment in opng_is_image_chunk() above.
      */
-    if (image.trans_alpha != NULL || image.trans_color_ptr != NULL)
+    if (ctx->image.trans_alpha != NULL || ctx->image.trans_color_ptr != NULL)
         png_set_tRNS(png_ptr, info_ptr,
-            image.trans_alpha, image.num_trans, image.trans_color_ptr);
+            ctx->image.trans_alpha, ctx->image.num_trans, ctx->image.trans_color_ptr);
 
     if (!store_meta)
         return;
 
-    if (image.background_ptr != NULL)
-        png_set_bKGD(png_ptr, info_ptr, image.background_ptr);
-    if (image.hist != NULL)
-        png_set_hIST(png_ptr, info_ptr, image.hist);
-    if (image.sig_bit_ptr != NULL)
-        png_set_sBIT(png_ptr, info_ptr, image.sig_bit_ptr);
-    if (image.num_unknowns != 0)
+    if (ctx->image.background_ptr != NULL)
+        png_set_bKGD(png_ptr, info_ptr, ctx->image.background_ptr);
+    if (ctx->image.hist != NULL)
+        png_set_hIST(png_ptr, info_ptr, ctx->image.hist);
+    if (ctx->image.sig_bit_ptr != NULL)
+        png_set_sBIT(png_ptr, info_ptr, ctx->image.sig_bit_ptr);
+    if (ctx->image.num_unknowns != 0)
     {
         int i;
         png_set_unknown_chunks(png_ptr, info_ptr,
-            image.unknowns, image.num_unknowns);
+            ctx->image.unknowns, ctx->image.num_unknowns);
         /* Is this really necessary? Should it not be implemented in libpng? */
-        for (i = 0; i < image.num_unknowns; ++i)
+        for (i = 0; i < ctx->image.num_unknowns; ++i)
             png_set_unknown_chunk_location(png_ptr, info_ptr,
-                i, image.unknowns[i].location);
+                i, ctx->image.unknowns[i].location);
     }
 }
 
@@ -881,23 +951,23 @@ opng_store_image_info(png_structp png_ptr, png_infop info_ptr, int store_meta)
  * Image info destruction
  */
 static void
-opng_destroy_image_info(void)
+opng_destroy_image_info(struct opng_context *ctx)
 {
     png_uint_32 i;
     int j;
 
-    if (image.row_pointers == NULL)
+    if (ctx->image.row_pointers == NULL)
         return;  /* nothing to clean up */
 
-    for (i = 0; i < image.height; ++i)
-        opng_free(image.row_pointers[i]);
-    opng_free(image.row_pointers);
-    opng_free(image.palette);
-    opng_free(image.trans_alpha);
-    opng_free(image.hist);
-    for (j = 0; j < image.num_unknowns; ++j)
-        opng_free(image.unknowns[j].data);
-    opng_free(image.unknowns);
+    for (i = 0; i < ctx->image.height; ++i)
+        opng_free(ctx->image.row_pointers[i]);
+    opng_free(ctx->image.row_pointers);
+    opng_free(ctx->image.palette);
+    opng_free(ctx->image.trans_alpha);
+    opng_free(ctx->image.hist);
+    for (j = 0; j < ctx->image.num_unknowns; ++j)
+        opng_free(ctx->image.unknowns[j].data);
+    opng_free(ctx->image.unknowns);
     /* DO NOT deallocate background_ptr, sig_bit_ptr, trans_color_ptr.
      * See the comments regarding double copying inside opng_load_image_info().
      */
@@ -905,14 +975,14 @@ opng_destroy_image_info(void)
     /* Clear the space here and do not worry about double-deallocation issues
      * that might arise later on.
      */
-    memset(&image, 0, sizeof(image));
+    memset(&ctx->image, 0, sizeof(ctx->image));
 }
 
 /*
  * Image file reading
  */
 static void
-opng_read_file(FILE *infile)
+opng_read_file(struct opng_context *ctx, FILE *infile)
 {
     const char *fmt_name;
     int num_img;
@@ -921,41 +991,41 @@ opng_read_file(FILE *infile)
 
     Try
     {
-        read_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
+        ctx->read_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, ctx,
             opng_error, opng_warning);
-        read_info_ptr = png_create_info_struct(read_ptr);
-        if (read_info_ptr == NULL)
+        ctx->read_info_ptr = png_create_info_struct(ctx->read_ptr);
+        if (ctx->read_info_ptr == NULL)
             Throw "Out of memory";
 
         /* Override the default libpng settings. */
-        png_set_keep_unknown_chunks(read_ptr,
+        png_set_keep_unknown_chunks(ctx->read_ptr,
                                     PNG_HANDLE_CHUNK_ALWAYS, NULL, 0);
-        png_set_user_limits(read_ptr, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
+        png_set_user_limits(ctx->read_ptr, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
 
         /* Read the input image file. */
-        opng_init_read_data();
-        pngx_set_read_fn(read_ptr, infile, opng_read_data);
+        opng_init_read_data(ctx);
+        pngx_set_read_fn(ctx->read_ptr, infile, opng_read_data);
         fmt_name = NULL;
-        num_img = pngx_read_image(read_ptr, read_info_ptr, &fmt_name, NULL);
+        num_img = pngx_read_image(ctx->read_ptr, ctx->read_info_ptr, &fmt_name, NULL);
         if (num_img <= 0)
             Throw "Unrecognized image file format";
         if (num_img > 1)
-            process.status |= INPUT_HAS_MULTIPLE_IMAGES;
-        if ((process.status & INPUT_IS_PNG_FILE) &&
-            (process.status & INPUT_HAS_MULTIPLE_IMAGES))
+            ctx->process.status |= INPUT_HAS_MULTIPLE_IMAGES;
+        if ((ctx->process.status & INPUT_IS_PNG_FILE) &&
+            (ctx->process.status & INPUT_HAS_MULTIPLE_IMAGES))
         {
             /* pngxtern can't distinguish between APNG and proper PNG. */
-            fmt_name = (process.status & INPUT_HAS_PNG_SIGNATURE) ?
+            fmt_name = (ctx->process.status & INPUT_HAS_PNG_SIGNATURE) ?
                        "APNG" : "APNG datastream";
         }
         OPNG_ENSURE(fmt_name != NULL, "No format name from pngxtern");
 
-        if (process.in_file_size == 0)
+        if (ctx->process.in_file_size == 0)
         {
-            if (osys_fgetsize(infile, &process.in_file_size) < 0)
+            if (osys_fgetsize(infile, &ctx->process.in_file_size) < 0)
             {
-                opng_print_warning("Can't get the correct file size");
-                process.in_file_size = 0;
+                opng_print_warning(ctx, "Can't get the correct file size");
+                ctx->process.in_file_size = 0;
             }
         }
 
@@ -966,9 +1036,9 @@ opng_read_file(FILE *infile)
         /* If the critical info has been loaded, treat all errors as warnings.
          * This enables a more advanced data recovery.
          */
-        if (opng_validate_image(read_ptr, read_info_ptr))
+        if (opng_validate_image(ctx->read_ptr, ctx->read_info_ptr))
         {
-           png_warning(read_ptr, err_msg);
+           png_warning(ctx->read_ptr, err_msg);
            err_msg = NULL;
         }
     }
@@ -981,85 +1051,85 @@ opng_read_file(FILE *infile)
         /* Display format and image information. */
         if (strcmp(fmt_name, "PNG") != 0)
         {
-            usr_printf("Importing %s", fmt_name);
-            if (process.status & INPUT_HAS_MULTIPLE_IMAGES)
+            ctx->usr_printf("Importing %s", fmt_name);
+            if (ctx->process.status & INPUT_HAS_MULTIPLE_IMAGES)
             {
-                if (!(process.status & INPUT_IS_PNG_FILE))
-                    usr_printf(" (multi-image or animation)");
-                if (options.snip)
-                    usr_printf("; snipping...");
+                if (!(ctx->process.status & INPUT_IS_PNG_FILE))
+                    ctx->usr_printf(" (multi-image or animation)");
+                if (ctx->options.snip)
+                    ctx->usr_printf("; snipping...");
             }
-            usr_printf("\n");
+            ctx->usr_printf("\n");
         }
-        opng_load_image_info(read_ptr, read_info_ptr, 1);
-        opng_print_image_info(1, 1, 1, 1);
-        usr_printf("\n");
+        opng_load_image_info(ctx, ctx->read_ptr, ctx->read_info_ptr, 1);
+        opng_print_image_info(ctx, 1, 1, 1, 1);
+        ctx->usr_printf("\n");
 
         /* Choose the applicable image reductions. */
         reductions = OPNG_REDUCE_ALL & ~OPNG_REDUCE_METADATA;
-        if (options.nb)
+        if (ctx->options.nb)
             reductions &= ~OPNG_REDUCE_BIT_DEPTH;
-        if (options.nc)
+        if (ctx->options.nc)
             reductions &= ~OPNG_REDUCE_COLOR_TYPE;
-        if (options.np)
+        if (ctx->options.np)
             reductions &= ~OPNG_REDUCE_PALETTE;
-        if (options.nz && (process.status & INPUT_HAS_PNG_DATASTREAM))
+        if (ctx->options.nz && (ctx->process.status & INPUT_HAS_PNG_DATASTREAM))
         {
             /* Do not reduce files with PNG datastreams under -nz. */
             reductions = OPNG_REDUCE_NONE;
         }
-        if (process.status & INPUT_HAS_DIGITAL_SIGNATURE)
+        if (ctx->process.status & INPUT_HAS_DIGITAL_SIGNATURE)
         {
             /* Do not reduce signed files. */
             reductions = OPNG_REDUCE_NONE;
         }
-        if ((process.status & INPUT_IS_PNG_FILE) &&
-            (process.status & INPUT_HAS_MULTIPLE_IMAGES) &&
-            (reductions != OPNG_REDUCE_NONE) && !options.snip)
+        if ((ctx->process.status & INPUT_IS_PNG_FILE) &&
+            (ctx->process.status & INPUT_HAS_MULTIPLE_IMAGES) &&
+            (reductions != OPNG_REDUCE_NONE) && !ctx->options.snip)
         {
-            usr_printf(
+            ctx->usr_printf(
                 "Can't reliably reduce APNG file; disabling reductions.\n"
                 "(Did you want to -snip and optimize the first frame?)\n");
             reductions = OPNG_REDUCE_NONE;
         }
 
         /* Try to reduce the image. */
-        process.reductions =
-            opng_reduce_image(read_ptr, read_info_ptr, reductions);
+        ctx->process.reductions =
+            opng_reduce_image(ctx->read_ptr, ctx->read_info_ptr, reductions);
 
         /* If the image is reduced, enforce full compression. */
-        if (process.reductions != OPNG_REDUCE_NONE)
+        if (ctx->process.reductions != OPNG_REDUCE_NONE)
         {
-            opng_load_image_info(read_ptr, read_info_ptr, 1);
-            usr_printf("Reducing image to ");
-            opng_print_image_info(0, 1, 1, 0);
-            usr_printf("\n");
+            opng_load_image_info(ctx, ctx->read_ptr, ctx->read_info_ptr, 1);
+            ctx->usr_printf("Reducing image to ");
+            opng_print_image_info(ctx, 0, 1, 1, 0);
+            ctx->usr_printf("\n");
         }
 
         /* Change the interlace type if required. */
-        if (options.interlace >= 0 &&
-            image.interlace_type != options.interlace)
+        if (ctx->options.interlace >= 0 &&
+            ctx->image.interlace_type != ctx->options.interlace)
         {
-            image.interlace_type = options.interlace;
+            ctx->image.interlace_type = ctx->options.interlace;
             /* A change in interlacing requires IDAT recoding. */
-            process.status |= OUTPUT_NEEDS_NEW_IDAT;
+            ctx->process.status |= OUTPUT_NEEDS_NEW_IDAT;
         }
     }
     Catch (err_msg)
     {
         /* Do the cleanup, then rethrow the exception. */
-        png_data_freer(read_ptr, read_info_ptr,
+        png_data_freer(ctx->read_ptr, ctx->read_info_ptr,
                        PNG_DESTROY_WILL_FREE_DATA, PNG_FREE_ALL);
-        png_destroy_read_struct(&read_ptr, &read_info_ptr, NULL);
+        png_destroy_read_struct(&ctx->read_ptr, &ctx->read_info_ptr, NULL);
         Throw err_msg;
     }
 
     /* Destroy the libpng structures, but leave the enclosed data intact
      * to allow further processing.
      */
-    png_data_freer(read_ptr, read_info_ptr,
+    png_data_freer(ctx->read_ptr, ctx->read_info_ptr,
                    PNG_USER_WILL_FREE_DATA, PNG_FREE_ALL);
-    png_destroy_read_struct(&read_ptr, &read_info_ptr, NULL);
+    png_destroy_read_struct(&ctx->read_ptr, &ctx->read_info_ptr, NULL);
 }
 
 /*
@@ -1069,7 +1139,7 @@ opng_read_file(FILE *infile)
  * but no file is written.
  */
 static void
-opng_write_file(FILE *outfile,
+opng_write_file(struct opng_context *ctx, FILE *outfile,
                 int compression_level, int memory_level,
                 int compression_strategy, int filter)
 {
@@ -1088,53 +1158,53 @@ opng_write_file(FILE *outfile,
 
     Try
     {
-        write_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
-            NULL, opng_error, opng_warning);
-        write_info_ptr = png_create_info_struct(write_ptr);
-        if (write_info_ptr == NULL)
+        ctx->write_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+            ctx, opng_error, opng_warning);
+        ctx->write_info_ptr = png_create_info_struct(ctx->write_ptr);
+        if (ctx->write_info_ptr == NULL)
             Throw "Out of memory";
 
-        png_set_compression_level(write_ptr, compression_level);
-        png_set_compression_mem_level(write_ptr, memory_level);
-        png_set_compression_strategy(write_ptr, compression_strategy);
-        png_set_filter(write_ptr, PNG_FILTER_TYPE_BASE, filter_table[filter]);
+        png_set_compression_level(ctx->write_ptr, compression_level);
+        png_set_compression_mem_level(ctx->write_ptr, memory_level);
+        png_set_compression_strategy(ctx->write_ptr, compression_strategy);
+        png_set_filter(ctx->write_ptr, PNG_FILTER_TYPE_BASE, filter_table[filter]);
         if (compression_strategy != Z_HUFFMAN_ONLY &&
             compression_strategy != Z_RLE)
         {
-            if (options.window_bits > 0)
-                png_set_compression_window_bits(write_ptr,
-                                                options.window_bits);
+            if (ctx->options.window_bits > 0)
+                png_set_compression_window_bits(ctx->write_ptr,
+                                                ctx->options.window_bits);
         }
         else
         {
 #ifdef WBITS_8_OK
-            png_set_compression_window_bits(write_ptr, 8);
+            png_set_compression_window_bits(ctx->write_ptr, 8);
 #else
-            png_set_compression_window_bits(write_ptr, 9);
+            png_set_compression_window_bits(ctx->write_ptr, 9);
 #endif
         }
 
         /* Override the default libpng settings. */
-        png_set_keep_unknown_chunks(write_ptr,
+        png_set_keep_unknown_chunks(ctx->write_ptr,
                                     PNG_HANDLE_CHUNK_ALWAYS, NULL, 0);
-        png_set_user_limits(write_ptr, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
+        png_set_user_limits(ctx->write_ptr, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
 
         /* Write the PNG stream. */
-        opng_store_image_info(write_ptr, write_info_ptr, (outfile != NULL));
-        opng_init_write_data();
-        pngx_set_write_fn(write_ptr, outfile, opng_write_data, NULL);
-        png_write_png(write_ptr, write_info_ptr, 0, NULL);
+        opng_store_image_info(ctx, ctx->write_ptr, ctx->write_info_ptr, (outfile != NULL));
+        opng_init_write_data(ctx);
+        pngx_set_write_fn(ctx->write_ptr, outfile, opng_write_data, NULL);
+        png_write_png(ctx->write_ptr, ctx->write_info_ptr, 0, NULL);
 
         err_msg = NULL;  /* everything is ok */
     }
     Catch (err_msg)
     {
         /* Set IDAT size to invalid. */
-        process.out_idat_size = idat_size_max + 1;
+        ctx->process.out_idat_size = idat_size_max + 1;
     }
 
     /* Destroy the libpng structures. */
-    png_destroy_write_struct(&write_ptr, &write_info_ptr);
+    png_destroy_write_struct(&ctx->write_ptr, &ctx->write_info_ptr);
 
     if (err_msg != NULL)
         Throw err_msg;
@@ -1144,7 +1214,7 @@ opng_write_file(FILE *outfile,
  * PNG file copying
  */
 static void
-opng_copy_file(FILE *infile, FILE *outfile)
+opng_copy_file(struct opng_context *ctx, FILE *infile, FILE *outfile)
 {
     volatile png_bytep buf;  /* volatile is required by cexcept */
     const png_uint_32 buf_size_incr = 0x1000;
@@ -1152,12 +1222,12 @@ opng_copy_file(FILE *infile, FILE *outfile)
     png_byte chunk_hdr[8];
     const char * volatile err_msg;
 
-    write_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
-        NULL, opng_error, opng_warning);
-    if (write_ptr == NULL)
+    ctx->write_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+        ctx, opng_error, opng_warning);
+    if (ctx->write_ptr == NULL)
         Throw "Out of memory";
-    opng_init_write_data();
-    pngx_set_write_fn(write_ptr, outfile, opng_write_data, NULL);
+    opng_init_write_data(ctx);
+    pngx_set_write_fn(ctx->write_ptr, outfile, opng_write_data, NULL);
 
     Try
     {
@@ -1165,7 +1235,7 @@ opng_copy_file(FILE *infile, FILE *outfile)
         buf_size = 0;
 
         /* Write the signature in the output file. */
-        pngx_write_sig(write_ptr);
+        pngx_write_sig(ctx->write_ptr);
 
         /* Copy all chunks until IEND. */
         /* Error checking is done only at a very basic level. */
@@ -1182,15 +1252,15 @@ opng_copy_file(FILE *infile, FILE *outfile)
             }
             if (length + 4 > buf_size)
             {
-                png_free(write_ptr, buf);
+                png_free(ctx->write_ptr, buf);
                 buf_size = (((length + 4) + (buf_size_incr - 1))
                             / buf_size_incr) * buf_size_incr;
-                buf = (png_bytep)png_malloc(write_ptr, buf_size);
+                buf = (png_bytep)png_malloc(ctx->write_ptr, buf_size);
                 /* Do not use realloc() here, it's slower. */
             }
             if (fread(buf, length + 4, 1, infile) != 1)  /* data + crc */
                 Throw "Read error";
-            png_write_chunk(write_ptr, chunk_hdr + 4, buf, length);
+            png_write_chunk(ctx->write_ptr, chunk_hdr + 4, buf, length);
         } while (memcmp(chunk_hdr + 4, sig_IEND, 4) != 0);
 
         err_msg = NULL;  /* everything is ok */
@@ -1199,8 +1269,8 @@ opng_copy_file(FILE *infile, FILE *outfile)
     {
     }
 
-    png_free(write_ptr, buf);
-    png_destroy_write_struct(&write_ptr, NULL);
+    png_free(ctx->write_ptr, buf);
+    png_destroy_write_struct(&ctx->write_ptr, NULL);
 
     if (err_msg != NULL)
         Throw err_msg;
@@ -1210,7 +1280,8 @@ opng_copy_file(FILE *infile, FILE *outfile)
  * Iteration initialization
  */
 static void
-opng_init_iteration(opng_bitset_t cmdline_set, opng_bitset_t mask_set,
+opng_init_iteration(struct opng_context *ctx,
+                    opng_bitset_t cmdline_set, opng_bitset_t mask_set,
                     const char *preset, opng_bitset_t *output_set)
 {
     opng_bitset_t preset_set;
@@ -1218,7 +1289,7 @@ opng_init_iteration(opng_bitset_t cmdline_set, opng_bitset_t mask_set,
     *output_set = cmdline_set & mask_set;
     if (*output_set == 0 && cmdline_set != 0)
         Throw "Iteration parameter(s) out of range";
-    if (*output_set == 0 || options.optim_level >= 0)
+    if (*output_set == 0 || ctx->options.optim_level >= 0)
     {
         preset_set = opng_rangeset_string_to_bitset(preset, NULL);
         *output_set |= preset_set & mask_set;
@@ -1229,7 +1300,7 @@ opng_init_iteration(opng_bitset_t cmdline_set, opng_bitset_t mask_set,
  * Iteration initialization
  */
 static void
-opng_init_iterations(void)
+opng_init_iterations(struct opng_context *ctx)
 {
     opng_bitset_t compr_level_set, mem_level_set, strategy_set, filter_set;
     opng_bitset_t strategy_singles_set;
@@ -1240,26 +1311,26 @@ opng_init_iterations(void)
      * abandoned, as there will be no need to wait until their completion.
      * This limit may further decrease as iterations go on.
      */
-    if ((process.status & OUTPUT_NEEDS_NEW_IDAT) || options.full)
-        process.max_idat_size = idat_size_max;
+    if ((ctx->process.status & OUTPUT_NEEDS_NEW_IDAT) || ctx->options.full)
+        ctx->process.max_idat_size = idat_size_max;
     else
     {
-        OPNG_ENSURE(process.in_idat_size > 0, "No IDAT in input");
+        OPNG_ENSURE(ctx->process.in_idat_size > 0, "No IDAT in input");
         /* Add the input PLTE and tRNS sizes to the initial max IDAT size,
          * to account for the changes that may occur during reduction.
          * This incurs a negligible overhead on processing only: the final
          * IDAT size will not be affected, because a precise check will be
          * performed at the end, inside opng_finish_iterations().
          */
-        process.max_idat_size =
-            process.in_idat_size + process.in_plte_trns_size;
+        ctx->process.max_idat_size =
+            ctx->process.in_idat_size + ctx->process.in_plte_trns_size;
     }
 
     /* Get preset_index from options.optim_level, but leave the latter intact,
      * because the effect of "optipng -o2 -z... -f..." is slightly different
      * from the effect of "optipng -z... -f..." (without "-o").
      */
-    preset_index = options.optim_level;
+    preset_index = ctx->options.optim_level;
     if (preset_index < 0)
         preset_index = OPNG_OPTIM_LEVEL_DEFAULT;
     else if (preset_index > OPNG_OPTIM_LEVEL_MAX)
@@ -1268,13 +1339,13 @@ opng_init_iterations(void)
     /* Initialize the iteration sets.
      * Combine the user-defined values with the optimization presets.
      */
-    opng_init_iteration(options.compr_level_set, OPNG_COMPR_LEVEL_SET_MASK,
+    opng_init_iteration(ctx, ctx->options.compr_level_set, OPNG_COMPR_LEVEL_SET_MASK,
         presets[preset_index].compr_level, &compr_level_set);
-    opng_init_iteration(options.mem_level_set, OPNG_MEM_LEVEL_SET_MASK,
+    opng_init_iteration(ctx, ctx->options.mem_level_set, OPNG_MEM_LEVEL_SET_MASK,
         presets[preset_index].mem_level, &mem_level_set);
-    opng_init_iteration(options.strategy_set, OPNG_STRATEGY_SET_MASK,
+    opng_init_iteration(ctx, ctx->options.strategy_set, OPNG_STRATEGY_SET_MASK,
         presets[preset_index].strategy, &strategy_set);
-    opng_init_iteration(options.filter_set, OPNG_FILTER_SET_MASK,
+    opng_init_iteration(ctx, ctx->options.filter_set, OPNG_FILTER_SET_MASK,
         presets[preset_index].filter, &filter_set);
 
     /* Replace the empty sets with the libpng's "best guess" heuristics. */
@@ -1282,7 +1353,7 @@ opng_init_iterations(void)
         opng_bitset_set(&compr_level_set, Z_BEST_COMPRESSION);  /* -zc9 */
     if (mem_level_set == 0)
         opng_bitset_set(&mem_level_set, 8);
-    if (image.bit_depth < 8 || image.palette != NULL)
+    if (ctx->image.bit_depth < 8 || ctx->image.palette != NULL)
     {
         if (strategy_set == 0)
             opng_bitset_set(&strategy_set, Z_DEFAULT_STRATEGY);  /* -zs0 */
@@ -1298,61 +1369,180 @@ opng_init_iterations(void)
     }
 
     /* Store the results into process. */
-    process.compr_level_set = compr_level_set;
-    process.mem_level_set = mem_level_set;
-    process.strategy_set = strategy_set;
-    process.filter_set = filter_set;
+    ctx->process.compr_level_set = compr_level_set;
+    ctx->process.mem_level_set = mem_level_set;
+    ctx->process.strategy_set = strategy_set;
+    ctx->process.filter_set = filter_set;
     strategy_singles_set = (1 << Z_HUFFMAN_ONLY) | (1 << Z_RLE);
     t1 = opng_bitset_count(compr_level_set) *
          opng_bitset_count(strategy_set & ~strategy_singles_set);
     t2 = opng_bitset_count(strategy_set & strategy_singles_set);
-    process.num_iterations =
+    ctx->process.num_iterations =
         (t1 + t2) *
         opng_bitset_count(mem_level_set) * opng_bitset_count(filter_set);
-    OPNG_ENSURE(process.num_iterations > 0, "Invalid iteration parameters");
+    OPNG_ENSURE(ctx->process.num_iterations > 0, "Invalid iteration parameters");
+}
+
+/*
+ * A compression trial
+ */
+struct opng_trial
+{
+    int compr_level, mem_level, strategy, filter;
+    osys_fsize_t idat_size, file_size;
+    png_uint_32 plte_trns_size;
+    const char *err_msg;
+};
+
+struct opng_trial_set
+{
+    struct opng_context *ctx;
+    struct opng_trial *trials;
+    osys_fsize_t max_idat_size;  /* shared by the running trials */
+    int completed;  /* trials that have run to the end */
+    size_t *order;  /* order the trials run in, NULL for the iteration order */
+};
+
+#ifdef OPNG_PARALLEL_TRIALS
+/*
+ * Parallel trial
+ * Each trial writes through its own copy of the context, which holds the
+ * libpng structures, the output handler state and the exception context.
+ * Only the IDAT size limit is shared: it drops as the trials complete.
+ * A trial is abandoned only if it is strictly bigger than a completed
+ * one, so all the trials of the smallest size run to the end, and the
+ * selection below picks the same winner as the serial iteration.
+ * Past the time limit, the trials are abandoned once one has completed,
+ * and the winner is the best of those that have.
+ */
+static void
+opng_run_trial(void *arg, size_t i)
+{
+    struct opng_trial_set *set = (struct opng_trial_set *)arg;
+    struct opng_trial *trial = &set->trials[set->order ? set->order[i] : i];
+    struct opng_context trial_ctx = *set->ctx;
+    struct opng_context *ctx = &trial_ctx;
+    const char * volatile err_msg;  /* volatile is required by cexcept */
+    osys_fsize_t max_idat_size;
+
+    ctx->shared_max_idat_size = &set->max_idat_size;
+    ctx->shared_completed = &set->completed;
+    if (opng_trial_stopped(ctx))
+    {
+        /* Not run, it counts as too big. */
+        trial->idat_size = idat_size_max + 1;
+        trial->file_size = ctx->process.out_file_size;
+        trial->plte_trns_size = ctx->process.out_plte_trns_size;
+        trial->err_msg = NULL;
+        return;
+    }
+    Try
+    {
+        opng_write_file(ctx, NULL, trial->compr_level, trial->mem_level,
+                        trial->strategy, trial->filter);
+        err_msg = NULL;
+    }
+    Catch (err_msg)
+    {
+        ctx->process.out_idat_size = idat_size_max + 1;
+    }
+    trial->idat_size = ctx->process.out_idat_size;
+    trial->file_size = ctx->process.out_file_size;
+    trial->plte_trns_size = ctx->process.out_plte_trns_size;
+    trial->err_msg = err_msg;
+
+    if (trial->idat_size > idat_size_max)
+        return;
+    __atomic_add_fetch(&set->completed, 1, __ATOMIC_RELAXED);
+    if (ctx->options.full)
+        return;
+    max_idat_size = OPNG_ATOMIC_LOAD(&set->max_idat_size);
+    while (trial->idat_size < max_idat_size &&
+           !__atomic_compare_exchange_n(&set->max_idat_size, &max_idat_size,
+                                        trial->idat_size, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
 }
 
+/*
+ * Run order of the trials under a time limit: the first trial of every
+ * filter, then the second one, and so on, so that a trial cut short by
+ * the limit doesn't leave a whole filter untried. The trials are listed
+ * filter by filter. Returns NULL if out of memory.
+ */
+static size_t *
+opng_interleave_trials(const struct opng_trial_set *set, int count)
+{
+    size_t *order;
+    int rank, first, i, n;
+
+    order = (size_t *)malloc(count * sizeof(size_t));
+    if (order == NULL)
+        return NULL;
+    n = 0;
+    for (rank = 0; n < count; ++rank)
+    {
+        first = 0;
+        for (i = 0; i < count; ++i)
+        {
+            if (set->trials[i].filter != set->trials[first].filter)
+                first = i;
+            if (i - first == rank)
+                order[n++] = (size_t)i;
+        }
+    }
+    return order;
+}
+#endif
+
 /*
  * Iteration
  */
 static void
-opng_iterate(void)
+opng_iterate(struct opng_context *ctx)
 {
     opng_bitset_t compr_level_set, mem_level_set, strategy_set, filter_set;
     opng_bitset_t saved_compr_level_set;
     int compr_level, mem_level, strategy, filter;
+    struct opng_trial_set set;
+    struct opng_trial *trial;
+    const char * volatile err_msg;  /* volatile is required by cexcept */
     int counter;
+    int parallel;
     int line_reused;
 
-    OPNG_ENSURE(process.num_iterations > 0, "Iterations not initialized");
-    if ((process.num_iterations == 1) &&
-        (process.status & OUTPUT_NEEDS_NEW_IDAT))
+    OPNG_ENSURE(ctx->process.num_iterations > 0, "Iterations not initialized");
+    if ((ctx->process.num_iterations == 1) &&
+        (ctx->process.status & OUTPUT_NEEDS_NEW_IDAT))
     {
        /* We already know this combination will be selected.
         * Do not waste time running it twice.
         */
-       process.best_idat_size = 0;
-       process.best_compr_level = opng_bitset_find_first(process.compr_level_set);
-       process.best_mem_level = opng_bitset_find_first(process.mem_level_set);
-       process.best_strategy = opng_bitset_find_first(process.strategy_set);
-       process.best_filter = opng_bitset_find_first(process.filter_set);
+       ctx->process.best_idat_size = 0;
+       ctx->process.best_compr_level = opng_bitset_find_first(ctx->process.compr_level_set);
+       ctx->process.best_mem_level = opng_bitset_find_first(ctx->process.mem_level_set);
+       ctx->process.best_strategy = opng_bitset_find_first(ctx->process.strategy_set);
+       ctx->process.best_filter = opng_bitset_find_first(ctx->process.filter_set);
        return;
     }
 
     /* Prepare for the big iteration. */
-    compr_level_set = process.compr_level_set;
-    mem_level_set = process.mem_level_set;
-    strategy_set = process.strategy_set;
-    filter_set = process.filter_set;
-    process.best_idat_size = idat_size_max + 1;
-    process.best_compr_level = -1;
-    process.best_mem_level = -1;
-    process.best_strategy = -1;
-    process.best_filter = -1;
-
-    /* Iterate through the "hyper-rectangle" (zc, zm, zs, f). */
-    usr_printf("\nTrying:\n");
-    line_reused = 0;
+    compr_level_set = ctx->process.compr_level_set;
+    mem_level_set = ctx->process.mem_level_set;
+    strategy_set = ctx->process.strategy_set;
+    filter_set = ctx->process.filter_set;
+    ctx->process.best_idat_size = idat_size_max + 1;
+    ctx->process.best_compr_level = -1;
+    ctx->process.best_mem_level = -1;
+    ctx->process.best_strategy = -1;
+    ctx->process.best_filter = -1;
+
+    /* List the "hyper-rectangle" (zc, zm, zs, f) in iteration order. */
+    set.ctx = ctx;
+    set.trials = (struct opng_trial *)
+        malloc(ctx->process.num_iterations * sizeof(struct opng_trial));
+    if (set.trials == NULL)
+        Throw "Out of memory";
     counter = 0;
     for (filter = OPNG_FILTER_MIN;
          filter <= OPNG_FILTER_MAX; ++filter)
@@ -1388,43 +1578,13 @@ opng_iterate(void)
                       {
                          if (opng_bitset_test(mem_level_set, mem_level))
                          {
-                            usr_printf(
-                               "  zc = %d  zm = %d  zs = %d  f = %d",
-                               compr_level, mem_level, strategy, filter);
-                            usr_progress(counter, process.num_iterations);
-                            ++counter;
-                            opng_write_file(NULL,
-                               compr_level, mem_level, strategy, filter);
-                            if (process.out_idat_size > idat_size_max)
-                            {
-                               if (options.verbose)
-                               {
-                                  usr_printf("\t\tIDAT too big\n");
-                                  line_reused = 0;
-                               }
-                               else
-                               {
-                                  usr_print_cntrl('\r');  /* CR: reset line */
-                                  line_reused = 1;
-                               }
-                               continue;
-                            }
-                            usr_printf("\t\tIDAT size = %" OSYS_FSIZE_PRIu
-                                       "\n",
-                                       process.out_idat_size);
-                            line_reused = 0;
-                            if (process.best_idat_size < process.out_idat_size)
-                               continue;
-                            if (process.best_idat_size == process.out_idat_size
-                                && process.best_strategy >= Z_HUFFMAN_ONLY)
-                               continue;  /* it's neither smaller nor faster */
-                            process.best_compr_level = compr_level;
-                            process.best_mem_level   = mem_level;
-                            process.best_strategy    = strategy;
-                            process.best_filter      = filter;
-                            process.best_idat_size   = process.out_idat_size;
-                            if (!options.full)
-                               process.max_idat_size = process.out_idat_size;
+                            OPNG_ENSURE(counter < ctx->process.num_iterations,
+                                        "Inconsistent iteration counter");
+                            trial = &set.trials[counter++];
+                            trial->compr_level = compr_level;
+                            trial->mem_level = mem_level;
+                            trial->strategy = strategy;
+                            trial->filter = filter;
                          }
                       }
                    }
@@ -1434,43 +1594,130 @@ opng_iterate(void)
           }
        }
     }
+    OPNG_ENSURE(counter == ctx->process.num_iterations,
+                "Inconsistent iteration counter");
+
+    /* Run the trials all at once if possible, then go through the
+     * results in iteration order, as if they were run one by one.
+     */
+    parallel = 0;
+#ifdef OPNG_PARALLEL_TRIALS
+    if (ctx->parallel_for != NULL && counter > 1)
+    {
+        set.max_idat_size = ctx->process.max_idat_size;
+        set.completed = 0;
+        set.order = NULL;
+        if (ctx->stop != NULL)
+            set.order = opng_interleave_trials(&set, counter);
+        ctx->parallel_for(opng_run_trial, &set, (size_t)counter);
+        free(set.order);
+        parallel = 1;
+    }
+#endif
+
+    ctx->usr_printf("\nTrying:\n");
+    line_reused = 0;
+    for (counter = 0; counter < ctx->process.num_iterations; ++counter)
+    {
+        trial = &set.trials[counter];
+        ctx->usr_printf(
+           "  zc = %d  zm = %d  zs = %d  f = %d",
+           trial->compr_level, trial->mem_level, trial->strategy,
+           trial->filter);
+        ctx->usr_progress(counter, ctx->process.num_iterations);
+        if (!parallel)
+        {
+            Try
+            {
+                opng_write_file(ctx, NULL,
+                                trial->compr_level, trial->mem_level,
+                                trial->strategy, trial->filter);
+                trial->err_msg = NULL;
+            }
+            Catch (err_msg)
+            {
+                trial->err_msg = err_msg;
+            }
+            trial->idat_size = ctx->process.out_idat_size;
+        }
+        else
+        {
+            /* Leave the output sizes as the serial trial would. */
+            ctx->process.out_idat_size = trial->idat_size;
+            ctx->process.out_file_size = trial->file_size;
+            ctx->process.out_plte_trns_size = trial->plte_trns_size;
+        }
+        if (trial->err_msg != NULL)
+        {
+            free(set.trials);
+            Throw trial->err_msg;
+        }
+        if (trial->idat_size > idat_size_max)
+        {
+           if (ctx->options.verbose)
+           {
+              ctx->usr_printf("\t\tIDAT too big\n");
+              line_reused = 0;
+           }
+           else
+           {
+              ctx->usr_print_cntrl('\r');  /* CR: reset line */
+              line_reused = 1;
+           }
+           continue;
+        }
+        ctx->usr_printf("\t\tIDAT size = %" OSYS_FSIZE_PRIu "\n",
+                        trial->idat_size);
+        line_reused = 0;
+        if (ctx->process.best_idat_size < trial->idat_size)
+           continue;
+        if (ctx->process.best_idat_size == trial->idat_size
+            && ctx->process.best_strategy >= Z_HUFFMAN_ONLY)
+           continue;  /* it's neither smaller nor faster */
+        ctx->process.best_compr_level = trial->compr_level;
+        ctx->process.best_mem_level   = trial->mem_level;
+        ctx->process.best_strategy    = trial->strategy;
+        ctx->process.best_filter      = trial->filter;
+        ctx->process.best_idat_size   = trial->idat_size;
+        if (!ctx->options.full)
+           ctx->process.max_idat_size = trial->idat_size;
+    }
+    free(set.trials);
     if (line_reused)
-        usr_print_cntrl(-31);  /* Minus N: erase N chars from start of line */
+        ctx->usr_print_cntrl(-31);  /* Minus N: erase N chars from start of line */
 
-    OPNG_ENSURE(counter == process.num_iterations,
-                "Inconsistent iteration counter");
-    usr_progress(counter, process.num_iterations);
+    ctx->usr_progress(counter, ctx->process.num_iterations);
 }
 
 /*
  * Iteration finalization
  */
 static void
-opng_finish_iterations(void)
+opng_finish_iterations(struct opng_context *ctx)
 {
-    if (process.best_idat_size + process.out_plte_trns_size <
-        process.in_idat_size + process.in_plte_trns_size)
-        process.status |= OUTPUT_NEEDS_NEW_IDAT;
-    if (process.status & OUTPUT_NEEDS_NEW_IDAT)
+    if (ctx->process.best_idat_size + ctx->process.out_plte_trns_size <
+        ctx->process.in_idat_size + ctx->process.in_plte_trns_size)
+        ctx->process.status |= OUTPUT_NEEDS_NEW_IDAT;
+    if (ctx->process.status & OUTPUT_NEEDS_NEW_IDAT)
     {
-        if (process.best_idat_size <= idat_size_max)
+        if (ctx->process.best_idat_size <= idat_size_max)
         {
-            usr_printf("\nSelecting parameters:\n");
-            usr_printf("  zc = %d  zm = %d  zs = %d  f = %d",
-                       process.best_compr_level, process.best_mem_level,
-                       process.best_strategy, process.best_filter);
-            if (process.best_idat_size > 0)
+            ctx->usr_printf("\nSelecting parameters:\n");
+            ctx->usr_printf("  zc = %d  zm = %d  zs = %d  f = %d",
+                       ctx->process.best_compr_level, ctx->process.best_mem_level,
+                       ctx->process.best_strategy, ctx->process.best_filter);
+            if (ctx->process.best_idat_size > 0)
             {
                 /* At least one trial has been run. */
-                usr_printf("\t\tIDAT size = %" OSYS_FSIZE_PRIu,
-                           process.best_idat_size);
+                ctx->usr_printf("\t\tIDAT size = %" OSYS_FSIZE_PRIu,
+                           ctx->process.best_idat_size);
             }
-            usr_printf("\n");
+            ctx->usr_printf("\n");
         }
         else
         {
             /* The compressed image data is larger than the maximum allowed. */
-            usr_printf("  zc = *  zm = *  zs = *  f = *\t\tIDAT size > %s\n",
+            ctx->usr_printf("  zc = *  zm = *  zs = *  f = *\t\tIDAT size > %s\n",
                        idat_size_max_string);
         }
     }
@@ -1480,18 +1727,18 @@ opng_finish_iterations(void)
  * Image file optimization
  */
 static void
-opng_optimize_impl(const char *infile_name)
+opng_optimize_impl(struct opng_context *ctx, const char *infile_name)
 {
-    static FILE *infile, *outfile;         /* static or volatile is required */
-    static const char *infile_name_local;                      /* by cexcept */
-    static const char *outfile_name, *bakfile_name;
-    static int new_outfile, has_backup;
+    FILE * volatile infile, * volatile outfile;  /* volatile is required */
+    const char * volatile infile_name_local;                /* by cexcept */
+    const char * volatile outfile_name, * volatile bakfile_name;
+    volatile int new_outfile, has_backup;
     char name_buf[FILENAME_MAX], tmp_buf[FILENAME_MAX];
     const char * volatile err_msg;
 
-    memset(&process, 0, sizeof(process));
-    if (options.force)
-        process.status |= OUTPUT_NEEDS_NEW_IDAT;
+    memset(&ctx->process, 0, sizeof(ctx->process));
+    if (ctx->options.force)
+        ctx->process.status |= OUTPUT_NEEDS_NEW_IDAT;
 
     err_msg = NULL;  /* prepare for error handling */
 
@@ -1500,7 +1747,7 @@ opng_optimize_impl(const char *infile_name)
         Throw "Can't open the input file";
     Try
     {
-        opng_read_file(infile);
+        opng_read_file(ctx, infile);
     }
     Catch (err_msg)
     {
@@ -1511,85 +1758,85 @@ opng_optimize_impl(const char *infile_name)
         Throw err_msg;  /* rethrow */
 
     /* Check the error flag. This must be the first check. */
-    if (process.status & INPUT_HAS_ERRORS)
+    if (ctx->process.status & INPUT_HAS_ERRORS)
     {
-        usr_printf("Recoverable errors found in input.");
-        if (options.fix)
+        ctx->usr_printf("Recoverable errors found in input.");
+        if (ctx->options.fix)
         {
-            usr_printf(" Fixing...\n");
-            process.status |= OUTPUT_NEEDS_NEW_FILE;
+            ctx->usr_printf(" Fixing...\n");
+            ctx->process.status |= OUTPUT_NEEDS_NEW_FILE;
         }
         else
         {
-            usr_printf(" Rerun " PROGRAM_NAME " with -fix enabled.\n");
+            ctx->usr_printf(" Rerun " PROGRAM_NAME " with -fix enabled.\n");
             Throw "Previous error(s) not fixed";
         }
     }
 
     /* Check the junk flag. */
-    if (process.status & INPUT_HAS_JUNK)
-        process.status |= OUTPUT_NEEDS_NEW_FILE;
+    if (ctx->process.status & INPUT_HAS_JUNK)
+        ctx->process.status |= OUTPUT_NEEDS_NEW_FILE;
 
     /* Check the PNG signature and datastream flags. */
-    if (!(process.status & INPUT_HAS_PNG_SIGNATURE))
-        process.status |= OUTPUT_NEEDS_NEW_FILE;
-    if (process.status & INPUT_HAS_PNG_DATASTREAM)
+    if (!(ctx->process.status & INPUT_HAS_PNG_SIGNATURE))
+        ctx->process.status |= OUTPUT_NEEDS_NEW_FILE;
+    if (ctx->process.status & INPUT_HAS_PNG_DATASTREAM)
     {
-        if (options.nz && (process.status & OUTPUT_NEEDS_NEW_IDAT))
+        if (ctx->options.nz && (ctx->process.status & OUTPUT_NEEDS_NEW_IDAT))
         {
-            usr_printf(
+            ctx->usr_printf(
                 "IDAT recoding is necessary, but is disabled by the user.\n");
             Throw "Can't continue";
         }
     }
     else
-        process.status |= OUTPUT_NEEDS_NEW_IDAT;
+        ctx->process.status |= OUTPUT_NEEDS_NEW_IDAT;
 
     /* Check the digital signature flag. */
-    if (process.status & INPUT_HAS_DIGITAL_SIGNATURE)
+    if (ctx->process.status & INPUT_HAS_DIGITAL_SIGNATURE)
     {
-        usr_printf("Digital signature found in input.");
-        if (options.force)
+        ctx->usr_printf("Digital signature found in input.");
+        if (ctx->options.force)
         {
-            usr_printf(" Erasing...\n");
-            process.status |= OUTPUT_NEEDS_NEW_FILE;
+            ctx->usr_printf(" Erasing...\n");
+            ctx->process.status |= OUTPUT_NEEDS_NEW_FILE;
         }
         else
         {
-            usr_printf(" Rerun " PROGRAM_NAME " with -force enabled.\n");
+            ctx->usr_printf(" Rerun " PROGRAM_NAME " with -force enabled.\n");
             Throw "Can't optimize digitally-signed files";
         }
     }
 
     /* Check the multi-image flag. */
-    if (process.status & INPUT_HAS_MULTIPLE_IMAGES)
+    if (ctx->process.status & INPUT_HAS_MULTIPLE_IMAGES)
     {
-        if (!options.snip && !(process.status & INPUT_IS_PNG_FILE))
+        if (!ctx->options.snip && !(ctx->process.status & INPUT_IS_PNG_FILE))
         {
-            usr_printf("Conversion to PNG requires snipping. "
+            ctx->usr_printf("Conversion to PNG requires snipping. "
                        "Rerun " PROGRAM_NAME " with -snip enabled.\n");
             Throw "Incompatible input format";
         }
     }
-    if ((process.status & INPUT_HAS_APNG) && options.snip)
-        process.status |= OUTPUT_NEEDS_NEW_FILE;
+    if ((ctx->process.status & INPUT_HAS_APNG) && ctx->options.snip)
+        ctx->process.status |= OUTPUT_NEEDS_NEW_FILE;
 
     /* Check the stripped-data flag. */
-    if (process.status & INPUT_HAS_STRIPPED_DATA)
-        usr_printf("Stripping metadata...\n");
+    if (ctx->process.status & INPUT_HAS_STRIPPED_DATA)
+        ctx->usr_printf("Stripping metadata...\n");
 
     /* Initialize the output file name. */
     outfile_name = NULL;
-    if (!(process.status & INPUT_IS_PNG_FILE))
+    if (!(ctx->process.status & INPUT_IS_PNG_FILE))
     {
         if (osys_path_chext(name_buf, sizeof(name_buf),
                             infile_name_local, ".png") == NULL)
             Throw "Can't create the output file (name too long)";
         outfile_name = name_buf;
     }
-    if (options.out_name != NULL)
-        outfile_name = options.out_name;  /* override the old name */
-    if (options.dir_name != NULL)
+    if (ctx->options.out_name != NULL)
+        outfile_name = ctx->options.out_name;  /* override the old name */
+    if (ctx->options.dir_name != NULL)
     {
         const char *tmp_name;
         if (outfile_name != NULL)
@@ -1600,7 +1847,7 @@ opng_optimize_impl(const char *infile_name)
         else
             tmp_name = infile_name_local;
         if (osys_path_chdir(name_buf, sizeof(name_buf), tmp_name,
-                            options.dir_name) == NULL)
+                            ctx->options.dir_name) == NULL)
             Throw "Can't create the output file (name too long)";
         outfile_name = name_buf;
     }
@@ -1641,69 +1888,69 @@ opng_optimize_impl(const char *infile_name)
     if (bakfile_name == NULL)
         Throw "Can't create backup file (name too long)";
     /* Check the backup file before engaging into lengthy trials. */
-    if (!options.simulate && osys_test(outfile_name, "e") == 0)
+    if (!ctx->options.simulate && osys_test(outfile_name, "e") == 0)
     {
-        if (new_outfile && !options.backup && !options.clobber)
+        if (new_outfile && !ctx->options.backup && !ctx->options.clobber)
         {
-            usr_printf("The output file exists. "
+            ctx->usr_printf("The output file exists. "
                        "Rerun " PROGRAM_NAME " with -backup enabled.\n");
             Throw "Can't overwrite the output file";
         }
         if (osys_test(outfile_name, "fw") != 0 ||
-            (!options.clobber && osys_test(bakfile_name, "e") == 0))
+            (!ctx->options.clobber && osys_test(bakfile_name, "e") == 0))
             Throw "Can't back up the existing output file";
     }
 
     /* Display the input IDAT/file sizes. */
-    if (process.status & INPUT_HAS_PNG_DATASTREAM)
-        usr_printf("Input IDAT size = %" OSYS_FSIZE_PRIu " bytes\n",
-                   process.in_idat_size);
-    usr_printf("Input file size = %" OSYS_FSIZE_PRIu " bytes\n",
-               process.in_file_size);
+    if (ctx->process.status & INPUT_HAS_PNG_DATASTREAM)
+        ctx->usr_printf("Input IDAT size = %" OSYS_FSIZE_PRIu " bytes\n",
+                   ctx->process.in_idat_size);
+    ctx->usr_printf("Input file size = %" OSYS_FSIZE_PRIu " bytes\n",
+               ctx->process.in_file_size);
 
     /* Find the best parameters and see if it's worth recompressing. */
-    if (!options.nz || (process.status & OUTPUT_NEEDS_NEW_IDAT))
+    if (!ctx->options.nz || (ctx->process.status & OUTPUT_NEEDS_NEW_IDAT))
     {
-        opng_init_iterations();
-        opng_iterate();
-        opng_finish_iterations();
+        opng_init_iterations(ctx);
+        opng_iterate(ctx);
+        opng_finish_iterations(ctx);
     }
-    if (process.status & OUTPUT_NEEDS_NEW_IDAT)
+    if (ctx->process.status & OUTPUT_NEEDS_NEW_IDAT)
     {
-        process.status |= OUTPUT_NEEDS_NEW_FILE;
-        opng_check_idat_size(process.best_idat_size);
+        ctx->process.status |= OUTPUT_NEEDS_NEW_FILE;
+        opng_check_idat_size(ctx, ctx->process.best_idat_size);
     }
 
     /* Stop here? */
-    if (!(process.status & OUTPUT_NEEDS_NEW_FILE))
+    if (!(ctx->process.status & OUTPUT_NEEDS_NEW_FILE))
     {
-        usr_printf("\n%s is already optimized.\n", infile_name_local);
+        ctx->usr_printf("\n%s is already optimized.\n", infile_name_local);
         if (!new_outfile)
             return;
     }
-    if (options.simulate)
+    if (ctx->options.simulate)
     {
-        usr_printf("\nNo output: simulation mode.\n");
+        ctx->usr_printf("\nNo output: simulation mode.\n");
         return;
     }
 
     /* Make room for the output file. */
     if (new_outfile)
     {
-        usr_printf("\nOutput file: %s\n", outfile_name);
-        if (options.dir_name != NULL)
-            osys_create_dir(options.dir_name);
+        ctx->usr_printf("\nOutput file: %s\n", outfile_name);
+        if (ctx->options.dir_name != NULL)
+            osys_create_dir(ctx->options.dir_name);
         has_backup = 0;
         if (osys_test(outfile_name, "e") == 0)
         {
-            if (osys_rename(outfile_name, bakfile_name, options.clobber) != 0)
+            if (osys_rename(outfile_name, bakfile_name, ctx->options.clobber) != 0)
                 Throw "Can't back up the output file";
             has_backup = 1;
         }
     }
     else
     {
-        if (osys_rename(infile_name_local, bakfile_name, options.clobber) != 0)
+        if (osys_rename(infile_name_local, bakfile_name, ctx->options.clobber) != 0)
             Throw "Can't back up the input file";
         has_backup = 1;
     }
@@ -1713,12 +1960,12 @@ opng_optimize_impl(const char *infile_name)
     {
         if (outfile == NULL)
             Throw "Can't open the output file";
-        if (process.status & OUTPUT_NEEDS_NEW_IDAT)
+        if (ctx->process.status & OUTPUT_NEEDS_NEW_IDAT)
         {
             /* Write a brand new PNG datastream to the output. */
-            opng_write_file(outfile,
-                process.best_compr_level, process.best_mem_level,
-                process.best_strategy, process.best_filter);
+            opng_write_file(ctx, outfile,
+                ctx->process.best_compr_level, ctx->process.best_mem_level,
+                ctx->process.best_strategy, ctx->process.best_filter);
         }
         else
         {
@@ -1729,12 +1976,12 @@ opng_optimize_impl(const char *infile_name)
                 Throw "Can't reopen the input file";
             Try
             {
-                if (process.in_datastream_offset > 0 &&
-                    osys_fseeko(infile, process.in_datastream_offset,
+                if (ctx->process.in_datastream_offset > 0 &&
+                    osys_fseeko(infile, ctx->process.in_datastream_offset,
                                  SEEK_SET) != 0)
                     Throw "Can't reposition the input file";
-                process.best_idat_size = process.in_idat_size;
-                opng_copy_file(infile, outfile);
+                ctx->process.best_idat_size = ctx->process.in_idat_size;
+                opng_copy_file(ctx, infile, outfile);
             }
             Catch (err_msg)
             {
@@ -1756,7 +2003,7 @@ opng_optimize_impl(const char *infile_name)
             if (osys_rename(bakfile_name,
                             (new_outfile ? outfile_name : infile_name_local),
                             1) != 0)
-                opng_print_warning(
+                opng_print_warning(ctx, 
                     "Can't recover the original file from backup");
         }
         else
@@ -1764,7 +2011,7 @@ opng_optimize_impl(const char *infile_name)
             OPNG_ENSURE(new_outfile,
                         "Overwrote input with no temporary backup");
             if (osys_unlink(outfile_name) != 0)
-                opng_print_warning("Can't remove the broken output file");
+                opng_print_warning(ctx, "Can't remove the broken output file");
         }
         Throw err_msg;  /* rethrow */
     }
@@ -1774,133 +2021,209 @@ opng_optimize_impl(const char *infile_name)
     /* Preserve file attributes (e.g. ownership, access rights, time stamps)
      * on request, if possible.
      */
-    if (options.preserve)
+    if (ctx->options.preserve)
         osys_copy_attr((new_outfile ? infile_name_local : bakfile_name),
                        outfile_name);
 
     /* Remove the backup file if it is not needed. */
-    if (!new_outfile && !options.backup)
+    if (!new_outfile && !ctx->options.backup)
     {
         if (osys_unlink(bakfile_name) != 0)
-            opng_print_warning("Can't remove the backup file");
+            opng_print_warning(ctx, "Can't remove the backup file");
     }
 
     /* Display the output IDAT/file sizes. */
-    usr_printf("\nOutput IDAT size = %" OSYS_FSIZE_PRIu " bytes",
-               process.out_idat_size);
-    if (process.status & INPUT_HAS_PNG_DATASTREAM)
-    {
-        usr_printf(" (");
-        opng_print_fsize_difference(process.in_idat_size,
-                                    process.out_idat_size, 0);
-        usr_printf(")");
-    }
-    usr_printf("\nOutput file size = %" OSYS_FSIZE_PRIu " bytes (",
-               process.out_file_size);
-    opng_print_fsize_difference(process.in_file_size,
-                                process.out_file_size, 1);
-    usr_printf(")\n");
+    ctx->usr_printf("\nOutput IDAT size = %" OSYS_FSIZE_PRIu " bytes",
+               ctx->process.out_idat_size);
+    if (ctx->process.status & INPUT_HAS_PNG_DATASTREAM)
+    {
+        ctx->usr_printf(" (");
+        opng_print_fsize_difference(ctx, ctx->process.in_idat_size,
+                                    ctx->process.out_idat_size, 0);
+        ctx->usr_printf(")");
+    }
+    ctx->usr_printf("\nOutput file size = %" OSYS_FSIZE_PRIu " bytes (",
+               ctx->process.out_file_size);
+    opng_print_fsize_difference(ctx, ctx->process.in_file_size,
+                                ctx->process.out_file_size, 1);
+    ctx->usr_printf(")\n");
 }
 
 /*
  * Engine initialization
  */
-int
-opng_initialize(const struct opng_options *init_options,
-                const struct opng_ui *init_ui)
+static int
+opng_init_context(struct opng_context *ctx,
+                  const struct opng_options *init_options,
+                  const struct opng_ui *init_ui)
 {
+    memset(ctx, 0, sizeof(*ctx));
+
     /* Initialize and check the validity of the user interface. */
-    usr_printf      = init_ui->printf_fn;
-    usr_print_cntrl = init_ui->print_cntrl_fn;
-    usr_progress    = init_ui->progress_fn;
-    usr_panic       = init_ui->panic_fn;
-    if (usr_printf == NULL      ||
-        usr_print_cntrl == NULL ||
-        usr_progress == NULL    ||
-        usr_panic == NULL)
+    ctx->usr_printf      = init_ui->printf_fn;
+    ctx->usr_print_cntrl = init_ui->print_cntrl_fn;
+    ctx->usr_progress    = init_ui->progress_fn;
+    ctx->usr_panic       = init_ui->panic_fn;
+    if (ctx->usr_printf == NULL      ||
+        ctx->usr_print_cntrl == NULL ||
+        ctx->usr_progress == NULL    ||
+        ctx->usr_panic == NULL)
        return -1;
 
     /* Initialize and adjust the user options. */
-    options = *init_options;
-    if (options.optim_level == 0)
+    ctx->options = *init_options;
+    if (ctx->options.optim_level == 0)
     {
-        options.nb = options.nc = options.np = 1;
-        options.nz = 1;
+        ctx->options.nb = ctx->options.nc = ctx->options.np = 1;
+        ctx->options.nz = 1;
     }
 
     /* Start the engine. */
-    memset(&summary, 0, sizeof(summary));
-    engine.started = 1;
+    ctx->engine.started = 1;
     return 0;
 }
 
+struct opng_context *
+opng_create_context(const struct opng_options *init_options,
+                    const struct opng_ui *init_ui)
+{
+    struct opng_context *ctx;
+
+    ctx = (struct opng_context *)malloc(sizeof(*ctx));
+    if (ctx == NULL)
+        return NULL;
+    if (opng_init_context(ctx, init_options, init_ui) != 0)
+    {
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
 /*
  * Engine execution
  */
 int
-opng_optimize(const char *infile_name)
+opng_optimize_file(struct opng_context *ctx, const char *infile_name)
 {
     const char *err_msg;
     volatile int result;  /* volatile not needed, but keeps compilers happy */
 
-    OPNG_ENSURE(engine.started, "The OptiPNG engine is not running");
+    OPNG_ENSURE(ctx->engine.started, "The OptiPNG engine is not running");
 
-    usr_printf("** Processing: %s\n", infile_name);
-    ++summary.file_count;
-    opng_clear_image_info();
+    ctx->usr_printf("** Processing: %s\n", infile_name);
+    ++ctx->summary.file_count;
+    opng_clear_image_info(ctx);
     Try
     {
-        opng_optimize_impl(infile_name);
-        if (process.status & INPUT_HAS_ERRORS)
+        opng_optimize_impl(ctx, infile_name);
+        if (ctx->process.status & INPUT_HAS_ERRORS)
         {
-            ++summary.err_count;
-            ++summary.fix_count;
+            ++ctx->summary.err_count;
+            ++ctx->summary.fix_count;
         }
-        if (process.status & INPUT_HAS_MULTIPLE_IMAGES)
+        if (ctx->process.status & INPUT_HAS_MULTIPLE_IMAGES)
         {
-            if (options.snip)
-                ++summary.snip_count;
+            if (ctx->options.snip)
+                ++ctx->summary.snip_count;
         }
         result = 0;
     }
     Catch (err_msg)
     {
-        ++summary.err_count;
-        opng_print_error(err_msg);
+        ++ctx->summary.err_count;
+        opng_print_error(ctx, err_msg);
         result = -1;
     }
-    opng_destroy_image_info();
-    usr_printf("\n");
+    opng_destroy_image_info(ctx);
+    ctx->usr_printf("\n");
     return result;
 }
 
 /*
  * Engine finalization
  */
-int
-opng_finalize(void)
+static int
+opng_finalize_context(struct opng_context *ctx)
 {
     /* Print the status report. */
-    if (options.verbose || summary.snip_count > 0 || summary.err_count > 0)
+    if (ctx->options.verbose ||
+        ctx->summary.snip_count > 0 || ctx->summary.err_count > 0)
     {
-        usr_printf("** Status report\n");
-        usr_printf("%u file(s) have been processed.\n", summary.file_count);
-        if (summary.snip_count > 0)
+        ctx->usr_printf("** Status report\n");
+        ctx->usr_printf("%u file(s) have been processed.\n",
+                        ctx->summary.file_count);
+        if (ctx->summary.snip_count > 0)
         {
-            usr_printf("%u multi-image file(s) have been snipped.\n",
-                       summary.snip_count);
+            ctx->usr_printf("%u multi-image file(s) have been snipped.\n",
+                            ctx->summary.snip_count);
         }
-        if (summary.err_count > 0)
+        if (ctx->summary.err_count > 0)
         {
-            usr_printf("%u error(s) have been encountered.\n",
-                       summary.err_count);
-            if (summary.fix_count > 0)
-                usr_printf("%u erroneous file(s) have been fixed.\n",
-                           summary.fix_count);
+            ctx->usr_printf("%u error(s) have been encountered.\n",
+                            ctx->summary.err_count);
+            if (ctx->summary.fix_count > 0)
+                ctx->usr_printf("%u erroneous file(s) have been fixed.\n",
+                                ctx->summary.fix_count);
         }
     }
 
     /* Stop the engine. */
-    engine.started = 0;
+    ctx->engine.started = 0;
     return 0;
 }
+
+void
+opng_destroy_context(struct opng_context *ctx)
+{
+    if (ctx == NULL)
+        return;
+    if (ctx->engine.started)
+        opng_finalize_context(ctx);
+    free(ctx);
+}
+
+/*
+ * Parallel trial execution
+ */
+void
+opng_set_parallel_for(struct opng_context *ctx,
+                      opng_parallel_for_fn *parallel_for)
+{
+    ctx->parallel_for = parallel_for;
+}
+
+/*
+ * Time limit of the parallel trials
+ */
+void
+opng_set_stop(struct opng_context *ctx,
+              opng_stop_fn *stop, void *stop_arg)
+{
+    ctx->stop = stop;
+    ctx->stop_arg = stop_arg;
+}
+
+/*
+ * The single-context interface, kept for the command-line program
+ */
+static struct opng_context default_context;
+
+int
+opng_initialize(const struct opng_options *init_options,
+                const struct opng_ui *init_ui)
+{
+    return opng_init_context(&default_context, init_options, init_ui);
+}
+
+int
+opng_optimize(const char *infile_name)
+{
+    return opng_optimize_file(&default_context, infile_name);
+}
+
+int
+opng_finalize(void)
+{
+    return opng_finalize_context(&default_context);
+}
@@ -11,6 +11,8 @@
 #ifndef OPTIPNG_H
 #define OPTIPNG_H
 
+#include <stddef.h>
+
 #include "bitset.h"
 
 
@@ -67,8 +69,61 @@ struct opng_ui
 };
 
 
+/*
+ * Engine context
+ * Each context holds its own optimization state, so that independent
+ * contexts can be used concurrently from different threads.
+ */
+struct opng_context;
+
+/*
+ * Context creation; returns NULL on invalid user interface or no memory
+ */
+struct opng_context *opng_create_context(const struct opng_options *options,
+                                         const struct opng_ui *ui);
+
+/*
+ * Context execution
+ */
+int opng_optimize_file(struct opng_context *ctx, const char *infile_name);
+
+/*
+ * Context destruction, printing the status report
+ */
+void opng_destroy_context(struct opng_context *ctx);
+
+/*
+ * Parallel trial execution
+ * The function must call run(arg, i) for every i in [0, n) and return
+ * once all calls are done; they may run concurrently. Without it, the
+ * compression trials run one after the other.
+ */
+typedef void opng_parallel_for_fn(void (*run)(void *arg, size_t i),
+                                  void *arg, size_t n);
+
+void opng_set_parallel_for(struct opng_context *ctx,
+                           opng_parallel_for_fn *parallel_for);
+
+/*
+ * Time limit of the parallel trials
+ * Once stop(arg) returns nonzero, the trials that are left are abandoned
+ * as soon as one of them has completed, and the best completed trial is
+ * selected. With OPNG_STOP_ALL they are all abandoned at once, the input
+ * IDAT is kept. The trials of the different filters then run interleaved,
+ * so that all of them get tried early. The function may be called from
+ * several threads at once.
+ */
+typedef int opng_stop_fn(void *arg);
+
+#define OPNG_STOP_ALL 2
+
+void opng_set_stop(struct opng_context *ctx,
+                   opng_stop_fn *stop, void *stop_arg);
+
+
 /*
  * Engine initialization
+ * The functions below drive a single built-in context.
  */
 int opng_initialize(const struct opng_options *options,
                     const struct opng_ui *ui);
@@ -5,13 +5,13 @@ from setuptools import setup, Extension, Command
 from distutils.command import build_py, build_ext, clean
 from distutils.util import get_platform
 
-WITH_OPTIPNG = False
+WITH_OPTIPNG = True
 WITH_ADVANCECOMP = True
 WITH_MC_OPNG = True
 BASE_DIR = os.path.dirname(os.path.abspath(__file__))
 
 libraries = []
-all_sources = ['src/main.c']
+all_sources = ['src/main.c', 'src/pool.cc', 'src/filter.cc', 'src/palette.cc', 'src/zcache.cc', 'src/arena.cc', 'src/stop.cc']
 defines = [
           ('PACKAGE', '"pyoptipng"'),
           ('VERSION', '"0.1.0"'),
@@ -25,8 +25,9 @@ defines = [
           ('HAVE_VSNPRINTF', None),
           ('USE_ERROR_SILENT', None),
           ('HAVE_GETOPT', None),
+          ('PYOPTIPNG_FILTER_KERNELS', None),
           ]
-include_dirs = []
+include_dirs = [os.path.join(BASE_DIR, 'src')]
 
 if WITH_OPTIPNG:
     defines += [('PYOPTIPNG_WITH_OPTIPNG', None)]
@@ -35,19 +36,6 @@ if WITH_OPTIPNG:
       'optipng/src/opngreduc/opngreduc.c',
       'optipng/src/optipng/ratio.c',
       'optipng/src/optipng/osys.c',
-      'optipng/src/libpng/png.c',
-      'optipng/src/libpng/pngread.c',
-      'optipng/src/libpng/pngwrite.c',
-      'optipng/src/libpng/pngerror.c',
-      'optipng/src/libpng/pngrutil.c',
-      'optipng/src/libpng/pngmem.c',
-      'optipng/src/libpng/pngwutil.c',
-      'optipng/src/libpng/pngtrans.c',
-      'optipng/src/libpng/pngrtran.c',
-      'optipng/src/libpng/pngwio.c',
-      'optipng/src/libpng/pngget.c',
-      'optipng/src/libpng/pngrio.c',
-      'optipng/src/libpng/pngset.c',
       'optipng/src/pngxtern/pngxmem.c',
       'optipng/src/pngxtern/pngxread.c',
       'optipng/src/pngxtern/pngxrbmp.c',
@@ -61,16 +49,45 @@ if WITH_OPTIPNG:
       'optipng/src/pngxtern/pngxset.c',
       'optipng/src/pnmio/pnmin.c',
       'optipng/src/pnmio/pnmutil.c']
+    # With mc_opng, optipng links against its libpng and zlib instead
+    if not WITH_MC_OPNG:
+      all_sources += [
+        'optipng/src/libpng/png.c',
+        'optipng/src/libpng/pngread.c',
+        'optipng/src/libpng/pngwrite.c',
+        'optipng/src/libpng/pngerror.c',
+        'optipng/src/libpng/pngrutil.c',
+        'optipng/src/libpng/pngmem.c',
+        'optipng/src/libpng/pngwutil.c',
+        'optipng/src/libpng/pngtrans.c',
+        'optipng/src/libpng/pngrtran.c',
+        'optipng/src/libpng/pngwio.c',
+        'optipng/src/libpng/pngget.c',
+        'optipng/src/libpng/pngrio.c',
+        'optipng/src/libpng/pngset.c',
+        'optipng/src/zlib/inflate.c',
+        'optipng/src/zlib/zutil.c',
+        'optipng/src/zlib/inffast.c',
+        'optipng/src/zlib/inftrees.c',
+        'optipng/src/zlib/deflate.c',
+        'optipng/src/zlib/trees.c',
+        'optipng/src/zlib/adler32.c',
+        'optipng/src/zlib/crc32.c',
+        'optipng/src/zlib/compress.c',
+        'optipng/src/zlib/uncompr.c',
+        ]
     include_dirs += [os.path.join(BASE_DIR, 'optipng', 'src', 'optipng'),
                      os.path.join(BASE_DIR, 'optipng', 'src', 'opngreduc'),
                      os.path.join(BASE_DIR, 'optipng', 'src', 'pngxtern'),
                      os.path.join(BASE_DIR, 'optipng', 'src', 'cexcept'),
-                     os.path.join(BASE_DIR, 'optipng', 'src', 'zlib'),
                      os.path.join(BASE_DIR, 'optipng', 'src', 'gifread'),
                      os.path.join(BASE_DIR, 'optipng', 'src', 'pnmio'),
                      os.path.join(BASE_DIR, 'optipng', 'src', 'minitiff'),
-                     os.path.join(BASE_DIR, 'optipng', 'src', 'libpng')
                      ]
+    if not WITH_MC_OPNG:
+      include_dirs += [os.path.join(BASE_DIR, 'optipng', 'src', 'zlib'),
+                       os.path.join(BASE_DIR, 'optipng', 'src', 'libpng')
+                       ]
 
 if WITH_ADVANCECOMP:
     defines += [('PYOPTIPNG_WITH_ADVANCECOMP', None)]
@@ -109,8 +126,10 @@ if WITH_ADVANCECOMP:
       'advancecomp/7z/LSBFEncoder.cc',
       'advancecomp/7z/CRC.cc',
       'advancecomp/libdeflate/deflate_compress.c',
+      'advancecomp/libdeflate/deflate_decompress.c',
       'advancecomp/libdeflate/aligned_malloc.c',
       'advancecomp/libdeflate/zlib_compress.c',
+      'advancecomp/libdeflate/zlib_decompress.c',
       'advancecomp/libdeflate/adler32.c',
       'advancecomp/libdeflate/x86_cpu_features.c']
     include_dirs += [os.path.join(BASE_DIR, 'advancecomp')]
@@ -118,6 +137,7 @@ if WITH_ADVANCECOMP:
 if WITH_MC_OPNG:
     defines += [
       ('PYOPTIPNG_WITH_MC_OPNG', None),
+      ('PNG_INTEL_SSE', None),
       ]
     all_sources += ['src/mc_opng.cc',
       'libpng/png.c',
@@ -134,17 +154,26 @@ if WITH_MC_OPNG:
       'libpng/pngget.c',
       'libpng/pngrio.c',
       'libpng/pngset.c',
+      'libpng/intel/intel_init.c',
+      'libpng/intel/filter_sse2_intrinsics.c',
+      'libpng/arm/arm_init.c',
+      'libpng/arm/filter_neon_intrinsics.c',
       'zlib/inflate.c',
       'zlib/zutil.c',
       'zlib/inffast.c',
       'zlib/inftrees.c',
+      'zlib/deflate.c',
+      'zlib/trees.c',
+      'zlib/adler32.c',
+      'zlib/crc32.c',
+      'zlib/compress.c',
+      'zlib/uncompr.c',
       ]
     if not WITH_OPTIPNG:
       all_sources += [
         'optipng/src/opngreduc/opngreduc.c',
         ]
     include_dirs += [
-      os.path.join(BASE_DIR, 'src'),
       os.path.join(BASE_DIR, 'libpng'),
       os.path.join(BASE_DIR, 'zlib'),
       os.path.join(BASE_DIR, 'optipng', 'src', 'opngreduc'),
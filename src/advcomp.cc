@@ -1,3 +1,4 @@
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
 #include "portable.h"
@@ -9,8 +10,14 @@
 
 #include "lib/endianrw.h"
 
+#include "pool.h"
+#include "palette.h"
+#include "advcomp.h"
+#include "stop.h"
+
 #include <iostream>
 #include <iomanip>
+#include <climits>
 
 using namespace std;
 
@@ -21,20 +28,17 @@ bool opt_crc;
 
 bool reduce_image(unsigned char** out_ptr, unsigned* out_scanline, unsigned char* pal_ptr, unsigned* pal_count, unsigned char* palrns_ptr, unsigned *palrns_count, unsigned width, unsigned height, unsigned char* img_ptr, unsigned img_scanline, const unsigned char* rns_ptr, unsigned rns_size)
 {
-    unsigned char col_ptr[256*3];
-    unsigned col_count;
-    unsigned i, j, k;
+    color_set colors;
+    unsigned i;
     unsigned char* new_ptr;
     unsigned new_scanline;
 
-    col_count = 0;
+    color_set_init(&colors);
 
     if (rns_ptr != 0 && rns_size == 6) {
         /* assume 8 bits per pixel */
-        col_count = 1;
-        col_ptr[0] = rns_ptr[1];
-        col_ptr[1] = rns_ptr[3];
-        col_ptr[2] = rns_ptr[5];
+        unsigned char rns_color[3] = { rns_ptr[1], rns_ptr[3], rns_ptr[5] };
+        color_set_add(&colors, color_set_key(rns_color, 3));
 
         *palrns_count = 1;
         palrns_ptr[0] = 0x0;
@@ -45,42 +49,213 @@ bool reduce_image(unsigned char** out_ptr, unsigned* out_scanline, unsigned char
     new_scanline = width;
     new_ptr = data_alloc(height * new_scanline);
 
+    // the colors are numbered in order of appearance, the pixels get their index
     for(i=0;i<height;++i) {
-        unsigned char* p0 = img_ptr + i * img_scanline;
-        unsigned char* p1 = new_ptr + i * new_scanline;
-        for(j=0;j<width;++j) {
-            for(k=0;k<col_count;++k) {
-                if (col_ptr[k*3] == p0[0] && col_ptr[k*3+1] == p0[1] && col_ptr[k*3+2] == p0[2])
-                    break;
-            }
-            if (k == col_count) {
-                if (col_count == 256) {
-                    data_free(new_ptr);
-                    return false; /* too many colors */
-                }
-                col_ptr[col_count*3] = p0[0];
-                col_ptr[col_count*3+1] = p0[1];
-                col_ptr[col_count*3+2] = p0[2];
-                ++col_count;
-            }
-            *p1 = k;
-            ++p1;
-            p0 += 3;
+        if (!color_set_add_row(&colors, img_ptr + i * img_scanline, width, 3, new_ptr + i * new_scanline)) {
+            data_free(new_ptr);
+            return false; /* too many colors */
         }
     }
 
-    memcpy(pal_ptr, col_ptr, col_count * 3);
-    *pal_count = col_count;
+    for(i=0;i<(unsigned)colors.count;++i) {
+        pal_ptr[i*3] = colors.colors[i];
+        pal_ptr[i*3+1] = colors.colors[i] >> 8;
+        pal_ptr[i*3+2] = colors.colors[i] >> 16;
+    }
+    *pal_count = colors.count;
     *out_ptr = new_ptr;
     *out_scanline = new_scanline;
 
     return true;
 }
 
-void write_image(adv_fz* f, unsigned pix_width, unsigned pix_height, unsigned pix_pixel, unsigned char* pix_ptr, unsigned pix_scanline, unsigned char* pal_ptr, unsigned pal_size, unsigned char* rns_ptr, unsigned rns_size)
+/* One order of the palette at one bit depth, tried with libdeflate before the final compression */
+struct palette_trial {
+    unsigned width;
+    unsigned height;
+    const unsigned char* img_ptr;
+    unsigned img_scanline;
+    unsigned depth;
+    unsigned char order[256];
+    unsigned char* new_ptr;     /* the pixels remapped, NULL for the palette as it is */
+    unsigned size;
+};
+
+void run_palette_trial(void* arg, size_t i)
+{
+    palette_trial* trial = (palette_trial*)arg + i;
+    const unsigned char* ptr = trial->img_ptr;
+    unsigned scanline = trial->img_scanline;
+    unsigned x, y;
+
+    for(x=0;x<256 && trial->order[x] == x;++x);
+    if (x < 256) {
+        unsigned char map[256];
+        for(x=0;x<256;++x)
+            map[trial->order[x]] = x;
+        trial->new_ptr = data_alloc(trial->width * trial->height);
+        for(y=0;y<trial->height;++y) {
+            const unsigned char* p0 = trial->img_ptr + y * trial->img_scanline;
+            unsigned char* p1 = trial->new_ptr + y * trial->width;
+            for(x=0;x<trial->width;++x)
+                p1[x] = map[p0[x]];
+        }
+        ptr = trial->new_ptr;
+        scanline = trial->width;
+    }
+
+    shrink_t level;
+    level.level = shrink_normal;
+    level.iter = 0;
+    level.parallel_for = 0;
+    level.stop = 0;
+    level.stop_arg = 0;
+
+    // on the pool, nothing may be thrown from here
+    try {
+        data_ptr z_ptr;
+        if (trial->depth < 8) {
+            unsigned pack_scanline;
+            data_ptr pack_ptr(png_pack(trial->width, trial->height, ptr, scanline, trial->depth, &pack_scanline));
+            png_compress(level, z_ptr, trial->size, pack_ptr, pack_scanline, 1, 0, 0, pack_scanline, trial->height);
+        } else {
+            png_compress(level, z_ptr, trial->size, ptr, scanline, 1, 0, 0, trial->width, trial->height);
+        }
+    } catch (...) {
+        trial->size = ~0U;
+    }
+}
+
+/*
+ * Tries the palette_order() methods on an 8 bit paletted image, at the
+ * smallest bit depth of its indexes and at 8 bits, and keeps what
+ * compresses best with libdeflate. Packed rows usually win, but not
+ * always: small images may compress better with whole bytes.
+ * The remapped pixels go to out_ptr, with a scanline of width, and the
+ * palette and tRNS are reordered in place. out_ptr stays NULL if the
+ * palette is best left as it is.
+ */
+void reorder_palette(unsigned char** out_ptr, unsigned* out_depth, unsigned width, unsigned height, const unsigned char* img_ptr, unsigned img_scanline, unsigned char* pal_ptr, unsigned pal_count, unsigned char* rns_ptr, unsigned* rns_size)
+{
+    palette_trial trials[2 * (1 + PALETTE_ORDER_COUNT)];
+    unsigned char orders[1 + PALETTE_ORDER_COUNT][256];
+    unsigned char rgba[256*4];
+    unsigned num_orders = 0;
+    unsigned count = 0;
+    unsigned depth;
+    unsigned i, j;
+
+    // the orders only move the indexes of the palette, the depth stays
+    depth = png_palette_depth(width, height, img_ptr, img_scanline, pal_count);
+
+    *out_ptr = 0;
+    *out_depth = depth;
+    if (pal_count < 2 && depth == 8)
+        return;
+
+    palette_stats* stats = (palette_stats*)malloc(sizeof(palette_stats));
+    palette_stats_init(stats);
+    for(i=0;i<height;++i)
+        palette_stats_add_row(stats, img_ptr + i * img_scanline, i > 0 ? img_ptr + (i - 1) * img_scanline : 0, width, 8);
+
+    for(i=0;i<pal_count;++i) {
+        memcpy(rgba + i*4, pal_ptr + i*3, 3);
+        rgba[i*4+3] = i < *rns_size ? rns_ptr[i] : 0xFF;
+    }
+
+    // order 0 is the palette as it is, the same order twice is tried once
+    for(i=0;i<1+PALETTE_ORDER_COUNT;++i) {
+        unsigned char* order = orders[num_orders];
+        for(j=0;j<256;++j)
+            order[j] = j;
+        if (i > 0 && pal_count >= 2)
+            palette_order(i - 1, stats, rgba, pal_count, order);
+        for(j=0;j<num_orders;++j)
+            if (memcmp(orders[j], order, 256) == 0)
+                break;
+        if (j == num_orders)
+            ++num_orders;
+    }
+    free(stats);
+
+    for(i=0;i<num_orders;++i) {
+        for(j=0;j<2;++j) {
+            if (j == 1 && depth == 8)
+                continue;
+            palette_trial* trial = &trials[count++];
+            trial->width = width;
+            trial->height = height;
+            trial->img_ptr = img_ptr;
+            trial->img_scanline = img_scanline;
+            trial->depth = j == 0 ? depth : 8;
+            memcpy(trial->order, orders[i], 256);
+            trial->new_ptr = 0;
+        }
+    }
+
+    pool_for(run_palette_trial, trials, count);
+
+    unsigned best = 0;
+    for(i=1;i<count;++i)
+        if (trials[i].size < trials[best].size)
+            best = i;
+    for(i=0;i<count;++i)
+        if (i != best)
+            data_free(trials[i].new_ptr);
+
+    *out_depth = trials[best].depth;
+    if (trials[best].new_ptr == 0)
+        return;
+
+    unsigned rns_count = 0;
+    for(i=0;i<pal_count;++i) {
+        const unsigned char* p = rgba + trials[best].order[i] * 4;
+        memcpy(pal_ptr + i*3, p, 3);
+        if (p[3] != 0xFF)
+            rns_ptr[rns_count++] = p[3];
+    }
+    if (*rns_size)
+        *rns_size = rns_count;
+    *out_ptr = trials[best].new_ptr;
+}
+
+void write_palette_image(adv_fz* f, unsigned pix_width, unsigned pix_height, unsigned char* pix_ptr, unsigned pix_scanline, unsigned char* pal_ptr, unsigned pal_size, unsigned char* rns_ptr, unsigned rns_size, unsigned interlace, shrink_t level)
+{
+    unsigned char new_pal_ptr[256*3];
+    unsigned char new_rns_ptr[256];
+    unsigned new_rns_size = rns_size;
+    unsigned char* new_ptr;
+    unsigned depth;
+
+    // stored data doesn't care about the order, and takes the smallest depth
+    if (level.level == shrink_none || pal_size > sizeof(new_pal_ptr) || rns_size > sizeof(new_rns_ptr)) {
+        depth = png_palette_depth(pix_width, pix_height, pix_ptr, pix_scanline, pal_size / 3);
+        png_write_type(f, pix_width, pix_height, 3, depth, 1, pix_ptr, pix_scanline, pal_ptr, pal_size, rns_ptr, rns_size, interlace, level);
+        return;
+    }
+
+    memcpy(new_pal_ptr, pal_ptr, pal_size);
+    memcpy(new_rns_ptr, rns_ptr, rns_size);
+    reorder_palette(&new_ptr, &depth, pix_width, pix_height, pix_ptr, pix_scanline, new_pal_ptr, pal_size / 3, new_rns_ptr, &new_rns_size);
+    if (!new_ptr) {
+        png_write_type(f, pix_width, pix_height, 3, depth, 1, pix_ptr, pix_scanline, pal_ptr, pal_size, rns_ptr, rns_size, interlace, level);
+        return;
+    }
+
+    try {
+        png_write_type(f, pix_width, pix_height, 3, depth, 1, new_ptr, pix_width, new_pal_ptr, pal_size, new_rns_size ? new_rns_ptr : 0, new_rns_size, interlace, level);
+    } catch (...) {
+        data_free(new_ptr);
+        throw;
+    }
+
+    data_free(new_ptr);
+}
+
+void write_image(adv_fz* f, unsigned pix_width, unsigned pix_height, unsigned pix_type, unsigned pix_depth, unsigned pix_interlace, unsigned pix_pixel, unsigned char* pix_ptr, unsigned pix_scanline, unsigned char* pal_ptr, unsigned pal_size, unsigned char* rns_ptr, unsigned rns_size, shrink_t level)
 {
-    if (pix_pixel == 1) {
-        png_write(f, pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline, pal_ptr, pal_size, rns_ptr, rns_size, opt_level);
+    if (pix_type == 3) {
+        write_palette_image(f, pix_width, pix_height, pix_ptr, pix_scanline, pal_ptr, pal_size, rns_ptr, rns_size, pix_interlace, level);
     } else {
         unsigned char new_pal_ptr[256*3];
         unsigned new_pal_count;
@@ -92,11 +267,11 @@ void write_image(adv_fz* f, unsigned pix_width, unsigned pix_height, unsigned pi
         new_ptr = 0;
 
         try {
-            if (pix_pixel == 3
+            if (pix_type == 2 && pix_depth == 8
                 && reduce_image(&new_ptr, &new_scanline, new_pal_ptr, &new_pal_count, new_rns_ptr, &new_rns_count, pix_width, pix_height, pix_ptr, pix_scanline, rns_ptr, rns_size)) {
-                png_write(f, pix_width, pix_height, 1, new_ptr, new_scanline, new_pal_ptr, new_pal_count * 3, new_rns_count ? new_rns_ptr : 0, new_rns_count, opt_level);
+                write_palette_image(f, pix_width, pix_height, new_ptr, new_scanline, new_pal_ptr, new_pal_count * 3, new_rns_count ? new_rns_ptr : 0, new_rns_count, pix_interlace, level);
             } else {
-                png_write(f, pix_width, pix_height, pix_pixel, pix_ptr, pix_scanline, 0, 0, rns_ptr, rns_size, opt_level);
+                png_write_type(f, pix_width, pix_height, pix_type, pix_depth, pix_pixel, pix_ptr, pix_scanline, 0, 0, rns_ptr, rns_size, pix_interlace, level);
             }
         } catch (...) {
             data_free(new_ptr);
@@ -112,6 +287,9 @@ void convert_f(adv_fz* f_in, adv_fz* f_out)
     unsigned char* dat_ptr;
     unsigned dat_size;
     unsigned pix_pixel;
+    unsigned pix_type;
+    unsigned pix_depth;
+    unsigned pix_interlace;
     unsigned pix_width;
     unsigned pix_height;
     unsigned char* pal_ptr;
@@ -121,8 +299,9 @@ void convert_f(adv_fz* f_in, adv_fz* f_out)
     unsigned char* pix_ptr;
     unsigned pix_scanline;
 
-    if (adv_png_read_rns(
+    if (adv_png_read_rns_type(
         &pix_width, &pix_height, &pix_pixel,
+        &pix_type, &pix_depth, &pix_interlace,
         &dat_ptr, &dat_size,
         &pix_ptr, &pix_scanline,
         &pal_ptr, &pal_size,
@@ -135,10 +314,12 @@ void convert_f(adv_fz* f_in, adv_fz* f_out)
     try {
         write_image(
             f_out,
-            pix_width, pix_height, pix_pixel,
+            pix_width, pix_height,
+            pix_type, pix_depth, pix_interlace, pix_pixel,
             pix_ptr, pix_scanline,
             pal_ptr, pal_size,
-            rns_ptr, rns_size
+            rns_ptr, rns_size,
+            opt_level
         );
     } catch (...) {
         free(dat_ptr);
@@ -465,13 +646,66 @@ void process(int argc, char* argv[])
     }
 }
 
+/* Level of advpng(), zopfli and 7z racing on the pool until stop fires */
+static void advpng_level(shrink_t* level, stop_cond* stop)
+{
+    level->level = shrink_insane;
+    level->iter = 10;
+    level->parallel_for = pool_for;
+    level->stop = stop != NULL ? stop_requested : 0;
+    level->stop_arg = stop;
+}
+
 extern "C" {
 
-PyObject* advpng(PyObject *self, PyObject *args)
+unsigned char* advpng_compress_idat(const unsigned char* data, unsigned long size, unsigned long* out_size, stop_cond* stop)
+{
+    shrink_t level;
+    unsigned char* z_ptr;
+    unsigned z_size;
+
+    advpng_level(&level, stop);
+
+    // advancecomp counts the sizes in unsigned
+    if (size > UINT_MAX / 2)
+        return NULL;
+
+    z_size = oversize_zlib(size);
+    z_ptr = (unsigned char*)malloc(z_size);
+    if (z_ptr == NULL)
+        return NULL;
+
+    try {
+        if (!compress_zlib(level, z_ptr, z_size, data, size)) {
+            free(z_ptr);
+            return NULL;
+        }
+    } catch (...) {
+        free(z_ptr);
+        return NULL;
+    }
+
+    *out_size = z_size;
+    return z_ptr;
+}
+
+/*
+ * advpng(data, deadline_ms=None, cancel=None)
+ *
+ * With deadline_ms, zopfli and 7z stop that many milliseconds after the
+ * call, and the smallest stream they had so far is kept. libdeflate
+ * always runs, its stream is the fallback. Once the CancelToken cancel
+ * is cancelled, or on Ctrl-C, they stop the same way, the output is
+ * dropped and the call raises.
+ */
+PyObject* advpng(PyObject *self, PyObject *args, PyObject *kwargs)
 {
     unsigned char* dat_ptr;
     unsigned dat_size;
     unsigned pix_pixel;
+    unsigned pix_type;
+    unsigned pix_depth;
+    unsigned pix_interlace;
     unsigned pix_width;
     unsigned pix_height;
     unsigned char* pal_ptr;
@@ -482,63 +716,72 @@ PyObject* advpng(PyObject *self, PyObject *args)
     unsigned pix_scanline;
     adv_fz* f_in;
     adv_fz* f_out;
+    shrink_t level;
+    string error_desc;
 
-    unsigned char* input;
-    unsigned long input_len;
-
-    opt_quiet = false;
-    opt_level.level = shrink_insane;
-    opt_level.iter = 10;
-    opt_force = false;
-    opt_crc = false;
+    Py_buffer input;
+    stop_cond stop;
+    static const char* keywords[] = {"data", "deadline_ms", "cancel", NULL};
 
-    if (!PyArg_ParseTuple(args, "s#", &input, &input_len))
+    stop_init(&stop);
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s*|O&O&", (char**)keywords,
+        &input, stop_convert_deadline, &stop, stop_convert_cancel, &stop))
         return NULL;
 
-    f_in = fzopenmemory(input, input_len);
+    advpng_level(&level, &stop);
+
+    // Nothing below touches Python objects, the input buffer can't change
+    // until it is released
+    stop_begin(&stop);
+    Py_BEGIN_ALLOW_THREADS
+
+    f_in = fzopenmemory((unsigned char*)input.buf, input.len);
     f_out = fzopennullwrite("", "w+");
 
-    if (adv_png_read_rns(
+    if (adv_png_read_rns_type(
         &pix_width, &pix_height, &pix_pixel,
+        &pix_type, &pix_depth, &pix_interlace,
         &dat_ptr, &dat_size,
         &pix_ptr, &pix_scanline,
         &pal_ptr, &pal_size,
         &rns_ptr, &rns_size,
         f_in) != 0) {
         // Original code: throw_png_error();
-        PyErr_Format(PyExc_ValueError, "adv_png_read_rns() error: %s", error_get());
-        return NULL;
-    }
+        error_desc = string("adv_png_read_rns_type() error: ") + error_get();
+    } else {
+        try {
+            write_image(
+                f_out,
+                pix_width, pix_height,
+                pix_type, pix_depth, pix_interlace, pix_pixel,
+                pix_ptr, pix_scanline,
+                pal_ptr, pal_size,
+                rns_ptr, rns_size,
+                level
+            );
+        } catch (...) {
+            error_desc = string("write_image() error: ") + error_get();
+        }
 
-    try {
-        write_image(
-            f_out,
-            pix_width, pix_height, pix_pixel,
-            pix_ptr, pix_scanline,
-            pal_ptr, pal_size,
-            rns_ptr, rns_size
-        );
-    } catch (...) {
-        
         free(dat_ptr);
         free(pal_ptr);
         free(rns_ptr);
-
-        fzclose(f_in);
-        fzclose(f_out);
-
-        PyErr_Format(PyExc_ValueError, "write_image() error: %s", error_get());
-        return NULL;
     }
 
-    free(dat_ptr);
-    free(pal_ptr);
-    free(rns_ptr);
+    Py_END_ALLOW_THREADS
 
-    PyObject* result = Py_BuildValue("s#", f_out->data_write, f_out->virtual_pos);
+    // A cancelled call drops its output
+    PyObject* result = NULL;
+    if (stop_end(&stop) == 0) {
+        if (error_desc.length())
+            PyErr_SetString(PyExc_ValueError, error_desc.c_str());
+        else
+            result = PyBytes_FromStringAndSize((const char*)f_out->data_write, f_out->virtual_pos);
+    }
 
     fzclose(f_in);
     fzclose(f_out);
+    PyBuffer_Release(&input);
 
     return result;
 }
@@ -0,0 +1,22 @@
+#ifndef __ADVCOMP_H
+#define __ADVCOMP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct stop_cond;
+
+/*
+ * Compresses a filtered IDAT stream with zopfli and 7z on the pool, as
+ * advpng() does, until stop fires if it isn't NULL. Returns the zlib
+ * stream, to free(), with its size in out_size, or NULL if it can't be
+ * compressed.
+ */
+unsigned char* advpng_compress_idat(const unsigned char* data, unsigned long size, unsigned long* out_size, struct stop_cond* stop);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+/* Alignment of the blocks, as malloc() on 64 bit */
+#define ARENA_ALIGN     16
+
+struct arena_chunk {
+    arena_chunk* next;
+    size_t size;            // bytes for the blocks
+    size_t pos;             // first free byte
+    size_t last;            // offset of the last block cut
+};
+
+#define ARENA_HEADER    ((sizeof(arena_chunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static unsigned char* chunk_data(arena_chunk* chunk)
+{
+    return (unsigned char*)chunk + ARENA_HEADER;
+}
+
+static arena_chunk* new_chunk(size_t size)
+{
+    arena_chunk* chunk = (arena_chunk*)malloc(ARENA_HEADER + size);
+
+    if (chunk != NULL) {
+        chunk->next = NULL;
+        chunk->size = size;
+        chunk->pos = 0;
+        chunk->last = 0;
+    }
+    return chunk;
+}
+
+extern "C" {
+
+void arena_init(arena* a)
+{
+    memset(a, 0, sizeof(arena));
+}
+
+void* arena_alloc(arena* a, size_t size)
+{
+    arena_chunk* chunk = a->chunk;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (size == 0)
+        size = ARENA_ALIGN;
+
+    if (chunk == NULL || chunk->size - chunk->pos < size) {
+        size_t chunk_size = a->chunk_size == 0 ? ARENA_CHUNK_MIN : a->chunk_size * 2;
+        if (chunk_size > ARENA_CHUNK_MAX)
+            chunk_size = ARENA_CHUNK_MAX;
+
+        if (size > chunk_size / 4) {
+            // A large block gets a chunk of its own, and the current chunk
+            // goes on with the small ones
+            arena_chunk* own = new_chunk(size);
+            if (own == NULL)
+                return NULL;
+            own->pos = size;
+            if (chunk != NULL) {
+                own->next = chunk->next;
+                chunk->next = own;
+            } else {
+                a->chunk = own;
+            }
+            return chunk_data(own);
+        }
+
+        chunk = new_chunk(chunk_size);
+        if (chunk == NULL)
+            return NULL;
+        chunk->next = a->chunk;
+        a->chunk = chunk;
+        a->chunk_size = chunk_size;
+    }
+
+    chunk->last = chunk->pos;
+    chunk->pos += size;
+    return chunk_data(chunk) + chunk->last;
+}
+
+void arena_free(arena* a, void* ptr)
+{
+    arena_chunk* chunk = a->chunk;
+
+    // A buffer taken and given back right away doesn't use up the chunk
+    if (ptr != NULL && chunk != NULL && chunk->last < chunk->pos
+        && (unsigned char*)ptr == chunk_data(chunk) + chunk->last)
+        chunk->pos = chunk->last;
+}
+
+void arena_release(arena* a)
+{
+    arena_chunk* chunk = a->chunk;
+
+    while (chunk != NULL) {
+        arena_chunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena_init(a);
+}
+
+}
@@ -0,0 +1,42 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Memory of one job. The blocks are cut from a few large chunks and all
+ * freed at once by arena_release(), instead of going one by one through
+ * malloc() and free(). An arena isn't locked, it belongs to one thread at
+ * a time. A zeroed arena is empty and ready for use.
+ */
+
+#define ARENA_CHUNK_MIN     64*1024
+#define ARENA_CHUNK_MAX     4*1024*1024
+
+typedef struct arena_chunk arena_chunk;
+
+typedef struct arena {
+    arena_chunk* chunk;     /* the one blocks are cut from, the others linked from it */
+    size_t chunk_size;      /* of the last chunk allocated */
+} arena;
+
+void arena_init(arena* a);
+
+/* Block of size bytes, aligned as malloc(), or NULL if out of memory */
+void* arena_alloc(arena* a, size_t size);
+
+/* Only the last block cut is given back, the others wait for arena_release() */
+void arena_free(arena* a, void* ptr);
+
+/* Frees every block of the arena, and leaves it empty */
+void arena_release(arena* a);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,552 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define USE_X86_FILTERS
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/*
+ * Every kernel filters the bytes [i, size) of a row. Sub, Avg and Paeth
+ * look bpp bytes back, so they start at bpp at least. The vector versions
+ * leave the tail to the scalar ones.
+ */
+typedef void (*filter_fn)(unsigned char* dst, const unsigned char* row, const unsigned char* prev, size_t i, size_t size, size_t bpp);
+typedef unsigned long (*sum_fn)(const unsigned char* p, size_t i, size_t size);
+
+/*
+ * The unfilter kernels work in place on a whole row, after the first bpp
+ * bytes for Avg and Paeth. They don't see the first row, which
+ * unfilter_row() handles without a previous row.
+ */
+typedef void (*unfilter_fn)(unsigned char* row, const unsigned char* prev, size_t size, size_t bpp);
+
+struct filter_kernels {
+    const char* name;
+    filter_fn sub;
+    filter_fn up;
+    filter_fn avg;
+    filter_fn paeth;
+    sum_fn sum;
+    unfilter_fn unsub;
+    unfilter_fn unup;
+    unfilter_fn unavg;
+    unfilter_fn unpaeth;
+};
+
+static inline int paeth_predictor(int a, int b, int c)
+{
+    int pa = abs(b - c);
+    int pb = abs(a - c);
+    int pc = abs(a + b - c - c);
+
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+static void sub_c(unsigned char* dst, const unsigned char* row, const unsigned char*, size_t i, size_t size, size_t bpp)
+{
+    for (; i < size; i++)
+        dst[i] = row[i] - row[i-bpp];
+}
+
+static void up_c(unsigned char* dst, const unsigned char* row, const unsigned char* prev, size_t i, size_t size, size_t)
+{
+    for (; i < size; i++)
+        dst[i] = row[i] - prev[i];
+}
+
+static void avg_c(unsigned char* dst, const unsigned char* row, const unsigned char* prev, size_t i, size_t size, size_t bpp)
+{
+    for (; i < size; i++)
+        dst[i] = row[i] - ((row[i-bpp] + prev[i]) >> 1);
+}
+
+static void paeth_c(unsigned char* dst, const unsigned char* row, const unsigned char* prev, size_t i, size_t size, size_t bpp)
+{
+    for (; i < size; i++)
+        dst[i] = row[i] - paeth_predictor(row[i-bpp], prev[i], prev[i-bpp]);
+}
+
+static unsigned long sum_c(const unsigned char* p, size_t i, size_t size)
+{
+    unsigned long sum = 0;
+
+    for (; i < size; i++)
+        sum += p[i] < 128 ? p[i] : 256 - p[i];
+    return sum;
+}
+
+static void unsub_c(unsigned char* row, const unsigned char*, size_t size, size_t bpp)
+{
+    for (size_t i = bpp; i < size; i++)
+        row[i] += row[i-bpp];
+}
+
+static void unup_c(unsigned char* row, const unsigned char* prev, size_t size, size_t)
+{
+    for (size_t i = 0; i < size; i++)
+        row[i] += prev[i];
+}
+
+static void unavg_c(unsigned char* row, const unsigned char* prev, size_t size, size_t bpp)
+{
+    for (size_t i = bpp; i < size; i++)
+        row[i] += (row[i-bpp] + prev[i]) >> 1;
+}
+
+static void unpaeth_c(unsigned char* row, const unsigned char* prev, size_t size, size_t bpp)
+{
+    for (size_t i = bpp; i < size; i++)
+        row[i] += paeth_predictor(row[i-bpp], prev[i], prev[i-bpp]);
+}
+
+static const filter_kernels kernels_c = { "c", sub_c, up_c, avg_c, paeth_c, sum_c, unsub_c, unup_c, unavg_c, unpaeth_c };
+
+#ifdef USE_X86_FILTERS
+
+// SSE2 is part of x86-64, these need no check
+
+#define LOAD128(P) _mm_loadu_si128((const __m128i*)(P))
+#define STORE128(P, V) _mm_storeu_si128((__m128i*)(P), V)
+
+static void sub_sse2(unsigned char* dst, const unsigned char* row, const unsigned char* prev, size_t i, size_t size, size_t bpp)
+{
+    for (; i + 16 <= size; i += 16)
+        STORE128(dst + i, _mm_sub_epi8(LOAD128(row + i), LOAD128(row + i - bpp)));
+    sub_c(dst, row, prev, i, size, bpp);
+}
+
+static void up_sse2(unsigned char* dst, const unsigned char* row, const unsigned char* prev, size_t i, size_t size, size_t bpp)
+{
+    for (; i + 16 <= size; i += 16)
+        STORE128(dst + i, _mm_sub_epi8(LOAD128(row + i), LOAD128(prev + i)));
+    up_c(dst, row, prev, i, size, bpp);
+}
+
+static void avg_sse2(unsigned char* dst, const unsigned char* row, const unsigned char* prev, size_t i, size_t size, size_t bpp)
+{
+    const __m128i one = _mm_set1_epi8(1);
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i a = LOAD128(row + i - bpp);
+        __m128i b = LOAD128(prev + i);
+        // pavgb rounds up, take the carry back for (a + b) >> 1
+        __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+        STORE128(dst + i, _mm_sub_epi8(LOAD128(row + i), avg));
+    }
+    avg_c(dst, row, prev, i, size, bpp);
+}
+
+static inline __m128i abs_epi16_sse2(__m128i x)
+{
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+// paeth_predictor() on 16 bit lanes
+static inline __m128i paeth_epi16_sse2(__m128i a, __m128i b, __m128i c)
+{
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = abs_epi16_sse2(_mm_add_epi16(pa, pb));
+    pa = abs_epi16_sse2(pa);
+    pb = abs_epi16_sse2(pb);
+
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    __m128i use_a = _mm_cmpeq_epi16(smallest, pa);
+    __m128i use_b = _mm_cmpeq_epi16(smallest, pb);
+
+    __m128i p = _mm_or_si128(_mm_and_si128(use_b, b), _mm_andnot_si128(use_b, c));
+    return _mm_or_si128(_mm_and_si128(use_a, a), _mm_andnot_si128(use_a, p));
+}
+
+static void paeth_sse2(unsigned char* dst, const unsigned char* row, const unsigned char* prev, size_t i, size_t size, size_t bpp)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i a = LOAD128(row + i - bpp);
+        __m128i b = LOAD128(prev + i);
+        __m128i c = LOAD128(prev + i - bpp);
+        __m128i lo = paeth_epi16_sse2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+        __m128i hi = paeth_epi16_sse2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+        STORE128(dst + i, _mm_sub_epi8(LOAD128(row + i), _mm_packus_epi16(lo, hi)));
+    }
+    paeth_c(dst, row, prev, i, size, bpp);
+}
+
+// min(v, 256 - v) is the absolute value of the signed byte, psadbw adds them up
+static unsigned long sum_sse2(const unsigned char* p, size_t i, size_t size)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = LOAD128(p + i);
+        __m128i m = _mm_min_epu8(v, _mm_sub_epi8(zero, v));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(m, zero));
+    }
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+    return (unsigned long)_mm_cvtsi128_si64(acc) + sum_c(p, i, size);
+}
+
+/*
+ * Sub is a running sum with a stride of bpp bytes. 16 bytes are summed in
+ * the register with log2(16 / bpp) shifted adds, after adding the last
+ * pixel of the previous block to the first one.
+ */
+template <int BPP>
+static void unsub_sse2_bpp(unsigned char* row, size_t size)
+{
+    __m128i last = _mm_setzero_si128();
+    size_t i;
+
+    for (i = 0; i + 16 <= size; i += 16) {
+        __m128i x = _mm_add_epi8(LOAD128(row + i), _mm_srli_si128(last, 16 - BPP));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, BPP));
+        if (2*BPP < 16)
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 2*BPP));
+        if (4*BPP < 16)
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 4*BPP));
+        if (8*BPP < 16)
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 8*BPP));
+        STORE128(row + i, x);
+        last = x;
+    }
+    for (i = i > BPP ? i : BPP; i < size; i++)
+        row[i] += row[i-BPP];
+}
+
+static void unsub_sse2(unsigned char* row, const unsigned char* prev, size_t size, size_t bpp)
+{
+    switch (bpp) {
+    case 1: unsub_sse2_bpp<1>(row, size); break;
+    case 2: unsub_sse2_bpp<2>(row, size); break;
+    case 3: unsub_sse2_bpp<3>(row, size); break;
+    case 4: unsub_sse2_bpp<4>(row, size); break;
+    case 6: unsub_sse2_bpp<6>(row, size); break;
+    case 8: unsub_sse2_bpp<8>(row, size); break;
+    default: unsub_c(row, prev, size, bpp); break;
+    }
+}
+
+static void unup_sse2(unsigned char* row, const unsigned char* prev, size_t size, size_t bpp)
+{
+    size_t i;
+
+    for (i = 0; i + 16 <= size; i += 16)
+        STORE128(row + i, _mm_add_epi8(LOAD128(row + i), LOAD128(prev + i)));
+    for (; i < size; i++)
+        row[i] += prev[i];
+}
+
+/*
+ * Avg and Paeth depend on the pixel before, they go a pixel at a time.
+ * The pixel is loaded as 4 or 8 bytes, the lanes past bpp are just not
+ * stored back.
+ */
+#define PIXEL_LOAD(BPP) ((BPP) <= 4 ? 4 : 8)
+
+template <int BPP>
+static inline __m128i load_pixel(const unsigned char* p)
+{
+    if (PIXEL_LOAD(BPP) == 4) {
+        unsigned v;
+        memcpy(&v, p, 4);
+        return _mm_cvtsi32_si128(v);
+    }
+    unsigned long long v;
+    memcpy(&v, p, 8);
+    return _mm_cvtsi64_si128(v);
+}
+
+template <int BPP>
+static inline void store_pixel(unsigned char* p, __m128i x)
+{
+    unsigned long long v = _mm_cvtsi128_si64(x);
+    memcpy(p, &v, BPP);
+}
+
+template <int BPP>
+static void unavg_sse2_bpp(unsigned char* row, const unsigned char* prev, size_t size)
+{
+    const __m128i one = _mm_set1_epi8(1);
+    size_t i = BPP;
+
+    if (size < PIXEL_LOAD(BPP)) {
+        unavg_c(row, prev, size, BPP);
+        return;
+    }
+    __m128i a = load_pixel<BPP>(row);
+    for (; i + PIXEL_LOAD(BPP) <= size; i += BPP) {
+        __m128i b = load_pixel<BPP>(prev + i);
+        __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+        a = _mm_add_epi8(load_pixel<BPP>(row + i), avg);
+        store_pixel<BPP>(row + i, a);
+    }
+    for (; i < size; i++)
+        row[i] += (row[i-BPP] + prev[i]) >> 1;
+}
+
+static void unavg_sse2(unsigned char* row, const unsigned char* prev, size_t size, size_t bpp)
+{
+    switch (bpp) {
+    case 3: unavg_sse2_bpp<3>(row, prev, size); break;
+    case 4: unavg_sse2_bpp<4>(row, prev, size); break;
+    case 6: unavg_sse2_bpp<6>(row, prev, size); break;
+    case 8: unavg_sse2_bpp<8>(row, prev, size); break;
+    default: unavg_c(row, prev, size, bpp); break;
+    }
+}
+
+// The pixels are kept widened to 16 bits between the steps
+template <int BPP>
+static void unpaeth_sse2_bpp(unsigned char* row, const unsigned char* prev, size_t size)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = BPP;
+
+    if (size < PIXEL_LOAD(BPP)) {
+        unpaeth_c(row, prev, size, BPP);
+        return;
+    }
+    __m128i a = _mm_unpacklo_epi8(load_pixel<BPP>(row), zero);
+    __m128i c = _mm_unpacklo_epi8(load_pixel<BPP>(prev), zero);
+    for (; i + PIXEL_LOAD(BPP) <= size; i += BPP) {
+        __m128i b = _mm_unpacklo_epi8(load_pixel<BPP>(prev + i), zero);
+        __m128i x = _mm_unpacklo_epi8(load_pixel<BPP>(row + i), zero);
+        x = _mm_add_epi16(x, paeth_epi16_sse2(a, b, c));
+        a = _mm_and_si128(x, _mm_set1_epi16(0xff));
+        c = b;
+        store_pixel<BPP>(row + i, _mm_packus_epi16(a, a));
+    }
+    for (; i < size; i++)
+        row[i] += paeth_predictor(row[i-BPP], prev[i], prev[i-BPP]);
+}
+
+static void unpaeth_sse2(unsigned char* row, const unsigned char* prev, size_t size, size_t bpp)
+{
+    switch (bpp) {
+    case 3: unpaeth_sse2_bpp<3>(row, prev, size); break;
+    case 4: unpaeth_sse2_bpp<4>(row, prev, size); break;
+    case 6: unpaeth_sse2_bpp<6>(row, prev, size); break;
+    case 8: unpaeth_sse2_bpp<8>(row, prev, size); break;
+    default: unpaeth_c(row, prev, size, bpp); break;
+    }
+}
+
+static const filter_kernels kernels_sse2 = { "sse2", sub_sse2, up_sse2, avg_sse2, paeth_sse2, sum_sse2,
+    unsub_sse2, unup_sse2, unavg_sse2, unpaeth_sse2 };
+
+#define AVX2 __attribute__((target("avx2")))
+#define LOAD256(P) _mm256_loadu_si256((const __m256i*)(P))
+#define STORE256(P, V) _mm256_storeu_si256((__m256i*)(P), V)
+
+AVX2 static void sub_avx2(unsigned char* dst, const unsigned char* row, const unsigned char* prev, size_t i, size_t size, size_t bpp)
+{
+    for (; i + 32 <= size; i += 32)
+        STORE256(dst + i, _mm256_sub_epi8(LOAD256(row + i), LOAD256(row + i - bpp)));
+    sub_sse2(dst, row, prev, i, size, bpp);
+}
+
+AVX2 static void up_avx2(unsigned char* dst, const unsigned char* row, const unsigned char* prev, size_t i, size_t size, size_t bpp)
+{
+    for (; i + 32 <= size; i += 32)
+        STORE256(dst + i, _mm256_sub_epi8(LOAD256(row + i), LOAD256(prev + i)));
+    up_sse2(dst, row, prev, i, size, bpp);
+}
+
+AVX2 static void avg_avx2(unsigned char* dst, const unsigned char* row, const unsigned char* prev, size_t i, size_t size, size_t bpp)
+{
+    const __m256i one = _mm256_set1_epi8(1);
+
+    for (; i + 32 <= size; i += 32) {
+        __m256i a = LOAD256(row + i - bpp);
+        __m256i b = LOAD256(prev + i);
+        __m256i avg = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one));
+        STORE256(dst + i, _mm256_sub_epi8(LOAD256(row + i), avg));
+    }
+    avg_sse2(dst, row, prev, i, size, bpp);
+}
+
+// 16 bytes at a time, widened to one register of 16 bit lanes
+AVX2 static void paeth_avx2(unsigned char* dst, const unsigned char* row, const unsigned char* prev, size_t i, size_t size, size_t bpp)
+{
+    for (; i + 16 <= size; i += 16) {
+        __m256i a = _mm256_cvtepu8_epi16(LOAD128(row + i - bpp));
+        __m256i b = _mm256_cvtepu8_epi16(LOAD128(prev + i));
+        __m256i c = _mm256_cvtepu8_epi16(LOAD128(prev + i - bpp));
+
+        __m256i pa = _mm256_sub_epi16(b, c);
+        __m256i pb = _mm256_sub_epi16(a, c);
+        __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(pa, pb));
+        pa = _mm256_abs_epi16(pa);
+        pb = _mm256_abs_epi16(pb);
+
+        __m256i smallest = _mm256_min_epi16(pc, _mm256_min_epi16(pa, pb));
+        __m256i p = _mm256_blendv_epi8(c, b, _mm256_cmpeq_epi16(smallest, pb));
+        p = _mm256_blendv_epi8(p, a, _mm256_cmpeq_epi16(smallest, pa));
+
+        __m128i pred = _mm_packus_epi16(_mm256_castsi256_si128(p), _mm256_extracti128_si256(p, 1));
+        STORE128(dst + i, _mm_sub_epi8(LOAD128(row + i), pred));
+    }
+    paeth_c(dst, row, prev, i, size, bpp);
+}
+
+AVX2 static unsigned long sum_avx2(const unsigned char* p, size_t i, size_t size)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = LOAD256(p + i);
+        __m256i m = _mm256_min_epu8(v, _mm256_sub_epi8(zero, v));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(m, zero));
+    }
+    __m128i acc128 = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    acc128 = _mm_add_epi64(acc128, _mm_unpackhi_epi64(acc128, acc128));
+    return (unsigned long)_mm_cvtsi128_si64(acc128) + sum_sse2(p, i, size);
+}
+
+AVX2 static void unup_avx2(unsigned char* row, const unsigned char* prev, size_t size, size_t bpp)
+{
+    size_t i;
+
+    for (i = 0; i + 32 <= size; i += 32)
+        STORE256(row + i, _mm256_add_epi8(LOAD256(row + i), LOAD256(prev + i)));
+    unup_sse2(row + i, prev + i, size - i, bpp);
+}
+
+// Sub, Avg and Paeth go pixel by pixel, the wider registers don't help them
+static const filter_kernels kernels_avx2 = { "avx2", sub_avx2, up_avx2, avg_avx2, paeth_avx2, sum_avx2,
+    unsub_sse2, unup_avx2, unavg_sse2, unpaeth_sse2 };
+
+// Like x86_setup_cpu_features() of libdeflate: AVX2 also needs the OS to save the ymm registers
+static int have_avx2()
+{
+    unsigned eax, ebx, ecx, edx;
+
+    if (__get_cpuid_max(0, NULL) < 7)
+        return 0;
+    __cpuid(1, eax, ebx, ecx, edx);
+    if ((ecx & bit_OSXSAVE) == 0)
+        return 0;
+
+    unsigned xcr0_lo, xcr0_hi;
+    __asm__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0_lo & 0x6) != 0x6)
+        return 0;
+
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & bit_AVX2) != 0;
+}
+
+#endif
+
+static const filter_kernels* select_kernels()
+{
+#ifdef USE_X86_FILTERS
+    // PYOPTIPNG_FILTERS=c or sse2 caps the version, to compare them
+    const char* cap = getenv("PYOPTIPNG_FILTERS");
+    if (cap && !strcmp(cap, "c"))
+        return &kernels_c;
+    if (cap && !strcmp(cap, "sse2"))
+        return &kernels_sse2;
+    return have_avx2() ? &kernels_avx2 : &kernels_sse2;
+#else
+    return &kernels_c;
+#endif
+}
+
+static const filter_kernels* kernels = select_kernels();
+
+extern "C" {
+
+void filter_row(int type, unsigned char* dst, const unsigned char* row, const unsigned char* prev, size_t size, int bpp)
+{
+    size_t i;
+
+    *dst++ = type;
+
+    switch (type) {
+    case 0: /* none */
+        memcpy(dst, row, size);
+        break;
+    case 1: /* sub */
+        for (i = 0; i < size && i < (size_t)bpp; i++)
+            dst[i] = row[i];
+        kernels->sub(dst, row, prev, i, size, bpp);
+        break;
+    case 2: /* up */
+        kernels->up(dst, row, prev, 0, size, bpp);
+        break;
+    case 3: /* average */
+        for (i = 0; i < size && i < (size_t)bpp; i++)
+            dst[i] = row[i] - (prev[i] >> 1);
+        kernels->avg(dst, row, prev, i, size, bpp);
+        break;
+    case 4: /* paeth */
+        for (i = 0; i < size && i < (size_t)bpp; i++)
+            dst[i] = row[i] - prev[i];
+        kernels->paeth(dst, row, prev, i, size, bpp);
+        break;
+    }
+}
+
+void unfilter_row(int type, unsigned char* row, const unsigned char* prev, size_t size, int bpp)
+{
+    size_t i;
+
+    switch (type) {
+    case 1: /* sub */
+        kernels->unsub(row, prev, size, bpp);
+        break;
+    case 2: /* up */
+        if (prev)
+            kernels->unup(row, prev, size, bpp);
+        break;
+    case 3: /* average */
+        if (!prev) {
+            for (i = bpp; i < size; i++)
+                row[i] += row[i-bpp] >> 1;
+            break;
+        }
+        for (i = 0; i < size && i < (size_t)bpp; i++)
+            row[i] += prev[i] >> 1;
+        if (size > (size_t)bpp)
+            kernels->unavg(row, prev, size, bpp);
+        break;
+    case 4: /* paeth */
+        // without the row above the predictor is always the left byte
+        if (!prev) {
+            kernels->unsub(row, prev, size, bpp);
+            break;
+        }
+        for (i = 0; i < size && i < (size_t)bpp; i++)
+            row[i] += prev[i];
+        if (size > (size_t)bpp)
+            kernels->unpaeth(row, prev, size, bpp);
+        break;
+    }
+}
+
+void filter_row_diff(unsigned char* dst, const unsigned char* row, const unsigned char* prev, size_t size)
+{
+    kernels->up(dst, row, prev, 0, size, 1);
+}
+
+unsigned long filter_row_sum(const unsigned char* p, size_t size)
+{
+    return kernels->sum(p, 0, size);
+}
+
+const char* filter_kernels_name()
+{
+    return kernels->name;
+}
+
+}
@@ -0,0 +1,46 @@
+#ifndef __FILTER_H
+#define __FILTER_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * PNG row filters, their inverse and the libpng filter heuristic. The loops
+ * have SSE2 and AVX2 versions, picked when the module is loaded from what
+ * the CPU supports. All the versions give the same bytes.
+ */
+
+/*
+ * Filters a row with one of the five PNG filter types (0 to 4). dst
+ * receives the filter type byte followed by the filtered row. prev must
+ * point at a zeroed row for the first row.
+ */
+void filter_row(int type, unsigned char* dst, const unsigned char* row, const unsigned char* prev, size_t size, int bpp);
+
+/*
+ * Undoes the filter of the given type (1 to 4) on a row in place, the
+ * filter type byte excluded. prev is the unfiltered row above, or NULL for
+ * the first row.
+ */
+void unfilter_row(int type, unsigned char* row, const unsigned char* prev, size_t size, int bpp);
+
+/* dst[i] = row[i] - prev[i], without the filter type byte */
+void filter_row_diff(unsigned char* dst, const unsigned char* row, const unsigned char* prev, size_t size);
+
+/*
+ * The "minimum sum of absolute differences" score of png_write_find_filter():
+ * the sum of the bytes taken as signed, made absolute.
+ */
+unsigned long filter_row_sum(const unsigned char* p, size_t size);
+
+/* "avx2", "sse2" or "c", the version in use */
+const char* filter_kernels_name(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
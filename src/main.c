@@ -1,15 +1,26 @@
 #include <Python.h>
 
+PyObject* set_num_threads(PyObject *self, PyObject *args);
+PyObject* get_num_threads(PyObject *self, PyObject *args);
+int stop_add_types(PyObject* module);
+
 #ifdef PYOPTIPNG_WITH_OPTIPNG
-PyObject* compress_png(PyObject *self, PyObject *args);
+PyObject* compress_png(PyObject *self, PyObject *args, PyObject *kwargs);
 #endif
 
 #ifdef PYOPTIPNG_WITH_ADVANCECOMP
-PyObject* advpng(PyObject *self, PyObject *args);
+PyObject* advpng(PyObject *self, PyObject *args, PyObject *kwargs);
 #endif
 
 #ifdef PYOPTIPNG_WITH_MC_OPNG
-PyObject* mc_compress_png(PyObject *self, PyObject *args);
+PyObject* mc_compress_png(PyObject *self, PyObject *args, PyObject *kwargs);
+PyObject* mc_compress_many(PyObject *self, PyObject *args, PyObject *kwargs);
+PyObject* mc_optimize_file(PyObject *self, PyObject *args, PyObject *kwargs);
+PyObject* mc_optimize_files(PyObject *self, PyObject *args, PyObject *kwargs);
+#endif
+
+#if defined(PYOPTIPNG_WITH_MC_OPNG) && defined(PYOPTIPNG_WITH_ADVANCECOMP)
+PyObject* mc_advpng(PyObject *self, PyObject *args, PyObject *kwargs);
 #endif
 
 //-----------------------------------------------------------------------------
@@ -17,27 +28,65 @@ static PyMethodDef pyoptipng_methods[] = {
 #ifdef PYOPTIPNG_WITH_OPTIPNG
     {
         "compress_png",
-        compress_png,
-        METH_VARARGS,
+        (PyCFunction)(void(*)(void))compress_png,
+        METH_VARARGS | METH_KEYWORDS,
         "compress PNG file"
     },
 #endif
 #ifdef PYOPTIPNG_WITH_ADVANCECOMP
     {
         "advpng",
-        advpng,
-        METH_VARARGS,
+        (PyCFunction)(void(*)(void))advpng,
+        METH_VARARGS | METH_KEYWORDS,
         "recompress PNG file"
     },
 #endif
 #ifdef PYOPTIPNG_WITH_MC_OPNG
     {
         "mc_compress_png",
-        mc_compress_png,
-        METH_VARARGS,
+        (PyCFunction)(void(*)(void))mc_compress_png,
+        METH_VARARGS | METH_KEYWORDS,
         "compress PNG file (multi-core version)"
     },
+    {
+        "mc_compress_many",
+        (PyCFunction)(void(*)(void))mc_compress_many,
+        METH_VARARGS | METH_KEYWORDS,
+        "compress a list of PNG files, returns (data or None, stats) pairs"
+    },
+    {
+        "mc_optimize_file",
+        (PyCFunction)(void(*)(void))mc_optimize_file,
+        METH_VARARGS | METH_KEYWORDS,
+        "optimize PNG file in place if the result is smaller, returns stats"
+    },
+    {
+        "mc_optimize_files",
+        (PyCFunction)(void(*)(void))mc_optimize_files,
+        METH_VARARGS | METH_KEYWORDS,
+        "optimize a list of PNG files in place, returns their stats"
+    },
 #endif
+#if defined(PYOPTIPNG_WITH_MC_OPNG) && defined(PYOPTIPNG_WITH_ADVANCECOMP)
+    {
+        "mc_advpng",
+        (PyCFunction)(void(*)(void))mc_advpng,
+        METH_VARARGS | METH_KEYWORDS,
+        "compress PNG file, the mc_compress_png search finished with zopfli and 7z"
+    },
+#endif
+    {
+        "set_num_threads",
+        set_num_threads,
+        METH_VARARGS,
+        "set the number of worker threads, 0 to follow the CPU affinity and cgroup quota"
+    },
+    {
+        "get_num_threads",
+        get_num_threads,
+        METH_NOARGS,
+        "number of worker threads"
+    },
     {NULL, NULL, 0, NULL}
 };
 
@@ -46,7 +95,9 @@ static PyMethodDef pyoptipng_methods[] = {
 
 PyMODINIT_FUNC init_pyoptipng(void)
 {
-    (void) Py_InitModule("_pyoptipng", pyoptipng_methods);
+    PyObject* module = Py_InitModule("_pyoptipng", pyoptipng_methods);
+    if (module != NULL)
+        (void) stop_add_types(module);
 }
 
 #else /* PY_MAJOR_VERSION >= 3 */
@@ -61,7 +112,13 @@ static struct PyModuleDef pyoptipng_module_def = {
 
 PyMODINIT_FUNC PyInit__pyoptipng(void)
 {
-    return PyModule_Create(&pyoptipng_module_def);
+    PyObject* module = PyModule_Create(&pyoptipng_module_def);
+    if (module != NULL && stop_add_types(module) < 0)
+    {
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
 }
 
 #endif /* PY_MAJOR_VERSION >= 3 */
\ No newline at end of file
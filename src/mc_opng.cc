@@ -1,6 +1,12 @@
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include <stdio.h>
+#include <math.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <png.h>
@@ -9,14 +15,64 @@
 #include <cpuid.h>
 #include <opngreduc.h>
 
-#include <queue>
-#include <list>
+#include "pool.h"
+#include "filter.h"
+#include "palette.h"
+#include "zcache.h"
+#include "arena.h"
+#include "stop.h"
+
+#ifdef PYOPTIPNG_WITH_ADVANCECOMP
+#include "libdeflate/libdeflate.h"
+#include "advcomp.h"
+#endif
 
 #define BUFGRAN     256*1024
 
-#ifdef __linux__
-#define USE_PTHREAD_AFFINITY
-#endif
+/* Input fed to deflate() between two checks of the best IDAT size */
+#define DEFLATE_SLICE   64*1024
+
+/* Largest deflate output buffer a pool thread keeps for the next trial */
+#define DEFLATE_OUTPUT_KEEP 8*1024*1024
+
+/*
+ * Size predictor: images whose filtered stream is at least PREDICT_MIN_SIZE
+ * have every candidate compressed on a sample of PREDICT_SLICES slices of
+ * PREDICT_SLICE bytes, after keeping the PREDICT_FILTERS most promising
+ * filters. Only the PREDICT_TOP_K best predictions are compressed in full.
+ */
+#define PREDICT_MIN_SIZE    512*1024
+#define PREDICT_SLICES      8
+#define PREDICT_SLICE       8*1024
+#define PREDICT_FILTERS     2
+#define PREDICT_TOP_K       4
+
+/*
+ * libdeflate level ranking the filters and palette orders in mc_advpng(),
+ * before zopfli and 7z compress the best of them
+ */
+#define PROXY_LEVEL 6
+
+/*
+ * With a deadline, the adaptive filter at the default zlib level is tried
+ * first, so that the call has a result to return early
+ */
+#define QUICK_FILTER    5
+#define QUICK_LEVEL     6
+
+/*
+ * Filters 6 and 7 pick every row like filter 5, by the entropy of the
+ * filtered bytes and by their deflated size after the rows before, as
+ * advpng does. Only mc_advpng() tries them.
+ */
+#define NUM_FILTERS     8
+#define FILTER_ENTROPY  6
+#define FILTER_DEFLATE  7
+#define FILTER_DEFLATE_WINDOW   8192
+#define FILTER_DEFLATE_LEVEL    1
+
+// The palette as reduced, and the palette_order() methods of the preset
+#define MAX_PALETTE_ORDERS  (1 + PALETTE_ORDER_COUNT)
 
 #define CPUID(INFO, LEAF, SUBLEAF) __cpuid_count(LEAF, SUBLEAF, INFO[0], INFO[1], INFO[2], INFO[3])
 
@@ -33,49 +89,114 @@
         if (CPU < 0) CPU = 0;                          \
       }
 
-struct thread_info {
-    int num;
-    pthread_t id;
-};
-
 struct stream {
     unsigned char* data;
     unsigned long size;
     unsigned long pos;
+    int fixed;      /* data belongs to the caller and can't grow */
+    int overflow;
+};
+
+struct filtered_image {
+    unsigned char* data;
+    unsigned long size;
+    unsigned char* sample;      /* slices of data for the predictor, or NULL */
+    unsigned long sample_size;
+    double sample_scale;        /* data over sample, in order 0 entropy */
+};
+
+struct job_info;
+
+/* The palette, tRNS and bKGD of the image under another palette order */
+struct reordered_palette {
+    png_color palette[256];
+    png_byte trans_alpha[256];
+    int num_trans;
+    png_byte background_index;
+    unsigned char* pixels;      /* remapped rows, until they are filtered */
+    unsigned char** rows;
+};
+
+/* The trials of one image and the best IDAT stream they produced */
+struct trial_set {
+    pool_group group;
+    pthread_mutex_t mutex;
+    unsigned long best_idat_size;
+    unsigned char* data;
+    unsigned long size;
+    int filter_type;
+    int palette_order;
+    int compression_level;
+    int compression_strategy;
+    int compression_mem_level;
+    unsigned order;             /* of the best trial, the first wins ties */
+    unsigned count;
+    unsigned aborted;
+    job_info* candidates;       /* every candidate, while they are probed */
+    unsigned num_candidates;
+    unsigned probes_left;
+    double prediction_error;    /* sum of |predicted - actual| / actual */
+    unsigned predicted;         /* completed trials summed in it */
+    stop_cond* stop;            /* deadline and cancel of the call, NULL if none */
 };
 
 struct job_info {
-    int image_width;
-    int image_height;
-    int bit_depth;
-    int color_type;
-    int interlace;
-    int compression_type;
+    trial_set* trials;
+    const filtered_image* image;
     int filter_type;
+    int palette_order;
     int compression_level;
     int compression_strategy;
     int compression_mem_level;
-    unsigned char** image_rows;
-    int row_bytes;
+    int compression_window_bits;
+    unsigned long predicted_size;   /* 0 without the predictor */
+    unsigned order;                 /* position in the preset, for ties */
+};
+
+/* One image going through mc_opng, from the input to the optimized PNG */
+struct image_job {
+    stream input;
+    int optim_level;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    int image_width;
+    int image_height;
+    int color_type;
+    int bit_depth;
+    int interlace_type;
+    int compression_type;
     png_colorp palette;
     int num_palette;
     png_color_16p background_ptr;
+    png_color_16 background;
     png_bytep trans_alpha;
     int num_trans;
     png_color_16p trans_color_ptr;
     png_color_16 trans_color;
+    filtered_image* filtered[MAX_PALETTE_ORDERS][NUM_FILTERS];   /* by palette order and filter */
+    int filters[NUM_FILTERS];   /* filters tried */
+    int num_filters;
+    reordered_palette* reordered;   /* palette orders 1 and up */
+    int num_orders;
+    trial_set trials;
+    const char* error;
+    stream output;
+    const char* path;   /* file optimized in place, NULL for a buffer */
+    int os_error;       /* errno of the failed file operation */
+    int replaced;
+    int finish;         /* mc_advpng(): the best stream goes through zopfli and 7z */
+    arena memory;       /* libpng structs and rows, released with the job */
 };
 
-struct thread_result {
-    unsigned char* data;
-    unsigned long size;
-};
+/* Room for the filters of a preset, -1 terminated */
+#define PRESET_FILTERS  7
 
 struct optim_preset {
     const int m[10];
     const int c[10];
     const int s[5];
-    const int f[7];
+    const int f[PRESET_FILTERS];
+    const int o[5];     /* palette orders tried besides the reduced palette */
 };
 
 #define MAX_OPTIM_LEVEL 8
@@ -87,68 +208,112 @@ static const int filter_table[] =
     PNG_FILTER_UP,
     PNG_FILTER_AVG,
     PNG_FILTER_PAETH,
+    PNG_ALL_FILTERS,
+    PNG_ALL_FILTERS,
     PNG_ALL_FILTERS
 };
 
+/* How the adaptive filters choose the filter of a row */
+enum row_select {
+    SELECT_SUM,         // least sum of absolute values, as libpng
+    SELECT_ENTROPY,     // least order 0 entropy
+    SELECT_DEFLATE      // smallest deflated size after the rows before
+};
+
+static const row_select filter_select[] =
+{
+    SELECT_SUM,
+    SELECT_SUM,
+    SELECT_SUM,
+    SELECT_SUM,
+    SELECT_SUM,
+    SELECT_SUM,
+    SELECT_ENTROPY,
+    SELECT_DEFLATE
+};
+
 static optim_preset presets[MAX_OPTIM_LEVEL+1] = {
     /*  Optimization level: 0 */ { 
-        .m = { -1 },
-        .c = { -1 },
-        .s = { -1 },
-        .f = { -1 }
+        .m = { 8, -1 },
+        .c = { 9, -1 },
+        .s = { 0, -1 },
+        .f = { 5, -1 },
+        .o = { -1 }
         },
     /*  Optimization level: 1 */ { 
-        .m = { -1 },
-        .c = { -1 },
-        .s = { -1 },
-        .f = { -1 }
+        .m = { 8, -1 },
+        .c = { 9, -1 },
+        .s = { 0, -1 },
+        .f = { 5, -1 },
+        .o = { -1 }
         },
     /*  Optimization level: 2 */ {
         .m = { 8, -1 },
         .c = { 9, -1 },
         .s = { 0, 1, 2, 3, -1 },
-        .f = { 0, 5, -1 }
+        .f = { 0, 5, -1 },
+        .o = { 0, 1, 2, 3, -1 }
         },
     /*  Optimization level: 3 */ {
         .m = { 8, 9, -1 }, 
         .c = { 9, -1 },
         .s = { 0, 1, 2, 3, -1 },
-        .f = { 0, 5, -1 }
+        .f = { 0, 5, -1 },
+        .o = { 0, 1, 2, 3, -1 }
         },
     /*  Optimization level: 4 */ {
         .m = { 8, -1 },
         .c = { 9, -1 },
         .s = { 0, 1, 2, 3, -1 },
-        .f = { 0, 1, 2, 3, 4, 5, -1 }
+        .f = { 0, 1, 2, 3, 4, 5, -1 },
+        .o = { 0, 1, 2, 3, -1 }
         },
     /*  Optimization level: 5 */ {
         .m = { 8, 9, -1 },
         .c = { 9, -1 },
         .s = { 0, 1, 2, 3, -1 },
-        .f = { 0, 1, 2, 3, 4, 5, -1 }
+        .f = { 0, 1, 2, 3, 4, 5, -1 },
+        .o = { 0, 1, 2, 3, -1 }
         },
     /*  Optimization level: 6 */ {
         .m = { 8, -1 },
         .c = { 5, 6, 7, 8, 9, -1 },
         .s = { 0, 1, 2, 3, -1 },
-        .f = { 0, 1, 2, 3, 4, 5, -1 }
+        .f = { 0, 1, 2, 3, 4, 5, -1 },
+        .o = { 0, 1, 2, 3, -1 }
         },
     /*  Optimization level: 7 */ {
         .m = { 8, 9, -1 },
         .c = { 5, 6, 7, 8, 9, -1 },
         .s = { 0, 1, 2, 3, -1 },
-        .f = { 0, 1, 2, 3, 4, 5, -1 }
+        .f = { 0, 1, 2, 3, 4, 5, -1 },
+        .o = { 0, 1, 2, 3, -1 }
         },
     /*  Optimization level: 8 */ {
         .m = { 1, 2, 3, 4, 5, 6, 7, 8, 9, -1 }, 
         .c = { 5, 6, 7, 8, 9, -1 },
         .s = { 0, 1, 2, 3, -1 },
-        .f = { 0, 1, 2, 3, 4, 5, -1 }
+        .f = { 0, 1, 2, 3, 4, 5, -1 },
+        .o = { 0, 1, 2, 3, -1 }
         },
 };
 
-std::queue<job_info*> jobs;
-pthread_mutex_t mutex;
+
+/* Adam7 passes: first column, first row, column step, row step */
+static const int adam7_table[7][4] =
+{
+    { 0, 0, 8, 8 },
+    { 4, 0, 8, 8 },
+    { 0, 4, 4, 8 },
+    { 2, 0, 4, 4 },
+    { 0, 2, 2, 4 },
+    { 1, 0, 2, 2 },
+    { 0, 1, 1, 2 }
+};
+
+/* Deflate output buffer of the pool thread, kept between the trials */
+static __thread unsigned char* deflate_output = NULL;
+static __thread unsigned long deflate_output_size = 0;
 
 void my_error_fn(png_structp png_ptr, png_const_charp error_msg){
     // printf("PNG error: %s\n", error_msg);
@@ -157,9 +322,23 @@ void my_warning_fn(png_structp png_ptr, png_const_charp warning_msg){
     // printf("PNG warning: %s\n", warning_msg);
 }
 
+// libpng allocations go to the arena of the image, its rows among them
+static png_voidp arena_png_malloc(png_structp png_ptr, png_alloc_size_t size)
+{
+    return arena_alloc((arena*)png_get_mem_ptr(png_ptr), size);
+}
+
+static void arena_png_free(png_structp png_ptr, png_voidp ptr)
+{
+    arena_free((arena*)png_get_mem_ptr(png_ptr), ptr);
+}
+
 static void custom_read_png(png_structp png_ptr, unsigned char* buf, unsigned long size) {
     stream* png_stream = (stream*)png_get_io_ptr(png_ptr);
 
+    if (size > png_stream->size - png_stream->pos)
+        png_error(png_ptr, "Truncated PNG file");
+
     memcpy(buf, png_stream->data+png_stream->pos, size);
     png_stream->pos += size;
 }
@@ -167,308 +346,1621 @@ static void custom_read_png(png_structp png_ptr, unsigned char* buf, unsigned lo
 static void custom_write_png(png_structp png_ptr, unsigned char* buf, unsigned long size) {
     stream* png_stream = (stream*)png_get_io_ptr(png_ptr);
 
-    while (png_stream->pos + size > png_stream->size) {
-        png_stream->data = (unsigned char*)realloc(png_stream->data, png_stream->size + BUFGRAN);
-        png_stream->size += BUFGRAN;
+    if (png_stream->pos + size > png_stream->size) {
+        if (png_stream->fixed) {
+            png_stream->overflow = 1;
+            png_error(png_ptr, "Output buffer too small");
+        }
+        // Grows geometrically, a large image doesn't go through a long
+        // series of reallocs
+        unsigned long new_size = png_stream->size + png_stream->size / 2 + BUFGRAN;
+        if (new_size < png_stream->pos + size)
+            new_size = png_stream->pos + size;
+        png_stream->data = (unsigned char*)realloc(png_stream->data, new_size);
+        png_stream->size = new_size;
     }
     memcpy(png_stream->data+png_stream->pos, buf, size);
     png_stream->pos += size;
 }
 
-static void* worker(void *arg)
+static int get_channels(int color_type)
+{
+    switch (color_type) {
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+        return 2;
+    case PNG_COLOR_TYPE_RGB:
+        return 3;
+    case PNG_COLOR_TYPE_RGB_ALPHA:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+static unsigned long get_row_bytes(int pixel_depth, png_uint_32 width)
 {
-    thread_info* info = (thread_info*)arg;
-    int cpu = 0;
-    GETCPU(cpu);
+    return ((unsigned long)width * pixel_depth + 7) >> 3;
+}
 
-    stream output;
-    thread_result* result = (thread_result*)malloc(sizeof(thread_result));
-    result->data = NULL;
-    result->size = 0;
-
-    output.data = (unsigned char *)malloc(BUFGRAN);
-    output.size = BUFGRAN;
-    output.pos = 0;
-
-    // printf("Thread %d on CPU %d\n", info->num, cpu);
-    
-    while(1) {
-        pthread_mutex_lock(&mutex);
-            if (jobs.empty()) {
-                pthread_mutex_unlock(&mutex);
-                break;
-            }
-            job_info* job = jobs.front();
-            jobs.pop();
-        pthread_mutex_unlock(&mutex);
+// Filters libpng would really use for the image, see png_write_start_row()
+static int get_allowed_filters(int filters, png_uint_32 width, png_uint_32 height)
+{
+    if (height == 1)
+        filters &= ~(PNG_FILTER_UP|PNG_FILTER_AVG|PNG_FILTER_PAETH);
+    if (width == 1)
+        filters &= ~(PNG_FILTER_SUB|PNG_FILTER_AVG|PNG_FILTER_PAETH);
+    if (filters == 0)
+        filters = PNG_FILTER_NONE;
+    return filters;
+}
 
-        png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, my_error_fn, my_warning_fn);
-        if (!png_ptr) {
-            free(job);
+// Zeroes the bits past the last pixel of the rows of less than 8 bits per
+// pixel. libpng leaves them as they were in the row buffer, and the output
+// would change from run to run.
+static void clear_row_padding(unsigned char** rows, png_uint_32 width, png_uint_32 height, int pixel_depth)
+{
+    unsigned bits = (unsigned long)width * pixel_depth & 7;
+
+    if (bits == 0)
+        return;
+    unsigned char mask = 0xff << (8 - bits);
+    unsigned long last = get_row_bytes(pixel_depth, width) - 1;
+    for (png_uint_32 i = 0; i < height; i++)
+        rows[i][last] &= mask;
+}
+
+// Gathers the pixels of an Adam7 pass row, packed as in a non interlaced row
+static void extract_pass_row(unsigned char* dst, const unsigned char* row, int x0, int dx, png_uint_32 pass_width, int pixel_depth)
+{
+    if (pixel_depth >= 8) {
+        int bpp = pixel_depth >> 3;
+        for (png_uint_32 i = 0; i < pass_width; i++)
+            memcpy(dst + i*bpp, row + (x0 + i*dx)*bpp, bpp);
+        return;
+    }
+
+    int mask = (1 << pixel_depth) - 1;
+    memset(dst, 0, get_row_bytes(pixel_depth, pass_width));
+    for (png_uint_32 i = 0; i < pass_width; i++) {
+        png_uint_32 src_bit = (x0 + i*dx) * pixel_depth;
+        png_uint_32 dst_bit = i * pixel_depth;
+        int v = (row[src_bit >> 3] >> (8 - pixel_depth - (src_bit & 7))) & mask;
+        dst[dst_bit >> 3] |= v << (8 - pixel_depth - (dst_bit & 7));
+    }
+}
+
+// Order 0 entropy of the bytes, in bits
+static double entropy_bits(const unsigned char* data, unsigned long size)
+{
+    unsigned long counts[256] = { 0 };
+    double bits = 0;
+
+    for (unsigned long i = 0; i < size; i++)
+        counts[data[i]]++;
+    for (int c = 0; c < 256; c++)
+        if (counts[c])
+            bits -= counts[c] * log2((double)counts[c] / size);
+    return bits;
+}
+
+/*
+ * Builds the uncompressed IDAT stream of the image (the filter type byte
+ * followed by the filtered row, for each row of each pass) with the given
+ * libpng filter mask. With more than one filter the row is chosen as
+ * select says, with SELECT_SUM like png_write_find_filter() does.
+ */
+static filtered_image* filter_image(int filters, row_select select, unsigned char** image_rows, png_uint_32 width, png_uint_32 height, int pixel_depth, int interlace)
+{
+    int bpp = (pixel_depth + 7) >> 3;
+    int num_passes = interlace == PNG_INTERLACE_ADAM7 ? 7 : 1;
+    unsigned long max_row_bytes = get_row_bytes(pixel_depth, width);
+    static const int filter_values[] = {
+        PNG_FILTER_VALUE_SUB,
+        PNG_FILTER_VALUE_UP,
+        PNG_FILTER_VALUE_AVG,
+        PNG_FILTER_VALUE_PAETH
+    };
+    static const int filter_masks[] = {
+        PNG_FILTER_SUB,
+        PNG_FILTER_UP,
+        PNG_FILTER_AVG,
+        PNG_FILTER_PAETH
+    };
+
+    filtered_image* image = (filtered_image*)malloc(sizeof(filtered_image));
+    memset(image, 0, sizeof(filtered_image));
+    for (int pass = 0; pass < num_passes; pass++) {
+        png_uint_32 x0 = num_passes > 1 ? adam7_table[pass][0] : 0;
+        png_uint_32 y0 = num_passes > 1 ? adam7_table[pass][1] : 0;
+        png_uint_32 dx = num_passes > 1 ? adam7_table[pass][2] : 1;
+        png_uint_32 dy = num_passes > 1 ? adam7_table[pass][3] : 1;
+        if (width <= x0 || height <= y0)
             continue;
+        image->size += ((height - y0 + dy - 1) / dy) * (get_row_bytes(pixel_depth, (width - x0 + dx - 1) / dx) + 1);
+    }
+    image->data = (unsigned char*)malloc(image->size);
+
+    unsigned char* zero = (unsigned char*)calloc(max_row_bytes, 1);
+    unsigned char* pass_rows[2];
+    pass_rows[0] = (unsigned char*)malloc(max_row_bytes);
+    pass_rows[1] = (unsigned char*)malloc(max_row_bytes);
+    unsigned char* try_row = (unsigned char*)malloc(max_row_bytes + 1);
+    unsigned char* best_row = (unsigned char*)malloc(max_row_bytes + 1);
+
+#ifdef PYOPTIPNG_WITH_ADVANCECOMP
+    struct libdeflate_compressor* compressor = NULL;
+    unsigned char* z_buf = NULL;
+    size_t z_size = 0;
+    if (select == SELECT_DEFLATE) {
+        compressor = zcache_libdeflate_get(FILTER_DEFLATE_LEVEL);
+        if (compressor != NULL) {
+            z_size = libdeflate_deflate_compress_bound(compressor, FILTER_DEFLATE_WINDOW + max_row_bytes + 1);
+            z_buf = (unsigned char*)malloc(z_size);
         }
+    }
+#endif
 
-        png_infop info_ptr = png_create_info_struct(png_ptr);
-        if (!info_ptr) {
-            png_destroy_write_struct(&png_ptr, NULL);
-            free(job);
+    unsigned char* dst = image->data;
+    for (int pass = 0; pass < num_passes; pass++) {
+        png_uint_32 x0 = num_passes > 1 ? adam7_table[pass][0] : 0;
+        png_uint_32 y0 = num_passes > 1 ? adam7_table[pass][1] : 0;
+        png_uint_32 dx = num_passes > 1 ? adam7_table[pass][2] : 1;
+        png_uint_32 dy = num_passes > 1 ? adam7_table[pass][3] : 1;
+        if (width <= x0 || height <= y0)
             continue;
-        }
 
-        png_set_compression_level(png_ptr, job->compression_level);
-        png_set_compression_mem_level(png_ptr, job->compression_mem_level);
-        png_set_compression_strategy(png_ptr, job->compression_strategy);
-        png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, filter_table[job->filter_type]);
-        // png_set_compression_window_bits(png_ptr, 15);
-
-        output.pos = 0;
-        png_set_write_fn(png_ptr, &output, custom_write_png, NULL);
-
-        png_set_IHDR(png_ptr, info_ptr,
-            job->image_width,
-            job->image_height,
-            job->bit_depth,
-            job->color_type,
-            job->interlace,
-            job->compression_type,
-            PNG_FILTER_TYPE_DEFAULT
-            );
-
-        png_set_user_limits(png_ptr, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
-        png_set_rows(png_ptr, info_ptr, job->image_rows);
-
-        if (job->color_type == PNG_COLOR_TYPE_PALETTE) {
-            png_set_PLTE(png_ptr, info_ptr, job->palette, 1<<job->bit_depth);
+        png_uint_32 pass_width = (width - x0 + dx - 1) / dx;
+        png_uint_32 pass_height = (height - y0 + dy - 1) / dy;
+        unsigned long row_bytes = get_row_bytes(pixel_depth, pass_width);
+        const unsigned char* prev = zero;
+
+        for (png_uint_32 j = 0; j < pass_height; j++) {
+            const unsigned char* row = image_rows[y0 + j*dy];
+            if (num_passes > 1) {
+                extract_pass_row(pass_rows[j & 1], row, x0, dx, pass_width, pixel_depth);
+                row = pass_rows[j & 1];
+            }
+
+            if (filters == PNG_FILTER_NONE) {
+                filter_row(PNG_FILTER_VALUE_NONE, dst, row, prev, row_bytes, bpp);
+            } else if (filters == PNG_FILTER_SUB || filters == PNG_FILTER_UP
+                || filters == PNG_FILTER_AVG || filters == PNG_FILTER_PAETH) {
+                for (int f = 0; f < 4; f++)
+                    if (filters == filter_masks[f])
+                        filter_row(filter_values[f], dst, row, prev, row_bytes, bpp);
+            } else {
+                double min_score = 0;
+                int have_best = 0;
+
+                for (int f = -1; f < 4; f++) {
+                    if ((filters & (f < 0 ? PNG_FILTER_NONE : filter_masks[f])) == 0)
+                        continue;
+                    filter_row(f < 0 ? PNG_FILTER_VALUE_NONE : filter_values[f], try_row, row, prev, row_bytes, bpp);
+
+                    double score;
+                    if (select == SELECT_ENTROPY) {
+                        score = entropy_bits(try_row + 1, row_bytes);
+#ifdef PYOPTIPNG_WITH_ADVANCECOMP
+                    } else if (select == SELECT_DEFLATE && z_buf != NULL) {
+                        // The row goes after the rows already filtered, which
+                        // are the dictionary of its deflated size
+                        unsigned long window = dst - image->data;
+                        if (window > FILTER_DEFLATE_WINDOW)
+                            window = FILTER_DEFLATE_WINDOW;
+                        memcpy(dst, try_row, row_bytes + 1);
+                        score = libdeflate_deflate_compress(compressor, dst - window, window + row_bytes + 1, z_buf, z_size);
+#endif
+                    } else {
+                        score = filter_row_sum(try_row + 1, row_bytes);
+                    }
+
+                    if (!have_best || score < min_score) {
+                        unsigned char* tmp = best_row;
+                        best_row = try_row;
+                        try_row = tmp;
+                        min_score = score;
+                        have_best = 1;
+                    }
+                }
+                memcpy(dst, best_row, row_bytes + 1);
+            }
+
+            dst += row_bytes + 1;
+            prev = row;
         }
+    }
 
-        if (job->trans_alpha != NULL || job->trans_color_ptr != NULL)
-            png_set_tRNS(png_ptr, info_ptr,
-                job->trans_alpha, job->num_trans, job->trans_color_ptr);
+#ifdef PYOPTIPNG_WITH_ADVANCECOMP
+    free(z_buf);
+    zcache_libdeflate_put(compressor);
+#endif
+    free(best_row);
+    free(try_row);
+    free(pass_rows[1]);
+    free(pass_rows[0]);
+    free(zero);
 
-        if (job->background_ptr != NULL)
-            png_set_bKGD(png_ptr, info_ptr, job->background_ptr);
+    return image;
+}
 
-        png_write_png(png_ptr, info_ptr, 0, NULL);
+static void free_filtered_image(filtered_image* image)
+{
+    if (image == NULL)
+        return;
+    free(image->sample);
+    free(image->data);
+    free(image);
+}
 
-        png_destroy_write_struct(&png_ptr, &info_ptr);
+/*
+ * Picks evenly spaced slices of the filtered stream for the predictor.
+ * The compressed size of the sample is scaled by the entropy of the
+ * whole stream over the entropy of the sample, rather than by their
+ * sizes, so that a sample falling on flat areas doesn't predict a busy
+ * image too small.
+ */
+static void sample_filtered_image(filtered_image* image)
+{
+    image->sample_size = PREDICT_SLICES * PREDICT_SLICE;
+    image->sample = (unsigned char*)malloc(image->sample_size);
+    for (int i = 0; i < PREDICT_SLICES; i++) {
+        unsigned long start = (image->size - PREDICT_SLICE) / (PREDICT_SLICES - 1) * i;
+        memcpy(image->sample + i * PREDICT_SLICE, image->data + start, PREDICT_SLICE);
+    }
 
-        // printf("zc = %d, zm = %d, zs = %d, f = %d, size: %d\n",
-        //     job->compression_level,
-        //     job->compression_mem_level,
-        //     job->compression_strategy,
-        //     job->filter_type,
-        //     output.pos);
+    double sample_bits = entropy_bits(image->sample, image->sample_size);
+    double data_bits = entropy_bits(image->data, image->size);
+    if (sample_bits > 0 && data_bits > 0)
+        image->sample_scale = data_bits / sample_bits;
+    else
+        image->sample_scale = (double)image->size / image->sample_size;
+}
 
-        if (result->data == NULL) {
-            result->data = (unsigned char*)malloc(output.pos);
-            result->size = output.pos;
-            memcpy(result->data, output.data, output.pos);
-        } else {
-            if (output.pos < result->size && output.pos > 0) {
-                result->data = (unsigned char*)realloc(result->data, output.pos);
-                result->size = output.pos;
-                memcpy(result->data, output.data, output.pos);
-            }
+// Smallest deflate window that covers the data, as png_deflate_claim() does
+static int get_window_bits(unsigned long data_size)
+{
+    int window_bits = 15;
+
+    if (data_size <= 16384) {
+        unsigned long half_window_size = 1UL << (window_bits - 1);
+        while (window_bits > 9 && data_size + 262 <= half_window_size) {
+            half_window_size >>= 1;
+            window_bits--;
         }
+    }
+    return window_bits;
+}
+
+static int get_preset_length(const int* values)
+{
+    int length = 0;
 
+    while (values[length] != -1)
+        length++;
+    return length;
+}
+
+static int get_preset_count(const optim_preset* preset)
+{
+    return get_preset_length(preset->m) * get_preset_length(preset->c)
+        * get_preset_length(preset->s) * get_preset_length(preset->f);
+}
+
+static void update_best_idat_size(unsigned long* best_idat_size, unsigned long size)
+{
+    unsigned long best = __atomic_load_n(best_idat_size, __ATOMIC_RELAXED);
+
+    while (size < best
+        && !__atomic_compare_exchange_n(best_idat_size, &best, size, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Deflate output buffer of the thread, of at least size bytes
+static void reserve_deflate_output(unsigned long size)
+{
+    if (size > deflate_output_size) {
+        deflate_output = (unsigned char*)realloc(deflate_output, size);
+        deflate_output_size = size;
+    }
+}
+
+// Don't hold on to the buffer of a big image
+static void trim_deflate_output()
+{
+    if (deflate_output_size > DEFLATE_OUTPUT_KEEP) {
+        free(deflate_output);
+        deflate_output = NULL;
+        deflate_output_size = 0;
+    }
+}
+
+/*
+ * Whether the work left is to be given up: past the deadline as soon as a
+ * trial has completed so that there is a result to write, at once if the
+ * call is cancelled
+ */
+static int trials_stopped(trial_set* trials)
+{
+    if (trials->stop == NULL)
+        return 0;
+
+    int stop = stop_requested(trials->stop);
+    return stop == STOP_CANCEL
+        || (stop && __atomic_load_n(&trials->best_idat_size, __ATOMIC_RELAXED) != ~0UL);
+}
+
+static int trials_cancelled(trial_set* trials)
+{
+    return trials->stop != NULL && stop_requested(trials->stop) == STOP_CANCEL;
+}
+
+/* Keeps the IDAT stream of a finished trial, left in deflate_output, if it is the best */
+static void keep_trial(job_info* job, unsigned long size)
+{
+    trial_set* trials = job->trials;
+
+    update_best_idat_size(&trials->best_idat_size, size);
+
+    pthread_mutex_lock(&trials->mutex);
+    if (job->predicted_size) {
+        trials->prediction_error += fabs((double)job->predicted_size - size) / size;
+        trials->predicted++;
+    }
+    if (trials->data == NULL || size < trials->size
+        || (size == trials->size && job->order < trials->order)) {
+        trials->data = (unsigned char*)realloc(trials->data, size);
+        trials->size = size;
+        memcpy(trials->data, deflate_output, size);
+        trials->order = job->order;
+        trials->filter_type = job->filter_type;
+        trials->palette_order = job->palette_order;
+        trials->compression_level = job->compression_level;
+        trials->compression_strategy = job->compression_strategy;
+        trials->compression_mem_level = job->compression_mem_level;
+    }
+    pthread_mutex_unlock(&trials->mutex);
+}
+
+static void run_trial(void *arg)
+{
+    job_info* job = (job_info*)arg;
+    trial_set* trials = job->trials;
+
+    if (trials_stopped(trials)) {
+        __atomic_add_fetch(&trials->aborted, 1, __ATOMIC_RELAXED);
         free(job);
+        return;
     }
 
-    free(output.data);
+    z_stream* zstream = zcache_deflate_get(job->compression_level,
+        job->compression_window_bits, job->compression_mem_level,
+        job->compression_strategy);
+    if (zstream == NULL) {
+        __atomic_add_fetch(&trials->aborted, 1, __ATOMIC_RELAXED);
+        free(job);
+        return;
+    }
 
-    return result;
+    reserve_deflate_output(deflateBound(zstream, job->image->size));
+
+    zstream->next_in = (Bytef*)job->image->data;
+    zstream->next_out = deflate_output;
+    zstream->avail_out = deflate_output_size;
+
+    // Like opng_write_data(), give up as soon as the trial can't win, or
+    // past the deadline
+    unsigned long remaining = job->image->size;
+    int ret;
+    do {
+        unsigned long slice = remaining < DEFLATE_SLICE ? remaining : DEFLATE_SLICE;
+        zstream->avail_in = slice;
+        remaining -= slice;
+        ret = deflate(zstream, remaining ? Z_NO_FLUSH : Z_FINISH);
+    } while (ret == Z_OK
+        && zstream->total_out < __atomic_load_n(&trials->best_idat_size, __ATOMIC_RELAXED)
+        && !trials_stopped(trials));
+    unsigned long size = zstream->total_out;
+    zcache_deflate_put(zstream);
+
+    // printf("zc = %d, zm = %d, zs = %d, f = %d, size: %d\n",
+    //     job->compression_level,
+    //     job->compression_mem_level,
+    //     job->compression_strategy,
+    //     job->filter_type,
+    //     size);
+
+    if (ret == Z_STREAM_END)
+        keep_trial(job, size);
+    else
+        __atomic_add_fetch(&trials->aborted, 1, __ATOMIC_RELAXED);
+
+    trim_deflate_output();
+    free(job);
 }
 
-extern "C" {
+#ifdef PYOPTIPNG_WITH_ADVANCECOMP
+/*
+ * Trial of mc_advpng(): libdeflate at PROXY_LEVEL stands for zopfli, whose
+ * sizes follow it closely enough to rank the filters and palette orders
+ */
+static void run_proxy(void* arg)
+{
+    job_info* job = (job_info*)arg;
 
-PyObject* mc_compress_png(PyObject *self, PyObject *args)
+    if (trials_stopped(job->trials)) {
+        __atomic_add_fetch(&job->trials->aborted, 1, __ATOMIC_RELAXED);
+        free(job);
+        return;
+    }
+
+    struct libdeflate_compressor* compressor = zcache_libdeflate_get(job->compression_level);
+    if (compressor == NULL) {
+        free(job);
+        return;
+    }
+
+    reserve_deflate_output(libdeflate_zlib_compress_bound(compressor, job->image->size));
+    unsigned long size = libdeflate_zlib_compress(compressor, job->image->data, job->image->size,
+        deflate_output, deflate_output_size);
+    zcache_libdeflate_put(compressor);
+
+    if (size != 0)
+        keep_trial(job, size);
+
+    trim_deflate_output();
+    free(job);
+}
+#endif
+
+// Compressed size of the sample with the given settings, scaled to the
+// whole filtered stream
+static unsigned long predict_size(const filtered_image* image, int level, int window_bits, int mem_level, int strategy)
 {
-    stream png;
-    int optim_level;
-    unsigned char** image_rows = NULL;
-    png_colorp palette = NULL;
-    int num_palette;
-    thread_info** threads = NULL;
-    png_color_16p background_ptr = NULL;
-    png_color_16 background;
-    png_bytep trans_alpha = NULL;
-    int num_trans;
-    png_color_16p trans_color_ptr = NULL;
-    png_color_16 trans_color;
+    z_stream* zstream = zcache_deflate_get(level, window_bits, mem_level, strategy);
+    if (zstream == NULL)
+        return ~0UL;
+
+    reserve_deflate_output(deflateBound(zstream, image->sample_size));
+
+    zstream->next_in = (Bytef*)image->sample;
+    zstream->avail_in = image->sample_size;
+    zstream->next_out = deflate_output;
+    zstream->avail_out = deflate_output_size;
+    int ret = deflate(zstream, Z_FINISH);
+    unsigned long size = zstream->total_out;
+    zcache_deflate_put(zstream);
+
+    if (ret != Z_STREAM_END)
+        return ~0UL;
+    return (unsigned long)(size * image->sample_scale + 0.5);
+}
 
-    png.pos = 0;
+// Best prediction first, the preset order breaking ties
+static int compare_candidates(const void* a, const void* b)
+{
+    const job_info* x = (const job_info*)a;
+    const job_info* y = (const job_info*)b;
+
+    if (x->predicted_size != y->predicted_size)
+        return x->predicted_size < y->predicted_size ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/* Pool task predicting one candidate, the last one queues the trials */
+static void run_probe(void* arg)
+{
+    job_info* candidate = (job_info*)arg;
+    trial_set* trials = candidate->trials;
+
+    // Past the deadline the trials are abandoned anyway, they aren't ranked
+    if (!trials_stopped(trials))
+        candidate->predicted_size = predict_size(candidate->image,
+            candidate->compression_level, candidate->compression_window_bits,
+            candidate->compression_mem_level, candidate->compression_strategy);
+
+    if (__atomic_sub_fetch(&trials->probes_left, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    qsort(trials->candidates, trials->num_candidates, sizeof(job_info), compare_candidates);
+    for(unsigned i=0; i<trials->num_candidates && i<PREDICT_TOP_K; i++) {
+        job_info* job = (job_info*)malloc(sizeof(job_info));
+        *job = trials->candidates[i];
+        trials->count++;
+        pool_submit(&trials->group, run_trial, job);
+    }
+    free(trials->candidates);
+    trials->candidates = NULL;
+}
 
-    if (!PyArg_ParseTuple(args, "s#|i", &png.data, &png.size, &optim_level))
+/*
+ * Maps the file of the job as its input. Returns NULL on success, or the
+ * error message with os_error set.
+ */
+static const char* map_file(image_job* image)
+{
+    struct stat st;
+
+    int fd = open(image->path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        image->os_error = errno;
+        if (fd >= 0)
+            close(fd);
+        return "Cannot open file";
+    }
+
+    // An empty file fails as any other invalid PNG
+    if (st.st_size > 0)
+    {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            image->os_error = errno;
+            close(fd);
+            return "Cannot map file";
+        }
+        image->input.data = (unsigned char*)data;
+        image->input.size = st.st_size;
+    }
+    close(fd);
+
+    return NULL;
+}
+
+/*
+ * Replaces the file of the job with the output if it is smaller. The PNG
+ * goes to a temporary file in the same directory first, which is renamed
+ * over the original, so that the file is never left half written.
+ */
+static const char* replace_file(image_job* image)
+{
+    struct stat st;
+
+    if (image->output.pos >= image->input.size)
         return NULL;
 
-    int is_png = !png_sig_cmp((png_const_bytep)png.data, 0, 8);
+    // A symlink stays, the file it points to is replaced
+    char* path = realpath(image->path, NULL);
+    if (path == NULL)
+    {
+        image->os_error = errno;
+        return "Cannot resolve path";
+    }
+
+    if (stat(path, &st) != 0)
+    {
+        image->os_error = errno;
+        free(path);
+        return "Cannot stat file";
+    }
+
+    size_t path_len = strlen(path);
+    char* temp_path = (char*)malloc(path_len + 8);
+    memcpy(temp_path, path, path_len);
+    memcpy(temp_path + path_len, ".XXXXXX", 8);
+
+    int fd = mkstemp(temp_path);
+    if (fd < 0)
+    {
+        image->os_error = errno;
+        free(temp_path);
+        free(path);
+        return "Cannot create temporary file";
+    }
+
+    int error = 0;
+    const unsigned char* data = image->output.data;
+    unsigned long left = image->output.pos;
+    while (left > 0)
+    {
+        ssize_t written = write(fd, data, left);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+        {
+            error = written < 0 ? errno : EIO;
+            break;
+        }
+        data += written;
+        left -= written;
+    }
+
+    // The owner can only be kept by root, or the group by a member of it.
+    // It goes before the mode, which a change of owner may clear bits of.
+    if (error == 0)
+        (void)fchown(fd, st.st_uid, st.st_gid); // best effort, else it stays the caller's
+    // On disk before the rename, a crash doesn't leave an empty file
+    if (error == 0 && (fchmod(fd, st.st_mode & 07777) != 0 || fsync(fd) != 0))
+        error = errno;
+    if (close(fd) != 0 && error == 0)
+        error = errno;
+    if (error == 0 && rename(temp_path, path) != 0)
+        error = errno;
+
+    free(path);
+    if (error != 0)
+    {
+        image->os_error = error;
+        unlink(temp_path);
+        free(temp_path);
+        return "Cannot write file";
+    }
+
+    free(temp_path);
+    image->replaced = 1;
+    return NULL;
+}
+
+// Byte to byte table applying the index map to every pixel packed in a byte
+static void build_remap_table(unsigned char* table, const unsigned char* map, int bit_depth)
+{
+    int mask = (1 << bit_depth) - 1;
+
+    for (int b = 0; b < 256; b++) {
+        int value = 0;
+        for (int shift = 0; shift < 8; shift += bit_depth)
+            value |= map[(b >> shift) & mask] << shift;
+        table[b] = (unsigned char)value;
+    }
+}
+
+/*
+ * Adds the palette orders of the preset that differ from the reduced
+ * palette and from each other, with the rows remapped to each of them.
+ */
+static void reorder_palette(image_job* image, unsigned char** image_rows)
+{
+    optim_preset* preset = &presets[image->optim_level];
+    int num = image->num_palette;
+    unsigned long row_bytes = get_row_bytes(image->bit_depth, image->image_width);
+    unsigned char rgba[256*4];
+    unsigned char orders[MAX_PALETTE_ORDERS][256];
+
+    palette_stats* stats = (palette_stats*)malloc(sizeof(palette_stats));
+    palette_stats_init(stats);
+    for(int i=0; i<image->image_height; i++)
+        palette_stats_add_row(stats, image_rows[i], i > 0 ? image_rows[i-1] : NULL, image->image_width, image->bit_depth);
+
+    for(int i=0; i<num; i++) {
+        rgba[i*4] = image->palette[i].red;
+        rgba[i*4+1] = image->palette[i].green;
+        rgba[i*4+2] = image->palette[i].blue;
+        rgba[i*4+3] = image->trans_alpha != NULL && i < image->num_trans ? image->trans_alpha[i] : 255;
+        orders[0][i] = i;
+    }
+
+    image->reordered = (reordered_palette*)calloc(MAX_PALETTE_ORDERS - 1, sizeof(reordered_palette));
+    for(int o=0; preset->o[o] != -1; o++) {
+        unsigned char* order = orders[image->num_orders];
+        palette_order(preset->o[o], stats, rgba, num, order);
+
+        int same = 0;
+        for(int k=0; k<image->num_orders && !same; k++)
+            same = !memcmp(orders[k], order, num);
+        if (same)
+            continue;
+
+        reordered_palette* reordered = &image->reordered[image->num_orders - 1];
+        unsigned char map[256];
+        for(int i=0; i<256; i++)
+            map[i] = i;
+        for(int i=0; i<num; i++)
+            map[order[i]] = i;
+
+        memcpy(reordered->palette, image->palette, sizeof(png_color) << image->bit_depth);
+        for(int i=0; i<num; i++) {
+            reordered->palette[i] = image->palette[order[i]];
+            reordered->trans_alpha[i] = rgba[order[i]*4+3];
+            if (reordered->trans_alpha[i] != 255)
+                reordered->num_trans++;
+        }
+        reordered->background_index = map[image->background.index];
+
+        unsigned char table[256];
+        build_remap_table(table, map, image->bit_depth);
+        reordered->pixels = (unsigned char*)malloc(row_bytes * image->image_height);
+        reordered->rows = (unsigned char**)malloc(sizeof(unsigned char*) * image->image_height);
+        for(int i=0; i<image->image_height; i++) {
+            unsigned char* row = reordered->pixels + row_bytes * i;
+            for(unsigned long j=0; j<row_bytes; j++)
+                row[j] = table[image_rows[i][j]];
+            reordered->rows[i] = row;
+        }
+        clear_row_padding(reordered->rows, image->image_width, image->image_height, image->bit_depth);
+        image->num_orders++;
+    }
+
+    free(stats);
+}
+
+// Remapped rows aren't needed once the image is filtered
+static void free_reordered_rows(image_job* image)
+{
+    for(int o=1; o<image->num_orders; o++) {
+        free(image->reordered[o-1].rows);
+        free(image->reordered[o-1].pixels);
+        image->reordered[o-1].rows = NULL;
+        image->reordered[o-1].pixels = NULL;
+    }
+}
+
+static void free_reordered_palettes(image_job* image)
+{
+    if (image->reordered != NULL)
+        free_reordered_rows(image);
+    free(image->reordered);
+    image->reordered = NULL;
+    image->num_orders = 1;
+}
+
+/* pool_for task filtering the image in one palette order with one filter */
+static void filter_order(void* arg, size_t i)
+{
+    image_job* image = (image_job*)arg;
+    optim_preset* preset = &presets[image->optim_level];
+    int order = i / image->num_filters;
+    int filter_type = image->filters[i % image->num_filters];
+
+    // Done by submit_quick_trial(), or not needed past the deadline
+    if (image->filtered[order][filter_type] != NULL || trials_stopped(&image->trials))
+        return;
+
+    unsigned char** rows = order > 0 ? image->reordered[order-1].rows : png_get_rows(image->png_ptr, image->info_ptr);
+
+    int pixel_depth = image->bit_depth * get_channels(image->color_type);
+    int filters = get_allowed_filters(filter_table[filter_type], image->image_width, image->image_height);
+    filtered_image* filtered = filter_image(filters, filter_select[filter_type], rows,
+        image->image_width, image->image_height, pixel_depth, image->interlace_type);
+    if (!image->finish && get_preset_count(preset) > PREDICT_TOP_K && filtered->size >= PREDICT_MIN_SIZE)
+        sample_filtered_image(filtered);
+    image->filtered[order][filter_type] = filtered;
+}
+
+static void init_image_job(image_job* image, const unsigned char* data, unsigned long size, int optim_level)
+{
+    memset(image, 0, sizeof(image_job));
+    image->input.data = (unsigned char*)data;
+    image->input.size = size;
+    image->optim_level = optim_level;
+    image->num_orders = 1;
+
+    pool_group_init(&image->trials.group);
+    pthread_mutex_init(&image->trials.mutex, NULL);
+    image->trials.best_idat_size = ~0UL;
+    arena_init(&image->memory);
+}
+
+/* Frees everything but the output, which goes to the caller */
+static void release_image_job(image_job* image)
+{
+    for(int o=0; o<MAX_PALETTE_ORDERS; o++) {
+        for(int f=0; f<NUM_FILTERS; f++) {
+            free_filtered_image(image->filtered[o][f]);
+            image->filtered[o][f] = NULL;
+        }
+    }
+    free_reordered_palettes(image);
+
+    free(image->trials.data);
+    image->trials.data = NULL;
+    free(image->trials.candidates);
+    image->trials.candidates = NULL;
+
+    if (image->png_ptr)
+        png_destroy_read_struct(&image->png_ptr, &image->info_ptr, NULL);
+    arena_release(&image->memory);
+
+    pool_group_destroy(&image->trials.group);
+    pthread_mutex_destroy(&image->trials.mutex);
+}
+
+/*
+ * Filters the image for the quick trial and queues it, ahead of the other
+ * filters. Ties go to the trials of the preset.
+ */
+static void submit_quick_trial(image_job* image)
+{
+    int f = 0;
+
+    while (f < image->num_filters - 1 && image->filters[f] != QUICK_FILTER)
+        f++;
+    filter_order(image, f);
+    if (image->filtered[0][image->filters[f]] == NULL)
+        return;
+
+    job_info* job = (job_info*)malloc(sizeof(job_info));
+    memset(job, 0, sizeof(job_info));
+    job->trials = &image->trials;
+    job->image = image->filtered[0][image->filters[f]];
+    job->filter_type = image->filters[f];
+    job->order = ~0U;
+    image->trials.count++;
+
+#ifdef PYOPTIPNG_WITH_ADVANCECOMP
+    if (image->finish) {
+        job->compression_level = PROXY_LEVEL;
+        pool_submit(&image->trials.group, run_proxy, job);
+        return;
+    }
+#endif
+
+    job->compression_level = QUICK_LEVEL;
+    job->compression_mem_level = 8;
+    job->compression_strategy = Z_DEFAULT_STRATEGY;
+    job->compression_window_bits = get_window_bits(job->image->size);
+    pool_submit(&image->trials.group, run_trial, job);
+}
+
+/*
+ * Decodes and reduces the image, and filters it with every filter of the
+ * preset. Returns NULL on success, or the error message.
+ */
+static const char* read_image(image_job* image)
+{
+    int is_png = image->input.size >= 8 && !png_sig_cmp((png_const_bytep)image->input.data, 0, 8);
 
     if(!is_png)
     {
-        PyErr_SetString(PyExc_ValueError, "Not valid PNG file");
-        return NULL;
+        return "Not valid PNG file";
     }
 
-    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, my_error_fn, my_warning_fn);
-    if (!png_ptr)
+    image->png_ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, my_error_fn, my_warning_fn,
+        &image->memory, arena_png_malloc, arena_png_free);
+    if (!image->png_ptr)
     {
-        PyErr_SetString(PyExc_ValueError, "png_create_read_struct() error");
-        return NULL;
+        return "png_create_read_struct() error";
     }
 
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr)
+    image->info_ptr = png_create_info_struct(image->png_ptr);
+    if (!image->info_ptr)
     {
-        png_destroy_read_struct(&png_ptr, NULL, NULL);
-        PyErr_SetString(PyExc_ValueError, "png_create_info_struct() error");
-        return NULL;
+        return "png_create_info_struct() error";
     }
 
+    png_structp png_ptr = image->png_ptr;
+    png_infop info_ptr = image->info_ptr;
+
     if (setjmp(png_jmpbuf(png_ptr)))
     {
-        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-        PyErr_SetString(PyExc_ValueError, "libpng error");
-        return NULL;
+        return "libpng error";
     }
 
-    png_set_read_fn(png_ptr, &png, custom_read_png);
+    png_set_read_fn(png_ptr, &image->input, custom_read_png);
     png_read_png(png_ptr, info_ptr, 0, NULL);
 
-    int reduction = opng_reduce_image(png_ptr, info_ptr, OPNG_REDUCE_ALL & ~OPNG_REDUCE_METADATA);
-    int image_width = png_get_image_width(png_ptr, info_ptr);
-    int image_height = png_get_image_height(png_ptr, info_ptr);
-    int color_type = png_get_color_type(png_ptr, info_ptr);
-    int bit_depth = png_get_bit_depth(png_ptr, info_ptr);
-    int interlace_type = png_get_interlace_type(png_ptr, info_ptr);
-    int compression_type = png_get_compression_type(png_ptr, info_ptr);
+    opng_reduce_image(png_ptr, info_ptr, OPNG_REDUCE_ALL & ~OPNG_REDUCE_METADATA);
+    image->image_width = png_get_image_width(png_ptr, info_ptr);
+    image->image_height = png_get_image_height(png_ptr, info_ptr);
+    image->color_type = png_get_color_type(png_ptr, info_ptr);
+    image->bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+    image->interlace_type = png_get_interlace_type(png_ptr, info_ptr);
+    image->compression_type = png_get_compression_type(png_ptr, info_ptr);
 
-    // printf("PNG info: %dx%d %d %d", image_width, image_height, color_type, bit_depth);
+    // printf("PNG info: %dx%d %d %d", image->image_width, image->image_height, image->color_type, image->bit_depth);
 
-    if (color_type == PNG_COLOR_TYPE_PALETTE) {
-        palette = (png_colorp)png_malloc(png_ptr, PNG_MAX_PALETTE_LENGTH*sizeof (png_color));
-        png_get_PLTE(png_ptr, info_ptr, &palette, &num_palette);
-        // printf("num_palette=%d\n", num_palette);
+    if (image->color_type == PNG_COLOR_TYPE_PALETTE) {
+        png_get_PLTE(png_ptr, info_ptr, &image->palette, &image->num_palette);
+        // printf("num_palette=%d\n", image->num_palette);
     }
 
-    if (png_get_tRNS(png_ptr, info_ptr, &trans_alpha, &num_trans, &trans_color_ptr))
+    if (png_get_tRNS(png_ptr, info_ptr, &image->trans_alpha, &image->num_trans, &image->trans_color_ptr))
     {
-        if (trans_color_ptr != NULL)
+        if (image->trans_color_ptr != NULL)
         {
-            trans_color = *trans_color_ptr;
-            trans_color_ptr = &trans_color;
+            image->trans_color = *image->trans_color_ptr;
+            image->trans_color_ptr = &image->trans_color;
         }
     }
 
-    if (png_get_bKGD(png_ptr, info_ptr, &background_ptr))
+    if (png_get_bKGD(png_ptr, info_ptr, &image->background_ptr))
     {
-        background = *background_ptr;
-        background_ptr = &background;
+        image->background = *image->background_ptr;
+        image->background_ptr = &image->background;
+    }
+
+    unsigned char** image_rows = png_get_rows(png_ptr, info_ptr);
+    clear_row_padding(image_rows, image->image_width, image->image_height,
+        image->bit_depth * get_channels(image->color_type));
+
+    optim_preset* preset = &presets[image->optim_level];
+
+    if (image->color_type == PNG_COLOR_TYPE_PALETTE && image->num_palette > 1 && preset->o[0] != -1)
+        reorder_palette(image, image_rows);
+
+    // The libdeflate trials are cheap, mc_advpng() tries every filter
+    image->num_filters = get_preset_length(preset->f);
+    memcpy(image->filters, preset->f, sizeof(int) * image->num_filters);
+    if (image->finish) {
+        image->num_filters = NUM_FILTERS;
+        for(int f=0; f<NUM_FILTERS; f++)
+            image->filters[f] = f;
+    }
+
+    if (image->trials.stop != NULL && image->trials.stop->deadline != 0)
+        submit_quick_trial(image);
+
+    // Every filter is applied once per palette order, in parallel, and its
+    // rows are shared by all the trials
+    pool_for(filter_order, image, image->num_orders * image->num_filters);
+    free_reordered_rows(image);
+
+    return NULL;
+}
+
+/*
+ * Keeps the PREDICT_FILTERS filters of the preset whose sample compresses
+ * best with fast settings, in the preset order. Returns their number.
+ */
+static int select_filters(image_job* image, int* filters, int num_f, int window_bits)
+{
+    unsigned long predicted[PRESET_FILTERS];
+    int kept = 0;
+
+    for(int f=0; f<num_f; f++)
+        predicted[f] = predict_size(image->filtered[0][filters[f]], 1, window_bits, 8, Z_DEFAULT_STRATEGY);
+
+    for(int f=0; f<num_f; f++) {
+        int better = 0;
+        for(int g=0; g<num_f; g++)
+            if (predicted[g] < predicted[f] || (predicted[g] == predicted[f] && g < f))
+                better++;
+        if (better < PREDICT_FILTERS)
+            filters[kept++] = filters[f];
+    }
+    return kept;
+}
+
+#ifdef PYOPTIPNG_WITH_ADVANCECOMP
+/* One libdeflate trial for each filter and palette order */
+static void submit_proxies(image_job* image)
+{
+    unsigned count = 0;
+
+    for(int f=0; f<image->num_filters; f++) {
+        for(int o=0; o<image->num_orders; o++) {
+            job_info* job = (job_info*)malloc(sizeof(job_info));
+            memset(job, 0, sizeof(job_info));
+            job->trials = &image->trials;
+            job->image = image->filtered[o][image->filters[f]];
+            job->filter_type = image->filters[f];
+            job->palette_order = o;
+            job->compression_level = PROXY_LEVEL;
+            job->order = count++;
+            image->trials.count++;
+            pool_submit(&image->trials.group, run_proxy, job);
+        }
     }
+}
+
+/*
+ * Recompresses the filtered stream of the best trial with zopfli and 7z,
+ * and keeps their IDAT if it is smaller
+ */
+static void finish_image(image_job* image)
+{
+    trial_set* trials = &image->trials;
+    unsigned long size;
+
+    // Past the deadline the best trial stands
+    if (trials->data == NULL || (trials->stop != NULL && stop_requested(trials->stop)))
+        return;
+
+    const filtered_image* filtered = image->filtered[trials->palette_order][trials->filter_type];
+    unsigned char* data = advpng_compress_idat(filtered->data, filtered->size, &size, trials->stop);
+    if (data == NULL)
+        return;
+
+    if (size < trials->size) {
+        free(trials->data);
+        trials->data = data;
+        trials->size = size;
+    } else {
+        free(data);
+    }
+}
+#endif
 
-    image_rows = png_get_rows(png_ptr, info_ptr);
+static void submit_trials(image_job* image)
+{
+    optim_preset* preset = &presets[image->optim_level];
 
-    int num_cpu = sysconf(_SC_NPROCESSORS_ONLN);
-    // printf("CPU cores: %d\n", num_cpu);
+    // The quick trial has run out the time, some filters may be missing
+    if (trials_stopped(&image->trials))
+        return;
+
+#ifdef PYOPTIPNG_WITH_ADVANCECOMP
+    if (image->finish) {
+        submit_proxies(image);
+        return;
+    }
+#endif
+
+    int window_bits = get_window_bits(image->filtered[0][preset->f[0]]->size);
+    int predict = image->filtered[0][preset->f[0]]->sample != NULL;
 
     // printf("Creating jobs...");
 
-    optim_preset* preset = &presets[optim_level];
-
-
-    for(unsigned int m=0; preset->m[m] != -1; m++) {
-        for(unsigned int f=0; preset->f[f] != -1; f++) {
-            for(unsigned int c=0; preset->c[c] != -1; c++) {
-                for(unsigned int s=0; preset->s[s] != -1; s++) {
-                    job_info* job = (job_info*)malloc(sizeof(job_info));
-                    memset(job, 0, sizeof(job_info));
-                    job->image_width = image_width;
-                    job->image_height = image_height;
-                    job->bit_depth = bit_depth;
-                    job->color_type = color_type;
-                    job->interlace = interlace_type;
-                    job->compression_mem_level = preset->m[m];
-                    job->compression_type = compression_type;
-                    job->compression_level = preset->c[c];
-                    job->compression_strategy = preset->s[s];
-                    job->filter_type = preset->f[f];
-                    job->image_rows = image_rows;
-                    job->row_bytes = png_get_rowbytes(png_ptr, info_ptr);
-                    job->palette = palette;
-                    job->num_palette = num_palette;
-                    job->background_ptr = background_ptr;
-                    job->trans_alpha = trans_alpha;
-                    job->num_trans = num_trans;
-                    job->trans_color_ptr = trans_color_ptr;
-                    job->trans_color = trans_color;
-                    jobs.push(job);
+    int filters[PRESET_FILTERS];
+    int num_m = get_preset_length(preset->m);
+    int num_f = get_preset_length(preset->f);
+    int num_c = get_preset_length(preset->c);
+    int num_s = get_preset_length(preset->s);
+    memcpy(filters, preset->f, sizeof(filters));
+    if (predict)
+        num_f = select_filters(image, filters, num_f, window_bits);
+
+    // The strongest settings go first, so that the best IDAT size drops
+    // early and the following trials can be cut short
+    job_info* candidates = (job_info*)malloc(sizeof(job_info) * num_m * num_f * num_c * num_s * image->num_orders);
+    unsigned count = 0;
+    for(int m=num_m-1; m>=0; m--) {
+        for(int f=num_f-1; f>=0; f--) {
+            for(int c=num_c-1; c>=0; c--) {
+                for(int s=0; s<num_s; s++) {
+                    for(int o=0; o<image->num_orders; o++) {
+                        job_info* job = &candidates[count];
+                        memset(job, 0, sizeof(job_info));
+                        job->trials = &image->trials;
+                        job->image = image->filtered[o][filters[f]];
+                        job->filter_type = filters[f];
+                        job->palette_order = o;
+                        job->compression_mem_level = preset->m[m];
+                        job->compression_level = preset->c[c];
+                        job->compression_strategy = preset->s[s];
+                        job->compression_window_bits = window_bits;
+                        job->order = count++;
+                    }
                 }
             }
         }
     }
-    // printf("DONE. %d jobs created.\n", jobs.size());
 
-    threads = (thread_info**)malloc(sizeof(thread_info*)*num_cpu);
-    pthread_mutex_init(&mutex, NULL);
+    // Small images and small presets try every candidate
+    if (!predict || count <= PREDICT_TOP_K) {
+        for(unsigned i=0; i<count; i++) {
+            job_info* job = (job_info*)malloc(sizeof(job_info));
+            *job = candidates[i];
+            image->trials.count++;
+            pool_submit(&image->trials.group, run_trial, job);
+        }
+        free(candidates);
+        return;
+    }
+
+    image->trials.candidates = candidates;
+    image->trials.num_candidates = count;
+    image->trials.probes_left = count;
+    for(unsigned i=0; i<count; i++)
+        pool_submit(&image->trials.group, run_probe, &candidates[i]);
+    // printf("DONE.\n");
+}
+
+/* Pool task decoding an image and queueing its trials in the same group */
+static void prepare_image(void* arg)
+{
+    image_job* image = (image_job*)arg;
+
+    if (trials_cancelled(&image->trials)) {
+        image->error = "Cancelled";
+        return;
+    }
+    if (image->path != NULL)
+        image->error = map_file(image);
+    if (image->error == NULL)
+        image->error = read_image(image);
+    if (image->error == NULL)
+        submit_trials(image);
+}
+
+/* Writes the PNG with the best IDAT stream found by the trials */
+static const char* write_png(image_job* image)
+{
+    stream* output = &image->output;
 
-    // printf("Creating threads...");
-    for(unsigned int i=0; i<num_cpu; i++)
+    if (image->trials.data == NULL)
     {
-        pthread_attr_t attr;
-        pthread_attr_init(&attr);
-
-        #ifdef USE_PTHREAD_AFFINITY
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
-        CPU_SET(i, &cpuset);
-        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
-        #endif
-
-        threads[i] = (thread_info*)malloc(sizeof(thread_info));
-        memset(threads[i], 0, sizeof(thread_info));
-        threads[i]->num = i;
-        pthread_create(&(threads[i]->id), &attr, worker, threads[i]);
-        pthread_attr_destroy(&attr);
+        return "deflate() error";
     }
-    // printf("DONE.\n");
 
-    // printf("Waiting for threads...");
-    thread_result* best_result = NULL;
-    for(unsigned int i=0; i<num_cpu; i++)
+    // printf("Best size: %d\n", image->trials.size);
+
+    // Enough for the signature, the chunks written below and the IDAT, so
+    // that the output is allocated once
+    if (!output->fixed) {
+        output->size = 8 + 25 + (12 + 3*256) + (12 + 256) + (12 + 6) + (12 + image->trials.size) + 12;
+        output->data = (unsigned char *)malloc(output->size);
+    }
+    output->pos = 0;
+
+    png_structp write_ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, my_error_fn, my_warning_fn,
+        &image->memory, arena_png_malloc, arena_png_free);
+    png_infop write_info_ptr = write_ptr ? png_create_info_struct(write_ptr) : NULL;
+    if (!write_info_ptr || setjmp(png_jmpbuf(write_ptr)))
     {
-        thread_result* result;
-        pthread_join(threads[i]->id, (void**)&result);
-        free(threads[i]);
-        if (best_result) {
-            if (result->size < best_result->size && result->size > 0) {
-                free(best_result->data);
-                free(best_result);
-                best_result = result;
-            } else {
-                free(result->data);
-                free(result);
-            }
+        png_destroy_write_struct(&write_ptr, &write_info_ptr);
+        if (!output->fixed) {
+            free(output->data);
+            output->data = NULL;
+        }
+        return output->overflow ? "Output buffer too small" : "libpng write error";
+    }
+
+    png_set_write_fn(write_ptr, output, custom_write_png, NULL);
+
+    png_set_IHDR(write_ptr, write_info_ptr,
+        image->image_width,
+        image->image_height,
+        image->bit_depth,
+        image->color_type,
+        image->interlace_type,
+        image->compression_type,
+        PNG_FILTER_TYPE_DEFAULT
+        );
+
+    // The palette goes out in the order of the best trial
+    png_colorp palette = image->palette;
+    png_bytep trans_alpha = image->trans_alpha;
+    int num_trans = image->num_trans;
+    if (image->trials.palette_order > 0) {
+        reordered_palette* reordered = &image->reordered[image->trials.palette_order - 1];
+        palette = reordered->palette;
+        if (trans_alpha != NULL) {
+            trans_alpha = reordered->trans_alpha;
+            num_trans = reordered->num_trans;
+        }
+        image->background.index = reordered->background_index;
+    }
+
+    if (image->color_type == PNG_COLOR_TYPE_PALETTE) {
+        png_set_PLTE(write_ptr, write_info_ptr, palette, 1<<image->bit_depth);
+    }
+
+    if (trans_alpha != NULL || image->trans_color_ptr != NULL)
+        png_set_tRNS(write_ptr, write_info_ptr,
+            trans_alpha, num_trans, image->trans_color_ptr);
+
+    if (image->background_ptr != NULL)
+        png_set_bKGD(write_ptr, write_info_ptr, image->background_ptr);
+
+    // The IDAT stream of the best trial goes out as it is
+    png_write_info(write_ptr, write_info_ptr);
+    png_write_chunk(write_ptr, (png_const_bytep)"IDAT", image->trials.data, image->trials.size);
+    png_write_chunk(write_ptr, (png_const_bytep)"IEND", NULL, 0);
+
+    png_destroy_write_struct(&write_ptr, &write_info_ptr);
+
+    return NULL;
+}
+
+/*
+ * Optimizes the images on the pool, the trials of all of them sharing the
+ * same queue. A few images are decoded ahead of the one being finished,
+ * so that its last trials don't leave threads idle without holding every
+ * decoded image in memory at once. It doesn't touch any Python object, so
+ * it runs without the GIL.
+ */
+static void optimize_images(image_job* images, int count)
+{
+    int ahead = 2 * pool_size();
+    int submitted = 0;
+
+    for(int i=0; i<count; i++) {
+        while (submitted < count && submitted <= i + ahead) {
+            pool_submit(&images[submitted].trials.group, prepare_image, &images[submitted]);
+            submitted++;
+        }
+
+        pool_wait(&images[i].trials.group);
+        if (images[i].error == NULL && trials_cancelled(&images[i].trials))
+            images[i].error = "Cancelled";
+#ifdef PYOPTIPNG_WITH_ADVANCECOMP
+        if (images[i].error == NULL && images[i].finish)
+            finish_image(&images[i]);
+#endif
+        if (images[i].error == NULL)
+            images[i].error = write_png(&images[i]);
+        release_image_job(&images[i]);
+
+        // Files are done with here, a long list doesn't pile up mappings
+        // and outputs
+        if (images[i].path != NULL) {
+            if (images[i].error == NULL)
+                images[i].error = replace_file(&images[i]);
+            if (images[i].input.size > 0)
+                munmap(images[i].input.data, images[i].input.size);
+            free(images[i].output.data);
+            images[i].output.data = NULL;
+        }
+    }
+}
+
+static int check_optim_level(int optim_level)
+{
+    if (optim_level < 0 || optim_level > MAX_OPTIM_LEVEL)
+    {
+        PyErr_Format(PyExc_ValueError, "Optimization level must be between 0 and %d", MAX_OPTIM_LEVEL);
+        return 0;
+    }
+    return 1;
+}
+
+static PyObject* build_stats(const image_job* image)
+{
+    if (image->error != NULL)
+        return Py_BuildValue("{s:k,s:s}",
+            "input_size", image->input.size,
+            "error", image->error);
+
+    double prediction_error = image->trials.predicted ?
+        image->trials.prediction_error / image->trials.predicted : 0;
+
+    return Py_BuildValue("{s:k,s:k,s:k,s:I,s:I,s:I,s:d,s:i,s:i,s:i,s:i}",
+        "input_size", image->input.size,
+        "output_size", image->output.pos,
+        "idat_size", image->trials.size,
+        "trials", image->trials.count,
+        "aborted", image->trials.aborted,
+        "probes", image->trials.num_candidates,
+        "prediction_error", prediction_error,
+        "filter", image->trials.filter_type,
+        "compression_level", image->trials.compression_level,
+        "mem_level", image->trials.compression_mem_level,
+        "strategy", image->trials.compression_strategy);
+}
+
+static PyObject* build_file_stats(const image_job* image)
+{
+    PyObject* stats = build_stats(image);
+    if (stats == NULL)
+        return NULL;
+
+    PyObject* replaced = PyBool_FromLong(image->replaced);
+    int ret = PyDict_SetItemString(stats, "replaced", replaced);
+    Py_DECREF(replaced);
+    if (ret == 0 && image->os_error != 0) {
+        PyObject* os_error = Py_BuildValue("i", image->os_error);
+        ret = PyDict_SetItemString(stats, "errno", os_error);
+        Py_DECREF(os_error);
+    }
+    if (ret != 0)
+        Py_CLEAR(stats);
+
+    return stats;
+}
+
+/* Converts a path to the bytes object holding its file system encoding */
+static int convert_path(PyObject* path, void* result)
+{
+#if PY_MAJOR_VERSION >= 3
+    return PyUnicode_FSConverter(path, result);
+#else
+    if (!PyString_Check(path)) {
+        PyErr_SetString(PyExc_TypeError, "Path must be a string");
+        return 0;
+    }
+    Py_INCREF(path);
+    *(PyObject**)result = path;
+    return 1;
+#endif
+}
+
+/*
+ * Optimizes the files of paths in place. Returns the list of their stats,
+ * or NULL with the Python error set.
+ */
+static PyObject* optimize_files(PyObject* paths, int optim_level, stop_cond* stop)
+{
+    Py_ssize_t count = PyTuple_GET_SIZE(paths);
+    PyObject** names = (PyObject**)malloc(sizeof(PyObject*) * (count > 0 ? count : 1));
+    for(Py_ssize_t i=0; i<count; i++) {
+        if (!convert_path(PyTuple_GET_ITEM(paths, i), &names[i])) {
+            while (i-- > 0)
+                Py_DECREF(names[i]);
+            free(names);
+            return NULL;
+        }
+    }
+
+    image_job* images = (image_job*)malloc(sizeof(image_job) * (count > 0 ? count : 1));
+    for(Py_ssize_t i=0; i<count; i++) {
+        init_image_job(&images[i], NULL, 0, optim_level);
+        images[i].path = PyBytes_AS_STRING(names[i]);
+        images[i].trials.stop = stop;
+    }
+
+    stop_begin(stop);
+    Py_BEGIN_ALLOW_THREADS
+    optimize_images(images, count);
+    Py_END_ALLOW_THREADS
+
+    // The files done before the cancel stay replaced
+    PyObject* result = stop_end(stop) < 0 ? NULL : PyList_New(count);
+    for(Py_ssize_t i=0; result != NULL && i<count; i++) {
+        PyObject* stats = build_file_stats(&images[i]);
+        if (stats == NULL) {
+            Py_CLEAR(result);
+            break;
+        }
+        PyList_SET_ITEM(result, i, stats);
+    }
+
+    for(Py_ssize_t i=0; i<count; i++)
+        Py_DECREF(names[i]);
+    free(names);
+    free(images);
+
+    return result;
+}
+
+/* Arguments and result of mc_compress_png() and mc_advpng() */
+static PyObject* compress_buffer(PyObject* args, PyObject* kwargs, int finish)
+{
+    Py_buffer input;
+    Py_buffer out;
+    PyObject* out_obj = Py_None;
+    int optim_level = 2;
+    stop_cond stop;
+    image_job image;
+    static const char* keywords[] = {"data", "level", "out", "deadline_ms", "cancel", NULL};
+
+    stop_init(&stop);
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s*|iOO&O&", (char**)keywords,
+        &input, &optim_level, &out_obj, stop_convert_deadline, &stop,
+        stop_convert_cancel, &stop))
+        return NULL;
+
+    if (!check_optim_level(optim_level))
+    {
+        PyBuffer_Release(&input);
+        return NULL;
+    }
+
+    if (out_obj != Py_None && PyObject_GetBuffer(out_obj, &out, PyBUF_WRITABLE) < 0)
+    {
+        PyBuffer_Release(&input);
+        return NULL;
+    }
+
+    init_image_job(&image, (const unsigned char*)input.buf, input.len, optim_level);
+    image.finish = finish;
+    image.trials.stop = &stop;
+    if (out_obj != Py_None)
+    {
+        image.output.data = (unsigned char*)out.buf;
+        image.output.size = out.len;
+        image.output.fixed = 1;
+    }
+
+    // The exported buffers can't be resized or freed until they are released
+    stop_begin(&stop);
+    Py_BEGIN_ALLOW_THREADS
+    optimize_images(&image, 1);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&input);
+    if (out_obj != Py_None)
+        PyBuffer_Release(&out);
+
+    if (stop_end(&stop) < 0 || image.error != NULL)
+    {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, image.error);
+        if (!image.output.fixed)
+            free(image.output.data);
+        return NULL;
+    }
+
+    if (image.output.fixed)
+        return PyLong_FromSize_t(image.output.pos);
+
+    PyObject* result = PyBytes_FromStringAndSize((const char*)image.output.data, image.output.pos);
+    free(image.output.data);
+
+    return result;
+}
+
+extern "C" {
+
+/*
+ * mc_compress_png(data, level=2, out=None, deadline_ms=None, cancel=None)
+ *
+ * data is anything exporting a buffer: bytes, bytearray, memoryview, mmap.
+ * It is read in place. Without out the PNG is returned as bytes, otherwise
+ * it is written at the start of the writable buffer out and its length is
+ * returned.
+ *
+ * With deadline_ms, a quick trial runs first and the preset improves on
+ * it until that many milliseconds after the call. The trials still
+ * running then are abandoned and the best completed one is written, so
+ * the call overruns by the quick trial at most, on a huge image.
+ *
+ * Once the CancelToken cancel is cancelled, from another thread or a
+ * signal handler, or on Ctrl-C, the trials are abandoned at once and the
+ * call raises CancelledError, or KeyboardInterrupt.
+ */
+PyObject* mc_compress_png(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    return compress_buffer(args, kwargs, 0);
+}
+
+#ifdef PYOPTIPNG_WITH_ADVANCECOMP
+/*
+ * mc_advpng(data, level=2, out=None, deadline_ms=None, cancel=None)
+ *
+ * As mc_compress_png(), but the trials only rank the filters and palette
+ * orders of the preset with libdeflate. The best filtered stream is then
+ * compressed with zopfli and 7z as advpng() does, without decoding the
+ * image again. The deadline and the cancel also end the zopfli iterations
+ * and 7z.
+ */
+PyObject* mc_advpng(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    return compress_buffer(args, kwargs, 1);
+}
+#endif
+
+/*
+ * mc_compress_many(images, level=2, cancel=None)
+ *
+ * Compresses the images on the pool, returns a (data or None, stats) pair
+ * for each. A cancel drops all of them.
+ */
+PyObject* mc_compress_many(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject* sequence;
+    int optim_level = 2;
+    stop_cond stop;
+    static const char* keywords[] = {"images", "level", "cancel", NULL};
+
+    stop_init(&stop);
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iO&", (char**)keywords,
+        &sequence, &optim_level, stop_convert_cancel, &stop))
+        return NULL;
+
+    if (!check_optim_level(optim_level))
+        return NULL;
+
+    // A tuple holds the inputs, the caller may change its list meanwhile
+    PyObject* items = PySequence_Tuple(sequence);
+    if (items == NULL)
+        return NULL;
+
+    // Every input is read in place through its buffer
+    Py_ssize_t count = PyTuple_GET_SIZE(items);
+    Py_buffer* buffers = (Py_buffer*)malloc(sizeof(Py_buffer) * (count > 0 ? count : 1));
+    for(Py_ssize_t i=0; i<count; i++) {
+        if (PyObject_GetBuffer(PyTuple_GET_ITEM(items, i), &buffers[i], PyBUF_SIMPLE) < 0) {
+            while (i-- > 0)
+                PyBuffer_Release(&buffers[i]);
+            free(buffers);
+            Py_DECREF(items);
+            return NULL;
+        }
+    }
+
+    image_job* images = (image_job*)malloc(sizeof(image_job) * (count > 0 ? count : 1));
+    for(Py_ssize_t i=0; i<count; i++) {
+        init_image_job(&images[i], (const unsigned char*)buffers[i].buf, buffers[i].len, optim_level);
+        images[i].trials.stop = &stop;
+    }
+
+    stop_begin(&stop);
+    Py_BEGIN_ALLOW_THREADS
+    optimize_images(images, count);
+    Py_END_ALLOW_THREADS
+
+    PyObject* result = stop_end(&stop) < 0 ? NULL : PyList_New(count);
+    for(Py_ssize_t i=0; result != NULL && i<count; i++) {
+        PyObject* data;
+        if (images[i].error != NULL) {
+            Py_INCREF(Py_None);
+            data = Py_None;
         } else {
-            if (result->size > 0) {
-                best_result = result;
-            } else {
-                free(result->data);
-                free(result);
-            }
+            data = PyBytes_FromStringAndSize((const char*)images[i].output.data, images[i].output.pos);
+        }
+        PyObject* stats = build_stats(&images[i]);
+        PyObject* entry = data && stats ? PyTuple_Pack(2, data, stats) : NULL;
+        Py_XDECREF(data);
+        Py_XDECREF(stats);
+        if (entry == NULL) {
+            Py_CLEAR(result);
+            break;
         }
+        PyList_SET_ITEM(result, i, entry);
     }
-    free(threads);
-    pthread_mutex_destroy(&mutex);
-    // printf("DONE.\n");
 
-    // printf("Best size: %d\n", best_result->size);
+    for(Py_ssize_t i=0; i<count; i++) {
+        free(images[i].output.data);
+        PyBuffer_Release(&buffers[i]);
+    }
+    free(images);
+    free(buffers);
+    Py_DECREF(items);
+
+    return result;
+}
+
+/*
+ * mc_optimize_file(path, level=2, cancel=None)
+ *
+ * Optimizes the PNG file in place, replacing it only if the result is
+ * smaller. Returns its stats, with "replaced" telling whether the file
+ * changed. A cancelled call leaves the file as it is.
+ */
+PyObject* mc_optimize_file(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject* path;
+    int optim_level = 2;
+    stop_cond stop;
+    static const char* keywords[] = {"path", "level", "cancel", NULL};
+
+    stop_init(&stop);
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iO&", (char**)keywords,
+        &path, &optim_level, stop_convert_cancel, &stop))
+        return NULL;
 
-    PyObject* result = Py_BuildValue("s#", best_result->data, best_result->size);
-    free(best_result->data);
-    free(best_result);
+    if (!check_optim_level(optim_level))
+        return NULL;
+
+    PyObject* paths = PyTuple_Pack(1, path);
+    if (paths == NULL)
+        return NULL;
 
-    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    PyObject* results = optimize_files(paths, optim_level, &stop);
+    Py_DECREF(paths);
+    if (results == NULL)
+        return NULL;
+
+    PyObject* stats = PyList_GET_ITEM(results, 0);
+    Py_INCREF(stats);
+    Py_DECREF(results);
+
+    // A single file reports its failure as an exception
+    PyObject* error = PyDict_GetItemString(stats, "error");
+    if (error != NULL) {
+        PyObject* os_error = PyDict_GetItemString(stats, "errno");
+        if (os_error != NULL) {
+            errno = PyLong_AsLong(os_error);
+            PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+        } else {
+            PyErr_SetObject(PyExc_ValueError, error);
+        }
+        Py_DECREF(stats);
+        return NULL;
+    }
+
+    return stats;
+}
+
+/*
+ * mc_optimize_files(paths, level=2, cancel=None)
+ *
+ * Optimizes the PNG files in place on the pool. Returns the stats of each
+ * file in order, a file that failed has "error" set instead of raising.
+ * A cancelled call raises, the files done by then stay optimized.
+ */
+PyObject* mc_optimize_files(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject* sequence;
+    int optim_level = 2;
+    stop_cond stop;
+    static const char* keywords[] = {"paths", "level", "cancel", NULL};
+
+    stop_init(&stop);
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iO&", (char**)keywords,
+        &sequence, &optim_level, stop_convert_cancel, &stop))
+        return NULL;
+
+    if (!check_optim_level(optim_level))
+        return NULL;
+
+    PyObject* paths = PySequence_Tuple(sequence);
+    if (paths == NULL)
+        return NULL;
+
+    PyObject* result = optimize_files(paths, optim_level, &stop);
+    Py_DECREF(paths);
 
     return result;
 }
 
-}
\ No newline at end of file
+}
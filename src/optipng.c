@@ -1,22 +1,23 @@
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include <stdio.h>
 
 #include <optipng.h>
 #include <optim.c>
 
+#include "pool.h"
+#include "stop.h"
+
 #define BUFFER_GRANULARITY  64*1024
 
 typedef struct {
-    int32_t size;
-    int32_t pos;
+    size_t size;
+    size_t pos;
     void *data;
 } Stream;
 
-static int start_of_line;
-
-static FILE *con_file;
-static FILE *log_file;
-
+/* The engine state lives in a context per call, the user interface
+ * doesn't keep any either so that calls can run concurrently. */
 static void
 app_printf(const char *fmt, ...)
 {
@@ -24,20 +25,10 @@ app_printf(const char *fmt, ...)
 
     if (fmt[0] == 0)
         return;
-    start_of_line = (fmt[strlen(fmt) - 1] == '\n') ? 1 : 0;
 
-    if (con_file != NULL)
-    {
-        va_start(arg_ptr, fmt);
-        vfprintf(con_file, fmt, arg_ptr);
-        va_end(arg_ptr);
-    }
-    if (log_file != NULL)
-    {
-        va_start(arg_ptr, fmt);
-        vfprintf(log_file, fmt, arg_ptr);
-        va_end(arg_ptr);
-    }
+    va_start(arg_ptr, fmt);
+    vprintf(fmt, arg_ptr);
+    va_end(arg_ptr);
 }
 
 static void
@@ -49,7 +40,7 @@ app_print_cntrl(int cntrl_code)
 static void
 app_progress(unsigned long current_step, unsigned long total_steps)
 {
-    printf("PROGRESS: %d/%d\n", current_step, total_steps);
+    printf("PROGRESS: %lu/%lu\n", current_step, total_steps);
 }
 
 static void
@@ -61,6 +52,8 @@ panic(const char *msg)
 static void
 opng_read_buffer_data(png_structp png_ptr, png_bytep data, size_t length)
 {
+    struct opng_context *ctx =
+        (struct opng_context *)png_get_error_ptr(png_ptr);
     png_voidp io_ptr = png_get_io_ptr(png_ptr);
     int io_state = pngx_get_io_state(png_ptr);
     int io_state_loc = io_state & PNGX_IO_MASK_LOC;
@@ -70,24 +63,26 @@ opng_read_buffer_data(png_structp png_ptr, png_bytep data, size_t length)
         return;
 
     Stream* input_stream = (Stream*)io_ptr;
+    if (length > input_stream->size - input_stream->pos)
+        png_error(png_ptr, "Unexpected end of input data");
     memcpy((png_byte*)data, input_stream->data+input_stream->pos, (size_t)length);
     input_stream->pos += length;
 
-    if (process.in_file_size == 0)  /* first piece of PNG data */
+    if (ctx->process.in_file_size == 0)  /* first piece of PNG data */
     {
         OPNG_ENSURE(length == 8, "PNG I/O must start with the first 8 bytes");
-        process.in_datastream_offset = input_stream->pos - 8;
-        process.status |= INPUT_HAS_PNG_DATASTREAM;
+        ctx->process.in_datastream_offset = input_stream->pos - 8;
+        ctx->process.status |= INPUT_HAS_PNG_DATASTREAM;
         if (io_state_loc == PNGX_IO_SIGNATURE)
-            process.status |= INPUT_HAS_PNG_SIGNATURE;
-        if (process.in_datastream_offset == 0)
-            process.status |= INPUT_IS_PNG_FILE;
-        else if (process.in_datastream_offset < 0)
+            ctx->process.status |= INPUT_HAS_PNG_SIGNATURE;
+        if (ctx->process.in_datastream_offset == 0)
+            ctx->process.status |= INPUT_IS_PNG_FILE;
+        else if (ctx->process.in_datastream_offset < 0)
             png_error(png_ptr,
                 "Can't get the file-position indicator in input file");
-        process.in_file_size = (osys_fsize_t)process.in_datastream_offset;
+        ctx->process.in_file_size = (osys_fsize_t)ctx->process.in_datastream_offset;
     }
-    process.in_file_size += length;
+    ctx->process.in_file_size += length;
 
     OPNG_ENSURE((io_state & PNGX_IO_READING) && (io_state_loc != 0),
                 "Incorrect info in png_ptr->io_state");
@@ -102,39 +97,39 @@ opng_read_buffer_data(png_structp png_ptr, png_bytep data, size_t length)
 
         if (memcmp(chunk_sig, sig_IDAT, 4) == 0)
         {
-            OPNG_ENSURE(png_ptr == read_ptr, "Incorrect I/O handler setup");
-            if (png_get_rows(read_ptr, read_info_ptr) == NULL)  /* 1st IDAT */
+            OPNG_ENSURE(png_ptr == ctx->read_ptr, "Incorrect I/O handler setup");
+            if (png_get_rows(ctx->read_ptr, ctx->read_info_ptr) == NULL)  /* 1st IDAT */
             {
-                OPNG_ENSURE(process.in_idat_size == 0,
+                OPNG_ENSURE(ctx->process.in_idat_size == 0,
                             "Found IDAT with no rows");
                 /* Allocate the rows here, bypassing libpng.
                  * This allows to initialize the contents and perform recovery
                  * in case of a premature EOF.
                  */
-                if (png_get_image_height(read_ptr, read_info_ptr) == 0)
+                if (png_get_image_height(ctx->read_ptr, ctx->read_info_ptr) == 0)
                     return;  /* premature IDAT; an error will occur later */
-                OPNG_ENSURE(pngx_malloc_rows(read_ptr,
-                                             read_info_ptr, 0) != NULL,
+                OPNG_ENSURE(pngx_malloc_rows(ctx->read_ptr,
+                                             ctx->read_info_ptr, 0) != NULL,
                             "Failed allocation of image rows; "
                             "unsafe libpng allocator");
-                png_data_freer(read_ptr, read_info_ptr,
+                png_data_freer(ctx->read_ptr, ctx->read_info_ptr,
                                PNG_USER_WILL_FREE_DATA, PNG_FREE_ROWS);
             }
             else
             {
                 /* There is split IDAT overhead. Join IDATs. */
-                process.status |= INPUT_HAS_JUNK;
+                ctx->process.status |= INPUT_HAS_JUNK;
             }
-            process.in_idat_size += png_get_uint_32(data);
+            ctx->process.in_idat_size += png_get_uint_32(data);
         }
         else if (memcmp(chunk_sig, sig_PLTE, 4) == 0 ||
                  memcmp(chunk_sig, sig_tRNS, 4) == 0)
         {
             /* Add the chunk overhead (header + CRC) to the data size. */
-            process.in_plte_trns_size += png_get_uint_32(data) + 12;
+            ctx->process.in_plte_trns_size += png_get_uint_32(data) + 12;
         }
         else
-            opng_handle_chunk(png_ptr, chunk_sig);
+            opng_handle_chunk(ctx, png_ptr, chunk_sig);
     }
     else if (io_state_loc == PNGX_IO_CHUNK_CRC)
     {
@@ -204,7 +199,7 @@ _sig_is_png(png_structp png_ptr,
 }
 
 static void
-my_opng_read_stream(Stream* input_stream)
+my_opng_read_stream(struct opng_context *ctx, Stream* input_stream)
 {
     const char *fmt_name;
     int num_img;
@@ -216,52 +211,52 @@ my_opng_read_stream(Stream* input_stream)
 
     Try
     {
-        read_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, opng_error, opng_warning);
-        read_info_ptr = png_create_info_struct(read_ptr);
-        if (read_info_ptr == NULL)
+        ctx->read_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, ctx, opng_error, opng_warning);
+        ctx->read_info_ptr = png_create_info_struct(ctx->read_ptr);
+        if (ctx->read_info_ptr == NULL)
             Throw "Out of memory";
 
         /* Override the default libpng settings. */
-        png_set_keep_unknown_chunks(read_ptr, PNG_HANDLE_CHUNK_ALWAYS, NULL, 0);
-        png_set_user_limits(read_ptr, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
+        png_set_keep_unknown_chunks(ctx->read_ptr, PNG_HANDLE_CHUNK_ALWAYS, NULL, 0);
+        png_set_user_limits(ctx->read_ptr, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
 
         /* Read the input image file. */
-        opng_init_read_data();
-        pngx_set_read_fn(read_ptr, input_stream, opng_read_buffer_data);
+        opng_init_read_data(ctx);
+        pngx_set_read_fn(ctx->read_ptr, input_stream, opng_read_buffer_data);
         fmt_name = NULL;
 
-        memcpy(sig, input_stream->data, sizeof(sig));
-        num = sizeof(sig);
+        num = input_stream->size < sizeof(sig) ? input_stream->size : sizeof(sig);
+        memcpy(sig, input_stream->data, num);
 
-        if (_sig_is_png(read_ptr, sig, num, &fmt_name, NULL) > 0)
+        if (_sig_is_png(ctx->read_ptr, sig, num, &fmt_name, NULL) > 0)
         {
-            png_read_png(read_ptr, read_info_ptr, 0, NULL);
+            png_read_png(ctx->read_ptr, ctx->read_info_ptr, 0, NULL);
             num_img = 1;
         } else {
             printf("It's not PNG file\n");
             num_img = 0;
         }
 
-        process.in_file_size = input_stream->size;
+        ctx->process.in_file_size = input_stream->size;
 
         if (num_img <= 0)
             Throw "Unrecognized image file format";
         if (num_img > 1)
-            process.status |= INPUT_HAS_MULTIPLE_IMAGES;
-        if ((process.status & INPUT_IS_PNG_FILE) &&
-            (process.status & INPUT_HAS_MULTIPLE_IMAGES))
+            ctx->process.status |= INPUT_HAS_MULTIPLE_IMAGES;
+        if ((ctx->process.status & INPUT_IS_PNG_FILE) &&
+            (ctx->process.status & INPUT_HAS_MULTIPLE_IMAGES))
         {
             /* pngxtern can't distinguish between APNG and proper PNG. */
-            fmt_name = (process.status & INPUT_HAS_PNG_SIGNATURE) ?
+            fmt_name = (ctx->process.status & INPUT_HAS_PNG_SIGNATURE) ?
                        "APNG" : "APNG datastream";
         }
         OPNG_ENSURE(fmt_name != NULL, "No format name from pngxtern");
 
         printf("fmt_name: %s\n", fmt_name);
 
-        if (process.in_file_size == 0)
+        if (ctx->process.in_file_size == 0)
         {
-            opng_print_warning("Can't get the correct file size");
+            opng_print_warning(ctx, "Can't get the correct file size");
         }
 
         err_msg = NULL;  /* everything is ok */
@@ -271,9 +266,9 @@ my_opng_read_stream(Stream* input_stream)
         /* If the critical info has been loaded, treat all errors as warnings.
          * This enables a more advanced data recovery.
          */
-        if (opng_validate_image(read_ptr, read_info_ptr))
+        if (opng_validate_image(ctx->read_ptr, ctx->read_info_ptr))
         {
-           png_warning(read_ptr, err_msg);
+           png_warning(ctx->read_ptr, err_msg);
            err_msg = NULL;
         }
     }
@@ -286,95 +281,92 @@ my_opng_read_stream(Stream* input_stream)
         /* Display format and image information. */
         if (strcmp(fmt_name, "PNG") != 0)
         {
-            usr_printf("Importing %s", fmt_name);
-            if (process.status & INPUT_HAS_MULTIPLE_IMAGES)
+            ctx->usr_printf("Importing %s", fmt_name);
+            if (ctx->process.status & INPUT_HAS_MULTIPLE_IMAGES)
             {
-                if (!(process.status & INPUT_IS_PNG_FILE))
-                    usr_printf(" (multi-image or animation)");
-                if (options.snip)
-                    usr_printf("; snipping...");
+                if (!(ctx->process.status & INPUT_IS_PNG_FILE))
+                    ctx->usr_printf(" (multi-image or animation)");
+                if (ctx->options.snip)
+                    ctx->usr_printf("; snipping...");
             }
-            usr_printf("\n");
+            ctx->usr_printf("\n");
         }
-        opng_load_image_info(read_ptr, read_info_ptr, 1);
-        opng_print_image_info(1, 1, 1, 1);
-        usr_printf("\n");
+        opng_load_image_info(ctx, ctx->read_ptr, ctx->read_info_ptr, 1);
+        opng_print_image_info(ctx, 1, 1, 1, 1);
+        ctx->usr_printf("\n");
 
         /* Choose the applicable image reductions. */
         reductions = OPNG_REDUCE_ALL & ~OPNG_REDUCE_METADATA;
-        if (options.nb)
+        if (ctx->options.nb)
             reductions &= ~OPNG_REDUCE_BIT_DEPTH;
-        if (options.nc)
+        if (ctx->options.nc)
             reductions &= ~OPNG_REDUCE_COLOR_TYPE;
-        if (options.np)
+        if (ctx->options.np)
             reductions &= ~OPNG_REDUCE_PALETTE;
-        if (options.nz && (process.status & INPUT_HAS_PNG_DATASTREAM))
+        if (ctx->options.nz && (ctx->process.status & INPUT_HAS_PNG_DATASTREAM))
         {
             /* Do not reduce files with PNG datastreams under -nz. */
             reductions = OPNG_REDUCE_NONE;
         }
-        if (process.status & INPUT_HAS_DIGITAL_SIGNATURE)
+        if (ctx->process.status & INPUT_HAS_DIGITAL_SIGNATURE)
         {
             /* Do not reduce signed files. */
             reductions = OPNG_REDUCE_NONE;
         }
-        if ((process.status & INPUT_IS_PNG_FILE) &&
-            (process.status & INPUT_HAS_MULTIPLE_IMAGES) &&
-            (reductions != OPNG_REDUCE_NONE) && !options.snip)
+        if ((ctx->process.status & INPUT_IS_PNG_FILE) &&
+            (ctx->process.status & INPUT_HAS_MULTIPLE_IMAGES) &&
+            (reductions != OPNG_REDUCE_NONE) && !ctx->options.snip)
         {
-            usr_printf(
+            ctx->usr_printf(
                 "Can't reliably reduce APNG file; disabling reductions.\n"
                 "(Did you want to -snip and optimize the first frame?)\n");
             reductions = OPNG_REDUCE_NONE;
         }
 
         /* Try to reduce the image. */
-        process.reductions =
-            opng_reduce_image(read_ptr, read_info_ptr, reductions);
+        ctx->process.reductions =
+            opng_reduce_image(ctx->read_ptr, ctx->read_info_ptr, reductions);
 
         /* If the image is reduced, enforce full compression. */
-        if (process.reductions != OPNG_REDUCE_NONE)
+        if (ctx->process.reductions != OPNG_REDUCE_NONE)
         {
-            opng_load_image_info(read_ptr, read_info_ptr, 1);
-            usr_printf("Reducing image to ");
-            opng_print_image_info(0, 1, 1, 0);
-            usr_printf("\n");
+            opng_load_image_info(ctx, ctx->read_ptr, ctx->read_info_ptr, 1);
+            ctx->usr_printf("Reducing image to ");
+            opng_print_image_info(ctx, 0, 1, 1, 0);
+            ctx->usr_printf("\n");
         }
 
         /* Change the interlace type if required. */
-        if (options.interlace >= 0 &&
-            image.interlace_type != options.interlace)
+        if (ctx->options.interlace >= 0 &&
+            ctx->image.interlace_type != ctx->options.interlace)
         {
-            image.interlace_type = options.interlace;
+            ctx->image.interlace_type = ctx->options.interlace;
             /* A change in interlacing requires IDAT recoding. */
-            process.status |= OUTPUT_NEEDS_NEW_IDAT;
+            ctx->process.status |= OUTPUT_NEEDS_NEW_IDAT;
         }
     }
     Catch (err_msg)
     {
         /* Do the cleanup, then rethrow the exception. */
-        png_data_freer(read_ptr, read_info_ptr,
+        png_data_freer(ctx->read_ptr, ctx->read_info_ptr,
                        PNG_DESTROY_WILL_FREE_DATA, PNG_FREE_ALL);
-        png_destroy_read_struct(&read_ptr, &read_info_ptr, NULL);
+        png_destroy_read_struct(&ctx->read_ptr, &ctx->read_info_ptr, NULL);
         Throw err_msg;
     }
 
     /* Destroy the libpng structures, but leave the enclosed data intact
      * to allow further processing.
      */
-    png_data_freer(read_ptr, read_info_ptr,
+    png_data_freer(ctx->read_ptr, ctx->read_info_ptr,
                    PNG_USER_WILL_FREE_DATA, PNG_FREE_ALL);
-    png_destroy_read_struct(&read_ptr, &read_info_ptr, NULL);
+    png_destroy_read_struct(&ctx->read_ptr, &ctx->read_info_ptr, NULL);
 }
 
 static void
 my_opng_write_stream_data(png_structp png_ptr, png_bytep data, size_t length)
 {
-    static int allow_crt_chunk;
-    static int crt_chunk_is_idat;
-    static osys_foffset_t crt_idat_offset;
-    static osys_fsize_t crt_idat_size; 
-    static png_uint_32 crt_idat_crc;
+    struct opng_context *ctx =
+        (struct opng_context *)png_get_error_ptr(png_ptr);
     int io_state = pngx_get_io_state(png_ptr);
     int io_state_loc = io_state & PNGX_IO_MASK_LOC;
     png_bytep chunk_sig;
@@ -399,26 +391,26 @@ my_opng_write_stream_data(png_structp png_ptr, png_bytep data, size_t length)
     {
         OPNG_ENSURE(length == 8, "Writing chunk header, expecting 8 bytes");
         chunk_sig = data + 4;
-        allow_crt_chunk = opng_allow_chunk(chunk_sig);
+        ctx->allow_crt_chunk = opng_allow_chunk(ctx, chunk_sig);
         if (memcmp(chunk_sig, sig_IDAT, 4) == 0)
         {
-            crt_chunk_is_idat = 1;
-            process.out_idat_size += png_get_uint_32(data);
+            ctx->crt_chunk_is_idat = 1;
+            ctx->process.out_idat_size += png_get_uint_32(data);
             /* Abandon the trial if IDAT is bigger than the maximum allowed. */
             if (stream == NULL)
             {
-                if (process.out_idat_size > process.max_idat_size)
+                if (ctx->process.out_idat_size > ctx->process.max_idat_size)
                     Throw NULL;  /* early interruption, not an error */
             }
         }
         else  /* not IDAT */
         {
-            crt_chunk_is_idat = 0;
+            ctx->crt_chunk_is_idat = 0;
             if (memcmp(chunk_sig, sig_PLTE, 4) == 0 ||
                 memcmp(chunk_sig, sig_tRNS, 4) == 0)
             {
                 /* Add the chunk overhead (header + CRC) to the data size. */
-                process.out_plte_trns_size += png_get_uint_32(data) + 12;
+                ctx->process.out_plte_trns_size += png_get_uint_32(data) + 12;
             }
         }
     }
@@ -432,7 +424,7 @@ my_opng_write_stream_data(png_structp png_ptr, png_bytep data, size_t length)
         return;
 
     /* Continue only if the current chunk type is allowed. */
-    if (io_state_loc != PNGX_IO_SIGNATURE && !allow_crt_chunk)
+    if (io_state_loc != PNGX_IO_SIGNATURE && !ctx->allow_crt_chunk)
         return;
 
     /* Here comes an elaborate way of writing the data, in which all IDATs
@@ -443,28 +435,28 @@ my_opng_write_stream_data(png_structp png_ptr, png_bytep data, size_t length)
     {
         case PNGX_IO_CHUNK_HDR:
         {
-            if (crt_chunk_is_idat)
+            if (ctx->crt_chunk_is_idat)
             {
-                if (crt_idat_offset == 0)
+                if (ctx->crt_idat_offset == 0)
                 {
                     /* This is the header of the first IDAT. */
-                    crt_idat_offset = stream->pos;
+                    ctx->crt_idat_offset = stream->pos;
                     /* Try guessing the size of the final (joined) IDAT. */
-                    if (process.best_idat_size > 0)
+                    if (ctx->process.best_idat_size > 0)
                     {
                         /* The guess is expected to be right. */
-                        crt_idat_size = process.best_idat_size;
+                        ctx->crt_idat_size = ctx->process.best_idat_size;
                     }
                     else
                     {
                         /* The guess could be wrong.
                          * The size of the final IDAT will be revised.
                          */
-                        crt_idat_size = length;
+                        ctx->crt_idat_size = length;
                     }
-                    png_save_uint_32(data, (png_uint_32)crt_idat_size);
+                    png_save_uint_32(data, (png_uint_32)ctx->crt_idat_size);
                     /* Start computing the CRC of the final IDAT. */
-                    crt_idat_crc = crc32(0, sig_IDAT, 4);
+                    ctx->crt_idat_crc = crc32(0, sig_IDAT, 4);
                 }
                 else
                 {
@@ -474,43 +466,43 @@ my_opng_write_stream_data(png_structp png_ptr, png_bytep data, size_t length)
             }
             else
             {
-                if (crt_idat_offset != 0)
+                if (ctx->crt_idat_offset != 0)
                 {
                     /* This is the header of the first chunk after IDAT.
                      * Finalize IDAT before resuming the normal operation.
                      */
-                    png_save_uint_32(buf, crt_idat_crc);
+                    png_save_uint_32(buf, ctx->crt_idat_crc);
                     memcpy(stream->data+stream->pos, buf, 4);
                     stream-> pos += 4;
-                    process.out_file_size += 4;
-                    if (process.out_idat_size != crt_idat_size)
+                    ctx->process.out_file_size += 4;
+                    if (ctx->process.out_idat_size != ctx->crt_idat_size)
                     {
                         /* The IDAT size has not been guessed correctly.
                          * It must be updated in a non-streamable way.
                          */
-                        OPNG_ENSURE(process.best_idat_size == 0,
+                        OPNG_ENSURE(ctx->process.best_idat_size == 0,
                                     "Wrong guess of the output IDAT size");
-                        opng_check_idat_size(process.out_idat_size);
+                        opng_check_idat_size(ctx, ctx->process.out_idat_size);
                         png_save_uint_32(buf,
-                                         (png_uint_32)process.out_idat_size);
-                        memcpy(stream->data+crt_idat_offset, buf, 4);
+                                         (png_uint_32)ctx->process.out_idat_size);
+                        memcpy(stream->data+ctx->crt_idat_offset, buf, 4);
                     }
                     if (io_state == 0)
                         png_error(png_ptr, "Can't finalize IDAT");
-                    crt_idat_offset = 0;
+                    ctx->crt_idat_offset = 0;
                 }
             }
             break;
         }
         case PNGX_IO_CHUNK_DATA:
         {
-            if (crt_chunk_is_idat)
-                crt_idat_crc = crc32(crt_idat_crc, data, length);
+            if (ctx->crt_chunk_is_idat)
+                ctx->crt_idat_crc = crc32(ctx->crt_idat_crc, data, length);
             break;
         }
         case PNGX_IO_CHUNK_CRC:
         {
-            if (crt_chunk_is_idat)
+            if (ctx->crt_chunk_is_idat)
                 return;  /* defer writing until the first non-IDAT occurs */
             break;
         }
@@ -519,11 +511,12 @@ my_opng_write_stream_data(png_structp png_ptr, png_bytep data, size_t length)
     /* Write the data. */
     memcpy(stream->data+stream->pos, data, length);
     stream-> pos += length;
-    process.out_file_size += length;
+    ctx->process.out_file_size += length;
 }
 
 static void
-my_opng_write_stream(Stream *stream, int compression_level, int memory_level, 
+my_opng_write_stream(struct opng_context *ctx, Stream *stream,
+                   int compression_level, int memory_level,
                    int compression_strategy, int filter)
 {
     const char * volatile err_msg;  /* volatile is required by cexcept */
@@ -541,76 +534,76 @@ my_opng_write_stream(Stream *stream, int compression_level, int memory_level,
 
     Try
     {
-        write_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
-            NULL, opng_error, opng_warning);
-        write_info_ptr = png_create_info_struct(write_ptr);
-        if (write_info_ptr == NULL)
+        ctx->write_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+            ctx, opng_error, opng_warning);
+        ctx->write_info_ptr = png_create_info_struct(ctx->write_ptr);
+        if (ctx->write_info_ptr == NULL)
             Throw "Out of memory";
 
-        png_set_compression_level(write_ptr, compression_level);
-        png_set_compression_mem_level(write_ptr, memory_level);
-        png_set_compression_strategy(write_ptr, compression_strategy);
-        png_set_filter(write_ptr, PNG_FILTER_TYPE_BASE, filter_table[filter]);
+        png_set_compression_level(ctx->write_ptr, compression_level);
+        png_set_compression_mem_level(ctx->write_ptr, memory_level);
+        png_set_compression_strategy(ctx->write_ptr, compression_strategy);
+        png_set_filter(ctx->write_ptr, PNG_FILTER_TYPE_BASE, filter_table[filter]);
         if (compression_strategy != Z_HUFFMAN_ONLY &&
             compression_strategy != Z_RLE)
         {
-            if (options.window_bits > 0)
-                png_set_compression_window_bits(write_ptr,
-                                                options.window_bits);
+            if (ctx->options.window_bits > 0)
+                png_set_compression_window_bits(ctx->write_ptr,
+                                                ctx->options.window_bits);
         }
         else
         {
 #ifdef WBITS_8_OK
-            png_set_compression_window_bits(write_ptr, 8);
+            png_set_compression_window_bits(ctx->write_ptr, 8);
 #else
-            png_set_compression_window_bits(write_ptr, 9);
+            png_set_compression_window_bits(ctx->write_ptr, 9);
 #endif
         }
 
         /* Override the default libpng settings. */
-        png_set_keep_unknown_chunks(write_ptr,
+        png_set_keep_unknown_chunks(ctx->write_ptr,
                                     PNG_HANDLE_CHUNK_ALWAYS, NULL, 0);
-        png_set_user_limits(write_ptr, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
+        png_set_user_limits(ctx->write_ptr, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
 
         /* Write the PNG stream. */
-        opng_store_image_info(write_ptr, write_info_ptr, (stream != NULL));
-        opng_init_write_data();
-        pngx_set_write_fn(write_ptr, stream, my_opng_write_stream_data, NULL);
-        png_write_png(write_ptr, write_info_ptr, 0, NULL);
+        opng_store_image_info(ctx, ctx->write_ptr, ctx->write_info_ptr, (stream != NULL));
+        opng_init_write_data(ctx);
+        pngx_set_write_fn(ctx->write_ptr, stream, my_opng_write_stream_data, NULL);
+        png_write_png(ctx->write_ptr, ctx->write_info_ptr, 0, NULL);
 
         err_msg = NULL;  /* everything is ok */
     }
     Catch (err_msg)
     {
         /* Set IDAT size to invalid. */
-        process.out_idat_size = idat_size_max + 1;
+        ctx->process.out_idat_size = idat_size_max + 1;
     }
 
     /* Destroy the libpng structures. */
-    png_destroy_write_struct(&write_ptr, &write_info_ptr);
+    png_destroy_write_struct(&ctx->write_ptr, &ctx->write_info_ptr);
 
     if (err_msg != NULL)
         Throw err_msg;
 }
 
 static int
-my_opng_optimize(Stream* input, Stream* output)
+my_opng_optimize(struct opng_context *ctx, Stream* input, Stream* output)
 {
     int result;
     const char *err_msg;
 
-    opng_clear_image_info();
+    opng_clear_image_info(ctx);
     Try
     {
-        memset(&process, 0, sizeof(process));
-        if (options.force)
-            process.status |= OUTPUT_NEEDS_NEW_IDAT;
+        memset(&ctx->process, 0, sizeof(ctx->process));
+        if (ctx->options.force)
+            ctx->process.status |= OUTPUT_NEEDS_NEW_IDAT;
 
         err_msg = NULL;  /* prepare for error handling */
 
         Try
         {
-            my_opng_read_stream(input);
+            my_opng_read_stream(ctx, input);
         }
         Catch (err_msg)
         {
@@ -621,113 +614,113 @@ my_opng_optimize(Stream* input, Stream* output)
         //     Throw err_msg;  /* rethrow */
 
         /* Check the error flag. This must be the first check. */
-        if (process.status & INPUT_HAS_ERRORS)
+        if (ctx->process.status & INPUT_HAS_ERRORS)
         {
-            usr_printf("Recoverable errors found in input.");
-            if (options.fix)
+            ctx->usr_printf("Recoverable errors found in input.");
+            if (ctx->options.fix)
             {
-                usr_printf(" Fixing...\n");
-                process.status |= OUTPUT_NEEDS_NEW_FILE;
+                ctx->usr_printf(" Fixing...\n");
+                ctx->process.status |= OUTPUT_NEEDS_NEW_FILE;
             }
             else
             {
-                usr_printf(" Rerun " PROGRAM_NAME " with -fix enabled.\n");
+                ctx->usr_printf(" Rerun " PROGRAM_NAME " with -fix enabled.\n");
                 Throw "Previous error(s) not fixed";
             }
         }
 
         /* Check the junk flag. */
-        if (process.status & INPUT_HAS_JUNK)
-            process.status |= OUTPUT_NEEDS_NEW_FILE;
+        if (ctx->process.status & INPUT_HAS_JUNK)
+            ctx->process.status |= OUTPUT_NEEDS_NEW_FILE;
 
         /* Check the PNG signature and datastream flags. */
-        if (!(process.status & INPUT_HAS_PNG_SIGNATURE))
-            process.status |= OUTPUT_NEEDS_NEW_FILE;
-        if (process.status & INPUT_HAS_PNG_DATASTREAM)
+        if (!(ctx->process.status & INPUT_HAS_PNG_SIGNATURE))
+            ctx->process.status |= OUTPUT_NEEDS_NEW_FILE;
+        if (ctx->process.status & INPUT_HAS_PNG_DATASTREAM)
         {
-            if (options.nz && (process.status & OUTPUT_NEEDS_NEW_IDAT))
+            if (ctx->options.nz && (ctx->process.status & OUTPUT_NEEDS_NEW_IDAT))
             {
-                usr_printf(
+                ctx->usr_printf(
                     "IDAT recoding is necessary, but is disabled by the user.\n");
                 Throw "Can't continue";
             }
         }
         else
-            process.status |= OUTPUT_NEEDS_NEW_IDAT;
+            ctx->process.status |= OUTPUT_NEEDS_NEW_IDAT;
 
         /* Check the digital signature flag. */
-        if (process.status & INPUT_HAS_DIGITAL_SIGNATURE)
+        if (ctx->process.status & INPUT_HAS_DIGITAL_SIGNATURE)
         {
-            usr_printf("Digital signature found in input.");
-            if (options.force)
+            ctx->usr_printf("Digital signature found in input.");
+            if (ctx->options.force)
             {
-                usr_printf(" Erasing...\n");
-                process.status |= OUTPUT_NEEDS_NEW_FILE;
+                ctx->usr_printf(" Erasing...\n");
+                ctx->process.status |= OUTPUT_NEEDS_NEW_FILE;
             }
             else
             {
-                usr_printf(" Rerun " PROGRAM_NAME " with -force enabled.\n");
+                ctx->usr_printf(" Rerun " PROGRAM_NAME " with -force enabled.\n");
                 Throw "Can't optimize digitally-signed files";
             }
         }
 
         /* Check the multi-image flag. */
-        if (process.status & INPUT_HAS_MULTIPLE_IMAGES)
+        if (ctx->process.status & INPUT_HAS_MULTIPLE_IMAGES)
         {
-            if (!options.snip && !(process.status & INPUT_IS_PNG_FILE))
+            if (!ctx->options.snip && !(ctx->process.status & INPUT_IS_PNG_FILE))
             {
-                usr_printf("Conversion to PNG requires snipping. "
+                ctx->usr_printf("Conversion to PNG requires snipping. "
                            "Rerun " PROGRAM_NAME " with -snip enabled.\n");
                 Throw "Incompatible input format";
             }
         }
-        if ((process.status & INPUT_HAS_APNG) && options.snip)
-            process.status |= OUTPUT_NEEDS_NEW_FILE;
+        if ((ctx->process.status & INPUT_HAS_APNG) && ctx->options.snip)
+            ctx->process.status |= OUTPUT_NEEDS_NEW_FILE;
 
         /* Check the stripped-data flag. */
-        if (process.status & INPUT_HAS_STRIPPED_DATA)
-            usr_printf("Stripping metadata...\n");
+        if (ctx->process.status & INPUT_HAS_STRIPPED_DATA)
+            ctx->usr_printf("Stripping metadata...\n");
 
         /* Display the input IDAT/file sizes. */
-        if (process.status & INPUT_HAS_PNG_DATASTREAM)
-            usr_printf("Input IDAT size = %" OSYS_FSIZE_PRIu " bytes\n",
-                       process.in_idat_size);
-        usr_printf("Input file size = %" OSYS_FSIZE_PRIu " bytes\n",
-                   process.in_file_size);
+        if (ctx->process.status & INPUT_HAS_PNG_DATASTREAM)
+            ctx->usr_printf("Input IDAT size = %" OSYS_FSIZE_PRIu " bytes\n",
+                       ctx->process.in_idat_size);
+        ctx->usr_printf("Input file size = %" OSYS_FSIZE_PRIu " bytes\n",
+                   ctx->process.in_file_size);
 
         /* Find the best parameters and see if it's worth recompressing. */
-        if (!options.nz || (process.status & OUTPUT_NEEDS_NEW_IDAT))
+        if (!ctx->options.nz || (ctx->process.status & OUTPUT_NEEDS_NEW_IDAT))
         {
-            opng_init_iterations();
-            opng_iterate();
-            opng_finish_iterations();
+            opng_init_iterations(ctx);
+            opng_iterate(ctx);
+            opng_finish_iterations(ctx);
         }
-        if (process.status & OUTPUT_NEEDS_NEW_IDAT)
+        if (ctx->process.status & OUTPUT_NEEDS_NEW_IDAT)
         {
-            process.status |= OUTPUT_NEEDS_NEW_FILE;
-            opng_check_idat_size(process.best_idat_size);
+            ctx->process.status |= OUTPUT_NEEDS_NEW_FILE;
+            opng_check_idat_size(ctx, ctx->process.best_idat_size);
         }
 
         /* Stop here? */
-        if (!(process.status & OUTPUT_NEEDS_NEW_FILE))
+        if (!(ctx->process.status & OUTPUT_NEEDS_NEW_FILE))
         {
-            usr_printf("\nFile is already optimized.\n");
+            ctx->usr_printf("\nFile is already optimized.\n");
         }
-        if (options.simulate)
+        if (ctx->options.simulate)
         {
-            usr_printf("\nNo output: simulation mode.\n");
+            ctx->usr_printf("\nNo output: simulation mode.\n");
             return 0;
         }
 
         Try
         {
-            if (process.status & OUTPUT_NEEDS_NEW_IDAT)
+            if (ctx->process.status & OUTPUT_NEEDS_NEW_IDAT)
             {
                 printf("OUTPUT_NEEDS_NEW_IDAT\n");
                 /* Write a brand new PNG datastream to the output. */
-                my_opng_write_stream(output,
-                    process.best_compr_level, process.best_mem_level,
-                    process.best_strategy, process.best_filter);
+                my_opng_write_stream(ctx, output,
+                    ctx->process.best_compr_level, ctx->process.best_mem_level,
+                    ctx->process.best_strategy, ctx->process.best_filter);
             }
             else
             {
@@ -736,8 +729,8 @@ my_opng_optimize(Stream* input, Stream* output)
                 output->pos = input->size;
                 memcpy(output->data, input->data, output->size);
 
-                process.out_idat_size = process.in_idat_size;
-                process.out_file_size = process.in_file_size;
+                ctx->process.out_idat_size = ctx->process.in_idat_size;
+                ctx->process.out_file_size = ctx->process.in_file_size;
             }
         }
         Catch (err_msg)
@@ -746,53 +739,76 @@ my_opng_optimize(Stream* input, Stream* output)
         }
 
         /* Display the output IDAT/file sizes. */
-        usr_printf("\nOutput IDAT size = %" OSYS_FSIZE_PRIu " bytes",
-                   process.out_idat_size);
-        if (process.status & INPUT_HAS_PNG_DATASTREAM)
+        ctx->usr_printf("\nOutput IDAT size = %" OSYS_FSIZE_PRIu " bytes",
+                   ctx->process.out_idat_size);
+        if (ctx->process.status & INPUT_HAS_PNG_DATASTREAM)
         {
-            usr_printf(" (");
-            opng_print_fsize_difference(process.in_idat_size,
-                                        process.out_idat_size, 0);
-            usr_printf(")");
+            ctx->usr_printf(" (");
+            opng_print_fsize_difference(ctx, ctx->process.in_idat_size,
+                                        ctx->process.out_idat_size, 0);
+            ctx->usr_printf(")");
         }
-        usr_printf("\nOutput file size = %" OSYS_FSIZE_PRIu " bytes (",
-                   process.out_file_size);
-        opng_print_fsize_difference(process.in_file_size,
-                                    process.out_file_size, 1);
-        usr_printf(")\n");
+        ctx->usr_printf("\nOutput file size = %" OSYS_FSIZE_PRIu " bytes (",
+                   ctx->process.out_file_size);
+        opng_print_fsize_difference(ctx, ctx->process.in_file_size,
+                                    ctx->process.out_file_size, 1);
+        ctx->usr_printf(")\n");
 
 
         result = 0;
     }
     Catch (err_msg)
     {
-        opng_print_error(err_msg);
+        opng_print_error(ctx, err_msg);
         result = -1;
     }
-    opng_destroy_image_info();
+    opng_destroy_image_info(ctx);
 
     return result;
 }
 
-PyObject* compress_png(PyObject *self, PyObject *args)
+/*
+ * compress_png(data, level=2, deadline_ms=None, cancel=None)
+ *
+ * With deadline_ms, the trials still running that many milliseconds
+ * after the call are abandoned, once one of them has completed, and the
+ * best completed one is written. Once the CancelToken cancel is
+ * cancelled, or on Ctrl-C, all of them are abandoned and the call raises.
+ */
+PyObject* compress_png(PyObject *self, PyObject *args, PyObject *kwargs)
 {
     struct opng_options options;
     struct opng_ui ui;
+    struct opng_context *ctx;
     int optim_level = 2;
+    const char* error = NULL;
+    osys_fsize_t out_file_size = 0;
+    Py_buffer input;
+    stop_cond stop;
+    static char* keywords[] = {"data", "level", "deadline_ms", "cancel", NULL};
 
     Stream input_stream;
+    Stream output_stream;
+
+    stop_init(&stop);
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s*|iO&O&", keywords,
+        &input, &optim_level, stop_convert_deadline, &stop,
+        stop_convert_cancel, &stop))
+        return NULL;
+
+    input_stream.data = input.buf;
+    input_stream.size = input.len;
     input_stream.pos = 0;
 
-    Stream output_stream;
+    /* Every call has its own engine context, so the GIL can be released
+     * for the whole optimization. The trials of a call run on the pool. */
+    stop_begin(&stop);
+    Py_BEGIN_ALLOW_THREADS
+
     output_stream.data = malloc(BUFFER_GRANULARITY);
     output_stream.size = BUFFER_GRANULARITY;
     output_stream.pos = 0;
 
-    if (!PyArg_ParseTuple(args, "s#|i", &input_stream.data, &input_stream.size, &optim_level))
-        return NULL;
-
-    con_file = stdout;
-
     ui.printf_fn      = app_printf;
     ui.print_cntrl_fn = app_print_cntrl;
     ui.progress_fn    = app_progress;
@@ -802,25 +818,37 @@ PyObject* compress_png(PyObject *self, PyObject *args)
     options.optim_level = optim_level;
     options.interlace = -1;
 
-    if (opng_initialize(&options, &ui) != 0)
+    ctx = opng_create_context(&options, &ui);
+    if (ctx != NULL)
     {
-        PyErr_SetString(PyExc_ValueError, "opng_initialize() error");
-        return NULL;
+        opng_set_parallel_for(ctx, pool_for);
+        opng_set_stop(ctx, stop_requested, &stop);
     }
+    if (ctx == NULL)
+        error = "opng_create_context() error";
+    else if (my_opng_optimize(ctx, &input_stream, &output_stream) != 0)
+        error = "my_opng_optimize() error";
+    else
+        out_file_size = ctx->process.out_file_size;
+    opng_destroy_context(ctx);
+
+    Py_END_ALLOW_THREADS
 
-    if (my_opng_optimize(&input_stream, &output_stream) != 0)
+    PyBuffer_Release(&input);
+
+    if (stop_end(&stop) < 0)
     {
-        PyErr_SetString(PyExc_ValueError, "my_opng_optimize() error");
+        free(output_stream.data);
         return NULL;
     }
-
-    if (opng_finalize() != 0)
+    if (error != NULL)
     {
-        PyErr_SetString(PyExc_ValueError, "opng_finalize() error");
+        free(output_stream.data);
+        PyErr_SetString(PyExc_ValueError, error);
         return NULL;
     }
 
-    PyObject* result = Py_BuildValue("s#", output_stream.data, process.out_file_size);
+    PyObject* result = PyBytes_FromStringAndSize((const char*)output_stream.data, out_file_size);
     free(output_stream.data);
 
     return result;
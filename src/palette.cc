@@ -0,0 +1,231 @@
+#include <string.h>
+
+#include "palette.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define USE_X86_RUNS
+#include <emmintrin.h>
+#endif
+
+static inline unsigned color_set_hash(unsigned key)
+{
+    // Fibonacci hashing, the top 10 bits for the 1024 slots
+    return (key * 0x9E3779B1u) >> 22;
+}
+
+// Index of pixel j of a packed row, the leftmost pixel in the high bits
+static inline unsigned get_index(const unsigned char* row, size_t j, int bit_depth)
+{
+    if (bit_depth == 8)
+        return row[j];
+    size_t bit = j * bit_depth;
+    return (row[bit >> 3] >> (8 - bit_depth - (bit & 7))) & ((1 << bit_depth) - 1);
+}
+
+// Insertion sort of the entries on their key, equal keys keep their order
+static void sort_entries(int* entries, int count, const long long* key)
+{
+    for (int i = 1; i < count; i++) {
+        int entry = entries[i];
+        int k = i;
+        for (; k > 0 && key[entries[k - 1]] > key[entry]; k--)
+            entries[k] = entries[k - 1];
+        entries[k] = entry;
+    }
+}
+
+/*
+ * Chains the entries greedily: the most used one first, then each time
+ * the entry left that scores best against the last one.
+ */
+static void chain_entries(int method, const palette_stats* stats, const unsigned char* rgba, int* entries, int count)
+{
+    for (int i = 0; i < count; i++) {
+        int best = i;
+        for (int k = i + 1; k < count; k++) {
+            int a = entries[k], b = entries[best];
+            long long score_a, score_b;
+            if (i == 0) {
+                score_a = score_b = 0;
+            } else if (method == PALETTE_ORDER_NEAREST) {
+                const unsigned char* last = rgba + entries[i - 1] * 4;
+                score_a = score_b = 0;
+                for (int c = 0; c < 4; c++) {
+                    int da = rgba[a * 4 + c] - last[c];
+                    int db = rgba[b * 4 + c] - last[c];
+                    score_a -= da * da;
+                    score_b -= db * db;
+                }
+            } else {
+                score_a = stats->adjacent[entries[i - 1]][a];
+                score_b = stats->adjacent[entries[i - 1]][b];
+            }
+            if (score_a > score_b || (score_a == score_b && stats->counts[a] > stats->counts[b]))
+                best = k;
+        }
+        int entry = entries[best];
+        entries[best] = entries[i];
+        entries[i] = entry;
+    }
+}
+
+/*
+ * Number of pixels from j on that are equal to the one before, up to
+ * width. j must be at least 1.
+ */
+static size_t count_run(const unsigned char* row, size_t j, size_t width, int bpp)
+{
+    size_t run = 0;
+
+#ifdef USE_X86_RUNS
+    // Byte k of the block equals byte k - bpp for every pixel of the run
+    const size_t block = 16 / bpp;
+    while ((j + run) * bpp + 16 <= width * bpp) {
+        const unsigned char* p = row + (j + run) * bpp;
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), _mm_loadu_si128((const __m128i*)(p - bpp)));
+        unsigned mask = _mm_movemask_epi8(eq);
+        if (mask != 0xffff) {
+            run += __builtin_ctz(~mask) / bpp;
+            return run;
+        }
+        run += block;
+    }
+#endif
+
+    while (j + run < width && !memcmp(row + (j + run) * bpp, row + (j + run - 1) * bpp, bpp))
+        run++;
+    return run;
+}
+
+extern "C" {
+
+void color_set_init(color_set* set)
+{
+    memset(set->slots, 0xff, sizeof(set->slots));
+    set->count = 0;
+}
+
+unsigned color_set_key(const unsigned char* pixel, int bpp)
+{
+    unsigned key = 0;
+
+    for (int i = 0; i < bpp; i++)
+        key |= (unsigned)pixel[i] << (8*i);
+    return key;
+}
+
+int color_set_add(color_set* set, unsigned key)
+{
+    unsigned slot = color_set_hash(key);
+
+    while (set->slots[slot] >= 0) {
+        if (set->keys[slot] == key)
+            return set->slots[slot];
+        slot = (slot + 1) & (COLOR_SET_SLOTS - 1);
+    }
+
+    if (set->count == COLOR_SET_MAX)
+        return -1;
+    set->keys[slot] = key;
+    set->slots[slot] = set->count;
+    set->colors[set->count] = key;
+    return set->count++;
+}
+
+int color_set_find(const color_set* set, unsigned key)
+{
+    unsigned slot = color_set_hash(key);
+
+    while (set->slots[slot] >= 0) {
+        if (set->keys[slot] == key)
+            return set->slots[slot];
+        slot = (slot + 1) & (COLOR_SET_SLOTS - 1);
+    }
+    return -1;
+}
+
+int color_set_add_row(color_set* set, const unsigned char* row, size_t width, int bpp, unsigned char* indexes)
+{
+    int index = -1;
+    size_t j = 0;
+
+    while (j < width) {
+        if (j > 0) {
+            size_t run = count_run(row, j, width, bpp);
+            if (run > 0) {
+                if (indexes)
+                    memset(indexes + j, index, run);
+                j += run;
+                continue;
+            }
+        }
+
+        index = color_set_add(set, color_set_key(row + j * bpp, bpp));
+        if (index < 0)
+            return 0;
+        if (indexes)
+            indexes[j] = index;
+        j++;
+    }
+    return 1;
+}
+
+void palette_stats_init(palette_stats* stats)
+{
+    memset(stats, 0, sizeof(palette_stats));
+}
+
+void palette_stats_add_row(palette_stats* stats, const unsigned char* row, const unsigned char* prev, size_t width, int bit_depth)
+{
+    unsigned left = 0;
+
+    for (size_t j = 0; j < width; j++) {
+        unsigned index = get_index(row, j, bit_depth);
+        stats->counts[index]++;
+        if (j > 0 && left != index) {
+            stats->adjacent[left][index]++;
+            stats->adjacent[index][left]++;
+        }
+        if (prev) {
+            unsigned up = get_index(prev, j, bit_depth);
+            if (up != index) {
+                stats->adjacent[up][index]++;
+                stats->adjacent[index][up]++;
+            }
+        }
+        left = index;
+    }
+}
+
+void palette_order(int method, const palette_stats* stats, const unsigned char* rgba, int num, unsigned char* order)
+{
+    long long key[256];
+    int entries[256];
+    int n = 0;
+
+    for (int i = 0; i < num; i++) {
+        const unsigned char* p = rgba + i * 4;
+        if (method == PALETTE_ORDER_LUMINANCE)
+            key[i] = (299LL * p[0] + 587 * p[1] + 114 * p[2]) * 256 + p[3];
+        else
+            key[i] = -(long long)stats->counts[i];
+    }
+
+    // The transparent entries, then the opaque ones
+    for (int opaque = 0; opaque <= 1; opaque++) {
+        int count = 0;
+        for (int i = 0; i < num; i++)
+            if ((rgba[i * 4 + 3] == 255) == opaque)
+                entries[count++] = i;
+
+        if (method == PALETTE_ORDER_LUMINANCE || method == PALETTE_ORDER_POPULARITY)
+            sort_entries(entries, count, key);
+        else
+            chain_entries(method, stats, rgba, entries, count);
+
+        for (int k = 0; k < count; k++)
+            order[n++] = entries[k];
+    }
+}
+
+}
@@ -0,0 +1,83 @@
+#ifndef __PALETTE_H
+#define __PALETTE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Set of up to 256 distinct colors, for the palette reductions. The colors
+ * are numbered in the order they are added. Lookups go through an open
+ * addressing hash of the pixel bytes, and the pixels equal to the one
+ * before are skipped with SSE2 compares.
+ */
+
+#define COLOR_SET_MAX   256
+#define COLOR_SET_SLOTS 1024    /* a power of 2, at least twice COLOR_SET_MAX */
+
+typedef struct color_set {
+    unsigned keys[COLOR_SET_SLOTS];
+    short slots[COLOR_SET_SLOTS];   /* index of the color, -1 if free */
+    unsigned colors[COLOR_SET_MAX]; /* keys by index */
+    int count;
+} color_set;
+
+void color_set_init(color_set* set);
+
+/* Pixel bytes, 1 to 4 of them, packed into the key of the set */
+unsigned color_set_key(const unsigned char* pixel, int bpp);
+
+/* Index of the color, added if new. -1 if the set is already full. */
+int color_set_add(color_set* set, unsigned key);
+
+/* Index of the color, -1 if it isn't in the set */
+int color_set_find(const color_set* set, unsigned key);
+
+/*
+ * Adds the width pixels of bpp bytes (1 to 4) of a row. indexes, if not
+ * NULL, receives the index of every pixel. Returns 0 as soon as the row
+ * has a color that doesn't fit in the set anymore, 1 otherwise.
+ */
+int color_set_add_row(color_set* set, const unsigned char* row, size_t width, int bpp, unsigned char* indexes);
+
+/*
+ * Orders of the palette entries for the trials. The pixel data doesn't
+ * change, only the index each color gets, which changes how well the
+ * filtered rows compress.
+ */
+enum palette_order_method {
+    PALETTE_ORDER_LUMINANCE,    /* darkest first */
+    PALETTE_ORDER_POPULARITY,   /* most used first */
+    PALETTE_ORDER_NEAREST,      /* each entry followed by the closest color left */
+    PALETTE_ORDER_ADJACENCY,    /* each entry followed by its most frequent neighbour */
+    PALETTE_ORDER_COUNT
+};
+
+/* How often each index is used, and next to which other index */
+typedef struct palette_stats {
+    unsigned long counts[256];
+    unsigned long adjacent[256][256];   /* left and upper neighbours, both ways */
+} palette_stats;
+
+void palette_stats_init(palette_stats* stats);
+
+/*
+ * Counts the indexes of a row of width pixels of bit_depth bits (1, 2, 4
+ * or 8). prev is the row above, or NULL for the first row.
+ */
+void palette_stats_add_row(palette_stats* stats, const unsigned char* row, const unsigned char* prev, size_t width, int bit_depth);
+
+/*
+ * Orders the num entries of a palette, given as red, green, blue and
+ * alpha bytes. order[k] receives the current index of the entry that goes
+ * at k. The entries with alpha below 255 stay first, tRNS doesn't grow.
+ */
+void palette_order(int method, const palette_stats* stats, const unsigned char* rgba, int num, unsigned char* order);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
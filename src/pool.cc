@@ -0,0 +1,437 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include <queue>
+
+#include "pool.h"
+
+#ifdef __linux__
+#define USE_PTHREAD_AFFINITY
+#endif
+
+struct pool_task {
+    void (*run)(void* arg);
+    void* arg;
+    pool_group* group;
+};
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static std::queue<pool_task> pool_tasks;
+static int pool_threads = 0;    /* running threads */
+static int pool_wanted = 0;     /* threads the pool should have */
+static int pool_override = 0;   /* set_num_threads() value, 0 for automatic */
+static int pool_started = 0;    /* threads ever started, for the affinity */
+
+#ifdef USE_PTHREAD_AFFINITY
+static cpu_set_t pool_cpus;     /* CPUs the process may run on */
+static int pool_num_cpus = 0;
+#endif
+
+static __thread int pool_worker = 0;
+static __thread void (*pool_poll)(void* arg) = NULL;
+static __thread void* pool_poll_arg = NULL;
+static __thread int pool_poll_ms = 0;
+
+#ifdef __linux__
+/*
+ * CPUs the cgroup quota of the given directory allows, rounded up, or 0
+ * without quota. Both the cgroup v2 cpu.max and the v1 cfs files are
+ * understood.
+ */
+static int read_cgroup_quota(const char* dir)
+{
+    char path[544];
+    long long quota = -1;
+    long long period = 0;
+    FILE* f;
+
+    snprintf(path, sizeof(path), "%s/cpu.max", dir);
+    f = fopen(path, "r");
+    if (f) {
+        char value[32];
+        if (fscanf(f, "%31s %lld", value, &period) == 2 && strcmp(value, "max") != 0)
+            quota = atoll(value);
+        fclose(f);
+    } else {
+        snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+        f = fopen(path, "r");
+        if (!f)
+            return -1;
+        if (fscanf(f, "%lld", &quota) != 1)
+            quota = -1;
+        fclose(f);
+
+        snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+        f = fopen(path, "r");
+        if (f) {
+            if (fscanf(f, "%lld", &period) != 1)
+                period = 0;
+            fclose(f);
+        }
+    }
+
+    if (quota <= 0 || period <= 0)
+        return 0;
+    return (quota + period - 1) / period;
+}
+
+/* CPU limit of the cgroup of the process, 0 if there is none */
+static int get_cgroup_cpu_limit()
+{
+    char v1_path[256] = "";
+    char v2_path[256] = "";
+    char line[512];
+    FILE* f;
+
+    // Lines are "id:controllers:path", v2 has no controllers
+    f = fopen("/proc/self/cgroup", "r");
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            char* controllers = strchr(line, ':');
+            char* path = controllers ? strchr(controllers + 1, ':') : NULL;
+            if (!path)
+                continue;
+            *path++ = 0;
+            path[strcspn(path, "\n")] = 0;
+            controllers++;
+            if (*controllers == 0) {
+                snprintf(v2_path, sizeof(v2_path), "%s", path);
+                continue;
+            }
+            char* save;
+            for (char* c = strtok_r(controllers, ",", &save); c; c = strtok_r(NULL, ",", &save))
+                if (!strcmp(c, "cpu"))
+                    snprintf(v1_path, sizeof(v1_path), "%s", path);
+        }
+        fclose(f);
+    }
+
+    // Inside a cgroup namespace the path may not exist, the root is the
+    // cgroup of the process then
+    const char* dirs[][2] = {
+        { "/sys/fs/cgroup", v2_path },
+        { "/sys/fs/cgroup", "" },
+        { "/sys/fs/cgroup/cpu", v1_path },
+        { "/sys/fs/cgroup/cpu,cpuacct", v1_path },
+        { "/sys/fs/cgroup/cpu", "" },
+        { "/sys/fs/cgroup/cpu,cpuacct", "" },
+    };
+    for(unsigned i=0; i<sizeof(dirs)/sizeof(dirs[0]); i++) {
+        char dir[512];
+        snprintf(dir, sizeof(dir), "%s%s", dirs[i][0], dirs[i][1]);
+        int limit = read_cgroup_quota(dir);
+        if (limit >= 0)
+            return limit;
+    }
+
+    return 0;
+}
+#endif
+
+/* Threads to run when the caller doesn't ask for a number */
+static int get_default_threads()
+{
+    int num_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+#ifdef USE_PTHREAD_AFFINITY
+    if (pool_num_cpus > 0)
+        num_cpu = pool_num_cpus;
+#endif
+
+#ifdef __linux__
+    int limit = get_cgroup_cpu_limit();
+    if (limit > 0 && limit < num_cpu)
+        num_cpu = limit;
+#endif
+
+    return num_cpu > 0 ? num_cpu : 1;
+}
+
+static void pool_run(const pool_task& task)
+{
+    task.run(task.arg);
+
+    pthread_mutex_lock(&task.group->mutex);
+    if (--task.group->pending == 0)
+        pthread_cond_broadcast(&task.group->done);
+    pthread_mutex_unlock(&task.group->mutex);
+}
+
+static void* pool_thread(void* arg)
+{
+    pool_worker = 1;
+
+    while(1) {
+        pthread_mutex_lock(&pool_mutex);
+        while (pool_tasks.empty() && pool_threads <= pool_wanted)
+            pthread_cond_wait(&pool_cond, &pool_mutex);
+        if (pool_threads > pool_wanted) {
+            pool_threads--;
+            pthread_mutex_unlock(&pool_mutex);
+            break;
+        }
+        pool_task task = pool_tasks.front();
+        pool_tasks.pop();
+        pthread_mutex_unlock(&pool_mutex);
+
+        pool_run(task);
+    }
+
+    return NULL;
+}
+
+// Called with pool_mutex held
+static void pool_spawn()
+{
+    while (pool_threads < pool_wanted)
+    {
+        pthread_t id;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        // Spread the threads on the CPUs the process is allowed to use
+        #ifdef USE_PTHREAD_AFFINITY
+        if (pool_num_cpus > 1) {
+            int n = pool_started % pool_num_cpus;
+            for(int cpu=0; cpu<CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &pool_cpus) && n-- == 0) {
+                    cpu_set_t cpuset;
+                    CPU_ZERO(&cpuset);
+                    CPU_SET(cpu, &cpuset);
+                    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
+                    break;
+                }
+            }
+        }
+        #endif
+
+        int ret = pthread_create(&id, &attr, pool_thread, NULL);
+        pthread_attr_destroy(&attr);
+        if (ret != 0)
+            break;
+        pool_threads++;
+        pool_started++;
+    }
+}
+
+// The threads don't survive a fork(), the child starts its own on demand
+static void pool_atfork_child()
+{
+    pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+    pool_once = once;
+    pool_mutex = mutex;
+    pool_cond = cond;
+    while (!pool_tasks.empty())
+        pool_tasks.pop();
+    pool_threads = 0;
+    pool_started = 0;
+}
+
+static void pool_start()
+{
+    pthread_atfork(NULL, NULL, pool_atfork_child);
+
+    #ifdef USE_PTHREAD_AFFINITY
+    CPU_ZERO(&pool_cpus);
+    if (sched_getaffinity(0, sizeof(pool_cpus), &pool_cpus) == 0)
+        pool_num_cpus = CPU_COUNT(&pool_cpus);
+    #endif
+
+    pthread_mutex_lock(&pool_mutex);
+    pool_wanted = pool_override > 0 ? pool_override : get_default_threads();
+    pool_spawn();
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+void pool_group_init(pool_group* group)
+{
+    pthread_mutex_init(&group->mutex, NULL);
+    pthread_cond_init(&group->done, NULL);
+    group->pending = 0;
+}
+
+void pool_group_destroy(pool_group* group)
+{
+    pthread_cond_destroy(&group->done);
+    pthread_mutex_destroy(&group->mutex);
+}
+
+void pool_submit(pool_group* group, void (*run)(void* arg), void* arg)
+{
+    pool_task task = { run, arg, group };
+
+    pthread_once(&pool_once, pool_start);
+
+    pthread_mutex_lock(&group->mutex);
+    group->pending++;
+    pthread_mutex_unlock(&group->mutex);
+
+    pthread_mutex_lock(&pool_mutex);
+    // Without any thread the caller does the work itself
+    if (pool_threads == 0) {
+        pthread_mutex_unlock(&pool_mutex);
+        pool_run(task);
+        return;
+    }
+    pool_tasks.push(task);
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+void pool_wait(pool_group* group)
+{
+    if (pool_worker) {
+        while(1) {
+            pthread_mutex_lock(&group->mutex);
+            int finished = group->pending == 0;
+            pthread_mutex_unlock(&group->mutex);
+            if (finished)
+                return;
+
+            pthread_mutex_lock(&pool_mutex);
+            if (pool_tasks.empty()) {
+                pthread_mutex_unlock(&pool_mutex);
+                break;
+            }
+            pool_task task = pool_tasks.front();
+            pool_tasks.pop();
+            pthread_mutex_unlock(&pool_mutex);
+
+            pool_run(task);
+        }
+    }
+
+    pthread_mutex_lock(&group->mutex);
+    while (group->pending > 0) {
+        if (pool_poll == NULL) {
+            pthread_cond_wait(&group->done, &group->mutex);
+            continue;
+        }
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += pool_poll_ms * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        if (pthread_cond_timedwait(&group->done, &group->mutex, &ts) == ETIMEDOUT) {
+            pthread_mutex_unlock(&group->mutex);
+            pool_poll(pool_poll_arg);
+            pthread_mutex_lock(&group->mutex);
+        }
+    }
+    pthread_mutex_unlock(&group->mutex);
+}
+
+void pool_set_wait_poll(void (*poll)(void* arg), void* arg, int interval_ms)
+{
+    pool_poll = poll;
+    pool_poll_arg = arg;
+    pool_poll_ms = interval_ms;
+}
+
+struct pool_for_task {
+    void (*run)(void* arg, size_t i);
+    void* arg;
+    size_t i;
+};
+
+static void pool_for_run(void* arg)
+{
+    pool_for_task* task = (pool_for_task*)arg;
+    task->run(task->arg, task->i);
+}
+
+void pool_for(void (*run)(void* arg, size_t i), void* arg, size_t n)
+{
+    pool_group group;
+    pool_for_task* tasks = (pool_for_task*)malloc(sizeof(pool_for_task) * n);
+
+    pool_group_init(&group);
+    for(size_t i=1; i<n; i++) {
+        tasks[i].run = run;
+        tasks[i].arg = arg;
+        tasks[i].i = i;
+        pool_submit(&group, pool_for_run, &tasks[i]);
+    }
+
+    // The caller isn't idle meanwhile, it takes the first index itself
+    if (n > 0)
+        run(arg, 0);
+
+    pool_wait(&group);
+    pool_group_destroy(&group);
+    free(tasks);
+}
+
+int pool_size()
+{
+    pthread_once(&pool_once, pool_start);
+
+    pthread_mutex_lock(&pool_mutex);
+    int size = pool_wanted;
+    pthread_mutex_unlock(&pool_mutex);
+
+    return size > 0 ? size : 1;
+}
+
+void pool_resize(int threads)
+{
+    pthread_once(&pool_once, pool_start);
+
+    pthread_mutex_lock(&pool_mutex);
+    pool_override = threads;
+    pool_wanted = threads > 0 ? threads : get_default_threads();
+    pool_spawn();
+    // Threads beyond the new size leave once they are idle
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+extern "C" {
+
+PyObject* set_num_threads(PyObject *self, PyObject *args)
+{
+    int threads;
+
+    if (!PyArg_ParseTuple(args, "i", &threads))
+        return NULL;
+
+    if (threads < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "Number of threads must be positive, or 0 for automatic");
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    pool_resize(threads);
+    Py_END_ALLOW_THREADS
+
+    Py_RETURN_NONE;
+}
+
+PyObject* get_num_threads(PyObject *self, PyObject *args)
+{
+    int threads;
+
+    Py_BEGIN_ALLOW_THREADS
+    threads = pool_size();
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("i", threads);
+}
+
+}
@@ -0,0 +1,61 @@
+#ifndef __POOL_H
+#define __POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Process-wide worker pool. The threads are started by the first
+ * submission and live as long as the module. Every caller collects its
+ * tasks in its own group and waits for them, so that concurrent calls
+ * share the workers without seeing each other's work.
+ */
+
+typedef struct pool_group {
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+    unsigned pending;
+} pool_group;
+
+void pool_group_init(pool_group* group);
+void pool_group_destroy(pool_group* group);
+
+/* Queues run(arg) on the pool as part of the group */
+void pool_submit(pool_group* group, void (*run)(void* arg), void* arg);
+
+/*
+ * Waits for all the tasks of the group. Called from a pool thread it
+ * runs queued tasks in the meantime, so that tasks can wait on nested
+ * groups without starving the pool.
+ */
+void pool_wait(pool_group* group);
+
+/*
+ * While the calling thread waits in pool_wait() outside the pool, poll(arg)
+ * runs every interval_ms. NULL stops it.
+ */
+void pool_set_wait_poll(void (*poll)(void* arg), void* arg, int interval_ms);
+
+/*
+ * Runs run(arg, i) for every i in [0, n) on the pool and waits for them,
+ * the caller running its share.
+ */
+void pool_for(void (*run)(void* arg, size_t i), void* arg, size_t n);
+
+int pool_size(void);
+
+/*
+ * Sets the number of threads. With 0 the pool follows the CPUs the process
+ * may use: its affinity mask, capped by the cgroup CPU quota.
+ */
+void pool_resize(int threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
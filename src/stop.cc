@@ -0,0 +1,216 @@
+#include <Python.h>
+#include <time.h>
+
+#include "pool.h"
+#include "stop.h"
+
+/* How often the caller runs the Python signal handlers */
+#define STOP_POLL_MS    50
+
+struct cancel_token {
+    PyObject_HEAD
+    int cancelled;
+};
+
+static PyTypeObject cancel_token_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+};
+
+static PyObject* cancelled_error = NULL;
+
+static unsigned long long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fire(stop_cond* cond, int stopped)
+{
+    __atomic_store_n(&cond->stopped, stopped, __ATOMIC_RELAXED);
+}
+
+/*
+ * Runs the signal handlers in the calling thread, which has released the
+ * GIL. The exception of one cancels the call, it is raised by stop_end().
+ */
+static void poll_signals(stop_cond* cond)
+{
+    PyGILState_STATE state = PyGILState_Ensure();
+
+    if (PyErr_CheckSignals() < 0) {
+        PyErr_Fetch(&cond->error[0], &cond->error[1], &cond->error[2]);
+        fire(cond, STOP_CANCEL);
+    }
+    PyGILState_Release(state);
+}
+
+// pool_wait() hook of the caller
+static void poll_stop(void* cond)
+{
+    stop_requested(cond);
+}
+
+static PyObject* cancel_token_cancel(PyObject* self, PyObject* args)
+{
+    __atomic_store_n(&((cancel_token*)self)->cancelled, 1, __ATOMIC_RELAXED);
+    Py_RETURN_NONE;
+}
+
+static PyObject* cancel_token_get_cancelled(PyObject* self, void* closure)
+{
+    return PyBool_FromLong(__atomic_load_n(&((cancel_token*)self)->cancelled, __ATOMIC_RELAXED));
+}
+
+static PyMethodDef cancel_token_methods[] = {
+    {
+        "cancel",
+        cancel_token_cancel,
+        METH_NOARGS,
+        "cancel the calls given this token, from any thread"
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef cancel_token_getset[] = {
+    {
+        (char*)"cancelled",
+        cancel_token_get_cancelled,
+        NULL,
+        (char*)"whether cancel() was called",
+        NULL
+    },
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+extern "C" {
+
+void stop_init(stop_cond* cond)
+{
+    cond->deadline = 0;
+    cond->stopped = 0;
+    cond->cancel = NULL;
+    cond->polls = 0;
+    cond->next_poll = 0;
+    cond->error[0] = cond->error[1] = cond->error[2] = NULL;
+}
+
+void stop_set_deadline(stop_cond* cond, long deadline_ms)
+{
+    cond->deadline = now_ns() + (unsigned long long)deadline_ms * 1000000ULL;
+}
+
+int stop_requested(void* arg)
+{
+    stop_cond* cond = (stop_cond*)arg;
+
+    int stopped = __atomic_load_n(&cond->stopped, __ATOMIC_RELAXED);
+    if (stopped == STOP_CANCEL)
+        return stopped;
+    if (cond->cancel != NULL && __atomic_load_n(cond->cancel, __ATOMIC_RELAXED)) {
+        fire(cond, STOP_CANCEL);
+        return STOP_CANCEL;
+    }
+
+    // The caller only reads the clock for the signals from time to time
+    if (cond->polls && pthread_equal(pthread_self(), cond->caller)) {
+        unsigned long long now = now_ns();
+        if (now >= cond->next_poll) {
+            cond->next_poll = now + STOP_POLL_MS * 1000000ULL;
+            poll_signals(cond);
+            stopped = __atomic_load_n(&cond->stopped, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (stopped || cond->deadline == 0 || now_ns() < cond->deadline)
+        return stopped;
+    // The clock isn't read again by the checks that follow
+    fire(cond, STOP_DEADLINE);
+    return STOP_DEADLINE;
+}
+
+void stop_begin(stop_cond* cond)
+{
+    cond->polls = 1;
+    cond->caller = pthread_self();
+    cond->next_poll = now_ns() + STOP_POLL_MS * 1000000ULL;
+    pool_set_wait_poll(poll_stop, cond, STOP_POLL_MS);
+}
+
+int stop_end(stop_cond* cond)
+{
+    pool_set_wait_poll(NULL, NULL, 0);
+    cond->polls = 0;
+
+    if (cond->error[0] != NULL) {
+        PyErr_Restore(cond->error[0], cond->error[1], cond->error[2]);
+        cond->error[0] = cond->error[1] = cond->error[2] = NULL;
+        return -1;
+    }
+    // Even if the work was over before it could see it
+    if (cond->cancel != NULL && __atomic_load_n(cond->cancel, __ATOMIC_RELAXED)) {
+        PyErr_SetString(cancelled_error, "The call was cancelled");
+        return -1;
+    }
+    return 0;
+}
+
+int stop_convert_deadline(PyObject* obj, void* cond)
+{
+    if (obj == Py_None)
+        return 1;
+
+    long deadline_ms = PyLong_AsLong(obj);
+    if (deadline_ms == -1 && PyErr_Occurred())
+        return 0;
+    if (deadline_ms < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "deadline_ms must be positive or None");
+        return 0;
+    }
+    stop_set_deadline((stop_cond*)cond, deadline_ms);
+    return 1;
+}
+
+int stop_convert_cancel(PyObject* obj, void* cond)
+{
+    if (obj == Py_None)
+        return 1;
+
+    // The arguments of the call keep the token alive until it returns
+    if (!PyObject_TypeCheck(obj, &cancel_token_type))
+    {
+        PyErr_SetString(PyExc_TypeError, "cancel must be a CancelToken or None");
+        return 0;
+    }
+    ((stop_cond*)cond)->cancel = &((cancel_token*)obj)->cancelled;
+    return 1;
+}
+
+int stop_add_types(PyObject* module)
+{
+    cancel_token_type.tp_name = "_pyoptipng.CancelToken";
+    cancel_token_type.tp_basicsize = sizeof(cancel_token);
+    cancel_token_type.tp_flags = Py_TPFLAGS_DEFAULT;
+    cancel_token_type.tp_doc = "token whose cancel() stops the calls it is given to";
+    cancel_token_type.tp_methods = cancel_token_methods;
+    cancel_token_type.tp_getset = cancel_token_getset;
+    cancel_token_type.tp_new = PyType_GenericNew;
+    if (PyType_Ready(&cancel_token_type) < 0)
+        return -1;
+
+    cancelled_error = PyErr_NewException((char*)"_pyoptipng.CancelledError", NULL, NULL);
+    if (cancelled_error == NULL)
+        return -1;
+
+    Py_INCREF(&cancel_token_type);
+    if (PyModule_AddObject(module, "CancelToken", (PyObject*)&cancel_token_type) < 0)
+        return -1;
+    Py_INCREF(cancelled_error);
+    if (PyModule_AddObject(module, "CancelledError", cancelled_error) < 0)
+        return -1;
+    return 0;
+}
+
+}
@@ -0,0 +1,71 @@
+#ifndef __STOP_H
+#define __STOP_H
+
+#include <Python.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * When a call has to give up the work it has left. The engines poll it
+ * between their steps, zopfli iterations, 7z passes and deflate slices.
+ * Past the deadline they return the best result they have so far, once
+ * cancelled they return at once and the call raises. Once it has fired
+ * it stays so, every thread of the call sees it.
+ */
+
+/* What stop_requested() returns once the call has to stop */
+#define STOP_DEADLINE   1
+#define STOP_CANCEL     2       /* as OPNG_STOP_ALL */
+
+typedef struct stop_cond {
+    unsigned long long deadline;    /* on the monotonic clock in ns, 0 for none */
+    int stopped;                    /* 0 or STOP_*, once fired */
+    int* cancel;                    /* flag of the CancelToken, NULL if none */
+    int polls;                      /* caller runs the signal handlers */
+    pthread_t caller;
+    unsigned long long next_poll;
+    PyObject* error[3];             /* exception from a signal handler */
+} stop_cond;
+
+/* Condition of a call that runs to the end */
+void stop_init(stop_cond* cond);
+
+/* The call stops deadline_ms milliseconds from now */
+void stop_set_deadline(stop_cond* cond, long deadline_ms);
+
+/*
+ * 0 as long as the call goes on, STOP_DEADLINE or STOP_CANCEL once it has
+ * to stop, cond is a stop_cond*
+ */
+int stop_requested(void* cond);
+
+/*
+ * Bracket the work of a call, in the thread that holds the GIL:
+ * stop_begin() before releasing it, stop_end() once it is taken back.
+ * In between the thread runs the Python signal handlers every
+ * STOP_POLL_MS, while it waits on the pool too, and an exception from
+ * one, KeyboardInterrupt for Ctrl-C, cancels the call. stop_end()
+ * returns -1 with the Python error set if the call was cancelled.
+ */
+void stop_begin(stop_cond* cond);
+int stop_end(stop_cond* cond);
+
+/*
+ * PyArg_ParseTuple() converters, of the deadline_ms argument, None for no
+ * deadline or a number of milliseconds, and of the cancel argument, None
+ * or a CancelToken. The stop_cond is to be initialized first.
+ */
+int stop_convert_deadline(PyObject* obj, void* cond);
+int stop_convert_cancel(PyObject* obj, void* cond);
+
+/* Adds CancelToken and CancelledError to the module */
+int stop_add_types(PyObject* module);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* zlib internals, the vendored zlib only. Before zlib.h, which has a dummy internal_state otherwise. */
+#include "deflate.h"
+
+#include "zcache.h"
+
+#ifdef PYOPTIPNG_WITH_ADVANCECOMP
+#include "libdeflate/libdeflate.h"
+#endif
+
+/* Contexts of each kind a thread keeps, the least recently used goes first */
+#define ZCACHE_DEFLATE_SLOTS    4
+#define ZCACHE_LIBDEFLATE_SLOTS 3
+
+struct deflate_slot {
+    z_stream stream;
+    int ready;                  // stream set up
+    int busy;                   // handed out
+    int level;
+    int window_bits;
+    int mem_level;
+    int strategy;
+    unsigned long used;         // clock of the last use
+};
+
+struct libdeflate_slot {
+    struct libdeflate_compressor* compressor;
+    int busy;
+    int level;
+    unsigned long used;
+};
+
+struct zcache {
+    deflate_slot deflate[ZCACHE_DEFLATE_SLOTS];
+#ifdef PYOPTIPNG_WITH_ADVANCECOMP
+    libdeflate_slot libdeflate[ZCACHE_LIBDEFLATE_SLOTS];
+    struct libdeflate_decompressor* decompressor;   // one is enough, it has no settings
+    int decompressor_busy;
+#endif
+    unsigned long clock;
+};
+
+static pthread_once_t zcache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t zcache_key;
+static __thread zcache* zcache_thread = NULL;
+
+/* Destructor of the key, run by the thread on its way out */
+static void zcache_free(void* arg)
+{
+    zcache* cache = (zcache*)arg;
+
+    for (int i = 0; i < ZCACHE_DEFLATE_SLOTS; i++)
+        if (cache->deflate[i].ready)
+            deflateEnd(&cache->deflate[i].stream);
+#ifdef PYOPTIPNG_WITH_ADVANCECOMP
+    for (int i = 0; i < ZCACHE_LIBDEFLATE_SLOTS; i++)
+        libdeflate_free_compressor(cache->libdeflate[i].compressor);
+    libdeflate_free_decompressor(cache->decompressor);
+#endif
+    free(cache);
+    zcache_thread = NULL;
+}
+
+static void zcache_init()
+{
+    pthread_key_create(&zcache_key, zcache_free);
+}
+
+static zcache* get_cache()
+{
+    if (zcache_thread == NULL) {
+        pthread_once(&zcache_once, zcache_init);
+        zcache_thread = (zcache*)calloc(1, sizeof(zcache));
+        if (zcache_thread != NULL && pthread_setspecific(zcache_key, zcache_thread) != 0) {
+            free(zcache_thread);
+            zcache_thread = NULL;
+        }
+    }
+    return zcache_thread;
+}
+
+/*
+ * Compression function zlib uses at the level: stored, fast or slow.
+ * deflateParams() only changes the level of a reset stream when it keeps
+ * the function, otherwise zlib 1.2.11 flushes a block and the zlib header
+ * with it.
+ */
+static int deflate_func(int level)
+{
+    return level == 0 ? 0 : level <= 3 ? 1 : 2;
+}
+
+static z_stream* new_stream(int level, int window_bits, int mem_level, int strategy)
+{
+    z_stream* stream = (z_stream*)calloc(1, sizeof(z_stream));
+
+    if (stream != NULL && deflateInit2(stream, level, Z_DEFLATED, window_bits, mem_level, strategy) != Z_OK) {
+        free(stream);
+        stream = NULL;
+    }
+    return stream;
+}
+
+extern "C" {
+
+z_stream* zcache_deflate_get(int level, int window_bits, int mem_level, int strategy)
+{
+    zcache* cache = get_cache();
+    deflate_slot* slot = NULL;
+
+    if (level == Z_DEFAULT_COMPRESSION)
+        level = 6;
+    if (cache == NULL)
+        return new_stream(level, window_bits, mem_level, strategy);
+
+    // A stream of the same shape keeps its allocations through deflateReset()
+    for (int i = 0; i < ZCACHE_DEFLATE_SLOTS; i++) {
+        deflate_slot* s = &cache->deflate[i];
+        if (s->ready && !s->busy && s->window_bits == window_bits && s->mem_level == mem_level
+            && s->strategy == strategy && deflate_func(s->level) == deflate_func(level)
+            && (slot == NULL || s->level == level))
+            slot = s;
+    }
+
+    if (slot != NULL) {
+        deflateReset(&slot->stream);
+        // deflateReset() keeps the window, and the match finder compares
+        // a few bytes past the input. A fresh stream has zeros there,
+        // the previous stream mustn't change the output.
+        ((deflate_state*)slot->stream.state)->high_water = 0;
+        if (slot->level != level && deflateParams(&slot->stream, level, strategy) != Z_OK)
+            slot = NULL;
+    }
+
+    if (slot == NULL) {
+        for (int i = 0; i < ZCACHE_DEFLATE_SLOTS; i++) {
+            deflate_slot* s = &cache->deflate[i];
+            if (!s->busy && (slot == NULL || !s->ready || (slot->ready && s->used < slot->used)))
+                slot = s;
+        }
+        // All handed out, by tasks nested on this thread
+        if (slot == NULL)
+            return new_stream(level, window_bits, mem_level, strategy);
+
+        if (slot->ready)
+            deflateEnd(&slot->stream);
+        memset(&slot->stream, 0, sizeof(slot->stream));
+        slot->ready = deflateInit2(&slot->stream, level, Z_DEFLATED, window_bits, mem_level, strategy) == Z_OK;
+        if (!slot->ready)
+            return NULL;
+        slot->window_bits = window_bits;
+        slot->mem_level = mem_level;
+        slot->strategy = strategy;
+    }
+
+    slot->level = level;
+    slot->busy = 1;
+    slot->used = ++cache->clock;
+    return &slot->stream;
+}
+
+void zcache_deflate_put(z_stream* stream)
+{
+    zcache* cache = zcache_thread;
+
+    if (stream == NULL)
+        return;
+    if (cache != NULL) {
+        for (int i = 0; i < ZCACHE_DEFLATE_SLOTS; i++) {
+            if (&cache->deflate[i].stream == stream) {
+                cache->deflate[i].busy = 0;
+                return;
+            }
+        }
+    }
+    deflateEnd(stream);
+    free(stream);
+}
+
+#ifdef PYOPTIPNG_WITH_ADVANCECOMP
+struct libdeflate_compressor* zcache_libdeflate_get(int level)
+{
+    zcache* cache = get_cache();
+    libdeflate_slot* slot = NULL;
+
+    if (cache == NULL)
+        return libdeflate_alloc_compressor(level);
+
+    for (int i = 0; i < ZCACHE_LIBDEFLATE_SLOTS; i++) {
+        libdeflate_slot* s = &cache->libdeflate[i];
+        if (s->compressor != NULL && !s->busy && s->level == level)
+            slot = s;
+    }
+
+    if (slot == NULL) {
+        for (int i = 0; i < ZCACHE_LIBDEFLATE_SLOTS; i++) {
+            libdeflate_slot* s = &cache->libdeflate[i];
+            if (!s->busy && (slot == NULL || s->compressor == NULL || (slot->compressor != NULL && s->used < slot->used)))
+                slot = s;
+        }
+        if (slot == NULL)
+            return libdeflate_alloc_compressor(level);
+
+        libdeflate_free_compressor(slot->compressor);
+        slot->compressor = libdeflate_alloc_compressor(level);
+        if (slot->compressor == NULL)
+            return NULL;
+        slot->level = level;
+    }
+
+    slot->busy = 1;
+    slot->used = ++cache->clock;
+    return slot->compressor;
+}
+
+void zcache_libdeflate_put(struct libdeflate_compressor* compressor)
+{
+    zcache* cache = zcache_thread;
+
+    if (compressor == NULL)
+        return;
+    if (cache != NULL) {
+        for (int i = 0; i < ZCACHE_LIBDEFLATE_SLOTS; i++) {
+            if (cache->libdeflate[i].compressor == compressor) {
+                cache->libdeflate[i].busy = 0;
+                return;
+            }
+        }
+    }
+    libdeflate_free_compressor(compressor);
+}
+
+struct libdeflate_decompressor* zcache_inflate_get(void)
+{
+    zcache* cache = get_cache();
+
+    if (cache == NULL || cache->decompressor_busy)
+        return libdeflate_alloc_decompressor();
+
+    if (cache->decompressor == NULL) {
+        cache->decompressor = libdeflate_alloc_decompressor();
+        if (cache->decompressor == NULL)
+            return NULL;
+    }
+    cache->decompressor_busy = 1;
+    return cache->decompressor;
+}
+
+void zcache_inflate_put(struct libdeflate_decompressor* decompressor)
+{
+    zcache* cache = zcache_thread;
+
+    if (decompressor == NULL)
+        return;
+    if (cache != NULL && cache->decompressor == decompressor) {
+        cache->decompressor_busy = 0;
+        return;
+    }
+    libdeflate_free_decompressor(decompressor);
+}
+#endif
+
+}
@@ -0,0 +1,49 @@
+#ifndef __ZCACHE_H
+#define __ZCACHE_H
+
+#include <zlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Compressor contexts kept by each thread between the calls. Setting up
+ * the deflate state costs more than compressing a small image, so the
+ * trials take a context from the cache, reset for the new stream, and give
+ * it back when done. The contexts of a thread are freed when it exits.
+ */
+
+/*
+ * zlib stream ready for deflate(), as after deflateInit2(), or NULL if it
+ * can't be set up. next_in, next_out and their sizes are left to the
+ * caller.
+ */
+z_stream* zcache_deflate_get(int level, int window_bits, int mem_level, int strategy);
+
+/* Gives back a stream of zcache_deflate_get(), finished or not */
+void zcache_deflate_put(z_stream* stream);
+
+#ifdef PYOPTIPNG_WITH_ADVANCECOMP
+struct libdeflate_compressor;
+
+/* libdeflate compressor of the given level, or NULL if it can't be allocated */
+struct libdeflate_compressor* zcache_libdeflate_get(int level);
+
+/* Gives back a compressor of zcache_libdeflate_get() */
+void zcache_libdeflate_put(struct libdeflate_compressor* compressor);
+
+struct libdeflate_decompressor;
+
+/* libdeflate decompressor, or NULL if it can't be allocated */
+struct libdeflate_decompressor* zcache_inflate_get(void);
+
+/* Gives back a decompressor of zcache_inflate_get() */
+void zcache_inflate_put(struct libdeflate_decompressor* decompressor);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
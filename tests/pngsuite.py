@@ -0,0 +1,214 @@
+"""Helpers for the round-trip tests: the PngSuite images and a small PNG
+decoder, so that the pixels of an optimized PNG can be compared with the
+ones of its input without depending on an imaging library.
+
+Run the tests from the top of the tree, once the extension is built:
+
+    python -m unittest discover -s tests -p "test_*.py"
+"""
+import os
+import struct
+import zlib
+
+SUITE_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'PngSuite')
+
+SIGNATURE = b'\x89PNG\r\n\x1a\n'
+
+CHANNELS = {0: 1, 2: 3, 3: 1, 4: 2, 6: 4}
+
+ADAM7 = [(0, 0, 8, 8), (4, 0, 8, 8), (0, 4, 4, 8), (2, 0, 4, 4),
+         (0, 2, 2, 4), (1, 0, 2, 2), (0, 1, 1, 2)]
+
+
+def names(prefix=''):
+    """Names of the valid PngSuite images starting with prefix, the corrupt
+    ones (x*) left out."""
+    return sorted(f[:-4] for f in os.listdir(SUITE_DIR)
+                  if f.endswith('.png') and f.startswith(prefix)
+                  and not f.startswith('x') and f != 'PngSuite.png')
+
+
+def read(name):
+    with open(os.path.join(SUITE_DIR, name + '.png'), 'rb') as f:
+        return f.read()
+
+
+def chunks(data):
+    if data[:8] != SIGNATURE:
+        raise ValueError('not a PNG')
+    pos = 8
+    while pos < len(data):
+        length, = struct.unpack('>I', data[pos:pos + 4])
+        yield data[pos + 4:pos + 8], data[pos + 8:pos + 8 + length]
+        pos += length + 12
+
+
+def header(data):
+    """(width, height, bit_depth, color_type, interlace) of a PNG."""
+    width, height, bit_depth, color_type, _, _, interlace = \
+        struct.unpack('>IIBBBBB', data[16:29])
+    return width, height, bit_depth, color_type, interlace
+
+
+def synthetic(width, height):
+    """An 8-bit RGB PNG of the given size with smooth areas and some noise,
+    for the paths that only big images take."""
+    state = 1
+    raw = bytearray()
+    for y in range(height):
+        raw.append(0)
+        for x in range(width):
+            state = (state * 1103515245 + 12345) & 0x7fffffff
+            v = (x * 255 // width + (y // 32) * 16 + (state >> 16) % 8) & 255
+            raw.extend((v, (v + y) & 255, (255 - v) & 255))
+
+    def chunk(kind, body):
+        return (struct.pack('>I', len(body)) + kind + body +
+                struct.pack('>I', zlib.crc32(kind + body) & 0xffffffff))
+
+    return (SIGNATURE +
+            chunk(b'IHDR', struct.pack('>IIBBBBB', width, height, 8, 2, 0, 0, 0)) +
+            chunk(b'IDAT', zlib.compress(bytes(raw), 1)) +
+            chunk(b'IEND', b''))
+
+
+def paletted(width, height, shuffle, colors=256):
+    """An 8-bit paletted PNG of a diagonal ramp through the given number of
+    colors. With shuffle the palette entries are in a scrambled order,
+    which the filters can't make anything of."""
+    order = list(range(colors))
+    if shuffle:
+        state = 1
+        for i in range(colors - 1, 0, -1):
+            state = (state * 1103515245 + 12345) & 0x7fffffff
+            k = (state >> 16) % (i + 1)
+            order[i], order[k] = order[k], order[i]
+    index = [0] * colors
+    for i, color in enumerate(order):
+        index[color] = i
+    raw = bytearray()
+    for y in range(height):
+        raw.append(0)
+        raw.extend(index[(x + y) * (colors - 1) // (width + height - 2)]
+                   for x in range(width))
+    levels = [c * 255 // (colors - 1) for c in order]
+    palette = b''.join(bytes((v, 255 - v, v // 2)) for v in levels)
+
+    def chunk(kind, body):
+        return (struct.pack('>I', len(body)) + kind + body +
+                struct.pack('>I', zlib.crc32(kind + body) & 0xffffffff))
+
+    return (SIGNATURE +
+            chunk(b'IHDR', struct.pack('>IIBBBBB', width, height, 8, 3, 0, 0, 0)) +
+            chunk(b'PLTE', palette) +
+            chunk(b'IDAT', zlib.compress(bytes(raw), 1)) +
+            chunk(b'IEND', b''))
+
+
+def _paeth(a, b, c):
+    p = a + b - c
+    pa, pb, pc = abs(p - a), abs(p - b), abs(p - c)
+    if pa <= pb and pa <= pc:
+        return a
+    return b if pb <= pc else c
+
+
+def _unfilter(raw, pos, height, row_bytes, bpp):
+    rows = []
+    prev = bytearray(row_bytes)
+    for _ in range(height):
+        filter_type = raw[pos]
+        line = raw[pos + 1:pos + 1 + row_bytes]
+        pos += row_bytes + 1
+        for i in range(row_bytes):
+            a = line[i - bpp] if i >= bpp else 0
+            b = prev[i]
+            c = prev[i - bpp] if i >= bpp else 0
+            if filter_type == 1:
+                line[i] = (line[i] + a) & 255
+            elif filter_type == 2:
+                line[i] = (line[i] + b) & 255
+            elif filter_type == 3:
+                line[i] = (line[i] + ((a + b) >> 1)) & 255
+            elif filter_type == 4:
+                line[i] = (line[i] + _paeth(a, b, c)) & 255
+            elif filter_type != 0:
+                raise ValueError('bad filter type %d' % filter_type)
+        rows.append(line)
+        prev = line
+    return rows, pos
+
+
+def _samples(line, bit_depth, count):
+    if bit_depth == 8:
+        return list(line[:count])
+    if bit_depth == 16:
+        return [line[2 * i] << 8 | line[2 * i + 1] for i in range(count)]
+    mask = (1 << bit_depth) - 1
+    return [(line[i * bit_depth // 8] >> (8 - bit_depth - i * bit_depth % 8)) & mask
+            for i in range(count)]
+
+
+def pixels(data):
+    """Decodes a PNG into (width, height, rows) where every pixel is a 16-bit
+    RGBA tuple, whatever the format it was stored in. Fully transparent
+    pixels all compare equal, as their color is not part of the image."""
+    idat = b''
+    palette = trns = None
+    for kind, body in chunks(data):
+        if kind == b'IHDR':
+            width, height, bit_depth, color_type, _, _, interlace = \
+                struct.unpack('>IIBBBBB', body)
+        elif kind == b'PLTE':
+            palette = bytearray(body)
+        elif kind == b'tRNS':
+            trns = bytearray(body)
+        elif kind == b'IDAT':
+            idat += body
+    raw = bytearray(zlib.decompress(idat))
+
+    channels = CHANNELS[color_type]
+    bpp = max(1, channels * bit_depth // 8)
+    top = (1 << bit_depth) - 1
+
+    def scale(v):
+        return v * 65535 // top
+
+    key = None
+    if trns is not None and color_type == 0:
+        key = (trns[0] << 8 | trns[1],)
+    elif trns is not None and color_type == 2:
+        key = tuple(trns[i] << 8 | trns[i + 1] for i in (0, 2, 4))
+
+    def rgba(px):
+        if color_type == 3:
+            r, g, b = palette[3 * px[0]:3 * px[0] + 3]
+            a = trns[px[0]] if trns is not None and px[0] < len(trns) else 255
+            return (r * 257, g * 257, b * 257, a * 257)
+        a = 0 if key is not None and tuple(px) == key else 65535
+        if color_type == 0:
+            return (scale(px[0]),) * 3 + (a,)
+        if color_type == 2:
+            return tuple(scale(v) for v in px) + (a,)
+        if color_type == 4:
+            return (scale(px[0]),) * 3 + (scale(px[1]),)
+        return tuple(scale(v) for v in px)
+
+    image = [[None] * width for _ in range(height)]
+    passes = ADAM7 if interlace else [(0, 0, 1, 1)]
+    pos = 0
+    for x0, y0, dx, dy in passes:
+        pass_width = (width - x0 + dx - 1) // dx
+        pass_height = (height - y0 + dy - 1) // dy
+        if pass_width == 0 or pass_height == 0:
+            continue
+        row_bytes = (pass_width * channels * bit_depth + 7) // 8
+        rows, pos = _unfilter(raw, pos, pass_height, row_bytes, bpp)
+        for j, line in enumerate(rows):
+            s = _samples(line, bit_depth, pass_width * channels)
+            for i in range(pass_width):
+                px = rgba(s[i * channels:(i + 1) * channels])
+                if px[3] == 0:
+                    px = (0, 0, 0, 0)
+                image[y0 + j * dy][x0 + i * dx] = px
+    return width, height, image
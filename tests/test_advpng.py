@@ -0,0 +1,126 @@
+"""advpng() keeps the pixels of every PngSuite image."""
+import struct
+import threading
+import time
+import unittest
+import zlib
+
+import pyoptipng
+
+import pngsuite
+
+
+class AdvpngTest(unittest.TestCase):
+
+    def assertSamePixels(self, name, data, out):
+        self.assertEqual(pngsuite.pixels(out), pngsuite.pixels(data), name)
+
+    def test_round_trip(self):
+        for name in pngsuite.names():
+            data = pngsuite.read(name)
+            self.assertSamePixels(name, data, pyoptipng.advpng(data))
+
+    def test_formats(self):
+        # grayscale, gray+alpha and 16-bit images keep their format, and
+        # interlaced ones are written back interlaced
+        for name in ('basn0g01', 'basn0g04', 'basn0g16', 'basi0g08',
+                     'basn4a08', 'basi4a16', 'basn2c16', 'basi6a16'):
+            data = pngsuite.read(name)
+            out = pyoptipng.advpng(data)
+            self.assertSamePixels(name, data, out)
+            self.assertEqual(pngsuite.header(out)[2:], pngsuite.header(data)[2:],
+                             name)
+
+    def test_threads(self):
+        names = pngsuite.names('basn')
+        results = {}
+
+        def run(name):
+            results[name] = pyoptipng.advpng(pngsuite.read(name))
+
+        threads = [threading.Thread(target=run, args=(name,))
+                   for name in names]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        for name in names:
+            self.assertSamePixels(name, pngsuite.read(name), results[name])
+
+    def test_num_threads(self):
+        # zopfli spreads its blocks on the pool, the output doesn't change
+        names = pngsuite.names('basn')
+        expected = [pyoptipng.advpng(pngsuite.read(name)) for name in names]
+        try:
+            for threads in (1, 4):
+                pyoptipng.set_num_threads(threads)
+                self.assertEqual([pyoptipng.advpng(pngsuite.read(name))
+                                  for name in names], expected)
+        finally:
+            pyoptipng.set_num_threads(0)
+
+    def test_palette_orders(self):
+        # the palette goes out in the order that compresses best, a
+        # scrambled one ends up about as small as the sorted one
+        ordered = pngsuite.paletted(256, 64, False)
+        shuffled = pngsuite.paletted(256, 64, True)
+        out = pyoptipng.advpng(shuffled)
+        self.assertSamePixels('shuffled', shuffled, out)
+        self.assertLessEqual(len(out), len(pyoptipng.advpng(ordered)) * 1.05)
+
+    def test_deadline(self):
+        # zopfli and 7z stop at the deadline, libdeflate is kept
+        data = pngsuite.synthetic(200, 120)
+        out = pyoptipng.advpng(data, deadline_ms=0)
+        self.assertSamePixels('synthetic', data, out)
+        self.assertGreaterEqual(len(out), len(pyoptipng.advpng(data)))
+        self.assertEqual(pyoptipng.advpng(data, deadline_ms=600000),
+                         pyoptipng.advpng(data))
+        self.assertRaises(ValueError, pyoptipng.advpng, data, deadline_ms=-1)
+
+    def test_cancel(self):
+        data = pngsuite.synthetic(200, 120)
+        token = pyoptipng.CancelToken()
+        token.cancel()
+        self.assertRaises(pyoptipng.CancelledError, pyoptipng.advpng,
+                          data, cancel=token)
+
+        # zopfli and 7z stop in the middle
+        data = pngsuite.synthetic(480, 400)
+        token = pyoptipng.CancelToken()
+        threading.Timer(0.1, token.cancel).start()
+        start = time.time()
+        self.assertRaises(pyoptipng.CancelledError, pyoptipng.advpng,
+                          data, cancel=token)
+        self.assertLess(time.time() - start, 2)
+
+    def test_huge_header(self):
+        # the IHDR size is checked before the buffers are sized from it.
+        # The first two decompress to the sizes that wrap at 32 bits.
+        def chunk(kind, body):
+            return (struct.pack('>I', len(body)) + kind + body +
+                    struct.pack('>I', zlib.crc32(kind + body) & 0xffffffff))
+
+        for width, height, depth, color, interlace, size in (
+                (65536, 65536, 16, 6, 1, 122880), (65536, 65536, 8, 6, 0, 65536),
+                (0x7fffffff, 2, 16, 6, 1, 1000), (0x80000000, 1, 8, 0, 0, 1000),
+                (0, 1, 8, 0, 0, 1000)):
+            data = (b'\x89PNG\r\n\x1a\n' +
+                    chunk(b'IHDR', struct.pack('>IIBBBBB', width, height,
+                                               depth, color, 0, 0, interlace)) +
+                    chunk(b'IDAT', zlib.compress(bytes(size))) +
+                    chunk(b'IEND', b''))
+            self.assertRaises(ValueError, pyoptipng.advpng, data)
+
+    def test_bit_depths(self):
+        # few colors are written packed, at the smallest bit depth, as
+        # long as it compresses better than whole bytes
+        for colors, bit_depth in ((2, 1), (4, 2)):
+            data = pngsuite.paletted(256, 64, True, colors)
+            out = pyoptipng.advpng(data)
+            self.assertSamePixels('%d colors' % colors, data, out)
+            self.assertEqual(pngsuite.header(out)[2], bit_depth)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,319 @@
+"""mc_compress_png() keeps the pixels of every PngSuite image."""
+import os
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import unittest
+from concurrent.futures import ThreadPoolExecutor
+
+import pyoptipng
+
+import pngsuite
+
+
+class McCompressPngTest(unittest.TestCase):
+
+    def assertSamePixels(self, name, data, out):
+        self.assertEqual(pngsuite.pixels(out), pngsuite.pixels(data), name)
+
+    def test_round_trip(self):
+        for name in pngsuite.names():
+            data = pngsuite.read(name)
+            self.assertSamePixels(name, data, pyoptipng.mc_compress_png(data, 2))
+
+    def test_all_filters(self):
+        # interlaced images and the adaptive filter at every bit depth
+        for name in pngsuite.names('basi') + pngsuite.names('basn'):
+            data = pngsuite.read(name)
+            self.assertSamePixels(name, data, pyoptipng.mc_compress_png(data, 4))
+
+    def test_threads(self):
+        # concurrent calls share the pool without mixing their trials
+        names = pngsuite.names('basn')
+        images = [pngsuite.read(name) for name in names]
+        expected = [pyoptipng.mc_compress_png(data, 2) for data in images]
+        results = [None] * len(images)
+
+        def run(i):
+            results[i] = pyoptipng.mc_compress_png(images[i], 2)
+
+        threads = [threading.Thread(target=run, args=(i,))
+                   for i in range(len(images))]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        for name, data, out in zip(names, images, results):
+            self.assertSamePixels(name, data, out)
+        self.assertEqual([len(out) for out in results],
+                         [len(out) for out in expected])
+
+    def test_num_threads(self):
+        data = pngsuite.read('basn2c08')
+        expected = pyoptipng.mc_compress_png(data, 2)
+        default = pyoptipng.get_num_threads()
+        try:
+            for threads in (1, 3):
+                pyoptipng.set_num_threads(threads)
+                self.assertEqual(pyoptipng.get_num_threads(), threads)
+                self.assertEqual(pyoptipng.mc_compress_png(data, 2), expected)
+        finally:
+            pyoptipng.set_num_threads(0)
+        self.assertEqual(pyoptipng.get_num_threads(), default)
+        self.assertRaises(ValueError, pyoptipng.set_num_threads, -1)
+
+    def test_many(self):
+        names = pngsuite.names('bas')
+        images = [pngsuite.read(name) for name in names]
+        results = pyoptipng.mc_compress_many(images + [b'not a png'], 2)
+        self.assertEqual(len(results), len(images) + 1)
+        for name, data, (out, stats) in zip(names, images, results):
+            self.assertSamePixels(name, data, out)
+            self.assertEqual(len(out), len(pyoptipng.mc_compress_png(data, 2)))
+            self.assertEqual(stats['input_size'], len(data))
+            self.assertEqual(stats['output_size'], len(out))
+            self.assertLess(stats['idat_size'], len(out))
+            self.assertLessEqual(stats['aborted'], stats['trials'])
+        out, stats = results[-1]
+        self.assertIsNone(out)
+        self.assertIn('error', stats)
+        self.assertEqual(pyoptipng.mc_compress_many([]), [])
+        self.assertRaises(TypeError, pyoptipng.mc_compress_many, [u'text'])
+
+    def test_buffers(self):
+        data = pngsuite.read('basn2c08')
+        expected = len(pyoptipng.mc_compress_png(data, 2))
+        for source in (bytearray(data), memoryview(data)):
+            out = pyoptipng.mc_compress_png(source, 2)
+            self.assertEqual(len(out), expected)
+            self.assertSamePixels('basn2c08', data, out)
+
+        out = bytearray(len(data) + 1024)
+        size = pyoptipng.mc_compress_png(memoryview(data), 2, out)
+        self.assertEqual(size, expected)
+        self.assertSamePixels('basn2c08', data, bytes(out[:size]))
+
+        self.assertRaises(ValueError, pyoptipng.mc_compress_png,
+                          data, 2, bytearray(expected - 1))
+        self.assertRaises((TypeError, BufferError), pyoptipng.mc_compress_png,
+                          data, 2, data)
+        self.assertRaises(ValueError, pyoptipng.mc_compress_png,
+                          data[:len(data) // 2], 2)
+
+        results = pyoptipng.mc_compress_many([bytearray(data), memoryview(data)])
+        self.assertEqual([len(out) for out, stats in results], [expected] * 2)
+
+    def test_files(self):
+        directory = tempfile.mkdtemp()
+        try:
+            names = pngsuite.names('basn')
+            paths = [os.path.join(directory, name + '.png') for name in names]
+            for name, path in zip(names, paths):
+                with open(path, 'wb') as f:
+                    f.write(pngsuite.read(name))
+            os.chmod(paths[0], 0o640)
+
+            results = pyoptipng.mc_optimize_files(paths, 2)
+            for name, path, stats in zip(names, paths, results):
+                with open(path, 'rb') as f:
+                    out = f.read()
+                self.assertSamePixels(name, pngsuite.read(name), out)
+                self.assertEqual(len(out), stats['output_size']
+                                 if stats['replaced'] else stats['input_size'])
+            self.assertTrue(any(stats['replaced'] for stats in results))
+            self.assertEqual(os.stat(paths[0]).st_mode & 0o777, 0o640)
+            self.assertEqual(sorted(os.listdir(directory)),
+                             sorted(name + '.png' for name in names))
+
+            # already optimized, the file stays as it is
+            stats = pyoptipng.mc_optimize_file(paths[0], 2)
+            self.assertFalse(stats['replaced'])
+
+            # through a symlink the file it points to is replaced
+            target = os.path.join(directory, 'target.png')
+            link = os.path.join(directory, 'link.png')
+            with open(target, 'wb') as f:
+                f.write(pngsuite.read(names[0]))
+            os.symlink(target, link)
+            self.assertTrue(pyoptipng.mc_optimize_file(link, 2)['replaced'])
+            self.assertTrue(os.path.islink(link))
+            with open(target, 'rb') as f, open(paths[0], 'rb') as g:
+                self.assertEqual(f.read(), g.read())
+            os.remove(link)
+            os.remove(target)
+
+            missing = os.path.join(directory, 'missing.png')
+            self.assertRaises(OSError, pyoptipng.mc_optimize_file, missing)
+            stats, = pyoptipng.mc_optimize_files([missing])
+            self.assertIn('error', stats)
+            self.assertIn('errno', stats)
+        finally:
+            shutil.rmtree(directory)
+
+    def test_predictor(self):
+        # big enough for the size predictor: 2 filters x 2 mem levels x
+        # 4 strategies are probed at level 5, 4 of them compressed in full
+        data = pngsuite.synthetic(480, 400)
+        (out, stats), = pyoptipng.mc_compress_many([data], 5)
+        self.assertSamePixels('synthetic', data, out)
+        self.assertEqual(stats['probes'], 16)
+        self.assertEqual(stats['trials'], 4)
+        self.assertGreaterEqual(stats['prediction_error'], 0)
+
+        (out, stats), = pyoptipng.mc_compress_many([pngsuite.read('basn2c08')], 5)
+        self.assertEqual(stats['probes'], 0)
+        self.assertEqual(stats['prediction_error'], 0)
+
+    def test_palette_orders(self):
+        # from level 2 the trials also try reordered palettes, a scrambled
+        # palette ends up about as small as the sorted one
+        ordered = pngsuite.paletted(256, 64, False)
+        shuffled = pngsuite.paletted(256, 64, True)
+        out = pyoptipng.mc_compress_png(shuffled, 2)
+        self.assertSamePixels('shuffled', shuffled, out)
+        self.assertLess(len(out), len(pyoptipng.mc_compress_png(shuffled, 1)))
+        self.assertLessEqual(len(out), len(pyoptipng.mc_compress_png(ordered, 2)) * 1.05)
+
+    def test_advpng(self):
+        # the trials rank every filter with libdeflate, zopfli and 7z only
+        # compress the best one, which ends up no larger than either tool
+        for name in pngsuite.names('basn') + pngsuite.names('basi'):
+            data = pngsuite.read(name)
+            self.assertSamePixels(name, data, pyoptipng.mc_advpng(data, 2))
+
+        data = pngsuite.synthetic(200, 120)
+        out = pyoptipng.mc_advpng(data, 2)
+        self.assertSamePixels('synthetic', data, out)
+        self.assertLess(len(out), len(pyoptipng.mc_compress_png(data, 2)))
+        self.assertLessEqual(len(out), len(pyoptipng.advpng(data)))
+
+    def test_deadline(self):
+        # past the deadline the best completed trial is written, at least
+        # the quick one that goes first
+        data = pngsuite.synthetic(480, 400)
+        for compress in (pyoptipng.mc_compress_png, pyoptipng.mc_advpng):
+            out = compress(data, 8, deadline_ms=0)
+            self.assertSamePixels('synthetic', data, out)
+        out = pyoptipng.mc_compress_png(data, 2, None, 0)
+        self.assertSamePixels('synthetic', data, out)
+
+        # a deadline that isn't reached doesn't change the output
+        data = pngsuite.read('basn2c08')
+        self.assertEqual(pyoptipng.mc_compress_png(data, 2, deadline_ms=600000),
+                         pyoptipng.mc_compress_png(data, 2))
+        self.assertEqual(pyoptipng.mc_advpng(data, 2, deadline_ms=600000),
+                         pyoptipng.mc_advpng(data, 2))
+        self.assertRaises(ValueError, pyoptipng.mc_compress_png,
+                          data, 2, deadline_ms=-1)
+
+    def test_cancel(self):
+        data = pngsuite.synthetic(800, 600)
+        token = pyoptipng.CancelToken()
+        token.cancel()
+        self.assertTrue(token.cancelled)
+        for compress in (pyoptipng.mc_compress_png, pyoptipng.mc_advpng):
+            self.assertRaises(pyoptipng.CancelledError, compress,
+                              data, 8, cancel=token)
+        self.assertRaises(pyoptipng.CancelledError, pyoptipng.mc_compress_many,
+                          [data], cancel=token)
+        self.assertRaises(TypeError, pyoptipng.mc_compress_png, data, cancel=1)
+
+        # from another thread, the trials running are abandoned
+        token = pyoptipng.CancelToken()
+        timer = threading.Timer(0.1, token.cancel)
+        start = time.time()
+        timer.start()
+        self.assertRaises(pyoptipng.CancelledError, pyoptipng.mc_compress_png,
+                          data, 8, cancel=token)
+        self.assertLess(time.time() - start, 2)
+
+        # Ctrl-C too, the caller runs the signal handlers while it waits
+        if hasattr(signal, 'setitimer'):
+            def interrupt(signum, frame):
+                raise KeyboardInterrupt
+            handler = signal.signal(signal.SIGALRM, interrupt)
+            try:
+                signal.setitimer(signal.ITIMER_REAL, 0.1)
+                start = time.time()
+                self.assertRaises(KeyboardInterrupt, pyoptipng.mc_compress_png,
+                                  data, 8)
+                self.assertLess(time.time() - start, 2)
+            finally:
+                signal.setitimer(signal.ITIMER_REAL, 0)
+                signal.signal(signal.SIGALRM, handler)
+
+        # the pool is left as it was
+        data = pngsuite.read('basn2c08')
+        self.assertSamePixels('basn2c08', data, pyoptipng.mc_compress_png(data, 2))
+
+    def test_filter_kernels(self):
+        # the vectorized filters are picked at load time, compare them
+        # with the plain C ones in a separate process. The second pass
+        # reads back rows with all the filter types.
+        script = ('import sys, pyoptipng, pngsuite\n'
+                  'images = [pngsuite.synthetic(200, 120)]\n'
+                  'images += [pngsuite.read(n) for n in pngsuite.names("basn")]\n'
+                  'for data in images:\n'
+                  '    out = pyoptipng.mc_compress_png(data, 4)\n'
+                  '    print(out.hex(), pyoptipng.mc_compress_png(out, 1).hex())\n')
+
+        def run(filters):
+            env = dict(os.environ, PYTHONPATH=os.pathsep.join(sys.path))
+            if filters:
+                env['PYOPTIPNG_FILTERS'] = filters
+            return subprocess.check_output([sys.executable, '-c', script], env=env)
+
+        self.assertEqual(run(None), run('c'))
+
+    def test_bad_level(self):
+        data = pngsuite.read('basn0g01')
+        self.assertRaises(ValueError, pyoptipng.mc_compress_png, data, 9)
+
+
+
+class CompressPngTest(unittest.TestCase):
+    """compress_png() runs its trials on the pool, each call on its own context."""
+
+    # sizes of the serial engine on the top-level libpng and zlib, at levels 2 and 5
+    golden = {
+        'basn0g01': (164, 164),
+        'basn2c08': (145, 137),
+        'basn3p08': (1286, 1253),
+        'basi6a16': (4133, 3387),
+    }
+
+    def test_golden(self):
+        for name, sizes in sorted(self.golden.items()):
+            data = pngsuite.read(name)
+            for level, size in zip((2, 5), sizes):
+                out = pyoptipng.compress_png(data, level)
+                self.assertEqual(pngsuite.pixels(out), pngsuite.pixels(data), name)
+                self.assertEqual(len(out), size, (name, level))
+
+    def test_concurrent(self):
+        images = [pngsuite.read(name) for name in pngsuite.names('basn')]
+        expected = [pyoptipng.compress_png(data, 5) for data in images]
+        with ThreadPoolExecutor(4) as executor:
+            results = list(executor.map(lambda data: pyoptipng.compress_png(data, 5),
+                                        images))
+        self.assertEqual(results, expected)
+
+    def test_num_threads(self):
+        # the parallel trials pick the same winner as the serial loop
+        images = [pngsuite.read(name) for name in pngsuite.names('bas')]
+        try:
+            outputs = []
+            for threads in (1, 4):
+                pyoptipng.set_num_threads(threads)
+                outputs.append([pyoptipng.compress_png(data, 5) for data in images])
+        finally:
+            pyoptipng.set_num_threads(0)
+        self.assertEqual(outputs[0], outputs[1])
+
+
+if __name__ == '__main__':
+    unittest.main()